@@ -0,0 +1,109 @@
+# Erzeugt include/web_assets.h aus den HTML-Seiten in web/
+#
+# Jede Seite wird aus web/_header.html + <seite>.html + web/_footer.html
+# zusammengesetzt, mit gzip (Stufe 9) komprimiert und als PROGMEM-Array
+# abgelegt. Die Firmware liefert die Bytes unverändert mit
+# "Content-Encoding: gzip" aus - kein String-Aufbau zur Laufzeit.
+#
+# Wird von PlatformIO als pre-Script vor jedem Build ausgeführt
+# (extra_scripts = pre:scripts/build_web.py), kann aber auch direkt
+# gestartet werden: python scripts/build_web.py
+
+import gzip
+import hashlib
+import os
+
+try:
+    Import("env")  # noqa: F821 - nur innerhalb von PlatformIO definiert
+    PROJECT_DIR = env["PROJECT_DIR"]  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+WEB_DIR = os.path.join(PROJECT_DIR, "web")
+OUTPUT = os.path.join(PROJECT_DIR, "include", "web_assets.h")
+
+# URL-Pfad -> Quelldatei in web/
+PAGES = [
+    ("/", "index.html"),
+    ("/bluetooth", "bluetooth.html"),
+    ("/cloud", "cloud.html"),
+    ("/wlan", "wlan.html"),
+]
+
+
+def read(name):
+    with open(os.path.join(WEB_DIR, name), "r", encoding="utf-8") as f:
+        return f.read()
+
+
+def symbol(path):
+    name = path.strip("/").replace("/", "_") or "index"
+    return "WEB_" + name.upper()
+
+
+def build():
+    header = read("_header.html")
+    footer = read("_footer.html")
+
+    lines = [
+        "// Automatisch erzeugt von scripts/build_web.py - nicht bearbeiten!",
+        "// Quelle: web/*.html",
+        "#pragma once",
+        "",
+        "#include <Arduino.h>",
+        "",
+    ]
+    table = []
+    total_raw = 0
+    total_gz = 0
+
+    for path, source in PAGES:
+        html = (header + read(source) + footer).encode("utf-8")
+        # mtime=0: identische Eingabe ergibt identische Bytes (stabiles ETag)
+        data = gzip.compress(html, compresslevel=9, mtime=0)
+        etag = '"' + hashlib.sha1(data).hexdigest()[:16] + '"'
+        sym = symbol(path)
+        total_raw += len(html)
+        total_gz += len(data)
+
+        lines.append("// %s: %d Bytes -> %d Bytes gzip" % (source, len(html), len(data)))
+        lines.append("const uint8_t %s[] PROGMEM = {" % sym)
+        for i in range(0, len(data), 20):
+            lines.append("  " + ",".join("0x%02x" % b for b in data[i:i + 20]) + ",")
+        lines.append("};")
+        lines.append("")
+        table.append('  {"%s", %s, sizeof(%s), "%s"},' % (path, sym, sym, etag.replace('"', '\\"')))
+
+    lines += [
+        "/**",
+        " * Vorkomprimierte Webseite im Flash",
+        " */",
+        "struct WebAsset {",
+        "  const char* path;     // URL-Pfad",
+        "  const uint8_t* data;  // gzip-Daten (PROGMEM)",
+        "  size_t length;        // Länge der gzip-Daten",
+        "  const char* etag;     // Hash über den Inhalt (inkl. Anführungszeichen)",
+        "};",
+        "",
+        "const WebAsset WEB_ASSETS[] = {",
+    ]
+    lines += table
+    lines += [
+        "};",
+        "",
+        "const size_t WEB_ASSET_COUNT = sizeof(WEB_ASSETS) / sizeof(WEB_ASSETS[0]);",
+        "",
+    ]
+
+    content = "\n".join(lines)
+    # Nur schreiben wenn sich etwas geändert hat (kein unnötiger Rebuild)
+    if os.path.exists(OUTPUT):
+        with open(OUTPUT, "r", encoding="utf-8") as f:
+            if f.read() == content:
+                return
+    with open(OUTPUT, "w", encoding="utf-8") as f:
+        f.write(content)
+    print("web_assets.h: %d Bytes HTML -> %d Bytes gzip" % (total_raw, total_gz))
+
+
+build()
@@ -29,15 +29,29 @@
 // ============================================================================
 #include <Arduino.h>          // Arduino-Kernfunktionen für ESP32
 #include <WiFi.h>             // WLAN-Funktionen (Station und Access Point)
-#include <WebServer.h>        // HTTP-Webserver für das Webinterface
+#include <ESPAsyncWebServer.h> // Asynchroner HTTP-Webserver (läuft im AsyncTCP-Task, nicht in loop())
+#include <AsyncJson.h>        // JSON-Body für POST-Anfragen
 #include <ESPmDNS.h>          // mDNS für lokale Namensauflösung (Hostname.local)
 #include <BMSClient.h>        // BLE-Client für LiTime BMS Kommunikation
 #include <time.h>             // Zeitfunktionen für NTP-Synchronisation
+#include <esp_sntp.h>         // Callback nach erfolgreicher NTP-Synchronisation
 #include <Preferences.h>      // Persistenter Speicher (NVS) für Einstellungen
 #include <ArduinoJson.h>      // JSON-Serialisierung für API und Webhook
 #include <nvs_flash.h>        // Non-Volatile Storage Flash-Initialisierung
 #include <HTTPClient.h>       // HTTP-Client für Webhook-Anfragen
+#include <WiFiClientSecure.h> // TLS-Verbindung für https-Webhooks
+#include <LittleFS.h>         // Dateisystem für den Zwischenspeicher bei Cloud-Ausfällen
+#include <espMqttClient.h>    // MQTT-Client mit eigenem Task (QoS 0/1, Last Will)
 #include <esp_task_wdt.h>     // Hardware Watchdog Timer für automatischen Reset bei Freeze
+#include <esp_system.h>       // Reset-Grund (Crash-Breadcrumb nur nach Fehler-Reset speichern)
+#include <esp_heap_caps.h>    // Hook für fehlgeschlagene Heap-Allokationen
+#include <esp_pm.h>           // Power Management (Taktabsenkung und automatischer Light Sleep)
+#include <esp_sleep.h>        // Deep Sleep für den Headless-Betrieb
+#include <freertos/FreeRTOS.h> // FreeRTOS für den BLE-Worker-Task
+#include <freertos/semphr.h>   // Mutex für den BMS-Daten-Snapshot
+#include <array>              // Festes Zellen-Array im BMS-Datensatz
+#include <type_traits>        // static_assert auf POD-Datensatz
+#include "web_assets.h"       // Vorkomprimierte Webseiten (erzeugt von scripts/build_web.py)
 
 // ============================================================================
 // Konstanten und Konfiguration
@@ -46,10 +60,71 @@
 // WLAN Access Point Konfiguration
 #define AP_PASSWORD "12345678"      // Passwort für den Access Point Modus
 #define WIFI_TIMEOUT_MS 30000       // Timeout für WLAN-Verbindungsversuche (30 Sekunden)
+#define WIFI_FAST_TIMEOUT_MS 3000   // Timeout für die gezielte Verbindung mit gemerktem AP (BSSID/Kanal)
+#define WIFI_RECONNECT_TIMEOUT_MS 15000  // Timeout für einen Reconnect mit vollem Scan
+#define SCAN_MAX_RESULTS 20         // Maximal gemerkte Netzwerke aus dem WLAN-Scan
+#define SCAN_CACHE_MS 30000         // Scan-Ergebnis 30 Sekunden wiederverwenden
+#define SCAN_TIMEOUT_MS 15000       // Hängender Scan wird nach 15 Sekunden verworfen
 
 // Watchdog-Timer Konfiguration
 #define WDT_TIMEOUT 30              // Watchdog Timeout in Sekunden (ESP32 resettet nach dieser Zeit)
 
+// BLE-Worker-Task Konfiguration
+#define BMS_TASK_STACK_SIZE 8192    // Stackgröße des BLE-Tasks in Bytes
+#define BMS_TASK_PRIORITY 1         // Gleiche Priorität wie loop() (Round-Robin)
+#define BMS_TASK_TICK_MS 100        // Zykluszeit des BLE-Tasks in ms
+#define BMS_RECONNECT_MIN_MS 10000  // Erster Reconnect-Versuch nach 10 Sekunden
+#define BMS_RECONNECT_MAX_MS 300000 // Backoff wird bei maximal 5 Minuten gedeckelt
+#define BMS_MAX_PACKS 4             // Maximal abgefragte BMS (parallele Batterie-Packs)
+#define BMS_POLL_FAST_MS 2000       // Adaptive Abfrage: Intervall bei hoher Last oder Alarm
+#define BMS_POLL_IDLE_MS 60000      // Adaptive Abfrage: Intervall im Ruhezustand (mindestens)
+#define BMS_ACTIVE_CURRENT_MA 5000  // Ab 5 A Lade-/Entladestrom schnell abfragen
+#define BMS_CURRENT_STEP_MA 2000    // Stromänderung um 2 A zwischen zwei Abfragen: schnell abfragen
+#define BMS_IDLE_CURRENT_MA 300     // Unter 0,3 A gilt die Batterie als in Ruhe
+#define BMS_IDLE_POLLS 5            // Nach 5 ruhigen Abfragen in Folge auf BMS_POLL_IDLE_MS wechseln
+#define BMS_POLL_TIMEOUT_MS 5000    // Abfrage länger als 5 s gilt als Timeout
+#define BMS_POLL_FAIL_LIMIT 3       // Nach 3 fehlgeschlagenen Abfragen in Folge neu verbinden
+#define BMS_MAX_LISTENERS 4         // Maximal registrierte Empfänger neuer Messungen
+#define ANALYTICS_EMA_TAU_S 300     // Restzeit: Zeitkonstante der Stromglättung (5 Minuten)
+#define ENERGY_MAX_GAP_MS 300000    // Energiezähler: Lücken über 5 Minuten nicht integrieren
+#define ENERGY_SAVE_INTERVAL_MS 900000  // Energiezähler alle 15 Minuten im NVS sichern (nur bei Änderung)
+
+// MQTT-Konfiguration
+#define MQTT_RECONNECT_MIN_MS 5000   // Erster Reconnect-Versuch nach 5 Sekunden
+#define MQTT_RECONNECT_MAX_MS 300000 // Backoff wird bei maximal 5 Minuten gedeckelt
+#define MQTT_KEEPALIVE_S 60          // Keep-Alive-Intervall der Broker-Verbindung
+#define MQTT_TOPIC_LEN 96            // Maximale Topic-Länge inkl. Nullterminator
+#define MQTT_REPLAY_INTERVAL_MS 1000 // Abstand zwischen zwei Nachhol-Blöcken (<basis>/backlog)
+#define MQTT_PAYLOAD_LEN 640         // Puffer für Discovery-Konfigurationen
+
+// Webhook-Verbindung
+#define POWER_LOOP_SLEEP_MS 20       // Stromsparmodus: loop() gibt die CPU pro Durchlauf 20 ms ab
+#define POWER_STATS_WINDOW_MS 10000  // Messfenster für die Auslastung von loop()
+#define HEADLESS_CONFIG_WINDOW_MS 300000  // Headless: nach Einschalten/Reset 5 Minuten Webinterface, dann Deep Sleep
+#define HEADLESS_WIFI_TIMEOUT_MS 5000     // Headless: maximale Wartezeit auf WLAN pro Versuch
+#define HEADLESS_MQTT_TIMEOUT_MS 3000     // Headless: maximale Wartezeit auf den Broker
+#define HEADLESS_NTP_TIMEOUT_MS 3000      // Headless: maximale Wartezeit auf die NTP-Antwort
+#define HEADLESS_MIN_SLEEP_S 10           // Headless: mindestens 10 Sekunden schlafen
+#define HEADLESS_DISCOVERY_EVERY 100      // Headless: MQTT Discovery nur jeden 100. Zyklus (retained)
+#define WIFI_FAST_MAGIC 0x57464331        // Kennung gültiger Schnellverbindungsdaten im RTC-Speicher
+#define HA_PAYLOAD_SIZE 8192         // Webhook-Puffer: Datensatz inkl. "packs"-Liste und Sammelmessungen, auch für Nachholnachrichten
+#define HA_DNS_CACHE_MS 600000       // Aufgelöste Webhook-IP 10 Minuten wiederverwenden
+#define HA_TLS_HANDSHAKE_S 5         // https: TLS-Handshake nach 5 Sekunden abbrechen (Standard wären 120 s)
+#define HA_BATCH_MAX_SAMPLES 50      // Sammelmodus: maximal 50 Messungen pro Webhook, ältere gehen in den Zwischenspeicher
+#define HA_RESPONSE_LEN 200          // Gespeicherte Webhook-Antwort wird auf 200 Zeichen gekürzt
+#define HA_BACKOFF_MAX_MS 900000     // Backoff nach Fehlern wird bei 15 Minuten gedeckelt
+#define ALARM_SOC_HYSTERESIS 2       // Alarm "SOC niedrig" endet erst 2 % über der Schwelle
+#define ALARM_DELTA_HYSTERESIS_MV 10 // Alarm "Zelldifferenz" endet erst 10 mV unter der Schwelle
+#define ALARM_TEMP_HYSTERESIS 2      // Alarm "Temperatur" endet erst 2 °C unter der Schwelle
+#define ALARM_CURRENT_HYSTERESIS_MA 1000  // Alarm "Strom" endet erst 1 A unter der Schwelle
+#define DEADBAND_CAPACITY_MAH 100    // Totband: Kapazitätswerte erst ab 0,1 Ah Änderung senden
+
+// Cloud-Task (Webhook-Versand außerhalb von loop())
+#define CLOUD_TASK_STACK_SIZE 8192   // Stackgröße inkl. TLS-Handshake
+#define CLOUD_TASK_PRIORITY 1        // Gleiche Priorität wie loop() (Round-Robin)
+#define CLOUD_QUEUE_LENGTH 2         // Maximal wartende Aufträge (periodisch + manueller Test)
+#define CLOUD_STOP_TIMEOUT_MS 25000  // Warten auf das Anhalten des Cloud-Tasks vor dem Deep Sleep (offene Sendung + Schreiben)
+
 // ============================================================================
 // LED-Konfiguration für Status-Anzeige
 // ============================================================================
@@ -76,15 +151,18 @@
 // Globale Objekte
 // ============================================================================
 
-// BMS Bluetooth Client - kommuniziert via BLE mit dem LiTime BMS
-BMSClient bmsClient;
+// Handle des BLE-Worker-Tasks (BMS-Clients siehe "BMS-Packs")
+TaskHandle_t bmsTaskHandle = nullptr;
 
-// MAC-Adresse des BMS - muss vom Benutzer im Webinterface konfiguriert werden
-// Format: XX:XX:XX:XX:XX:XX (17 Zeichen)
-String bmsMac = "";
+// Handle des Arduino-Tasks mit setup()/loop() (wird bei neuen Messungen geweckt)
+TaskHandle_t loopTaskHandle = nullptr;
 
 // HTTP-Webserver auf Port 80 für das Webinterface
-WebServer server(80);
+// Die Handler laufen im AsyncTCP-Task, parallel zu loop() (siehe "Webserver-Setup")
+AsyncWebServer server(80);
+
+// Push-Stream (Server-Sent Events) unter /api/stream
+AsyncEventSource events("/api/stream");
 
 // Preferences-Objekt für persistente Speicherung im NVS (Non-Volatile Storage)
 // Überlebt Neustarts und Stromausfälle
@@ -112,6 +190,65 @@ bool wifiReconnecting = false;
 // Zeitstempel wann der Reconnect-Versuch gestartet wurde
 unsigned long wifiReconnectStart = 0;
 
+// Laufender Reconnect-Versuch ist gezielt (gemerkter AP) statt mit vollem Scan
+bool wifiReconnectTargeted = false;
+
+// Reconnect-Versuche seit dem Verbindungsverlust (gerade = gezielt, ungerade = Scan)
+uint8_t wifiReconnectAttempts = 0;
+
+// Ergebnis des letzten WLAN-Scans (stärkstes Signal je SSID, absteigend sortiert)
+struct ScanResult {
+  char ssid[33];    // SSID (max. 32 Zeichen + Nullterminator)
+  int8_t rssi;      // Empfangsstärke in dBm
+  uint8_t channel;  // WLAN-Kanal
+};
+ScanResult scanResults[SCAN_MAX_RESULTS];
+uint8_t scanResultCount = 0;
+
+// Zeitpunkt des letzten abgeschlossenen Scans (millis, 0 = noch nie)
+unsigned long scanResultTime = 0;
+
+// Asynchroner Scan läuft (Ergebnis holt serviceWifiScan() ab) und dessen Start
+volatile bool scanRunning = false;
+unsigned long scanStartTime = 0;
+
+// Vom Webserver angeforderter Scan (startet serviceWifiScan() in loop())
+volatile bool scanRequested = false;
+
+// Schützt scanResults: loop() schreibt, /scan (AsyncTCP-Task) liest
+SemaphoreHandle_t scanMutex = nullptr;
+
+// ============================================================================
+// Startablauf
+// ============================================================================
+// setup() startet WLAN, Webserver und Tasks ohne zu warten. Die weiteren
+// Schritte (gezielte Verbindung, Scan, AP-Fallback) führt serviceBoot() aus
+// loop() fort, NTP und BLE laufen im Hintergrund.
+
+// Phasen der WLAN-Verbindung beim Start
+enum BootPhase : uint8_t {
+  BOOT_WIFI_TARGETED,  // Gezielt mit gemerktem AP
+  BOOT_WIFI_SCAN,      // Normal mit Scan
+  BOOT_DONE            // Verbunden oder AP-Modus, ab hier überwacht loop() das WLAN
+};
+
+// Aktuelle Phase und deren Beginn (millis)
+BootPhase bootPhase = BOOT_DONE;
+unsigned long bootPhaseStart = 0;
+
+// Zeitpunkte der Startphasen in ms seit Reset (0 = noch nicht erreicht)
+// Werden auch aus dem BLE-Task und dem SNTP-Callback geschrieben (32-Bit, atomar)
+struct BootTimings {
+  volatile uint32_t wifiStart;   // WLAN-Verbindungsaufbau gestartet
+  volatile uint32_t webServer;   // Webserver nimmt Anfragen an
+  volatile uint32_t setup;       // setup() beendet
+  volatile uint32_t wifi;        // WLAN verbunden
+  volatile uint32_t ntp;         // Erste NTP-Synchronisation
+  volatile uint32_t bmsConnect;  // Erste BMS-Verbindung
+  volatile uint32_t bmsData;     // Erste gültige Messung
+};
+BootTimings bootTimings = {};
+
 // ============================================================================
 // Benutzer-Einstellungen (werden persistent gespeichert)
 // ============================================================================
@@ -126,18 +263,24 @@ unsigned long bmsInterval = 20;
 // Bluetooth aktiviert/deaktiviert
 bool bluetoothEnabled = true;
 
-// BMS-Verbindungsstatus
-bool bmsConnected = false;
+// Verbindungen zwischen den Abfragen offen halten (false = je Abfrage verbinden, lesen, trennen)
+bool bmsKeepConnected = true;
+
+// Abfrageintervall an Last und Alarmzustand anpassen (false = immer bmsInterval)
+bool bmsAdaptivePolling = true;
+
+// BMS-Verbindungsstatus: alle konfigurierten Packs erreichbar (wird vom BLE-Task geschrieben)
+volatile bool bmsConnected = false;
 
 // Terminal-Ausgabe der BMS-Daten aktiviert/deaktiviert
 bool serialOutputEnabled = true;
 
-// Flag ob die aktuellen BMS-Daten plausibel sind
+// Flag ob die aktuellen BMS-Daten (Pack 0) plausibel sind
 // Wird bei jedem Update neu berechnet
-bool bmsDataValid = false;
+volatile bool bmsDataValid = false;
 
-// Flag für ausstehende BMS-Verbindung (non-blocking Verbindungsaufbau)
-bool bmsConnectPending = false;
+// Flag für ausstehende BMS-Verbindung (sofortiger Versuch im BLE-Task, ohne Backoff)
+volatile bool bmsConnectPending = false;
 
 // ============================================================================
 // WLAN-Sendestärke-Konfiguration
@@ -146,6 +289,55 @@ bool bmsConnectPending = false;
 // Höhere Sendeleistung = bessere Reichweite, aber mehr Wärmeentwicklung
 uint8_t wifiTxPower = 0;  // Standard: Niedrig (5 dBm) für minimale Wärme
 
+// ============================================================================
+// Energiesparmodus
+// ============================================================================
+// 0 = Normal: loop() läuft ohne Pause, WLAN im Modem-Sleep (Minimum)
+// 1 = Stromsparen: loop() gibt die CPU zwischen den Durchläufen ab, CPU-Takt
+//     wird bei Leerlauf abgesenkt (DFS) und der Chip geht automatisch in den
+//     Light Sleep; WLAN im Modem-Sleep (Maximum)
+uint8_t powerMode = 0;  // Standard: Normal
+
+// Automatischer Light Sleep vom System angenommen (hängt von der Build-Konfiguration ab)
+bool lightSleepActive = false;
+
+// Anteil der Zeit, die loop() im letzten Messfenster gearbeitet hat (in 0.1 %)
+uint16_t loopBusyPermille = 1000;
+
+// Laufendes Messfenster: Arbeitszeit von loop() und Fensterbeginn (µs)
+uint64_t loopBusyUs = 0;
+uint64_t loopWindowStart = 0;
+
+// ============================================================================
+// Headless-Betrieb (Deep Sleep)
+// ============================================================================
+
+// Headless-Betrieb aktiviert (Wachzyklen statt Dauerbetrieb)
+bool headlessMode = false;
+
+// Abstand zwischen zwei Wachzyklen in Sekunden (60-86400)
+unsigned long sleepInterval = 300;
+
+// Beginn des Konfigurationsfensters (millis), danach Deep Sleep
+unsigned long headlessWindowStart = 0;
+
+// WLAN-Schnellverbindung: zuletzt verwendeter AP und IP-Konfiguration
+struct WifiFastConnect {
+  uint32_t magic;      // WIFI_FAST_MAGIC wenn gültig
+  uint8_t bssid[6];    // MAC-Adresse des Access Points
+  uint8_t channel;     // WLAN-Kanal
+  uint32_t ip;         // Zuletzt per DHCP erhaltene Adresse (wird fest gesetzt)
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+// Bleiben im Deep Sleep erhalten (RTC-Speicher), nach Einschalten leer
+RTC_DATA_ATTR WifiFastConnect rtcWifi = {};
+RTC_DATA_ATTR time_t rtcLastSyncTime = 0;       // lastSyncTime über den Deep Sleep
+RTC_DATA_ATTR uint32_t headlessCycles = 0;      // Wachzyklen seit dem Einschalten
+RTC_DATA_ATTR uint32_t headlessLastAwakeMs = 0; // Dauer des letzten Wachzyklus
+
 // ============================================================================
 // Home Assistant Webhook-Konfiguration
 // ============================================================================
@@ -159,17 +351,206 @@ unsigned long haInterval = 60;
 // Webhook aktiviert/deaktiviert
 bool haEnabled = false;
 
-// Zeitstempel des letzten Webhook-Versands
+// Sammelmodus: alle Messungen seit der letzten Sendung als Array mitsenden
+bool haBatchMode = false;
+
+// Webhook als MessagePack statt JSON senden (gleiche Struktur, kompakter)
+bool haMsgPack = false;
+
+// Zeitstempel des letzten Webhook-Auftrags (loop)
 unsigned long lastHaSend = 0;
 
-// Zeitpunkt des letzten Webhook-Versands als lesbarer String
-String lastHaTime = "";
+// Zeitstempel des letzten echten Sendeversuchs (Cloud-Task, für den Backoff)
+unsigned long lastHaAttempt = 0;
+
+// Zeitpunkt des letzten Webhook-Versands als lesbarer String (unter haMutex)
+char lastHaTime[32] = "";
+
+// HTTP-Statuscode der letzten Webhook-Anfrage (wird vom Cloud-Task geschrieben)
+volatile int lastHaHttpCode = 0;
+
+// Response-Text der letzten Webhook-Anfrage (für Debugging, unter haMutex)
+char lastHaResponse[HA_RESPONSE_LEN + 4] = "";  // + "..." + Nullterminator
+
+// Dauer der letzten Webhook-Anfrage in ms (Verbindung + Senden + Antwort)
+volatile unsigned long lastHaDuration = 0;
+
+// Größe der letzten Webhook-Nutzdaten: gesendet und als JSON (Vergleich für MessagePack)
+volatile uint32_t lastHaBytes = 0;
+volatile uint32_t lastHaJsonBytes = 0;
+
+// Anzahl aufeinanderfolgender Fehlversuche (steuert den Backoff, 0 = kein Fehler)
+volatile uint8_t haFailCount = 0;
+
+// Schützt haWebhookUrl, lastHaTime und lastHaResponse (Webserver <-> Cloud-Task)
+SemaphoreHandle_t haMutex = nullptr;
+
+// Auftrag für den Cloud-Task
+struct CloudJob {
+  bool manual;  // true = Test über das Webinterface (auch bei deaktiviertem Webhook)
+  bool alarm;   // true = sofortige Sendung nach Alarmwechsel (ohne Backoff)
+  bool stop;    // true = Zwischenspeicher schreiben und anhalten (vor dem Deep Sleep)
+};
+
+// Warteschlange für Cloud-Aufträge (begrenzt die Anzahl laufender Sendungen)
+QueueHandle_t cloudQueue = nullptr;
+
+// Handle des Cloud-Tasks
+TaskHandle_t cloudTaskHandle = nullptr;
+
+// Meldet, dass der Cloud-Task nach einem Stop-Auftrag angehalten hat (siehe stopCloudTask())
+SemaphoreHandle_t cloudStopped = nullptr;
+
+// Flag während der Cloud-Task einen Auftrag bearbeitet
+volatile bool cloudBusy = false;
+
+// Sammelmodus: Index (Zählweise von historyTotal) der ersten noch nicht gesendeten Messung (Cloud-Task)
+uint32_t haBatchCursor = 0;
+
+// Sammelmodus wurde (wieder) eingeschaltet: Cursor auf die aktuelle Messung setzen
+volatile bool haBatchRestart = false;
+
+// Langlebiger HTTP-Client mit Keep-Alive (Verbindung wird zwischen Sendungen gehalten)
+HTTPClient haHttp;
+
+// Transport-Clients für http bzw. https (bleiben über Sendungen hinweg verbunden)
+WiFiClient haPlainClient;
+WiFiClientSecure haSecureClient;
+
+// URL, zu der die Verbindungsdaten unten gehören (Änderung = neue Verbindung)
+String haConnUrl = "";
+
+// Aus der Webhook-URL zerlegte Verbindungsdaten
+String haHost = "";
+uint16_t haPort = 80;
+bool haHttps = false;
+
+// Gecachte IP-Adresse des Webhook-Hosts (nur http) und Zeitpunkt der Auflösung
+IPAddress haHostIp;
+unsigned long haHostResolvedAt = 0;
+
+// Puffer des Cloud-Tasks (statisch, keine Allokation pro Sendung - der Heap des C3 fragmentiert):
+// serialisierter Webhook-Payload (auch Nachholnachrichten) und MessagePack-Fassung (siehe haEncodeBody())
+char haPayload[HA_PAYLOAD_SIZE];
+uint8_t haPacked[HA_PAYLOAD_SIZE];
+
+// ============================================================================
+// MQTT-Konfiguration
+// ============================================================================
+
+// MQTT-Ausgabe aktiviert/deaktiviert (unabhängig vom Webhook)
+bool mqttEnabled = false;
+
+// Hostname oder IP des Brokers
+String mqttHost = "";
+
+// Port des Brokers (Standard 1883)
+uint16_t mqttPort = 1883;
+
+// Zugangsdaten (leer = anonym)
+String mqttUser = "";
+String mqttPass = "";
+
+// Basis-Topic (leer = Hostname in Kleinbuchstaben, z.B. "litime-bms2cloud-ab12")
+String mqttBaseTopic = "";
+
+// QoS für Messwerte: 0 = höchstens einmal, 1 = mindestens einmal
+uint8_t mqttQos = 0;
+
+// Home Assistant MQTT Discovery aktiviert/deaktiviert
+bool mqttDiscovery = true;
+
+// Messungen als Binärdatensatz unter <basis>/bin statt als einzelne Topics
+bool mqttBinary = false;
+
+// ============================================================================
+// Alarmregeln
+// ============================================================================
+// Jede plausible Messung wird gegen die Regeln geprüft. Ändert sich der
+// Alarmzustand eines Packs, wird sofort gesendet (Webhook und MQTT) statt
+// erst zum nächsten Intervall. Schwelle 0 = Regel deaktiviert.
+
+// Alarmregeln aktiviert/deaktiviert
+bool alarmEnabled = false;
+
+// SOC unter diesem Wert in % (0 = aus)
+uint8_t alarmSocMin = 0;
+
+// Differenz höchste - niedrigste Zellspannung über diesem Wert in mV (0 = aus)
+uint16_t alarmCellDeltaMv = 0;
+
+// MOSFET- oder Zellentemperatur über diesem Wert in °C (0 = aus)
+uint8_t alarmTempMax = 0;
+
+// Lade- oder Entladestrom über diesem Wert in A (0 = aus)
+uint16_t alarmCurrentMax = 0;
+
+// Mindestabstand zwischen zwei Alarm-Sendungen in Sekunden (weitere Wechsel werden zusammengefasst)
+unsigned long alarmMinInterval = 30;
+
+// Alarmwechsel wartet auf Versand (vom BLE-Task gesetzt, in loop() abgearbeitet)
+volatile bool alarmPending = false;
+
+// Anzahl erkannter Alarmwechsel seit Start
+volatile uint32_t alarmEventCount = 0;
+
+// Zeitpunkt der letzten Alarm-Sendung
+unsigned long lastAlarmSend = 0;
+
+// ============================================================================
+// Änderungsbasiertes Senden (Totband)
+// ============================================================================
+// Ein Messwert wird erst wieder gesendet, wenn er sich um mehr als das
+// Totband vom zuletzt gesendeten Wert entfernt hat. Spätestens nach
+// reportHeartbeat Sekunden wird trotzdem gesendet (Lebenszeichen).
+
+// Totband aktiviert (false = jede Änderung bzw. jedes Intervall senden)
+bool reportDeadband = false;
+
+// Totband für Spannungen (Gesamt- und Zellspannung) in mV
+uint16_t deadbandMv = 10;
+
+// Totband für den Strom in mA
+uint16_t deadbandMa = 200;
+
+// Totband für den SOC in %
+uint8_t deadbandSoc = 1;
 
-// HTTP-Statuscode der letzten Webhook-Anfrage
-int lastHaHttpCode = 0;
+// Totband für Temperaturen in °C
+uint8_t deadbandTemp = 1;
 
-// Response-Text der letzten Webhook-Anfrage (für Debugging)
-String lastHaResponse = "";
+// Höchstens so lange (Sekunden) ohne Sendung, auch wenn sich nichts bewegt
+unsigned long reportHeartbeat = 900;
+
+// Webhook-Intervalle ohne Sendung (Totband nicht überschritten)
+volatile uint32_t haDeadbandSkips = 0;
+
+// MQTT-Client (Verbindungsaufbau und Keep-Alive laufen im eigenen Task der Bibliothek)
+espMqttClient mqttClient;
+
+// Verbindungsstatus (wird aus den Callbacks des MQTT-Tasks geschrieben)
+volatile bool mqttConnected = false;
+
+// Flag nach erfolgreichem Verbindungsaufbau: Discovery und alle Werte senden
+volatile bool mqttSessionStarted = false;
+
+// Flag für laufenden Verbindungsversuch
+volatile bool mqttConnecting = false;
+
+// Zeitstempel des letzten Verbindungsversuchs
+unsigned long lastMqttConnectAttempt = 0;
+
+// Aktuelle Wartezeit bis zum nächsten Reconnect (exponentieller Backoff)
+unsigned long mqttReconnectDelay = MQTT_RECONNECT_MIN_MS;
+
+// Sequenznummer der zuletzt veröffentlichten Messung (0 = noch nichts gesendet)
+uint32_t mqttLastSeq = 0;
+
+// Anzahl der Zellen, für die Discovery-Konfigurationen gesendet wurden
+uint8_t mqttDiscoveredCells = 0;
+
+// Anzahl der seit Start veröffentlichten Nachrichten (für Statusanzeige)
+uint32_t mqttPublishCount = 0;
 
 // ============================================================================
 // Timing-Variablen für non-blocking Operationen
@@ -177,9 +558,6 @@ String lastHaResponse = "";
 // Alle zeitgesteuerten Operationen verwenden millis() statt delay()
 // um den Webserver nicht zu blockieren
 
-// Zeitstempel der letzten BMS-Datenabfrage
-unsigned long lastBmsUpdate = 0;
-
 // Zeitstempel der letzten NTP-Synchronisation
 unsigned long lastNtpSync = 0;
 
@@ -192,8 +570,11 @@ time_t lastSyncTime = 0;
 // Zeitstempel der letzten WLAN-Verbindungsprüfung
 unsigned long lastWifiCheck = 0;
 
-// Intervall für WLAN-Verbindungsprüfung (30 Sekunden)
-unsigned long wifiCheckInterval = 30000;
+// Intervall für WLAN-Verbindungsprüfung (1 Sekunde, nur WiFi.status())
+unsigned long wifiCheckInterval = 1000;
+
+// Pause zwischen erfolglosen Reconnect-Runden (gezielt + Scan)
+unsigned long wifiRetryInterval = 30000;
 
 // NTP-Server für Zeitsynchronisation
 const char* ntpServer = "pool.ntp.org";
@@ -230,1596 +611,5795 @@ unsigned long lastHeapCheck = 0;
 // Intervall für Heap-Checks (alle 10 Sekunden)
 #define HEAP_CHECK_INTERVAL 10000
 
-// ============================================================================
-// BMS-Datenstruktur
-// ============================================================================
-// Speichert alle vom BMS abgefragten Werte zwischen den Abfragen
-// Wird im Webinterface und für Webhook-Daten verwendet
+#define HEAP_RECOVER_MARGIN 2048  // Hysterese: Entlastung endet erst über Schwelle + Marge
+#define HEAP_RESTART_CHECKS 6     // Checks in Folge unter der Schwelle bis zum Neustart (60 s)
+#define STACK_WARN_BYTES 512      // Warnung, wenn ein Task weniger freien Stack hatte
 
-struct BMSData {
-  float totalVoltage = 0;           // Gesamtspannung der Batterie in Volt
-  float cellVoltageSum = 0;         // Summe aller Zellspannungen in Volt
-  float current = 0;                // Aktueller Strom in Ampere (negativ = Entladen)
-  int16_t mosfetTemp = 0;           // MOSFET-Temperatur in °C
-  int16_t cellTemp = 0;             // Zellentemperatur in °C
-  uint8_t soc = 0;                  // State of Charge (Ladezustand) in Prozent
-  String soh = "";                  // State of Health (Batteriegesundheit)
-  float remainingAh = 0;            // Verbleibende Kapazität in Ah
-  float fullCapacityAh = 0;         // Volle Kapazität in Ah
-  String protectionState = "";      // Schutzstatus (z.B. "Normal", "Overvoltage")
-  String heatState = "";            // Heizungsstatus
-  String balanceMemory = "";        // Balance-Speicher
-  String failureState = "";         // Fehlerstatus
-  String balancingState = "";       // Balancing-Status
-  String batteryState = "";         // Batteriestatus (Charging/Discharging/Idle)
-  uint32_t dischargesCount = 0;     // Anzahl der Entladezyklen
-  float dischargesAhCount = 0;      // Gesamte entladene Ah über Lebensdauer
-  std::vector<float> cellVoltages;  // Einzelne Zellspannungen als Vektor
-} bmsData;
+// Größter zusammenhängender freier Block beim letzten Check und kleinster seit Start
+// (Fragmentierung: viel freier Heap, aber kein Block für TLS oder einen Sammel-Webhook)
+size_t largestFreeBlock = 0;
+size_t minLargestFreeBlock = 0;
+
+// Fehlgeschlagene Heap-Allokationen (Hook, kann aus jedem Task kommen) und Größe der letzten
+volatile uint32_t heapAllocFailures = 0;
+volatile uint32_t heapLastFailSize = 0;
+
+// Bereits ausgegebene fehlgeschlagene Allokationen (nur checkHeapMemory())
+uint32_t heapAllocFailuresLogged = 0;
+
+// Überwachte Tasks (Namen wie bei xTaskCreate(), "loopTask" = loop() selbst)
+#define STACK_WATCH_COUNT 5
+const char* const STACK_WATCH_NAMES[STACK_WATCH_COUNT] = { "loopTask", "bms", "cloud", "wifi", "async_tcp" };
+
+// Kleinster je freier Stack der überwachten Tasks in Bytes (0 = Task läuft nicht)
+uint32_t stackFreeBytes[STACK_WATCH_COUNT] = {};
+
+// Maßnahme bei knappem Speicher (größter freier Block unter heapMinBlock):
+// 0 = nur warnen
+// 1 = entlasten: Push-Stream trennen
+// 2 = entlasten und nach HEAP_RESTART_CHECKS Checks im Leerlauf neu starten
+uint8_t heapAction = 1;  // Standard: entlasten
+
+// Schwelle für den größten freien Block in Bytes (4096-65535)
+uint16_t heapMinBlock = 10240;
+
+// Entlastung aktiv (liest auch der AsyncTCP-Task)
+volatile bool heapLow = false;
+
+// Checks in Folge unter der Schwelle
+uint8_t heapLowChecks = 0;
+
+// Anzahl Entlastungen seit Start (für /metrics)
+uint32_t heapReliefCount = 0;
 
 // ============================================================================
-// Forward-Deklarationen
+// Metriken (/metrics)
 // ============================================================================
-// Funktionen die vor ihrer Definition aufgerufen werden
+// Interne Zähler für Prometheus. Jeder Wert wird nur von einem Task
+// geschrieben; einzelne 32-Bit-Zugriffe sind auf dem ESP32 atomar.
 
-void printBMSDataSerial();    // Gibt BMS-Daten auf Serial aus
-void startAP();               // Startet den Access Point Modus
-bool connectToSavedWiFi();    // Verbindet mit gespeichertem WLAN
+// Obergrenzen der Histogramm-Klassen in ms (zusätzlich +Inf)
+#define LATENCY_BUCKET_COUNT 8
+const uint32_t LATENCY_BUCKETS_MS[LATENCY_BUCKET_COUNT] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+
+/**
+ * Dauer-Histogramm mit festen Klassen (kumulativ erst bei der Ausgabe)
+ */
+struct LatencyHistogram {
+  volatile uint32_t buckets[LATENCY_BUCKET_COUNT + 1] = {};  // Letzte Klasse = +Inf
+  volatile uint32_t count = 0;
+  volatile uint32_t sumMs = 0;
+
+  /**
+   * Erfasst eine Dauer
+   *
+   * @param ms Dauer in Millisekunden
+   */
+  void observe(uint32_t ms) {
+    uint8_t i = 0;
+    while (i < LATENCY_BUCKET_COUNT && ms > LATENCY_BUCKETS_MS[i]) i++;
+    buckets[i]++;
+    sumMs += ms;
+    count++;
+  }
+};
+
+// Dauer einer BMS-Abfrage (BMSClient::update(), BLE-Task)
+LatencyHistogram blePollHistogram;
+
+// Verbindungsversuche zum BMS und davon fehlgeschlagene (BLE-Task)
+volatile uint32_t bmsConnectAttempts = 0;
+volatile uint32_t bmsConnectFailures = 0;
+
+// Fehlgeschlagene Abfragen (Timeout oder keine plausiblen Daten) und
+// dadurch ausgelöste Neuverbindungen (BLE-Task)
+volatile uint32_t bmsPollFailures = 0;
+volatile uint32_t bmsPollReconnects = 0;
+
+// Dauer eines Webhook-Versands inkl. Verbindungsaufbau (Cloud-Task)
+LatencyHistogram haLatencyHistogram;
+
+// Webhook-Ergebnisse nach Klasse: 2xx, 3xx, 4xx, 5xx, Verbindungsfehler (Cloud-Task)
+volatile uint32_t haResultCounts[5] = {};
+
+// Vom Webserver beantwortete Anfragen (AsyncTCP-Task)
+volatile uint32_t httpRequestCount = 0;
+
+// Anzahl loop()-Durchläufe und längster Durchlauf im letzten Messfenster (µs)
+uint32_t loopIterations = 0;
+uint32_t loopMaxUs = 0;
+uint32_t loopWindowMaxUs = 0;
 
 // ============================================================================
-// Watchdog und Crash-Logging Funktionen
+// Laufzeitprofil (/api/perf)
 // ============================================================================
+// Misst mit esp_timer_get_time() die Phasen von loop(), die BLE- und
+// Cloud-Operationen sowie jede HTTP-Route: Anzahl, Summe, Maximum und ein
+// log2-Histogramm in µs, alles in festen Arrays. Jeder Zähler wird nur von
+// einem Task geschrieben. Zurückgesetzt wird über eine Generationsnummer,
+// die der schreibende Task beim nächsten Messwert übernimmt.
+
+#define PERF_BUCKET_COUNT 22   // Klasse i: [2^i, 2^(i+1)) µs, letzte Klasse ab 2^21 µs (~2 s)
+#define PERF_MAX_ROUTES 40     // Registrierte HTTP-Routen mit eigenem Zähler (weitere zählen unter "other")
+#define PERF_ENTRY_SIZE 512    // Ein Eintrag der /api/perf-Antwort (Antwort wird stückweise gesendet)
 
 /**
- * Speichert den aktuellen Programmstatus im NVS für Crash-Analyse
- *
- * Diese Funktion wird vor kritischen Operationen aufgerufen und speichert
- * die aktuelle Position im Code. Nach einem Watchdog-Reset kann man im
- * Serial-Output sehen, wo der ESP32 zuletzt war.
- *
- * @param location Beschreibung der aktuellen Code-Position (z.B. "loop:bms_update")
+ * Messwerte eines Zeitabschnitts
  */
-void logCrashLocation(const char* location) {
-  static unsigned long lastLog = 0;
-  unsigned long now = millis();
-
-  // Nicht zu oft schreiben (NVS hat begrenzte Schreibzyklen)
-  // Nur alle 5 Sekunden oder bei wichtigen Positionen (mit "!" Präfix)
-  if (location[0] != '!' && now - lastLog < 5000) {
-    return;
+struct PerfStats {
+  volatile uint32_t generation = 0;  // Stand von perfGeneration beim letzten Messwert
+  volatile uint32_t count = 0;
+  volatile uint64_t totalUs = 0;
+  volatile uint32_t maxUs = 0;
+  volatile uint32_t buckets[PERF_BUCKET_COUNT] = {};
+
+  /**
+   * Erfasst eine Dauer (nur vom zugehörigen Task aufrufen)
+   *
+   * @param us Dauer in Mikrosekunden
+   */
+  void record(uint32_t us);
+
+  /**
+   * Liest die Summe ohne zerrissenen Wert
+   *
+   * 64 Bit werden auf dem C3 in zwei Zugriffen gelesen, der schreibende
+   * Task kann dazwischen laufen. Gelesen wird, bis zwei Werte gleich sind.
+   */
+  uint64_t total() const;
+};
+
+// Zeitabschnitte außerhalb der HTTP-Routen
+enum PerfProbe : uint8_t {
+  PERF_LOOP,             // Gesamter loop()-Durchlauf (ohne Pause im Stromsparmodus)
+  PERF_LOOP_LED,
+  PERF_LOOP_WEB_COMMANDS,
+  PERF_LOOP_STREAM,
+  PERF_LOOP_WIFI,
+  PERF_LOOP_NTP,
+  PERF_LOOP_WEBHOOK,
+  PERF_LOOP_MQTT,
+  PERF_LOOP_ALARMS,
+  PERF_LOOP_ENERGY,
+  PERF_BLE_CONNECT,      // BMSClient::connect() (BLE-Task)
+  PERF_BLE_UPDATE,       // BMSClient::update() (BLE-Task)
+  PERF_BLE_SAMPLE,       // Übernahme, Auswertung und Veröffentlichung einer Messung (BLE-Task)
+  PERF_CLOUD_WEBHOOK,    // sendToHomeAssistant() (Cloud-Task)
+  PERF_CLOUD_REPLAY,     // replayWebhookBacklog() (Cloud-Task)
+  PERF_PROBE_COUNT
+};
+
+// Namen in /api/perf (Reihenfolge wie PerfProbe)
+const char* const PERF_PROBE_NAMES[PERF_PROBE_COUNT] = {
+  "loop", "loop:led", "loop:web_commands", "loop:stream", "loop:wifi", "loop:ntp",
+  "loop:webhook", "loop:mqtt", "loop:alarms", "loop:energy",
+  "ble:connect", "ble:update", "ble:sample", "cloud:webhook", "cloud:replay"
+};
+
+// Wird bei jedem Zurücksetzen erhöht (Messwerte älterer Generationen gelten als 0)
+volatile uint32_t perfGeneration = 0;
+
+// Zeitpunkt des letzten Zurücksetzens (esp_timer_get_time())
+volatile int64_t perfResetAt = 0;
+
+// Messwerte der Zeitabschnitte
+PerfStats perfProbes[PERF_PROBE_COUNT];
+
+// Messwerte der HTTP-Routen (nur AsyncTCP-Task), letzter Eintrag = "other"
+PerfStats perfRoutes[PERF_MAX_ROUTES + 1];
+
+// Registrierte Pfade (in setupWebServer() vor server.begin() gesetzt, danach unveränderlich)
+const char* perfRouteNames[PERF_MAX_ROUTES];
+uint8_t perfRouteCount = 0;
+
+void PerfStats::record(uint32_t us) {
+  uint32_t gen = perfGeneration;
+  if (generation != gen) {
+    count = 0;
+    totalUs = 0;
+    maxUs = 0;
+    for (uint8_t i = 0; i < PERF_BUCKET_COUNT; i++) buckets[i] = 0;
+    generation = gen;
   }
-  lastLog = now;
+  count++;
+  totalUs += us;
+  if (us > maxUs) maxUs = us;
+  uint8_t bucket = 31 - __builtin_clz(us | 1);
+  buckets[min(bucket, (uint8_t)(PERF_BUCKET_COUNT - 1))]++;
+}
 
-  preferences.begin("crashlog", false);
-  preferences.putString("location", location);
-  preferences.putULong("millis", now);
-  preferences.putULong("freeHeap", ESP.getFreeHeap());
-  preferences.end();
+uint64_t PerfStats::total() const {
+  uint64_t value = totalUs;
+  uint64_t check = totalUs;
+  while (value != check) {
+    value = check;
+    check = totalUs;
+  }
+  return value;
 }
 
 /**
- * Liest und zeigt das letzte Crash-Log an
+ * Erfasst die Dauer seit start für einen Zeitabschnitt
  *
- * Wird in setup() aufgerufen um zu sehen, wo der ESP32 beim letzten
- * Watchdog-Reset war. Hilft bei der Fehlersuche.
+ * @param probe Zeitabschnitt
+ * @param start Startzeit (esp_timer_get_time())
+ * @return Aktuelle Zeit (Startzeit des nächsten Abschnitts)
  */
-void printLastCrashLog() {
-  preferences.begin("crashlog", true);
-  String lastLocation = preferences.getString("location", "");
-  unsigned long lastMillis = preferences.getULong("millis", 0);
-  unsigned long lastHeap = preferences.getULong("freeHeap", 0);
-  preferences.end();
-
-  if (lastLocation.length() > 0) {
-    Serial.println();
-    Serial.println("╔═══════════════════════════════════════════════════════");
-    Serial.println("║ WATCHDOG RESET ERKANNT!");
-    Serial.println("╠═══════════════════════════════════════════════════════");
-    Serial.println("║ Letzte Position: " + lastLocation);
-    Serial.println("║ Uptime: " + String(lastMillis / 1000) + " Sekunden");
-    Serial.println("║ Free Heap: " + String(lastHeap) + " bytes");
-    Serial.println("╚═══════════════════════════════════════════════════════");
-    Serial.println();
-  }
+int64_t perfLap(PerfProbe probe, int64_t start) {
+  int64_t now = esp_timer_get_time();
+  perfProbes[probe].record((uint32_t)min(now - start, (int64_t)UINT32_MAX));
+  return now;
 }
 
 /**
- * Löscht das Crash-Log nach erfolgreichem Start
+ * Meldet eine Route für das Laufzeitprofil an (nur in setupWebServer())
  *
- * Wird nach einer gewissen Laufzeit aufgerufen (z.B. nach 60 Sekunden)
- * um das alte Crash-Log zu löschen, damit beim nächsten Reset nur
- * relevante Daten angezeigt werden.
+ * @param path Registrierter Pfad (muss dauerhaft gültig sein, z.B. Literal)
  */
-void clearCrashLog() {
-  preferences.begin("crashlog", false);
-  preferences.clear();
-  preferences.end();
+void perfAddRoute(const char* path) {
+  if (perfRouteCount < PERF_MAX_ROUTES) perfRouteNames[perfRouteCount++] = path;
 }
 
 /**
- * Überwacht den freien Heap-Speicher
+ * Zähler einer HTTP-Route
  *
- * Gibt Warnungen aus wenn der Speicher knapp wird (unter 10KB).
- * Hilft Speicherlecks zu identifizieren.
+ * Nur aus dem AsyncTCP-Task aufrufen. Nicht angemeldete Pfade (404,
+ * favicon.ico, Scanner) landen im letzten Eintrag "other" und belegen
+ * keinen eigenen Zähler.
+ *
+ * @param url Pfad der Anfrage
  */
-void checkHeapMemory() {
-  size_t currentHeap = ESP.getFreeHeap();
+PerfStats& perfRoute(const char* url) {
+  for (uint8_t i = 0; i < perfRouteCount; i++) {
+    if (strcmp(perfRouteNames[i], url) == 0) return perfRoutes[i];
+  }
+  return perfRoutes[PERF_MAX_ROUTES];
+}
 
-  // Minimum tracken
-  if (minFreeHeap == 0 || currentHeap < minFreeHeap) {
-    minFreeHeap = currentHeap;
-    Serial.println("[HEAP] Neues Minimum: " + String(minFreeHeap) + " bytes");
+// ============================================================================
+// Push-Stream (Server-Sent Events)
+// ============================================================================
+
+// Maximale Anzahl gleichzeitig offener Stream-Verbindungen
+#define STREAM_MAX_CLIENTS 4
+
+// Intervall für das Zeit-Ereignis (dient gleichzeitig als Keep-Alive)
+#define STREAM_TIME_INTERVAL 1000
+
+// Neuer Client verbunden: beim nächsten Durchlauf ein vollständiges "update" senden
+volatile bool streamForceUpdate = false;
+
+// Zuletzt per Stream gesendete Messung und Status-Bitmaske
+uint32_t streamLastSeq = 0;
+uint16_t streamLastStatus = 0;
+
+// Zeitstempel des letzten Zeit-Ereignisses
+unsigned long streamLastTime = 0;
+
+// ============================================================================
+// Aufträge vom Webserver
+// ============================================================================
+
+// Maximal wartende Aufträge (Einstellungen speichern, WLAN verbinden, ...)
+#define WEB_COMMAND_QUEUE_LENGTH 4
+
+// Warteschlange der Aufträge (Webserver → loop(), siehe serviceWebCommands())
+QueueHandle_t webCommandQueue = nullptr;
+
+// Schützt die Einstellungen: loop() ändert sie, /api/settings liest sie
+SemaphoreHandle_t settingsMutex = nullptr;
+
+// ============================================================================
+// BMS-Statustexte
+// ============================================================================
+// Der BMS-Client liefert Zustände (Schutz, Fehler, Heizung, ...) als Text.
+// Damit der Datensatz allokationsfrei bleibt, werden die Texte einmalig in
+// einer festen Tabelle interniert und im Datensatz nur als 1-Byte-Code
+// gespeichert. Das BMS kennt nur wenige verschiedene Zustände, die Tabelle
+// füllt sich daher nach kurzer Laufzeit nicht weiter.
+//
+// Die Tabelle wird nur vom BLE-Task erweitert (append-only), Leser greifen
+// nur auf bereits veröffentlichte Codes zu und brauchen daher keine Sperre.
+
+#define BMS_MAX_CELLS 16            // Maximal unterstützte Zellenzahl (16S)
+#define BMS_STATE_TEXT_LEN 32       // Maximale Länge eines Statustexts inkl. Nullterminator
+#define BMS_STATE_TABLE_SIZE 32     // Maximale Anzahl unterschiedlicher Statustexte
+
+// Code eines internierten Statustexts (0 = leer/unbekannt)
+typedef uint8_t BmsStateCode;
+
+// Code für Texte die nicht mehr in die Tabelle passen
+#define BMS_STATE_OVERFLOW 0xFF
+
+// Tabelle der internierten Statustexte (Eintrag 0 ist immer der Leerstring)
+char bmsStateTexts[BMS_STATE_TABLE_SIZE][BMS_STATE_TEXT_LEN] = { "" };
+
+// Anzahl belegter Tabelleneinträge
+volatile uint8_t bmsStateCount = 1;
+
+/**
+ * Liefert den Code für einen Statustext und legt ihn bei Bedarf an
+ *
+ * Läuft nur im BLE-Task. Texte werden auf BMS_STATE_TEXT_LEN - 1 Zeichen
+ * gekürzt.
+ *
+ * @param text Statustext vom BMS-Client
+ * @return Code des Texts oder BMS_STATE_OVERFLOW wenn die Tabelle voll ist
+ */
+BmsStateCode internBmsState(const String& text) {
+  for (uint8_t i = 0; i < bmsStateCount; i++) {
+    if (strncmp(bmsStateTexts[i], text.c_str(), BMS_STATE_TEXT_LEN - 1) == 0) {
+      return i;
+    }
   }
+  if (bmsStateCount >= BMS_STATE_TABLE_SIZE) {
+    return BMS_STATE_OVERFLOW;
+  }
+  uint8_t code = bmsStateCount;
+  strlcpy(bmsStateTexts[code], text.c_str(), BMS_STATE_TEXT_LEN);
+  bmsStateCount = code + 1;  // Erst nach dem Kopieren sichtbar machen
+  return code;
+}
 
-  // Warnung bei kritischem Speicher (unter 10KB)
-  if (currentHeap < 10240) {
-    Serial.println("[HEAP] ⚠️ WARNUNG: Nur noch " + String(currentHeap) + " bytes frei!");
+/**
+ * Liefert den Text zu einem Statuscode (für die Ausgabe)
+ *
+ * @param code Statuscode aus BMSData
+ * @return Statustext, "?" für übergelaufene oder ungültige Codes
+ */
+const char* bmsStateText(BmsStateCode code) {
+  if (code >= bmsStateCount) {
+    return "?";
   }
+  return bmsStateTexts[code];
 }
 
 // ============================================================================
-// LED-Steuerungsfunktionen
+// BMS-Datenstruktur
+// ============================================================================
+// Speichert alle vom BMS abgefragten Werte zwischen den Abfragen
+// Wird im Webinterface und für Webhook-Daten verwendet
+//
+// Der Datensatz ist ein reiner POD ohne Heap-Anteile: ganzzahlige Einheiten
+// (mV, mA, mAh, °C), Zustände als Codes und ein festes Zellen-Array.
+// Umrechnung in Volt/Ampere/Text erfolgt erst bei der Ausgabe über die
+// Zugriffsfunktionen.
+//
+// Doppelpufferung: Der BLE-Task füllt immer den inaktiven Puffer und
+// schaltet nach einer vollständigen Abfrage unter dem Mutex um.
+// Leser holen sich per getBMSSnapshot() eine konsistente Kopie und
+// blockieren dabei nie auf eine laufende BLE-Abfrage.
+
+struct BMSData {
+  uint16_t totalMv = 0;                 // Gesamtspannung der Batterie in mV
+  uint16_t cellSumMv = 0;               // Summe aller Zellspannungen in mV
+  int32_t currentMa = 0;                // Aktueller Strom in mA (negativ = Entladen)
+  int16_t mosfetTemp = 0;               // MOSFET-Temperatur in °C (BMS liefert ganze Grad)
+  int16_t cellTemp = 0;                 // Zellentemperatur in °C (BMS liefert ganze Grad)
+  uint32_t remainingMah = 0;            // Verbleibende Kapazität in mAh
+  uint32_t fullCapacityMah = 0;         // Volle Kapazität in mAh
+  uint32_t dischargesCount = 0;         // Anzahl der Entladezyklen
+  uint32_t dischargesMah = 0;           // Gesamte entladene mAh über Lebensdauer
+  uint8_t soc = 0;                      // State of Charge (Ladezustand) in Prozent
+  BmsStateCode sohCode = 0;             // State of Health (Batteriegesundheit)
+  BmsStateCode protectionCode = 0;      // Schutzstatus (z.B. "Normal", "Overvoltage")
+  BmsStateCode heatCode = 0;            // Heizungsstatus
+  BmsStateCode balanceMemoryCode = 0;   // Balance-Speicher
+  BmsStateCode failureCode = 0;         // Fehlerstatus
+  BmsStateCode balancingCode = 0;       // Balancing-Status
+  BmsStateCode batteryStateCode = 0;    // Batteriestatus (Charging/Discharging/Idle)
+  uint8_t cellCount = 0;                // Anzahl gültiger Einträge in cellMv
+  std::array<uint16_t, BMS_MAX_CELLS> cellMv{};  // Einzelne Zellspannungen in mV
+
+  // Zugriffsfunktionen für die Ausgabe (Webinterface, API, Webhook)
+  float totalVoltage() const { return totalMv / 1000.0f; }
+  float cellVoltageSum() const { return cellSumMv / 1000.0f; }
+  float current() const { return currentMa / 1000.0f; }
+  float remainingAh() const { return remainingMah / 1000.0f; }
+  float fullCapacityAh() const { return fullCapacityMah / 1000.0f; }
+  float dischargesAhCount() const { return dischargesMah / 1000.0f; }
+  float cellVoltage(size_t i) const { return cellMv[i] / 1000.0f; }
+  const char* soh() const { return bmsStateText(sohCode); }
+  const char* protectionState() const { return bmsStateText(protectionCode); }
+  const char* heatState() const { return bmsStateText(heatCode); }
+  const char* balanceMemory() const { return bmsStateText(balanceMemoryCode); }
+  const char* failureState() const { return bmsStateText(failureCode); }
+  const char* balancingState() const { return bmsStateText(balancingCode); }
+  const char* batteryState() const { return bmsStateText(batteryStateCode); }
+};
+
+// Snapshot-Kopien sind reine Speicherkopien ohne Allokation
+static_assert(std::is_trivially_copyable<BMSData>::value, "BMSData muss POD bleiben");
+
+// Die beiden Puffer (aktiver = veröffentlichter Snapshot, inaktiver = in Arbeit)
+BMSData bmsBuffers[2];
+
+// Index des aktuell veröffentlichten Puffers
+volatile uint8_t bmsActiveBuffer = 0;
+
+// Laufende Nummer der veröffentlichten Messung (0 = noch keine Messung)
+volatile uint32_t bmsSampleSeq = 0;
+
+// Schützt Pufferwechsel und Snapshot-Kopie
+SemaphoreHandle_t bmsDataMutex = nullptr;
+
+// Einzelne Felder des /api/data-Datensatzes (für Delta-Abfragen mit ?since=)
+enum BmsField : uint8_t {
+  FIELD_TOTAL_VOLTAGE,
+  FIELD_CELL_VOLTAGE_SUM,
+  FIELD_CURRENT,
+  FIELD_MOSFET_TEMP,
+  FIELD_CELL_TEMP,
+  FIELD_SOC,
+  FIELD_SOH,
+  FIELD_REMAINING_AH,
+  FIELD_FULL_CAPACITY_AH,
+  FIELD_PROTECTION_STATE,
+  FIELD_HEAT_STATE,
+  FIELD_FAILURE_STATE,
+  FIELD_BALANCING_STATE,
+  FIELD_BATTERY_STATE,
+  FIELD_DISCHARGES_COUNT,
+  FIELD_DISCHARGES_AH,
+  FIELD_CELL_VOLTAGES,
+  FIELD_COUNT
+};
+
+// Sequenznummer der Messung, in der sich das jeweilige Feld zuletzt geändert hat
+// (wird zusammen mit dem Pufferwechsel unter bmsDataMutex aktualisiert)
+uint32_t bmsFieldSeq[FIELD_COUNT] = {};
+
 // ============================================================================
+// BMS-Packs
+// ============================================================================
+// Bis zu BMS_MAX_PACKS Batterien werden über einen BLE-Stack reihum
+// abgefragt. Pack 0 ist die bisherige Einzelbatterie: Er speist den
+// doppelt gepufferten Datensatz oben (Delta-Abfragen, MQTT, Webhook-Felder).
+// Zusätzlich hält jeder Pack seine letzte Messung für die "packs"-Listen
+// in /api/data, Webhook und /metrics.
 
 /**
- * Schaltet die LED ein
+ * Aus den Messungen eines Packs abgeleitete Werte (siehe updateBmsAnalytics())
  *
- * Berücksichtigt die Active-Low-Logik des ESP32-C3 SuperMini:
- * Bei LED_ACTIVE_LOW = true wird LOW ausgegeben um die LED einzuschalten.
+ * Wird pro Messung in O(Zellen) fortgeschrieben, damit Webinterface,
+ * Webhook-Empfänger und MQTT-Abonnenten nichts selbst nachrechnen müssen.
  */
-void ledOn() {
-  digitalWrite(LED_PIN, LED_ACTIVE_LOW ? LOW : HIGH);
-  ledState = true;
-}
+struct BmsAnalytics {
+  bool valid = false;           // Mindestens eine plausible Messung ausgewertet
+  uint16_t cellMinMv = 0;       // Niedrigste Zellspannung
+  uint16_t cellMaxMv = 0;       // Höchste Zellspannung
+  uint8_t cellMin = 0;          // Index der niedrigsten Zelle (0-basiert)
+  uint8_t cellMax = 0;          // Index der höchsten Zelle (0-basiert)
+  int32_t powerMw = 0;          // Momentanleistung in mW (negativ = Entladen)
+  uint64_t chargedMwMs = 0;     // Geladene Energie in mW·ms (seit Zählerstart, im NVS gesichert)
+  uint64_t dischargedMwMs = 0;  // Entladene Energie in mW·ms
+  int32_t emaCurrentMa = 0;     // Geglätteter Strom (Zeitkonstante ANALYTICS_EMA_TAU_S)
+  uint32_t timeToFullS = 0;     // Restzeit bis voll (0 = lädt nicht)
+  uint32_t timeToEmptyS = 0;    // Restzeit bis leer (0 = entlädt nicht)
+  unsigned long lastSampleAt = 0;  // Zeitpunkt der letzten ausgewerteten Messung (millis)
+
+  uint16_t cellDeltaMv() const { return cellMaxMv - cellMinMv; }
+  uint32_t chargedWh() const { return chargedMwMs / 3600000000ULL; }
+  uint32_t dischargedWh() const { return dischargedMwMs / 3600000000ULL; }
+};
 
 /**
- * Schaltet die LED aus
+ * Ein BMS-Platz (ein Batterie-Pack)
  *
- * Berücksichtigt die Active-Low-Logik des ESP32-C3 SuperMini:
- * Bei LED_ACTIVE_LOW = true wird HIGH ausgegeben um die LED auszuschalten.
+ * Client und Verbindungszustand gehören exklusiv dem BLE-Worker-Task
+ * (bmsTask), niemals aus loop() aufrufen! data, seq und dataValid werden
+ * unter bmsDataMutex geschrieben und gelesen (siehe getPackSnapshot()).
  */
-void ledOff() {
-  digitalWrite(LED_PIN, LED_ACTIVE_LOW ? HIGH : LOW);
-  ledState = false;
+struct BmsSlot {
+  BMSClient client;                      // BLE-Client für dieses BMS
+  char mac[18] = "";                     // MAC-Adresse XX:XX:XX:XX:XX:XX (leer = unbenutzt, nach setup() unveränderlich)
+  volatile bool connected = false;       // BLE-Verbindung besteht
+  volatile bool online = false;          // Letzter Verbindungsversuch/Abfrage erfolgreich
+  bool connectPending = false;           // Sofort verbinden (ohne Backoff)
+  unsigned long lastUpdate = 0;          // Letzte Datenabfrage (millis)
+  unsigned long lastConnectAttempt = 0;  // Letzter Verbindungsversuch (millis)
+  unsigned long reconnectDelay = BMS_RECONNECT_MIN_MS;  // Backoff bis zum nächsten Versuch
+  BMSData data;                          // Letzte Messung
+  uint32_t seq = 0;                      // Anzahl Messungen (0 = noch keine)
+  bool dataValid = false;                // Letzte Messung plausibel
+  volatile unsigned long pollInterval = 0;  // Aktuelles Abfrageintervall in ms (0 = bmsInterval)
+  volatile uint16_t pollLatencyMs = 0;   // Dauer der letzten Abfrage
+  uint8_t failedPolls = 0;               // Fehlgeschlagene Abfragen in Folge
+  uint8_t idlePolls = 0;                 // Ruhige Abfragen in Folge
+  int32_t lastCurrentMa = 0;             // Strom der letzten plausiblen Messung
+  unsigned long lastHistory = 0;         // Letzter Eintrag in der Historie (millis)
+  volatile uint8_t alarmFlags = 0;       // Aktive Alarme (ALARM_*-Bits)
+  BmsStateCode lastProtectionCode = 0;   // Schutzstatus der letzten Messung (Wechselerkennung)
+  BmsStateCode lastFailureCode = 0;      // Fehlerstatus der letzten Messung
+  BmsAnalytics analytics;                // Abgeleitete Werte (nur mit bmsDataMutex lesen)
+};
+
+// Alle Plätze; konfiguriert sind die ersten bmsPackCount() (MACs lückenlos)
+BmsSlot bmsSlots[BMS_MAX_PACKS];
+
+// Zählt jede veröffentlichte Messung aller Packs (Cache, ETag und Push-Stream)
+volatile uint32_t bmsPacksSeq = 0;
+
+// Nächster Pack in der Round-Robin-Reihenfolge des BLE-Tasks
+uint8_t bmsNextPack = 0;
+
+/**
+ * Anzahl konfigurierter Packs (MAC mit 17 Zeichen)
+ */
+uint8_t bmsPackCount() {
+  uint8_t count = 0;
+  while (count < BMS_MAX_PACKS && strlen(bmsSlots[count].mac) == 17) count++;
+  return count;
 }
 
+// ----------------------------------------------------------------------------
+// Empfänger neuer Messungen
+// ----------------------------------------------------------------------------
+// Statt dass jeder Verbraucher die Sequenznummern abfragt, ruft der BLE-Task
+// nach jeder veröffentlichten Messung die registrierten Empfänger auf.
+
 /**
- * Ermittelt die Anzahl der benötigten Blinker basierend auf dem Status
+ * Empfänger einer neuen Messung
  *
- * Berücksichtigt den Soll-Zustand:
- * - Wenn Bluetooth deaktiviert ist, wird BMS nicht geprüft
- * - Wenn Cloud deaktiviert ist, wird Cloud nicht geprüft
+ * Läuft im BLE-Task direkt nach dem Veröffentlichen. Muss kurz sein und darf
+ * nicht blockieren (Daten kopieren bzw. einen Task wecken, nicht senden).
  *
- * @return 0 = alles OK (LED dauerhaft an), 1-3 = Anzahl Blinker
+ * @param pack Pack-Index
+ * @param data Neue Messung
+ * @param valid Ergebnis der Plausibilitätsprüfung
  */
-uint8_t getLedBlinkCount() {
-  // WLAN prüfen (immer erforderlich)
-  bool wlanOk = (WiFi.status() == WL_CONNECTED) || apMode;
-  if (!wlanOk) {
-    return 1;  // 1x Blinken: WLAN-Problem
-  }
+typedef void (*BmsSampleListener)(uint8_t pack, const BMSData& data, bool valid);
 
-  // BMS prüfen (nur wenn Bluetooth aktiviert)
-  if (bluetoothEnabled) {
-    bool bmsOk = bmsConnected && bmsDataValid;
-    if (!bmsOk) {
-      return 2;  // 2x Blinken: BMS-Problem
-    }
-  }
+// Registrierte Empfänger (nur in setup() vor dem Start des BLE-Tasks ändern)
+BmsSampleListener bmsListeners[BMS_MAX_LISTENERS] = {};
+uint8_t bmsListenerCount = 0;
 
-  // Cloud prüfen (nur wenn Cloud aktiviert)
-  if (haEnabled) {
-    bool cloudOk = (lastHaHttpCode == 200);
-    if (!cloudOk) {
-      return 3;  // 3x Blinken: Cloud-Problem
-    }
-  }
+/**
+ * Registriert einen Empfänger neuer Messungen
+ *
+ * Nur vor startBMSTask() aufrufen, die Liste wird danach ohne Sperre gelesen.
+ *
+ * @param listener Aufzurufende Funktion
+ * @return false wenn bereits BMS_MAX_LISTENERS Empfänger registriert sind
+ */
+bool addBmsSampleListener(BmsSampleListener listener) {
+  if (bmsListenerCount >= BMS_MAX_LISTENERS) return false;
+  bmsListeners[bmsListenerCount++] = listener;
+  return true;
+}
 
-  return 0;  // Alle aktivierten Dienste OK
+/**
+ * Ruft alle registrierten Empfänger mit einer neuen Messung auf
+ */
+void notifyBmsSampleListeners(uint8_t pack, const BMSData& data, bool valid) {
+  for (uint8_t i = 0; i < bmsListenerCount; i++) {
+    bmsListeners[i](pack, data, valid);
+  }
 }
 
 /**
- * Aktualisiert das LED-Blinkmuster basierend auf dem Verbindungsstatus
- *
- * Diese Funktion wird in jedem Loop-Durchlauf aufgerufen und steuert
- * die LED gemäß dem aktuellen Verbindungsstatus.
- *
- * Blinkmuster nach Anzahl:
- * - 1x Blinken: WLAN nicht verbunden
- * - 2x Blinken: BMS nicht verbunden (wenn Bluetooth aktiviert)
- * - 3x Blinken: Cloud-Fehler (wenn Cloud aktiviert)
- * - Dauerhaft an: Alle aktivierten Dienste funktionieren
+ * Aktuelles Abfrageintervall eines Packs
  *
- * @param currentMillis Aktueller Zeitstempel aus millis()
+ * @param slot BMS-Platz
+ * @return Intervall in ms
  */
-void updateLED(unsigned long currentMillis) {
-  // Benötigte Blinker ermitteln
-  uint8_t requiredBlinks = getLedBlinkCount();
+unsigned long bmsPollInterval(const BmsSlot& slot) {
+  unsigned long interval = slot.pollInterval;
+  return (bmsAdaptivePolling && interval > 0) ? interval : bmsInterval * 1000;
+}
 
-  // Alles OK → LED dauerhaft an
-  if (requiredBlinks == 0) {
-    ledOn();
-    ledCurrentBlink = 0;
-    ledBlinkPhase = false;
-    return;
+// ============================================================================
+// JSON-Ausgabe mit festem Schema
+// ============================================================================
+// Die API-Antworten und der Webhook haben ein festes Schema. Statt pro
+// Anfrage ein JsonDocument aufzubauen und zu serialisieren, schreibt
+// JsonWriter die Ausgabe direkt in einen vorab angelegten Puffer - ohne
+// Heap-Allokation. Festkomma-Werte (mV, mA, mAh) werden ohne Float-
+// Umrechnung formatiert.
+
+#define DATA_JSON_SIZE 1024     // /api/data vollständig (16 Zellen, lange Statustexte)
+#define DATA_CACHE_SIZE 4096    // /api/data inkl. "packs"-Liste (bis zu 4 Packs)
+#define STATUS_JSON_SIZE 1280   // /api/status (mit Startzeiten und Speicher)
+#define STREAM_JSON_SIZE 4608   // "update"-Ereignis des Push-Streams (Zeit + Status + Daten)
+
+// Zuletzt geschriebener /api/data-Datensatz (nur mit dataJsonMutex, siehe getCachedDataJson())
+char dataJsonCache[DATA_CACHE_SIZE];
+
+// Schützt den Cache: Webserver (AsyncTCP-Task) und Push-Stream (loop()) greifen zu
+SemaphoreHandle_t dataJsonMutex = nullptr;
+
+// Länge, Sequenznummer und Status-Flags des Datensatzes im Cache (Länge 0 = ungültig)
+size_t dataJsonLength = 0;
+uint32_t dataJsonSeq = 0;
+uint8_t dataJsonFlags = 0;
+
+// Stand von bmsPacksSeq beim Schreiben des Caches
+uint32_t dataJsonPacksSeq = 0;
+
+// Ereignisdaten des Push-Streams (einmal geschrieben, an alle Clients verteilt)
+char streamJson[STREAM_JSON_SIZE];
+
+/**
+ * Schreibt JSON sequentiell in einen festen Puffer
+ *
+ * Beispiel:
+ *   JsonWriter json(buf, sizeof(buf));
+ *   json.beginObject().addBool("ok", true).addFixed("voltage", 26400, 3).endObject();
+ *   // {"ok":true,"voltage":26.400}
+ *
+ * Schlüssel sind bei Array-Elementen nullptr. Reicht der Puffer nicht,
+ * liefert length() 0 (die Ausgabe ist dann unvollständig).
+ */
+class JsonWriter {
+public:
+  /**
+   * @param buf Zielpuffer (wird immer nullterminiert)
+   * @param size Größe des Zielpuffers
+   */
+  JsonWriter(char* buf, size_t size) : buf(buf), size(size) {
+    buf[0] = '\0';
   }
 
-  // Blinkanzahl hat sich geändert → Zyklus neu starten
-  if (requiredBlinks != ledBlinkCount) {
-    ledBlinkCount = requiredBlinks;
-    ledCurrentBlink = 0;
-    ledBlinkPhase = false;
-    ledOff();
-    lastLedChange = currentMillis;
+  JsonWriter& beginObject(const char* key = nullptr) {
+    prefix(key);
+    put('{');
+    needComma = false;
+    return *this;
   }
 
-  // Zustandsautomat für Blinkmuster
-  unsigned long elapsed = currentMillis - lastLedChange;
+  JsonWriter& endObject() {
+    put('}');
+    needComma = true;
+    return *this;
+  }
 
-  if (ledCurrentBlink == 0) {
-    // Pause zwischen Zyklen
-    if (elapsed >= LED_CYCLE_PAUSE) {
-      ledCurrentBlink = 1;
-      ledBlinkPhase = true;
-      ledOn();
-      lastLedChange = currentMillis;
+  JsonWriter& beginArray(const char* key = nullptr) {
+    prefix(key);
+    put('[');
+    needComma = false;
+    return *this;
+  }
+
+  JsonWriter& endArray() {
+    put(']');
+    needComma = true;
+    return *this;
+  }
+
+  /**
+   * Text mit JSON-Escaping (nullptr wird als null geschrieben)
+   */
+  JsonWriter& addString(const char* key, const char* value) {
+    prefix(key);
+    if (value == nullptr) {
+      append("null", 4);
+    } else {
+      putEscaped(value);
     }
-  } else if (ledBlinkPhase) {
-    // LED ist an - warten bis an-Zeit vorbei
-    if (elapsed >= LED_BLINK_ON_TIME) {
-      ledOff();
-      ledBlinkPhase = false;
-      lastLedChange = currentMillis;
+    return *this;
+  }
+
+  JsonWriter& addString(const char* key, const String& value) {
+    return addString(key, value.c_str());
+  }
+
+  JsonWriter& addBool(const char* key, bool value) {
+    prefix(key);
+    if (value) {
+      append("true", 4);
+    } else {
+      append("false", 5);
     }
-  } else {
-    // LED ist aus - warten bis aus-Zeit vorbei
-    if (elapsed >= LED_BLINK_OFF_TIME) {
-      if (ledCurrentBlink < ledBlinkCount) {
-        // Nächster Blinker
-        ledCurrentBlink++;
-        ledBlinkPhase = true;
-        ledOn();
+    return *this;
+  }
+
+  JsonWriter& addInt(const char* key, long value) {
+    prefix(key);
+    appendf("%ld", value);
+    return *this;
+  }
+
+  JsonWriter& addUInt(const char* key, unsigned long value) {
+    prefix(key);
+    appendf("%lu", value);
+    return *this;
+  }
+
+  /**
+   * Festkommazahl: value / 10^decimals, z.B. addFixed("v", 26400, 3) -> 26.400
+   *
+   * @param decimals Nachkommastellen (0-3)
+   */
+  JsonWriter& addFixed(const char* key, long value, uint8_t decimals) {
+    static const unsigned long POW10[] = { 1, 10, 100, 1000 };
+    prefix(key);
+    unsigned long magnitude = (value < 0) ? -(unsigned long)value : (unsigned long)value;
+    unsigned long scale = POW10[min(decimals, (uint8_t)3)];
+    if (scale == 1) {
+      appendf("%ld", value);
+    } else {
+      appendf("%s%lu.%0*lu", value < 0 ? "-" : "", magnitude / scale, (int)decimals, magnitude % scale);
+    }
+    return *this;
+  }
+
+  JsonWriter& addNull(const char* key) {
+    prefix(key);
+    append("null", 4);
+    return *this;
+  }
+
+  /**
+   * Bereits serialisiertes JSON unverändert übernehmen
+   */
+  JsonWriter& addRaw(const char* key, const char* json, size_t len) {
+    prefix(key);
+    append(json, len);
+    return *this;
+  }
+
+  /**
+   * @return Länge der Ausgabe (0 wenn der Puffer nicht gereicht hat)
+   */
+  size_t length() const {
+    return overflow ? 0 : used;
+  }
+
+  bool overflowed() const {
+    return overflow;
+  }
+
+private:
+  void prefix(const char* key) {
+    if (needComma) put(',');
+    needComma = true;
+    if (key != nullptr) {
+      putEscaped(key);
+      put(':');
+    }
+  }
+
+  void put(char c) {
+    append(&c, 1);
+  }
+
+  void append(const char* data, size_t len) {
+    if (overflow || used + len >= size) {
+      overflow = true;
+      return;
+    }
+    memcpy(buf + used, data, len);
+    used += len;
+    buf[used] = '\0';
+  }
+
+  void appendf(const char* format, ...) {
+    if (overflow) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + used, size - used, format, args);
+    va_end(args);
+    if (n < 0 || used + n >= size) {
+      overflow = true;
+      buf[used] = '\0';
+      return;
+    }
+    used += n;
+  }
+
+  void putEscaped(const char* text) {
+    put('"');
+    for (const char* p = text; *p; p++) {
+      char c = *p;
+      if (c == '"' || c == '\\') {
+        char esc[2] = { '\\', c };
+        append(esc, 2);
+      } else if ((uint8_t)c < 0x20) {
+        appendf("\\u%04x", (unsigned)(uint8_t)c);
       } else {
-        // Zyklus fertig, Pause starten
-        ledCurrentBlink = 0;
+        put(c);
       }
-      lastLedChange = currentMillis;
     }
+    put('"');
+  }
+
+  char* buf;
+  size_t size;
+  size_t used = 0;
+  bool needComma = false;
+  bool overflow = false;
+};
+
+// ============================================================================
+// Messwert-Historie (Ringpuffer im RAM)
+// ============================================================================
+// Jede plausible Messung wird als kompakter 16-Byte-Datensatz abgelegt.
+// Bei 2048 Einträgen und 20s Abfrageintervall reicht das für gut 11 Stunden.
+// Der Zeitstempel ist die Laufzeit in Sekunden (unabhängig von NTP) und wird
+// erst beim Export in Unix-Zeit umgerechnet.
+
+#define HISTORY_CAPACITY 2048         // Anzahl Einträge im Ringpuffer (32 KB)
+#define HISTORY_EXPORT_CHUNK 32       // Einträge pro Kopie beim Export (kurze Sperrzeit)
+#define HISTORY_LINE_SIZE 96          // Puffer für eine CSV-Zeile beim Export
+
+/**
+ * Kompakter Historien-Eintrag (16 Bytes, Little Endian)
+ *
+ * Dieses Layout wird auch unverändert im Binär-Export gesendet.
+ */
+struct HistorySample {
+  uint32_t time;        // Laufzeit in s (Export: Unix-Zeit, falls NTP synchronisiert)
+  uint16_t totalMv;     // Gesamtspannung in mV
+  int16_t currentCa;    // Strom in 10 mA (positiv = Laden)
+  uint16_t cellMinMv;   // Niedrigste Zellspannung in mV
+  uint16_t cellMaxMv;   // Höchste Zellspannung in mV
+  int8_t mosfetTemp;    // MOSFET-Temperatur in °C
+  int8_t cellTemp;      // Zellentemperatur in °C
+  uint8_t soc;          // Ladezustand in %
+  uint8_t pack;         // Pack-Index (0 = erstes BMS)
+};
+
+static_assert(sizeof(HistorySample) == 16, "HistorySample muss 16 Bytes groß sein");
+
+// Ringpuffer; Eintrag Nr. n liegt an Position n % HISTORY_CAPACITY
+HistorySample historyBuffer[HISTORY_CAPACITY];
+
+// Anzahl aller bisher geschriebenen Einträge (auch bereits überschriebener)
+uint32_t historyTotal = 0;
+
+// Anzahl gültiger Einträge im Ringpuffer (maximal HISTORY_CAPACITY)
+uint16_t historyCount = 0;
+
+// Schützt Ringpuffer, Schreibzähler und Anzahl (BLE-Task <-> Webserver)
+SemaphoreHandle_t historyMutex = nullptr;
+
+/**
+ * Laufzeit seit Start in Sekunden (64-Bit-Timer, kein Überlauf nach 49 Tagen)
+ */
+uint32_t uptimeSeconds() {
+  return (uint32_t)(esp_timer_get_time() / 1000000ULL);
+}
+
+/**
+ * Begrenzt einen Wert auf den int8-Bereich
+ */
+int8_t clampInt8(int value) {
+  return (int8_t)max(-128, min(127, value));
+}
+
+/**
+ * Verdichtet einen BMS-Datensatz zu einem Historien-Eintrag
+ *
+ * @param data Plausible BMS-Daten
+ * @return Eintrag mit aktueller Laufzeit als Zeitstempel
+ */
+HistorySample makeHistorySample(const BMSData& data) {
+  HistorySample sample = {};
+  sample.time = uptimeSeconds();
+  sample.totalMv = data.totalMv;
+  sample.currentCa = (int16_t)max(-32768L, min(32767L, (long)(data.currentMa / 10)));
+  sample.mosfetTemp = clampInt8(data.mosfetTemp);
+  sample.cellTemp = clampInt8(data.cellTemp);
+  sample.soc = data.soc;
+
+  // Minimale und maximale Zellspannung
+  sample.cellMinMv = data.cellCount > 0 ? 0xFFFF : 0;
+  for (uint8_t i = 0; i < data.cellCount; i++) {
+    sample.cellMinMv = min(sample.cellMinMv, data.cellMv[i]);
+    sample.cellMaxMv = max(sample.cellMaxMv, data.cellMv[i]);
+  }
+  return sample;
+}
+
+/**
+ * Legt eine Messung im Ringpuffer ab (ältester Eintrag wird überschrieben)
+ *
+ * @param data Plausible BMS-Daten
+ * @param pack Pack-Index
+ */
+void recordHistorySample(const BMSData& data, uint8_t pack) {
+  HistorySample sample = makeHistorySample(data);
+  sample.pack = pack;
+
+  xSemaphoreTake(historyMutex, portMAX_DELAY);
+  historyBuffer[historyTotal % HISTORY_CAPACITY] = sample;
+  historyTotal++;
+  if (historyCount < HISTORY_CAPACITY) historyCount++;
+  xSemaphoreGive(historyMutex);
+}
+
+/**
+ * Kopiert Einträge ab einer Position im Ringpuffer (für fortlaufende Leser)
+ *
+ * Bereits überschriebene Einträge werden übersprungen.
+ *
+ * @param cursor Index des ersten gewünschten Eintrags (Zählweise von
+ *               historyTotal), zeigt danach hinter den letzten kopierten
+ * @param out Zielpuffer
+ * @param maxCount Maximale Anzahl
+ * @return Anzahl kopierter Einträge
+ */
+size_t readHistorySince(uint32_t& cursor, HistorySample* out, size_t maxCount) {
+  xSemaphoreTake(historyMutex, portMAX_DELAY);
+  uint32_t start = max(cursor, historyTotal - historyCount);
+  size_t count = min((size_t)(historyTotal - min(start, historyTotal)), maxCount);
+  for (size_t i = 0; i < count; i++) {
+    out[i] = historyBuffer[(start + i) % HISTORY_CAPACITY];
   }
+  cursor = start + count;
+  xSemaphoreGive(historyMutex);
+  return count;
 }
 
 // ============================================================================
-// Einstellungen speichern und laden
+// Zwischenspeicher bei Cloud-Ausfällen (Store-and-Forward)
 // ============================================================================
+// Messungen, die nicht gesendet werden konnten, landen pro Ziel (Webhook,
+// MQTT) in einem Log auf der LittleFS-Partition "spool". Das Log besteht
+// aus Segmentdateien fester Größe (/wh/00000001.bin, ...), es wird nur
+// angehängt und ganze Segmente werden gelöscht - keine Datei wird
+// umgeschrieben. Neue Einträge werden im RAM gesammelt und blockweise
+// geschrieben. Die Leseposition liegt im NVS und wird nur nach einem
+// erfolgreich gesendeten Block aktualisiert.
+
+#define SPOOL_SEGMENT_RECORDS 1024    // Einträge pro Segmentdatei (16 KB)
+#define SPOOL_MAX_SEGMENTS 20         // Pro Ziel maximal 20 Segmente (320 KB), ältestes wird verworfen
+#define SPOOL_WRITE_BATCH 8           // Einträge im RAM sammeln bevor geschrieben wird
+#define SPOOL_REPLAY_BATCH 50         // Einträge pro Nachholnachricht
+#define SPOOL_REPLAY_MAX_BATCHES 10   // Maximal nachgeholte Blöcke pro Webhook-Intervall
+#define SPOOL_PAYLOAD_SIZE 4096       // Puffer für eine Nachholnachricht (JSON)
+
+// LittleFS-Partition gemountet?
+bool spoolAvailable = false;
 
 /**
- * Speichert alle Benutzereinstellungen im NVS (Non-Volatile Storage)
+ * Append-only Log von HistorySample-Einträgen in Segmentdateien
  *
- * Diese Funktion wird aufgerufen wenn der Benutzer Einstellungen
- * im Webinterface ändert. Die Daten überleben Neustarts.
+ * Jede Instanz wird nur aus einem Task benutzt (Webhook: Cloud-Task,
+ * MQTT: loop()); pending() darf von überall gelesen werden.
  */
-void saveSettings() {
-  // NVS-Namespace "settings" im Schreibmodus öffnen
-  preferences.begin("settings", false);
+class SampleSpool {
+public:
+  /**
+   * @param dir Verzeichnis auf der Spool-Partition (z.B. "/wh")
+   * @param key NVS-Schlüsselpräfix für die Leseposition (max. 8 Zeichen)
+   */
+  SampleSpool(const char* dir, const char* key) : dir(dir), key(key) {}
+
+  /**
+   * Sucht vorhandene Segmente und lädt die Leseposition
+   */
+  void begin() {
+    if (!spoolAvailable) return;
+    LittleFS.mkdir(dir);
+
+    firstSeg = 0;
+    lastSeg = 0;
+    File root = LittleFS.open(dir);
+    for (File f = root.openNextFile(); f; f = root.openNextFile()) {
+      uint32_t seg = strtoul(f.name(), nullptr, 10);
+      if (seg == 0) continue;
+      if (firstSeg == 0 || seg < firstSeg) firstSeg = seg;
+      if (seg > lastSeg) {
+        lastSeg = seg;
+        lastSegRecords = f.size() / sizeof(HistorySample);
+      }
+    }
+
+    // Leseposition gehört nur zum gespeicherten Segment
+    char k[16];
+    Preferences prefs;
+    prefs.begin("spool", true);
+    snprintf(k, sizeof(k), "%sSeg", key);
+    uint32_t savedSeg = prefs.getULong(k, 0);
+    snprintf(k, sizeof(k), "%sOff", key);
+    uint32_t savedOff = prefs.getULong(k, 0);
+    prefs.end();
+    readRecord = (savedSeg == firstSeg) ? savedOff : 0;
+
+    updatePending();
+    if (pendingCount > 0) {
+      Serial.printf("[SPOOL] %s: %lu Messungen zum Nachholen\n", dir, (unsigned long)pendingCount);
+    }
+  }
 
-  // Alle Einstellungen speichern
-  preferences.putString("timezone", timezone);
-  preferences.putULong("bmsInterval", bmsInterval);
-  preferences.putBool("btEnabled", bluetoothEnabled);
-  preferences.putString("bmsMac", bmsMac);
-  preferences.putString("haWebhook", haWebhookUrl);
-  preferences.putULong("haInterval", haInterval);
-  preferences.putBool("haEnabled", haEnabled);
-  preferences.putBool("serialOut", serialOutputEnabled);
-  preferences.putUChar("wifiTxPower", wifiTxPower);
+  /**
+   * Hängt einen Eintrag an (wird gesammelt und blockweise geschrieben)
+   *
+   * @param sample Eintrag (Zeit in Unix-Sekunden oder 0 ohne NTP)
+   */
+  void append(const HistorySample& sample) {
+    if (!spoolAvailable) return;
+    buffer[buffered++] = sample;
+    pendingCount++;
+    if (buffered == SPOOL_WRITE_BATCH) flush();
+  }
 
-  // Namespace schließen um Änderungen zu persistieren
-  preferences.end();
+  /**
+   * Schreibt gesammelte Einträge in das aktuelle Segment
+   */
+  void flush() {
+    if (buffered == 0) return;
+    size_t written = 0;
+    while (written < buffered) {
+      // Neues Segment wenn keins existiert oder das letzte voll ist
+      if (lastSeg == 0 || lastSegRecords >= SPOOL_SEGMENT_RECORDS) {
+        lastSeg++;
+        if (firstSeg == 0) firstSeg = lastSeg;
+        lastSegRecords = 0;
+        // Speicher begrenzen: ältestes Segment verwerfen
+        if (lastSeg - firstSeg >= SPOOL_MAX_SEGMENTS) {
+          Serial.printf("[SPOOL] %s: Speicher voll, verwerfe ältestes Segment\n", dir);
+          dropFirstSegment();
+        }
+      }
+      size_t n = min(buffered - written, (size_t)(SPOOL_SEGMENT_RECORDS - lastSegRecords));
+      char path[32];
+      segmentPath(path, sizeof(path), lastSeg);
+      File f = LittleFS.open(path, FILE_APPEND);
+      if (!f) {
+        Serial.printf("[SPOOL] Schreiben fehlgeschlagen: %s\n", path);
+        break;
+      }
+      f.write((const uint8_t*)&buffer[written], n * sizeof(HistorySample));
+      f.close();
+      lastSegRecords += n;
+      written += n;
+    }
+    buffered = 0;
+    updatePending();
+  }
+
+  /**
+   * Liest die ältesten noch nicht gesendeten Einträge (ohne sie zu entfernen)
+   *
+   * Liest höchstens bis zum Ende des ältesten Segments.
+   *
+   * @param out Zielpuffer
+   * @param max Maximale Anzahl
+   * @return Anzahl gelesener Einträge
+   */
+  size_t peek(HistorySample* out, size_t max) {
+    flush();
+    if (firstSeg == 0) return 0;
+    char path[32];
+    segmentPath(path, sizeof(path), firstSeg);
+    File f = LittleFS.open(path, FILE_READ);
+    if (!f) return 0;
+    f.seek(readRecord * sizeof(HistorySample));
+    size_t n = f.read((uint8_t*)out, max * sizeof(HistorySample)) / sizeof(HistorySample);
+    f.close();
+    return n;
+  }
+
+  /**
+   * Markiert n Einträge als gesendet und speichert die Leseposition
+   *
+   * @param n Anzahl erfolgreich gesendeter Einträge (aus peek())
+   */
+  void consume(size_t n) {
+    readRecord += n;
+    uint32_t segRecords = (firstSeg == lastSeg) ? lastSegRecords : SPOOL_SEGMENT_RECORDS;
+    if (readRecord >= segRecords) {
+      dropFirstSegment();
+    }
+    saveCursor();
+    updatePending();
+  }
+
+  /**
+   * Anzahl noch nicht gesendeter Einträge
+   */
+  uint32_t pending() const {
+    return pendingCount;
+  }
+
+private:
+  void segmentPath(char* buf, size_t len, uint32_t seg) {
+    snprintf(buf, len, "%s/%08lu.bin", dir, (unsigned long)seg);
+  }
+
+  void dropFirstSegment() {
+    char path[32];
+    segmentPath(path, sizeof(path), firstSeg);
+    LittleFS.remove(path);
+    readRecord = 0;
+    if (firstSeg == lastSeg) {
+      // Letztes Segment gelesen: Log ist leer, Nummerierung läuft weiter
+      firstSeg = 0;
+      lastSegRecords = SPOOL_SEGMENT_RECORDS;
+    } else {
+      firstSeg++;
+    }
+    saveCursor();
+  }
+
+  void saveCursor() {
+    char k[16];
+    Preferences prefs;
+    prefs.begin("spool", false);
+    snprintf(k, sizeof(k), "%sSeg", key);
+    prefs.putULong(k, firstSeg);
+    snprintf(k, sizeof(k), "%sOff", key);
+    prefs.putULong(k, readRecord);
+    prefs.end();
+  }
+
+  void updatePending() {
+    uint32_t stored = 0;
+    if (firstSeg != 0) {
+      stored = (lastSeg - firstSeg) * SPOOL_SEGMENT_RECORDS + lastSegRecords - readRecord;
+    }
+    pendingCount = stored + buffered;
+  }
+
+  const char* dir;
+  const char* key;
+  uint32_t firstSeg = 0;         // Ältestes Segment (0 = Log leer)
+  uint32_t lastSeg = 0;          // Neuestes Segment (hier wird angehängt)
+  uint32_t lastSegRecords = 0;   // Einträge im neuesten Segment
+  uint32_t readRecord = 0;       // Leseposition im ältesten Segment
+  volatile uint32_t pendingCount = 0;
+  HistorySample buffer[SPOOL_WRITE_BATCH];
+  size_t buffered = 0;
+};
+
+// Zwischenspeicher je Ziel
+SampleSpool webhookSpool("/wh", "wh");
+SampleSpool mqttSpool("/mq", "mq");
+
+/**
+ * Rechnet den Zeitstempel eines Historien-Eintrags in Unix-Zeit um
+ *
+ * Unix-Zeit, damit gesendete und nachgeholte Werte auch nach einem Neustart
+ * richtig einsortiert werden. Ohne NTP-Zeit wird 0 eingetragen.
+ *
+ * @param sample Eintrag mit Laufzeit in Sekunden
+ * @return Eintrag mit Unix-Zeitstempel
+ */
+HistorySample toUnixTime(HistorySample sample) {
+  if (lastSyncTime > 0) {
+    sample.time = (uint32_t)time(nullptr) - (uptimeSeconds() - sample.time);
+  } else {
+    sample.time = 0;
+  }
+  return sample;
 }
 
 /**
- * Lädt alle Benutzereinstellungen aus dem NVS
+ * Erzeugt einen Zwischenspeicher-Eintrag aus einem BMS-Datensatz
  *
- * Wird beim Start aufgerufen. Falls keine Einstellungen vorhanden sind,
- * werden die Standardwerte (zweiter Parameter) verwendet.
+ * @param data Plausible BMS-Daten
+ * @return Eintrag mit Unix-Zeitstempel
  */
-void loadSettings() {
-  // NVS-Namespace "settings" im Lesemodus öffnen
-  preferences.begin("settings", true);
+HistorySample makeSpoolSample(const BMSData& data) {
+  return toUnixTime(makeHistorySample(data));
+}
 
-  // Einstellungen laden mit Standardwerten als Fallback
-  timezone = preferences.getString("timezone", "CET-1CEST,M3.5.0,M10.5.0/3");
-  bmsInterval = preferences.getULong("bmsInterval", 20);
-  bluetoothEnabled = preferences.getBool("btEnabled", true);
-  bmsMac = preferences.getString("bmsMac", "");
-  haWebhookUrl = preferences.getString("haWebhook", "");
-  haInterval = preferences.getULong("haInterval", 60);
-  haEnabled = preferences.getBool("haEnabled", false);
-  serialOutputEnabled = preferences.getBool("serialOut", true);
-  wifiTxPower = preferences.getUChar("wifiTxPower", 0);  // Standard: Niedrig
+/**
+ * Mountet die Spool-Partition und lädt den Zustand beider Zwischenspeicher
+ */
+void setupSpool() {
+  // Partition "spool" aus partitions.csv, wird beim ersten Start formatiert
+  spoolAvailable = LittleFS.begin(true, "/spool", 4, "spool");
+  if (!spoolAvailable) {
+    Serial.println("[SPOOL] LittleFS-Partition nicht verfügbar - Zwischenspeicher deaktiviert");
+    return;
+  }
+  Serial.printf("[SPOOL] LittleFS: %u von %u KB belegt\n",
+                (unsigned)(LittleFS.usedBytes() / 1024), (unsigned)(LittleFS.totalBytes() / 1024));
+  webhookSpool.begin();
+  mqttSpool.begin();
+}
 
-  preferences.end();
+/**
+ * Schreibt Messungen kompakt als "fields" + "samples" in das offene Objekt
+ *
+ * "samples" enthält eine Zeile pro Messung in der Reihenfolge von "fields":
+ * "fields":["timestamp","voltage",...],"samples":[[1700000000,26.400,...],...]
+ *
+ * @param json Ziel (innerhalb eines Objekts)
+ * @param samples Einträge mit Unix-Zeitstempel (0 = unbekannt)
+ * @param count Anzahl
+ */
+void writeSampleRows(JsonWriter& json, const HistorySample* samples, size_t count) {
+  json.beginArray("fields");
+  for (const char* name : { "timestamp", "voltage", "current", "soc", "mosfet_temp", "cell_temp", "cell_min", "cell_max", "pack" }) {
+    json.addString(nullptr, name);
+  }
+  json.endArray();
+
+  json.beginArray("samples");
+  for (size_t i = 0; i < count; i++) {
+    const HistorySample& s = samples[i];
+    json.beginArray();
+    if (s.time > 0) {
+      json.addUInt(nullptr, s.time);
+    } else {
+      json.addNull(nullptr);  // Zeitpunkt unbekannt (kein NTP)
+    }
+    json.addFixed(nullptr, s.totalMv, 3);
+    json.addFixed(nullptr, s.currentCa, 2);
+    json.addUInt(nullptr, s.soc);
+    json.addInt(nullptr, s.mosfetTemp);
+    json.addInt(nullptr, s.cellTemp);
+    json.addFixed(nullptr, s.cellMinMv, 3);
+    json.addFixed(nullptr, s.cellMaxMv, 3);
+    json.addUInt(nullptr, s.pack);
+    json.endArray();
+  }
+  json.endArray();
 }
 
 /**
- * Wendet die konfigurierte WLAN-Sendestärke an
+ * Serialisiert einen Block zwischengespeicherter Messungen als JSON
  *
- * Stufen:
- * - 0: Niedrig (5 dBm) - Minimale Wärmeentwicklung, reduzierte Reichweite
- * - 1: Normal (11 dBm) - Ausgewogen, moderate Wärmeentwicklung
- * - 2: Hoch (17 dBm) - Maximale Reichweite, erhöhte Wärmeentwicklung
+ * Format: {"device":"litime-bms","mac":"...","backlog":true,"fields":[...],"samples":[...]}
+ *
+ * @param samples Einträge
+ * @param count Anzahl
+ * @param buf Zielpuffer
+ * @param len Größe des Zielpuffers
+ * @return Länge des JSON (0 wenn der Puffer zu klein ist)
+ */
+size_t buildBacklogPayload(const HistorySample* samples, size_t count, char* buf, size_t len) {
+  JsonWriter json(buf, len);
+  json.beginObject();
+  json.addString("device", "litime-bms");
+  json.addString("mac", macAddress);
+  json.addBool("backlog", true);
+  writeSampleRows(json, samples, count);
+  json.endObject();
+  return json.length();
+}
+
+// ============================================================================
+// Forward-Deklarationen
+// ============================================================================
+// Funktionen die vor ihrer Definition aufgerufen werden
+
+void printBMSDataSerial(const BMSData& data, uint8_t pack);  // Gibt BMS-Daten auf Serial aus
+void adaptPollInterval(uint8_t pack, const BMSData& data);   // Passt das Abfrageintervall an die Last an
+void startAP();               // Startet den Access Point Modus
+void writeStatusJson(JsonWriter& json, const char* key = nullptr, bool boot = false);  // Schreibt den Systemstatus als JSON
+bool isCloudOk();             // Prüft alle aktivierten Cloud-Ausgänge
+bool startSavedWiFi();        // Startet die Verbindung mit gespeichertem WLAN
+void saveWifiCache();         // Merkt BSSID und Kanal der aktuellen Verbindung
+void saveEnergyCounters();    // Sichert die Energiezähler im NVS
+
+// ============================================================================
+// Watchdog und Crash-Logging Funktionen
+// ============================================================================
+
+// Letzte Code-Position (Breadcrumb) für die Analyse nach einem Absturz
+#define CRASH_MAGIC 0x43524231      // Kennung eines gültigen Breadcrumbs im RTC-Speicher
+#define CRASH_LOCATION_LEN 40       // Maximale Länge der Positionsangabe inkl. Nullterminator
+
+struct CrashBreadcrumb {
+  uint32_t magic;                      // CRASH_MAGIC wenn gültig
+  char location[CRASH_LOCATION_LEN];   // Letzte Position (z.B. "!ble:bms_update_start")
+  uint32_t millis;                     // Laufzeit zum Zeitpunkt der Position
+  uint32_t freeHeap;                   // Freier Heap zum Zeitpunkt der Position
+};
+
+// Nicht initialisierter RTC-Speicher: übersteht Watchdog- und Panic-Resets,
+// nach dem Einschalten zufällig (daher magic)
+RTC_NOINIT_ATTR CrashBreadcrumb rtcCrash;
+
+// Schützt rtcCrash (Aufrufe aus loop(), BLE-Task und Cloud-Task)
+portMUX_TYPE crashMux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Merkt sich den aktuellen Programmstatus für die Crash-Analyse
+ *
+ * Diese Funktion wird vor kritischen Operationen aufgerufen und speichert
+ * die aktuelle Position im Code im RTC-Speicher (kein Flash-Zugriff, daher
+ * bei jedem Aufruf). Erst nach einem Watchdog- oder Panic-Reset wird die
+ * Position in den NVS übernommen (siehe printLastCrashLog()).
+ *
+ * @param location Beschreibung der aktuellen Code-Position (z.B. "loop:bms_update",
+ *                 "!" kennzeichnet kritische Positionen)
+ */
+void logCrashLocation(const char* location) {
+  uint32_t now = millis();
+  uint32_t heap = ESP.getFreeHeap();
+  portENTER_CRITICAL(&crashMux);
+  strlcpy(rtcCrash.location, location, sizeof(rtcCrash.location));
+  rtcCrash.millis = now;
+  rtcCrash.freeHeap = heap;
+  rtcCrash.magic = CRASH_MAGIC;
+  portEXIT_CRITICAL(&crashMux);
+}
+
+/**
+ * Bezeichnung eines Reset-Grunds, der auf einen Fehler hinweist
+ *
+ * @return Text für Fehler-Resets, nullptr für normale Resets (Einschalten, Neustart, Deep Sleep)
+ */
+const char* faultResetName(esp_reset_reason_t reason) {
+  switch (reason) {
+    case ESP_RST_PANIC:    return "Absturz (Panic)";
+    case ESP_RST_INT_WDT:  return "Interrupt-Watchdog";
+    case ESP_RST_TASK_WDT: return "Task-Watchdog";
+    case ESP_RST_WDT:      return "Watchdog";
+    default:               return nullptr;
+  }
+}
+
+/**
+ * Wertet das Crash-Breadcrumb nach dem Start aus
+ *
+ * Wird in setup() aufgerufen. Nach einem Fehler-Reset wird die letzte
+ * Position angezeigt und im NVS gespeichert (bleibt auch nach einem
+ * Stromausfall erhalten, bis zum nächsten Fehler). Sonst wird nur der
+ * zuletzt gespeicherte Fehler als Hinweis ausgegeben - ohne Schreibzugriff.
+ */
+void printLastCrashLog() {
+  const char* fault = faultResetName(esp_reset_reason());
+  bool valid = rtcCrash.magic == CRASH_MAGIC;
+  rtcCrash.location[CRASH_LOCATION_LEN - 1] = '\0';
+
+  if (fault && valid) {
+    Preferences crashPrefs;
+    crashPrefs.begin("crashlog", false);
+    crashPrefs.putString("location", rtcCrash.location);
+    crashPrefs.putULong("millis", rtcCrash.millis);
+    crashPrefs.putULong("freeHeap", rtcCrash.freeHeap);
+    crashPrefs.putString("reason", fault);
+    crashPrefs.end();
+
+    Serial.println();
+    Serial.println("╔═══════════════════════════════════════════════════════");
+    Serial.println("║ " + String(fault) + " - RESET ERKANNT!");
+    Serial.println("╠═══════════════════════════════════════════════════════");
+    Serial.println("║ Letzte Position: " + String(rtcCrash.location));
+    Serial.println("║ Uptime: " + String(rtcCrash.millis / 1000) + " Sekunden");
+    Serial.println("║ Free Heap: " + String(rtcCrash.freeHeap) + " bytes");
+    Serial.println("╚═══════════════════════════════════════════════════════");
+    Serial.println();
+  } else {
+    preferences.begin("crashlog", true);
+    String lastLocation = preferences.getString("location", "");
+    String lastReason = preferences.getString("reason", "Watchdog");
+    preferences.end();
+    if (lastLocation.length() > 0) {
+      Serial.println("[WATCHDOG] Letzter Fehler-Reset (" + lastReason + ") bei: " + lastLocation);
+    }
+  }
+
+  // Breadcrumb des vorherigen Laufs nicht einem späteren Fehler zuordnen
+  rtcCrash.magic = 0;
+}
+
+/**
+ * Zählt fehlgeschlagene Heap-Allokationen (Hook, in setup() registriert)
+ *
+ * Läuft im Kontext der fehlgeschlagenen Allokation (beliebiger Task),
+ * daher nur Zähler - die Ausgabe übernimmt checkHeapMemory().
+ */
+void onHeapAllocFailed(size_t size, uint32_t caps, const char* functionName) {
+  heapAllocFailures = heapAllocFailures + 1;
+  heapLastFailSize = size;
+}
+
+/**
+ * Erfasst den kleinsten je freien Stack der überwachten Tasks
+ *
+ * ESP-IDF liefert den Wert von uxTaskGetStackHighWaterMark() in Bytes.
+ */
+void checkTaskStacks() {
+  for (uint8_t i = 0; i < STACK_WATCH_COUNT; i++) {
+    TaskHandle_t task = (i == 0) ? nullptr : xTaskGetHandle(STACK_WATCH_NAMES[i]);
+    if (i > 0 && !task) {
+      stackFreeBytes[i] = 0;
+      continue;
+    }
+    uint32_t freeBytes = uxTaskGetStackHighWaterMark(task);
+    if (freeBytes < STACK_WARN_BYTES && freeBytes != stackFreeBytes[i]) {
+      Serial.printf("[HEAP] ⚠️ WARNUNG: Task %s hatte nur noch %u bytes Stack frei!\n", STACK_WATCH_NAMES[i], (unsigned)freeBytes);
+    }
+    stackFreeBytes[i] = freeBytes;
+  }
+}
+
+/**
+ * Ruhiger Moment für einen Neustart
+ *
+ * Kein Webhook in Arbeit oder wartend, keine offenen Web-Aufträge und keine
+ * ungesendeten MQTT-Nachrichten.
+ */
+bool isIdleForRestart() {
+  if (cloudBusy || uxQueueMessagesWaiting(cloudQueue) > 0) return false;
+  if (uxQueueMessagesWaiting(webCommandQueue) > 0) return false;
+  if (mqttConnected && mqttClient.queueSize() > 0) return false;
+  return true;
+}
+
+/**
+ * Startet wegen Speichermangels kontrolliert neu
+ *
+ * Der Grund wird wie ein Fehler-Reset im NVS vermerkt (Hinweis beim
+ * nächsten Start, siehe printLastCrashLog()), die Energiezähler werden
+ * vorher gesichert.
+ */
+void restartForLowMemory() {
+  Serial.printf("[HEAP] Größter freier Block seit %u s unter %u bytes - Neustart\n",
+                (unsigned)(heapLowChecks * HEAP_CHECK_INTERVAL / 1000), (unsigned)heapMinBlock);
+  Preferences crashPrefs;
+  crashPrefs.begin("crashlog", false);
+  crashPrefs.putString("location", "heap:low_memory_restart");
+  crashPrefs.putULong("millis", millis());
+  crashPrefs.putULong("freeHeap", ESP.getFreeHeap());
+  crashPrefs.putString("reason", "Speichermangel");
+  crashPrefs.end();
+  saveEnergyCounters();
+  delay(100);
+  ESP.restart();
+}
+
+/**
+ * Reagiert auf einen zu kleinen größten freien Block (siehe heapAction)
+ *
+ * Die Entlastung beginnt beim ersten Check unter der Schwelle und endet
+ * erst mit HEAP_RECOVER_MARGIN Abstand. Der Neustart (Stufe 2) folgt
+ * erst, wenn die Entlastung HEAP_RESTART_CHECKS Checks lang nicht
+ * geholfen hat - und nur im Leerlauf, damit keine Sendung abbricht.
+ *
+ * @param block Aktuell größter freier Block in Bytes
+ */
+void serviceHeapAction(size_t block) {
+  if (block >= heapMinBlock) {
+    heapLowChecks = 0;
+    if (heapLow && block >= (size_t)heapMinBlock + HEAP_RECOVER_MARGIN) {
+      heapLow = false;
+      Serial.println("[HEAP] Speicher erholt, Entlastung beendet (größter Block " + String(block) + " bytes)");
+    }
+    return;
+  }
+
+  if (heapLowChecks < 255) heapLowChecks++;
+  if (heapLowChecks == 1) {
+    Serial.println("[HEAP] ⚠️ WARNUNG: Größter freier Block nur " + String(block) + " bytes (Fragmentierung)");
+  }
+  if (heapAction == 0) return;
+
+  if (!heapLow) {
+    heapLow = true;
+    heapReliefCount++;
+    Serial.printf("[HEAP] Entlastung: %u Stream-Verbindung(en) getrennt\n", (unsigned)events.count());
+    events.close();
+  }
+
+  if (heapAction >= 2 && heapLowChecks >= HEAP_RESTART_CHECKS && isIdleForRestart()) {
+    restartForLowMemory();
+  }
+}
+
+/**
+ * Überwacht Heap-Speicher und Task-Stacks
+ *
+ * Gibt Warnungen aus wenn der Speicher knapp wird (unter 10KB), wenn
+ * Allokationen fehlgeschlagen sind oder ein Task-Stack fast voll war.
+ * Zusätzlich wird der größte freie Block verfolgt: fällt er unter
+ * heapMinBlock, greift die eingestellte Maßnahme (serviceHeapAction()),
+ * bevor der Watchdog das Gerät zurücksetzen muss.
+ */
+void checkHeapMemory() {
+  size_t currentHeap = ESP.getFreeHeap();
+  largestFreeBlock = ESP.getMaxAllocHeap();
+
+  // Minimum tracken (vom Heap selbst geführt, erfasst auch kurze Einbrüche zwischen den Checks)
+  size_t lowest = ESP.getMinFreeHeap();
+  if (minFreeHeap == 0 || lowest < minFreeHeap) {
+    minFreeHeap = lowest;
+    Serial.println("[HEAP] Neues Minimum: " + String(minFreeHeap) + " bytes");
+  }
+  if (minLargestFreeBlock == 0 || largestFreeBlock < minLargestFreeBlock) {
+    minLargestFreeBlock = largestFreeBlock;
+  }
+
+  // Warnung bei kritischem Speicher (unter 10KB)
+  if (currentHeap < 10240) {
+    Serial.println("[HEAP] ⚠️ WARNUNG: Nur noch " + String(currentHeap) + " bytes frei!");
+  }
+
+  // Fehlgeschlagene Allokationen seit dem letzten Check
+  uint32_t failures = heapAllocFailures;
+  if (failures != heapAllocFailuresLogged) {
+    Serial.printf("[HEAP] ⚠️ %u Allokation(en) fehlgeschlagen, zuletzt %u bytes\n",
+                  (unsigned)(failures - heapAllocFailuresLogged), (unsigned)heapLastFailSize);
+    heapAllocFailuresLogged = failures;
+  }
+
+  checkTaskStacks();
+  serviceHeapAction(largestFreeBlock);
+}
+
+// ============================================================================
+// LED-Steuerungsfunktionen
+// ============================================================================
+
+/**
+ * Schaltet die LED ein
+ *
+ * Berücksichtigt die Active-Low-Logik des ESP32-C3 SuperMini:
+ * Bei LED_ACTIVE_LOW = true wird LOW ausgegeben um die LED einzuschalten.
+ */
+void ledOn() {
+  digitalWrite(LED_PIN, LED_ACTIVE_LOW ? LOW : HIGH);
+  ledState = true;
+}
+
+/**
+ * Schaltet die LED aus
+ *
+ * Berücksichtigt die Active-Low-Logik des ESP32-C3 SuperMini:
+ * Bei LED_ACTIVE_LOW = true wird HIGH ausgegeben um die LED auszuschalten.
+ */
+void ledOff() {
+  digitalWrite(LED_PIN, LED_ACTIVE_LOW ? HIGH : LOW);
+  ledState = false;
+}
+
+/**
+ * Ermittelt die Anzahl der benötigten Blinker basierend auf dem Status
+ *
+ * Berücksichtigt den Soll-Zustand:
+ * - Wenn Bluetooth deaktiviert ist, wird BMS nicht geprüft
+ * - Wenn Cloud deaktiviert ist, wird Cloud nicht geprüft
+ *
+ * @return 0 = alles OK (LED dauerhaft an), 1-3 = Anzahl Blinker
+ */
+uint8_t getLedBlinkCount() {
+  // WLAN prüfen (immer erforderlich)
+  bool wlanOk = (WiFi.status() == WL_CONNECTED) || apMode;
+  if (!wlanOk) {
+    return 1;  // 1x Blinken: WLAN-Problem
+  }
+
+  // BMS prüfen (nur wenn Bluetooth aktiviert)
+  if (bluetoothEnabled) {
+    bool bmsOk = bmsConnected && bmsDataValid;
+    if (!bmsOk) {
+      return 2;  // 2x Blinken: BMS-Problem
+    }
+  }
+
+  // Cloud prüfen (nur wenn Webhook oder MQTT aktiviert)
+  if (haEnabled || mqttEnabled) {
+    if (!isCloudOk()) {
+      return 3;  // 3x Blinken: Cloud-Problem
+    }
+  }
+
+  return 0;  // Alle aktivierten Dienste OK
+}
+
+/**
+ * Aktualisiert das LED-Blinkmuster basierend auf dem Verbindungsstatus
+ *
+ * Diese Funktion wird in jedem Loop-Durchlauf aufgerufen und steuert
+ * die LED gemäß dem aktuellen Verbindungsstatus.
+ *
+ * Blinkmuster nach Anzahl:
+ * - 1x Blinken: WLAN nicht verbunden
+ * - 2x Blinken: BMS nicht verbunden (wenn Bluetooth aktiviert)
+ * - 3x Blinken: Cloud-Fehler (wenn Cloud aktiviert)
+ * - Dauerhaft an: Alle aktivierten Dienste funktionieren
+ *
+ * @param currentMillis Aktueller Zeitstempel aus millis()
+ */
+void updateLED(unsigned long currentMillis) {
+  // Benötigte Blinker ermitteln
+  uint8_t requiredBlinks = getLedBlinkCount();
+
+  // Alles OK → LED dauerhaft an
+  if (requiredBlinks == 0) {
+    ledOn();
+    ledCurrentBlink = 0;
+    ledBlinkPhase = false;
+    return;
+  }
+
+  // Blinkanzahl hat sich geändert → Zyklus neu starten
+  if (requiredBlinks != ledBlinkCount) {
+    ledBlinkCount = requiredBlinks;
+    ledCurrentBlink = 0;
+    ledBlinkPhase = false;
+    ledOff();
+    lastLedChange = currentMillis;
+  }
+
+  // Zustandsautomat für Blinkmuster
+  unsigned long elapsed = currentMillis - lastLedChange;
+
+  if (ledCurrentBlink == 0) {
+    // Pause zwischen Zyklen
+    if (elapsed >= LED_CYCLE_PAUSE) {
+      ledCurrentBlink = 1;
+      ledBlinkPhase = true;
+      ledOn();
+      lastLedChange = currentMillis;
+    }
+  } else if (ledBlinkPhase) {
+    // LED ist an - warten bis an-Zeit vorbei
+    if (elapsed >= LED_BLINK_ON_TIME) {
+      ledOff();
+      ledBlinkPhase = false;
+      lastLedChange = currentMillis;
+    }
+  } else {
+    // LED ist aus - warten bis aus-Zeit vorbei
+    if (elapsed >= LED_BLINK_OFF_TIME) {
+      if (ledCurrentBlink < ledBlinkCount) {
+        // Nächster Blinker
+        ledCurrentBlink++;
+        ledBlinkPhase = true;
+        ledOn();
+      } else {
+        // Zyklus fertig, Pause starten
+        ledCurrentBlink = 0;
+      }
+      lastLedChange = currentMillis;
+    }
+  }
+}
+
+// ============================================================================
+// Einstellungen speichern und laden
+// ============================================================================
+
+/**
+ * Schreibt Einstellungen nur, wenn sich der gespeicherte Wert unterscheidet
+ *
+ * Jede Änderung im Webinterface ruft saveSettings() auf, meist ändern sich
+ * dabei nur ein oder zwei Werte. Unveränderte Schlüssel werden nur gelesen,
+ * das spart Flash-Schreibzyklen und die Zeit für das Schreiben.
+ */
+struct SettingsWriter {
+  Preferences& prefs;
+  uint8_t changed = 0;  // Anzahl tatsächlich geschriebener Schlüssel
+
+  void putBool(const char* key, bool value) {
+    if (prefs.isKey(key) && prefs.getBool(key) == value) return;
+    prefs.putBool(key, value);
+    changed++;
+  }
+  void putUChar(const char* key, uint8_t value) {
+    if (prefs.isKey(key) && prefs.getUChar(key) == value) return;
+    prefs.putUChar(key, value);
+    changed++;
+  }
+  void putUShort(const char* key, uint16_t value) {
+    if (prefs.isKey(key) && prefs.getUShort(key) == value) return;
+    prefs.putUShort(key, value);
+    changed++;
+  }
+  void putULong(const char* key, unsigned long value) {
+    if (prefs.isKey(key) && prefs.getULong(key) == value) return;
+    prefs.putULong(key, value);
+    changed++;
+  }
+  void putString(const char* key, const String& value) {
+    if (prefs.isKey(key) && prefs.getString(key) == value) return;
+    prefs.putString(key, value);
+    changed++;
+  }
+};
+
+/**
+ * Schreibt die MAC-Adresse eines Packs (Schlüssel bmsMac, bmsMac2..4)
+ *
+ * @param nvs Geöffneter Namespace "settings"
+ * @param index Pack-Index (0 = erstes BMS)
+ * @param mac MAC-Adresse (leer = Pack unbenutzt)
+ */
+void putBmsMac(SettingsWriter& nvs, uint8_t index, const char* mac) {
+  if (index == 0) {
+    nvs.putString("bmsMac", mac);
+  } else {
+    nvs.putString(("bmsMac" + String(index + 1)).c_str(), mac);
+  }
+}
+
+/**
+ * Speichert alle Benutzereinstellungen im NVS (Non-Volatile Storage)
+ *
+ * Diese Funktion wird aufgerufen wenn der Benutzer Einstellungen
+ * im Webinterface ändert. Die Daten überleben Neustarts. Geschrieben
+ * werden nur geänderte Werte (siehe SettingsWriter).
+ */
+void saveSettings() {
+  // NVS-Namespace "settings" im Schreibmodus öffnen
+  preferences.begin("settings", false);
+  SettingsWriter nvs{preferences};
+
+  // Alle Einstellungen speichern (nur geänderte werden geschrieben)
+  nvs.putString("timezone", timezone);
+  nvs.putULong("bmsInterval", bmsInterval);
+  nvs.putBool("btEnabled", bluetoothEnabled);
+  for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+    putBmsMac(nvs, i, bmsSlots[i].mac);
+  }
+  nvs.putBool("bmsKeep", bmsKeepConnected);
+  nvs.putBool("bmsAdaptive", bmsAdaptivePolling);
+  nvs.putString("haWebhook", haWebhookUrl);
+  nvs.putULong("haInterval", haInterval);
+  nvs.putBool("haEnabled", haEnabled);
+  nvs.putBool("haBatch", haBatchMode);
+  nvs.putBool("haMsgPack", haMsgPack);
+  nvs.putBool("serialOut", serialOutputEnabled);
+  nvs.putUChar("wifiTxPower", wifiTxPower);
+  nvs.putUChar("powerMode", powerMode);
+  nvs.putUChar("heapAction", heapAction);
+  nvs.putUShort("heapBlock", heapMinBlock);
+  nvs.putBool("headless", headlessMode);
+  nvs.putULong("sleepIntv", sleepInterval);
+  nvs.putBool("mqttEnabled", mqttEnabled);
+  nvs.putString("mqttHost", mqttHost);
+  nvs.putUShort("mqttPort", mqttPort);
+  nvs.putString("mqttUser", mqttUser);
+  nvs.putString("mqttPass", mqttPass);
+  nvs.putString("mqttTopic", mqttBaseTopic);
+  nvs.putUChar("mqttQos", mqttQos);
+  nvs.putBool("mqttDiscovery", mqttDiscovery);
+  nvs.putBool("mqttBinary", mqttBinary);
+  nvs.putBool("alarmOn", alarmEnabled);
+  nvs.putUChar("alarmSoc", alarmSocMin);
+  nvs.putUShort("alarmDelta", alarmCellDeltaMv);
+  nvs.putUChar("alarmTemp", alarmTempMax);
+  nvs.putUShort("alarmCurr", alarmCurrentMax);
+  nvs.putULong("alarmGap", alarmMinInterval);
+  nvs.putBool("dbOn", reportDeadband);
+  nvs.putUShort("dbMv", deadbandMv);
+  nvs.putUShort("dbMa", deadbandMa);
+  nvs.putUChar("dbSoc", deadbandSoc);
+  nvs.putUChar("dbTemp", deadbandTemp);
+  nvs.putULong("dbBeat", reportHeartbeat);
+
+  // Namespace schließen um Änderungen zu persistieren
+  preferences.end();
+  if (nvs.changed > 0) {
+    Serial.printf("[NVS] %u Einstellung(en) gespeichert\n", nvs.changed);
+  }
+}
+
+/**
+ * Lädt alle Benutzereinstellungen aus dem NVS
+ *
+ * Wird beim Start aufgerufen. Falls keine Einstellungen vorhanden sind,
+ * werden die Standardwerte (zweiter Parameter) verwendet.
+ */
+void loadSettings() {
+  // NVS-Namespace "settings" im Lesemodus öffnen
+  preferences.begin("settings", true);
+
+  // Einstellungen laden mit Standardwerten als Fallback
+  timezone = preferences.getString("timezone", "CET-1CEST,M3.5.0,M10.5.0/3");
+  bmsInterval = preferences.getULong("bmsInterval", 20);
+  bluetoothEnabled = preferences.getBool("btEnabled", true);
+  // MACs nur hier setzen (vor dem Start der Tasks), danach lesen sie BLE-, Cloud- und AsyncTCP-Task ohne Sperre
+  preferences.getString("bmsMac", bmsSlots[0].mac, sizeof(bmsSlots[0].mac));
+  for (uint8_t i = 1; i < BMS_MAX_PACKS; i++) {
+    preferences.getString(("bmsMac" + String(i + 1)).c_str(), bmsSlots[i].mac, sizeof(bmsSlots[i].mac));
+  }
+  bmsKeepConnected = preferences.getBool("bmsKeep", true);
+  bmsAdaptivePolling = preferences.getBool("bmsAdaptive", true);
+  haWebhookUrl = preferences.getString("haWebhook", "");
+  haInterval = preferences.getULong("haInterval", 60);
+  haEnabled = preferences.getBool("haEnabled", false);
+  haBatchMode = preferences.getBool("haBatch", false);
+  haMsgPack = preferences.getBool("haMsgPack", false);
+  serialOutputEnabled = preferences.getBool("serialOut", true);
+  wifiTxPower = preferences.getUChar("wifiTxPower", 0);  // Standard: Niedrig
+  powerMode = preferences.getUChar("powerMode", 0);      // Standard: Normal
+  heapAction = preferences.getUChar("heapAction", 1);    // Standard: entlasten
+  heapMinBlock = preferences.getUShort("heapBlock", 10240);
+  headlessMode = preferences.getBool("headless", false);
+  sleepInterval = preferences.getULong("sleepIntv", 300);
+  mqttEnabled = preferences.getBool("mqttEnabled", false);
+  mqttHost = preferences.getString("mqttHost", "");
+  mqttPort = preferences.getUShort("mqttPort", 1883);
+  mqttUser = preferences.getString("mqttUser", "");
+  mqttPass = preferences.getString("mqttPass", "");
+  mqttBaseTopic = preferences.getString("mqttTopic", "");
+  mqttQos = preferences.getUChar("mqttQos", 0);
+  mqttDiscovery = preferences.getBool("mqttDiscovery", true);
+  mqttBinary = preferences.getBool("mqttBinary", false);
+  alarmEnabled = preferences.getBool("alarmOn", false);
+  alarmSocMin = preferences.getUChar("alarmSoc", 0);
+  alarmCellDeltaMv = preferences.getUShort("alarmDelta", 0);
+  alarmTempMax = preferences.getUChar("alarmTemp", 0);
+  alarmCurrentMax = preferences.getUShort("alarmCurr", 0);
+  alarmMinInterval = preferences.getULong("alarmGap", 30);
+  reportDeadband = preferences.getBool("dbOn", false);
+  deadbandMv = preferences.getUShort("dbMv", 10);
+  deadbandMa = preferences.getUShort("dbMa", 200);
+  deadbandSoc = preferences.getUChar("dbSoc", 1);
+  deadbandTemp = preferences.getUChar("dbTemp", 1);
+  reportHeartbeat = preferences.getULong("dbBeat", 900);
+
+  preferences.end();
+}
+
+/**
+ * Wendet die konfigurierte WLAN-Sendestärke an
+ *
+ * Stufen:
+ * - 0: Niedrig (5 dBm) - Minimale Wärmeentwicklung, reduzierte Reichweite
+ * - 1: Normal (11 dBm) - Ausgewogen, moderate Wärmeentwicklung
+ * - 2: Hoch (17 dBm) - Maximale Reichweite, erhöhte Wärmeentwicklung
+ */
+void applyWifiTxPower() {
+  switch (wifiTxPower) {
+    case 1:
+      WiFi.setTxPower(WIFI_POWER_11dBm);
+      Serial.println("[WIFI] Sendestärke: Normal (11 dBm)");
+      break;
+    case 2:
+      WiFi.setTxPower(WIFI_POWER_17dBm);
+      Serial.println("[WIFI] Sendestärke: Hoch (17 dBm)");
+      break;
+    default:
+      WiFi.setTxPower(WIFI_POWER_5dBm);
+      Serial.println("[WIFI] Sendestärke: Niedrig (5 dBm)");
+      break;
+  }
+}
+
+// ============================================================================
+// Energiesparmodus
+// ============================================================================
+// Im Stromsparmodus verbringt loop() die meiste Zeit in delay(). Der
+// Leerlauf-Task kann dann den Takt auf 40 MHz absenken und den Chip in
+// den Light Sleep schicken. Geweckt wird er automatisch vom nächsten
+// FreeRTOS-Timer (BMS-Intervall, loop()-Pause), von BLE und vom WLAN
+// (Beacon/DTIM, eingehende TCP-Pakete).
+//
+// Das Board hat keine Strommessung. /api/status meldet nur gemessene
+// Werte: die Auslastung von loop() und ob der Light Sleep aktiv ist.
+// Den Strom bestimmen BLE- und WLAN-Funkzeit, die aus der Auslastung
+// nicht ablesbar sind - dafür ein USB-Strommessgerät verwenden.
+
+/**
+ * Wendet den Energiesparmodus an (Power Management und WLAN-Modem-Sleep)
+ *
+ * Muss nach dem Start des WLANs aufgerufen werden.
+ */
+void applyPowerMode() {
+  bool save = (powerMode == 1);
+
+  esp_pm_config_esp32c3_t pm = {};
+  pm.max_freq_mhz = 160;
+  pm.min_freq_mhz = save ? 40 : 160;  // 40 MHz = Quarztakt, niedrigste DFS-Stufe
+  pm.light_sleep_enable = save;
+  esp_err_t err = esp_pm_configure(&pm);
+  if (err != ESP_OK && save) {
+    // Ohne Tickless-Idle im Build wird Light Sleep abgelehnt: nur Taktabsenkung
+    pm.light_sleep_enable = false;
+    err = esp_pm_configure(&pm);
+  }
+  lightSleepActive = (err == ESP_OK && pm.light_sleep_enable);
+
+  // Mit BLE muss das WLAN im Modem-Sleep bleiben, nur die Stufe ist wählbar
+  WiFi.setSleep(save ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+
+  if (save) {
+    Serial.printf("[POWER] Stromsparmodus: DFS %s, Light Sleep %s\n",
+                  err == ESP_OK ? "aktiv" : "nicht verfügbar",
+                  lightSleepActive ? "aktiv" : "nicht verfügbar");
+  } else {
+    Serial.println("[POWER] Normalbetrieb");
+  }
+}
+
+/**
+ * Erfasst die Arbeitszeit eines loop()-Durchlaufs
+ *
+ * Alle POWER_STATS_WINDOW_MS wird daraus die Auslastung und der längste
+ * Durchlauf (für /metrics) berechnet.
+ *
+ * @param loopStart esp_timer_get_time() zu Beginn des Durchlaufs
+ */
+void trackLoopLoad(uint64_t loopStart) {
+  uint64_t now = esp_timer_get_time();
+  uint32_t duration = (uint32_t)(now - loopStart);
+  loopBusyUs += duration;
+  loopIterations++;
+  if (duration > loopWindowMaxUs) {
+    loopWindowMaxUs = duration;
+  }
+  if (loopWindowStart == 0) {
+    loopWindowStart = loopStart;
+  }
+  uint64_t window = now - loopWindowStart;
+  if (window >= POWER_STATS_WINDOW_MS * 1000ULL) {
+    loopBusyPermille = (uint16_t)min((uint64_t)1000, loopBusyUs * 1000 / window);
+    loopBusyUs = 0;
+    loopWindowStart = now;
+    loopMaxUs = loopWindowMaxUs;
+    loopWindowMaxUs = 0;
+  }
+}
+
+// ============================================================================
+// BMS-Datenvalidierung
+// ============================================================================
+
+/**
+ * Prüft ob die aktuellen BMS-Daten plausibel sind
+ *
+ * Diese Funktion verhindert die Anzeige/Übertragung von ungültigen Daten,
+ * die z.B. direkt nach dem Verbindungsaufbau auftreten können (alle Werte 0).
+ *
+ * Prüfkriterien für LiFePO4-Batterien:
+ * - Gesamtspannung: 10V - 60V
+ * - SOC: 0% - 100%
+ * - Zellspannungen: 2.0V - 4.0V (etwas großzügiger für Randfälle)
+ *
+ * @param data Zu prüfende BMS-Daten
+ * @return true wenn alle Daten plausibel sind, sonst false
+ */
+bool isBmsDataValid(const BMSData& data) {
+  // Spannung muss zwischen 10V und 60V liegen (typisch für LiFePO4 4S-16S)
+  if (data.totalMv < 10000 || data.totalMv > 60000) {
+    return false;
+  }
+
+  // SOC muss zwischen 0 und 100 Prozent sein
+  if (data.soc > 100) {
+    return false;
+  }
+
+  // Mindestens eine Zellspannung muss vorhanden sein
+  if (data.cellCount == 0) {
+    return false;
+  }
+
+  // Alle Zellspannungen müssen plausibel sein
+  // LiFePO4: Nominal 3.2V, Bereich ca. 2.5V - 3.65V
+  // Wir verwenden 2.0V - 4.0V für etwas Toleranz
+  for (uint8_t i = 0; i < data.cellCount; i++) {
+    if (data.cellMv[i] < 2000 || data.cellMv[i] > 4000) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Prüft ob ein Schutz- oder Fehlerstatus des BMS den Normalzustand meldet
+ *
+ * Das BMS liefert Klartext ("Normal", bei Fehlern z.B. "Overvoltage").
+ * Leer, "Normal" und Texte die mit "No" beginnen ("None", "No Failure")
+ * gelten als Normalzustand.
+ *
+ * @param text Statustext
+ * @return true wenn kein Alarm vorliegt
+ */
+bool isBmsStateNormal(const char* text) {
+  return text[0] == '\0' || strcasecmp(text, "Normal") == 0 || strncasecmp(text, "No", 2) == 0;
+}
+
+// ============================================================================
+// Alarmregeln
+// ============================================================================
+
+// Bits in BmsSlot::alarmFlags
+#define ALARM_PROTECTION 0x01    // Schutzstatus nicht normal
+#define ALARM_FAILURE 0x02       // Fehlerstatus nicht normal
+#define ALARM_SOC_LOW 0x04       // SOC unter alarmSocMin
+#define ALARM_CELL_DELTA 0x08    // Zelldifferenz über alarmCellDeltaMv
+#define ALARM_TEMP_HIGH 0x10     // Temperatur über alarmTempMax
+#define ALARM_CURRENT_HIGH 0x20  // Strom über alarmCurrentMax
+#define ALARM_COUNT 6
+
+// Namen der Alarme in JSON und MQTT (Reihenfolge der Bits)
+const char* const ALARM_NAMES[ALARM_COUNT] = {
+  "protection", "failure", "soc_low", "cell_delta", "temp_high", "current_high"
+};
+
+/**
+ * Prüft eine Schwelle mit Hysterese
+ *
+ * @param active Alarm war bisher aktiv
+ * @param value Messwert
+ * @param limit Schwelle (Alarm ab value > limit)
+ * @param hysteresis Abstand unter der Schwelle, ab dem der Alarm endet
+ */
+bool aboveLimit(bool active, int32_t value, int32_t limit, int32_t hysteresis) {
+  return active ? value > limit - hysteresis : value > limit;
+}
+
+/**
+ * Bestimmt die aktiven Alarme einer Messung
+ *
+ * @param data Plausible Messung
+ * @param previous Bisher aktive Alarme (für die Hysterese)
+ * @return ALARM_*-Bits
+ */
+uint8_t evaluateAlarmFlags(const BMSData& data, uint8_t previous) {
+  uint8_t flags = 0;
+  if (!isBmsStateNormal(data.protectionState())) flags |= ALARM_PROTECTION;
+  if (!isBmsStateNormal(data.failureState())) flags |= ALARM_FAILURE;
+
+  if (alarmSocMin > 0) {
+    uint8_t limit = (previous & ALARM_SOC_LOW) ? alarmSocMin + ALARM_SOC_HYSTERESIS : alarmSocMin;
+    if (data.soc < limit) flags |= ALARM_SOC_LOW;
+  }
+  if (alarmCellDeltaMv > 0 && data.cellCount > 0) {
+    uint16_t lo = 0xFFFF, hi = 0;
+    for (uint8_t i = 0; i < data.cellCount; i++) {
+      lo = min(lo, data.cellMv[i]);
+      hi = max(hi, data.cellMv[i]);
+    }
+    if (aboveLimit(previous & ALARM_CELL_DELTA, hi - lo, alarmCellDeltaMv, ALARM_DELTA_HYSTERESIS_MV)) {
+      flags |= ALARM_CELL_DELTA;
+    }
+  }
+  if (alarmTempMax > 0) {
+    int32_t temp = max(data.mosfetTemp, data.cellTemp);
+    if (aboveLimit(previous & ALARM_TEMP_HIGH, temp, alarmTempMax, ALARM_TEMP_HYSTERESIS)) {
+      flags |= ALARM_TEMP_HIGH;
+    }
+  }
+  if (alarmCurrentMax > 0) {
+    if (aboveLimit(previous & ALARM_CURRENT_HIGH, abs(data.currentMa), alarmCurrentMax * 1000, ALARM_CURRENT_HYSTERESIS_MA)) {
+      flags |= ALARM_CURRENT_HIGH;
+    }
+  }
+  return flags;
+}
+
+/**
+ * Schreibt die Namen aktiver Alarme als JSON-Array
+ *
+ * @param json Ziel
+ * @param key Schlüssel im umgebenden Objekt
+ * @param flags ALARM_*-Bits
+ */
+void writeAlarmNames(JsonWriter& json, const char* key, uint8_t flags) {
+  json.beginArray(key);
+  for (uint8_t i = 0; i < ALARM_COUNT; i++) {
+    if (flags & (1 << i)) json.addString(nullptr, ALARM_NAMES[i]);
+  }
+  json.endArray();
+}
+
+/**
+ * Empfänger neuer Messungen: prüft die Alarmregeln (läuft im BLE-Task)
+ *
+ * Ein geänderter Alarmzustand oder ein Wechsel des Schutz-/Fehlerstatus
+ * (auch zwischen zwei Alarmtexten) setzt alarmPending, den Versand
+ * übernimmt serviceAlarms() in loop().
+ */
+void evaluateAlarmRules(uint8_t pack, const BMSData& data, bool valid) {
+  if (!valid) return;
+  BmsSlot& slot = bmsSlots[pack];
+  uint8_t previous = slot.alarmFlags;
+  uint8_t flags = alarmEnabled ? evaluateAlarmFlags(data, previous) : 0;
+  bool stateChanged = slot.seq > 1 &&
+    (data.protectionCode != slot.lastProtectionCode || data.failureCode != slot.lastFailureCode);
+  slot.lastProtectionCode = data.protectionCode;
+  slot.lastFailureCode = data.failureCode;
+  slot.alarmFlags = flags;
+
+  if (!alarmEnabled || (flags == previous && !stateChanged)) return;
+  alarmEventCount++;
+  alarmPending = true;
+  Serial.printf("[ALARM] Pack %u: Alarme 0x%02X -> 0x%02X (Schutz: %s, Fehler: %s)\n",
+    pack, previous, flags, data.protectionState(), data.failureState());
+}
+
+// ============================================================================
+// Abgeleitete Werte (Zellabweichung, Leistung, Energie, Restzeit)
+// ============================================================================
+// Die Energiezähler integrieren die Leistung über die Zeit zwischen zwei
+// Messungen (Trapezregel). Bei schneller Abfrage unter Last ist das deutlich
+// genauer als eine Auswertung der Webhook-Messungen im Minutenabstand.
+
+// Zuletzt im NVS gesicherter Stand der Energiezähler in Wh (geladen, entladen)
+// (ganze Wh reichen in uint32_t für über 4 GWh je Richtung)
+uint32_t energySavedWh[BMS_MAX_PACKS][2] = {};
+
+// Letzte Sicherung der Energiezähler (millis)
+unsigned long lastEnergySave = 0;
+
+/**
+ * Liefert eine konsistente Kopie der abgeleiteten Werte eines Packs
+ *
+ * @param pack Pack-Index
+ * @param out Zielstruktur für die Kopie
+ */
+void getPackAnalytics(uint8_t pack, BmsAnalytics& out) {
+  xSemaphoreTake(bmsDataMutex, portMAX_DELAY);
+  out = bmsSlots[pack].analytics;
+  xSemaphoreGive(bmsDataMutex);
+}
+
+/**
+ * Schreibt die abgeleiteten Werte eines Packs fort (läuft im BLE-Task)
+ *
+ * Wird vor der Veröffentlichung der Messung aufgerufen, damit jeder Leser
+ * mit der neuen Sequenznummer auch die passenden Werte sieht.
+ *
+ * @param pack Pack-Index
+ * @param data Neue Messung
+ * @param valid Ergebnis der Plausibilitätsprüfung (ungültige Messungen werden ignoriert)
+ */
+void updateBmsAnalytics(uint8_t pack, const BMSData& data, bool valid) {
+  if (!valid) return;
+  BmsAnalytics a = bmsSlots[pack].analytics;  // Nur dieser Task schreibt, Lesen ohne Mutex
+
+  // Niedrigste und höchste Zelle
+  a.cellMinMv = 0xFFFF;
+  a.cellMaxMv = 0;
+  for (uint8_t i = 0; i < data.cellCount; i++) {
+    if (data.cellMv[i] < a.cellMinMv) { a.cellMinMv = data.cellMv[i]; a.cellMin = i; }
+    if (data.cellMv[i] > a.cellMaxMv) { a.cellMaxMv = data.cellMv[i]; a.cellMax = i; }
+  }
+  if (data.cellCount == 0) a.cellMinMv = 0;
+
+  int32_t power = (int32_t)((int64_t)data.totalMv * data.currentMa / 1000);
+  unsigned long now = millis();
+  unsigned long dt = now - a.lastSampleAt;
+  if (a.valid && dt <= ENERGY_MAX_GAP_MS) {
+    // Energie seit der letzten Messung (Trapezregel). Bei einem Vorzeichenwechsel
+    // wird die Lücke am Nulldurchgang geteilt, sonst heben sich Laden und Entladen auf
+    int64_t p0 = a.powerMw;
+    int64_t p1 = power;
+    if ((p0 < 0 && p1 > 0) || (p0 > 0 && p1 < 0)) {
+      int64_t a0 = p0 < 0 ? -p0 : p0;
+      int64_t a1 = p1 < 0 ? -p1 : p1;
+      int64_t t0 = (int64_t)dt * a0 / (a0 + a1);
+      int64_t e0 = a0 * t0 / 2;
+      int64_t e1 = a1 * ((int64_t)dt - t0) / 2;
+      a.chargedMwMs += (p0 > 0) ? e0 : e1;
+      a.dischargedMwMs += (p0 > 0) ? e1 : e0;
+    } else {
+      int64_t energy = (p0 + p1) * (int64_t)dt / 2;
+      if (energy >= 0) a.chargedMwMs += energy;
+      else a.dischargedMwMs += -energy;
+    }
+    // Exponentielle Glättung mit an die Abfragelücke angepasstem Gewicht
+    a.emaCurrentMa += (int32_t)((int64_t)(data.currentMa - a.emaCurrentMa) * (int64_t)dt /
+                                ((int64_t)ANALYTICS_EMA_TAU_S * 1000 + dt));
+  } else {
+    a.emaCurrentMa = data.currentMa;
+  }
+
+  // Restzeit aus dem geglätteten Strom (in Ruhe keine Angabe)
+  a.timeToFullS = 0;
+  a.timeToEmptyS = 0;
+  if (a.emaCurrentMa >= BMS_IDLE_CURRENT_MA && data.fullCapacityMah > data.remainingMah) {
+    a.timeToFullS = (uint64_t)(data.fullCapacityMah - data.remainingMah) * 3600 / a.emaCurrentMa;
+  } else if (a.emaCurrentMa <= -BMS_IDLE_CURRENT_MA) {
+    a.timeToEmptyS = (uint64_t)data.remainingMah * 3600 / -a.emaCurrentMa;
+  }
+
+  a.powerMw = power;
+  a.lastSampleAt = now;
+  a.valid = true;
+
+  xSemaphoreTake(bmsDataMutex, portMAX_DELAY);
+  bmsSlots[pack].analytics = a;
+  xSemaphoreGive(bmsDataMutex);
+}
+
+/**
+ * Schreibt die abgeleiteten Werte als JSON-Objekt
+ *
+ * @param json Ziel
+ * @param key Schlüssel im umgebenden Objekt
+ * @param a Abgeleitete Werte
+ * @param snake true = Schlüssel in snake_case (Webhook), sonst camelCase (/api/data)
+ */
+void writeAnalyticsJson(JsonWriter& json, const char* key, const BmsAnalytics& a, bool snake) {
+  auto k = [snake](const char* camel, const char* snakeKey) { return snake ? snakeKey : camel; };
+  json.beginObject(key);
+  json.addFixed(k("cellMin", "cell_min"), a.cellMinMv, 3);
+  json.addUInt(k("cellMinCell", "cell_min_cell"), a.cellMin + 1);
+  json.addFixed(k("cellMax", "cell_max"), a.cellMaxMv, 3);
+  json.addUInt(k("cellMaxCell", "cell_max_cell"), a.cellMax + 1);
+  json.addUInt(k("cellDeltaMv", "cell_delta_mv"), a.cellDeltaMv());
+  json.addFixed(k("power", "power"), a.powerMw, 3);
+  json.addUInt(k("chargedWh", "charged_wh"), a.chargedWh());
+  json.addUInt(k("dischargedWh", "discharged_wh"), a.dischargedWh());
+  if (a.timeToFullS > 0) json.addUInt(k("timeToFull", "time_to_full"), a.timeToFullS);
+  else json.addNull(k("timeToFull", "time_to_full"));
+  if (a.timeToEmptyS > 0) json.addUInt(k("timeToEmpty", "time_to_empty"), a.timeToEmptyS);
+  else json.addNull(k("timeToEmpty", "time_to_empty"));
+  json.endObject();
+}
+
+/**
+ * Lädt die Energiezähler aller Packs aus dem NVS (vor dem Start des BLE-Tasks)
+ *
+ * Gespeichert werden ganze Wh (Schlüssel whIn0.., whOut0..). Fehlen sie,
+ * wird der ältere Stand in mWh (in0.., out0..) übernommen.
+ */
+void loadEnergyCounters() {
+  Preferences prefs;
+  prefs.begin("energy", true);
+  char key[8];
+  char legacy[8];
+  for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+    for (uint8_t d = 0; d < 2; d++) {
+      snprintf(key, sizeof(key), d == 0 ? "whIn%u" : "whOut%u", i);
+      snprintf(legacy, sizeof(legacy), d == 0 ? "in%u" : "out%u", i);
+      energySavedWh[i][d] = prefs.isKey(key) ? prefs.getULong(key, 0) : prefs.getULong(legacy, 0) / 1000;
+    }
+    bmsSlots[i].analytics.chargedMwMs = (uint64_t)energySavedWh[i][0] * 3600000000ULL;
+    bmsSlots[i].analytics.dischargedMwMs = (uint64_t)energySavedWh[i][1] * 3600000000ULL;
+  }
+  prefs.end();
+}
+
+/**
+ * Sichert geänderte Energiezähler im NVS
+ *
+ * Eigene Preferences-Instanz, da auch vor Neustart und Deep Sleep aufgerufen.
+ */
+void saveEnergyCounters() {
+  Preferences prefs;
+  bool open = false;
+  char key[8];
+  for (uint8_t i = 0; i < bmsPackCount(); i++) {
+    BmsAnalytics a;
+    getPackAnalytics(i, a);
+    uint32_t values[2] = { a.chargedWh(), a.dischargedWh() };
+    for (uint8_t d = 0; d < 2; d++) {
+      if (values[d] == energySavedWh[i][d]) continue;
+      if (!open) open = prefs.begin("energy", false);
+      if (!open) return;
+      snprintf(key, sizeof(key), d == 0 ? "whIn%u" : "whOut%u", i);
+      prefs.putULong(key, values[d]);
+      energySavedWh[i][d] = values[d];
+    }
+  }
+  if (open) prefs.end();
+}
+
+/**
+ * Sichert die Energiezähler regelmäßig (aus loop() aufgerufen)
+ *
+ * @param currentMillis Aktueller millis()-Wert
+ */
+void serviceEnergyCounters(unsigned long currentMillis) {
+  if (currentMillis - lastEnergySave < ENERGY_SAVE_INTERVAL_MS) return;
+  lastEnergySave = currentMillis;
+  saveEnergyCounters();
+}
+
+// ============================================================================
+// Zeit-Funktionen
+// ============================================================================
+
+/**
+ * Startet die Synchronisation der Systemzeit mit einem NTP-Server (non-blocking)
+ *
+ * Verwendet die konfigurierte Zeitzone für automatische
+ * Sommer-/Winterzeit-Umstellung. lastSyncTime wird erst im Callback
+ * onNtpSync() gesetzt.
+ */
+void syncNTP() {
+  // Zeitzone und NTP-Server konfigurieren, die Synchronisation läuft im
+  // Hintergrund (lwIP) und meldet sich über onNtpSync()
+  configTzTime(timezone.c_str(), ntpServer);
+}
+
+/**
+ * SNTP-Callback: Zeit wurde synchronisiert (läuft im lwIP-Task)
+ *
+ * @param tv Neue Systemzeit
+ */
+void onNtpSync(struct timeval* tv) {
+  // Zeitstempel der erfolgreichen Synchronisation speichern
+  lastSyncTime = tv->tv_sec;
+  if (bootTimings.ntp == 0) {
+    bootTimings.ntp = millis();
+  }
+  Serial.println("NTP synchronisiert");
+}
+
+/**
+ * Gibt die aktuelle Zeit als formatierten String zurück
+ *
+ * @return Zeit im Format "DD.MM.YYYY HH:MM:SS" oder Fehlermeldung
+ */
+String getCurrentTimeString() {
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo)) {
+    return "Zeit nicht verfügbar";
+  }
+  char buffer[64];
+  strftime(buffer, sizeof(buffer), "%d.%m.%Y %H:%M:%S", &timeinfo);
+  return String(buffer);
+}
+
+/**
+ * Gibt den Zeitpunkt der letzten NTP-Synchronisation zurück
+ *
+ * @return Zeitpunkt als String oder "Noch nicht synchronisiert"
+ */
+String getLastSyncTimeString() {
+  if (lastSyncTime == 0) {
+    return "Noch nicht synchronisiert";
+  }
+  // localtime_r: wird auch aus dem Webserver-Task aufgerufen
+  struct tm timeinfo;
+  localtime_r(&lastSyncTime, &timeinfo);
+  char buffer[64];
+  strftime(buffer, sizeof(buffer), "%d.%m.%Y %H:%M:%S", &timeinfo);
+  return String(buffer);
+}
+
+// ============================================================================
+// BMS-Datenabfrage
+// ============================================================================
+
+/**
+ * Liefert eine konsistente Kopie der zuletzt veröffentlichten BMS-Daten
+ *
+ * Kann aus jedem Task aufgerufen werden. Der Mutex wird nur für die Dauer
+ * der Kopie gehalten, eine laufende BLE-Abfrage blockiert den Aufrufer nicht.
+ *
+ * @param out Zielstruktur für die Kopie
+ * @param fieldSeq Optional: Array[FIELD_COUNT] für die Änderungs-Sequenznummern
+ * @return Sequenznummer der Messung (0 = noch keine Messung vorhanden)
+ */
+uint32_t getBMSSnapshot(BMSData& out, uint32_t* fieldSeq = nullptr) {
+  xSemaphoreTake(bmsDataMutex, portMAX_DELAY);
+  out = bmsBuffers[bmsActiveBuffer];
+  uint32_t seq = bmsSampleSeq;
+  if (fieldSeq) {
+    memcpy(fieldSeq, bmsFieldSeq, sizeof(bmsFieldSeq));
+  }
+  xSemaphoreGive(bmsDataMutex);
+  return seq;
+}
+
+/**
+ * Liefert eine konsistente Kopie der letzten Messung eines Packs
+ *
+ * @param pack Pack-Index
+ * @param out Zielstruktur für die Kopie
+ * @param valid Optional: Plausibilität der Messung
+ * @return Anzahl Messungen des Packs (0 = noch keine Messung vorhanden)
+ */
+uint32_t getPackSnapshot(uint8_t pack, BMSData& out, bool* valid = nullptr) {
+  xSemaphoreTake(bmsDataMutex, portMAX_DELAY);
+  out = bmsSlots[pack].data;
+  uint32_t seq = bmsSlots[pack].seq;
+  if (valid) *valid = bmsSlots[pack].dataValid;
+  xSemaphoreGive(bmsDataMutex);
+  return seq;
+}
+
+/**
+ * Prüft ob sich ein einzelnes Feld zwischen zwei Datensätzen unterscheidet
+ *
+ * @param a Bisheriger Datensatz
+ * @param b Neuer Datensatz
+ * @param field Zu vergleichendes Feld
+ * @return true wenn sich der ausgegebene Wert geändert hat
+ */
+bool bmsFieldChanged(const BMSData& a, const BMSData& b, BmsField field) {
+  switch (field) {
+    case FIELD_TOTAL_VOLTAGE:     return a.totalMv != b.totalMv;
+    case FIELD_CELL_VOLTAGE_SUM:  return a.cellSumMv != b.cellSumMv;
+    case FIELD_CURRENT:           return a.currentMa != b.currentMa;
+    case FIELD_MOSFET_TEMP:       return a.mosfetTemp != b.mosfetTemp;
+    case FIELD_CELL_TEMP:         return a.cellTemp != b.cellTemp;
+    case FIELD_SOC:               return a.soc != b.soc;
+    case FIELD_SOH:               return a.sohCode != b.sohCode;
+    case FIELD_REMAINING_AH:      return a.remainingMah != b.remainingMah;
+    case FIELD_FULL_CAPACITY_AH:  return a.fullCapacityMah != b.fullCapacityMah;
+    case FIELD_PROTECTION_STATE:  return a.protectionCode != b.protectionCode;
+    case FIELD_HEAT_STATE:        return a.heatCode != b.heatCode;
+    case FIELD_FAILURE_STATE:     return a.failureCode != b.failureCode;
+    case FIELD_BALANCING_STATE:   return a.balancingCode != b.balancingCode;
+    case FIELD_BATTERY_STATE:     return a.batteryStateCode != b.batteryStateCode;
+    case FIELD_DISCHARGES_COUNT:  return a.dischargesCount != b.dischargesCount;
+    case FIELD_DISCHARGES_AH:     return a.dischargesMah != b.dischargesMah;
+    case FIELD_CELL_VOLTAGES:
+      return a.cellCount != b.cellCount ||
+             memcmp(a.cellMv.data(), b.cellMv.data(), a.cellCount * sizeof(uint16_t)) != 0;
+    default:                      return false;
+  }
+}
+
+/**
+ * Veröffentlicht den im inaktiven Puffer fertig befüllten Datensatz
+ *
+ * Schaltet unter dem Mutex auf den neuen Puffer um, damit Leser nie
+ * einen halb geschriebenen Datensatz sehen.
+ *
+ * @param valid Ergebnis der Plausibilitätsprüfung des neuen Datensatzes
+ */
+void publishBMSData(bool valid) {
+  xSemaphoreTake(bmsDataMutex, portMAX_DELAY);
+  const BMSData& previous = bmsBuffers[bmsActiveBuffer];
+  const BMSData& next = bmsBuffers[bmsActiveBuffer ^ 1];
+  uint32_t seq = bmsSampleSeq + 1;
+
+  // Geänderte Felder für Delta-Abfragen markieren (erste Messung: alle)
+  for (uint8_t f = 0; f < FIELD_COUNT; f++) {
+    if (seq == 1 || bmsFieldChanged(previous, next, (BmsField)f)) {
+      bmsFieldSeq[f] = seq;
+    }
+  }
+
+  bmsActiveBuffer ^= 1;
+  bmsDataValid = valid;
+  bmsSampleSeq = seq;
+  xSemaphoreGive(bmsDataMutex);
+
+  if (valid && bootTimings.bmsData == 0) {
+    bootTimings.bmsData = millis();
+  }
+}
+
+/**
+ * Legt die neue Messung eines Packs für die Pack-Listen ab
+ *
+ * @param pack Pack-Index
+ * @param data Neue Messung
+ * @param valid Ergebnis der Plausibilitätsprüfung
+ */
+void publishPackData(uint8_t pack, const BMSData& data, bool valid) {
+  xSemaphoreTake(bmsDataMutex, portMAX_DELAY);
+  bmsSlots[pack].data = data;
+  bmsSlots[pack].seq++;
+  bmsSlots[pack].dataValid = valid;
+  bmsPacksSeq = bmsPacksSeq + 1;
+  xSemaphoreGive(bmsDataMutex);
+}
+
+/**
+ * Rechnet einen Wert vom BMS-Client in Tausendstel um (V → mV, Ah → mAh)
+ *
+ * Negative Werte werden auf 0 begrenzt.
+ *
+ * @param value Wert in Basiseinheit
+ * @return Gerundeter Wert in Tausendstel
+ */
+uint32_t toMilliUnsigned(float value) {
+  if (value <= 0) return 0;
+  return (uint32_t)lroundf(value * 1000.0f);
+}
+
+/**
+ * Wie toMilliUnsigned(), aber auf den 16-Bit-Bereich begrenzt (für Spannungen)
+ *
+ * @param value Wert in Volt
+ * @return Gerundeter Wert in mV (maximal 65535)
+ */
+uint16_t toMilli16(float value) {
+  return (uint16_t)min(toMilliUnsigned(value), (uint32_t)0xFFFF);
+}
+
+/**
+ * Fragt alle Daten eines BMS ab und veröffentlicht sie als neuen Snapshot
+ *
+ * Läuft ausschließlich im BLE-Task. Diese Funktion:
+ * 1. Prüft ob eine BMS-Verbindung besteht
+ * 2. Ruft update() am BMS-Client auf um neue Daten zu holen
+ * 3. Kopiert alle Werte in den inaktiven Puffer (Pack 0) bzw. einen lokalen
+ * 4. Validiert die Daten auf Plausibilität und veröffentlicht sie
+ * 5. Passt das Abfrageintervall an (siehe adaptPollInterval())
+ * 6. Gibt die Daten optional auf Serial aus
+ *
+ * @param pack Pack-Index
+ * @return true wenn die Abfrage rechtzeitig plausible Daten geliefert hat
+ */
+bool updateBMSData(uint8_t pack) {
+  BmsSlot& slot = bmsSlots[pack];
+  BMSClient& bmsClient = slot.client;
+
+  // Abbrechen wenn keine Verbindung besteht
+  if (!slot.connected) return false;
+
+  // BMS-Client auffordern neue Daten zu holen
+  unsigned long pollStart = millis();
+  int64_t perfStart = esp_timer_get_time();
+  bmsClient.update();
+  perfStart = perfLap(PERF_BLE_UPDATE, perfStart);
+  unsigned long latency = millis() - pollStart;
+  blePollHistogram.observe(latency);
+  slot.pollLatencyMs = min(latency, (unsigned long)UINT16_MAX);
+
+  // Alle Werte übernehmen: Pack 0 direkt in den inaktiven Puffer (nur der
+  // BLE-Task schreibt hier), weitere Packs nur für die Pack-Listen
+  BMSData packData;
+  BMSData& next = (pack == 0) ? bmsBuffers[bmsActiveBuffer ^ 1] : packData;
+  next.totalMv = toMilli16(bmsClient.getTotalVoltage());
+  next.cellSumMv = toMilli16(bmsClient.getCellVoltageSum());
+  next.currentMa = lroundf(bmsClient.getCurrent() * 1000.0f);
+  next.mosfetTemp = bmsClient.getMosfetTemp();
+  next.cellTemp = bmsClient.getCellTemp();
+  next.soc = bmsClient.getSOC();
+  next.sohCode = internBmsState(bmsClient.getSOH());
+  next.remainingMah = toMilliUnsigned(bmsClient.getRemainingAh());
+  next.fullCapacityMah = toMilliUnsigned(bmsClient.getFullCapacityAh());
+  next.protectionCode = internBmsState(bmsClient.getProtectionState());
+  next.heatCode = internBmsState(bmsClient.getHeatState());
+  next.balanceMemoryCode = internBmsState(bmsClient.getBalanceMemory());
+  next.failureCode = internBmsState(bmsClient.getFailureState());
+  next.balancingCode = internBmsState(bmsClient.getBalancingState());
+  next.batteryStateCode = internBmsState(bmsClient.getBatteryState());
+  next.dischargesCount = bmsClient.getDischargesCount();
+  next.dischargesMah = toMilliUnsigned(bmsClient.getDischargesAhCount());
+
+  // Zellspannungen in das feste Array übernehmen (Überzählige werden ignoriert)
+  std::vector<float> cells = bmsClient.getCellVoltages();
+  next.cellCount = min(cells.size(), (size_t)BMS_MAX_CELLS);
+  for (uint8_t i = 0; i < next.cellCount; i++) {
+    next.cellMv[i] = toMilli16(cells[i]);
+  }
+
+  // Plausibilitätsprüfung durchführen und Puffer veröffentlichen
+  bool wasValid = slot.dataValid;
+  bool valid = isBmsDataValid(next);
+  updateBmsAnalytics(pack, next, valid);
+  publishPackData(pack, next, valid);
+  if (pack == 0) {
+    publishBMSData(valid);  // "next" ist danach der aktive Puffer (unverändert)
+  }
+  notifyBmsSampleListeners(pack, next, valid);
+
+  // Bei ungültigen Daten: Meldung ausgeben und abbrechen
+  if (!valid) {
+    if (wasValid) {
+      Serial.printf("[BMS] Pack %u: Daten nicht plausibel - überspringe Ausgabe/Webhook\n", pack);
+    }
+    perfLap(PERF_BLE_SAMPLE, perfStart);  // Auch der Fehlerpfad zählt zum Profil
+    return false;  // Keine weitere Verarbeitung bei ungültigen Daten
+  }
+
+  // Wenn Daten wieder plausibel werden: Meldung ausgeben
+  if (!wasValid) {
+    Serial.printf("[BMS] Pack %u: Daten jetzt plausibel - Ausgabe aktiviert\n", pack);
+  }
+
+  adaptPollInterval(pack, next);
+
+  // Messung in der Historie ablegen, auch bei schneller Abfrage höchstens
+  // im eingestellten Intervall (sonst wäre der Ringpuffer nach Minuten voll)
+  unsigned long now = millis();
+  if (slot.lastHistory == 0 || now - slot.lastHistory >= bmsInterval * 1000) {
+    recordHistorySample(next, pack);
+    slot.lastHistory = now;
+  }
+
+  // Optional: Daten auf Serial ausgeben
+  if (serialOutputEnabled) {
+    printBMSDataSerial(next, pack);
+  }
+  perfLap(PERF_BLE_SAMPLE, perfStart);
+  return latency < BMS_POLL_TIMEOUT_MS;
+}
+
+/**
+ * Passt das Abfrageintervall eines Packs an die aktuelle Messung an
+ *
+ * - Schnell (BMS_POLL_FAST_MS): hoher Strom, starke Stromänderung seit der
+ *   letzten Messung oder Schutz-/Fehlerstatus aktiv
+ * - Ruhe (mindestens BMS_POLL_IDLE_MS): nach BMS_IDLE_POLLS Messungen in
+ *   Folge mit nahezu keinem Strom
+ * - Sonst das eingestellte bmsInterval
+ *
+ * @param pack Pack-Index
+ * @param data Neue, plausible Messung
+ */
+void adaptPollInterval(uint8_t pack, const BMSData& data) {
+  BmsSlot& slot = bmsSlots[pack];
+  unsigned long base = bmsInterval * 1000;
+  int32_t current = abs(data.currentMa);
+  int32_t step = (slot.seq > 1) ? abs(data.currentMa - slot.lastCurrentMa) : 0;
+  slot.lastCurrentMa = data.currentMa;
+
+  bool alarm = !isBmsStateNormal(data.protectionState()) || !isBmsStateNormal(data.failureState());
+  unsigned long interval = base;
+  if (current >= BMS_ACTIVE_CURRENT_MA || step >= BMS_CURRENT_STEP_MA || alarm) {
+    slot.idlePolls = 0;
+    interval = min((unsigned long)BMS_POLL_FAST_MS, base);
+  } else if (current < BMS_IDLE_CURRENT_MA) {
+    if (slot.idlePolls < BMS_IDLE_POLLS) slot.idlePolls++;
+    if (slot.idlePolls >= BMS_IDLE_POLLS) interval = max((unsigned long)BMS_POLL_IDLE_MS, base);
+  } else {
+    slot.idlePolls = 0;
+  }
+
+  if (bmsAdaptivePolling && interval != bmsPollInterval(slot)) {
+    Serial.printf("[BMS] Pack %u: Abfrageintervall %lu s (%s)\n", pack, interval / 1000,
+      interval < base ? (alarm ? "Alarm" : "hohe Last") : (interval > base ? "Ruhe" : "normal"));
+  }
+  slot.pollInterval = interval;
+}
+
+/**
+ * Gibt eine kompakte Übersicht der BMS-Daten auf Serial aus
+ *
+ * Wird nur aufgerufen wenn serialOutputEnabled true ist.
+ *
+ * @param data Auszugebende BMS-Daten
+ * @param pack Pack-Index (wird nur bei mehreren Packs angezeigt)
+ */
+void printBMSDataSerial(const BMSData& data, uint8_t pack) {
+  Serial.println("══════════════════════════════════════════════════════");
+  if (bmsPackCount() > 1) {
+    Serial.printf("               LiTime BMS Status (Pack %u)              \n", pack + 1);
+  } else {
+    Serial.println("                   LiTime BMS Status                   ");
+  }
+  Serial.println("══════════════════════════════════════════════════════");
+  Serial.printf("Gesamtspannung: %.2f V | SOC: %d%% | Strom: %.2f A\n",
+    data.totalVoltage(), data.soc, data.current());
+  Serial.printf("Temperatur: MOSFET %d°C | Zellen %d°C\n",
+    data.mosfetTemp, data.cellTemp);
+  Serial.println();
+}
+
+// ============================================================================
+// BLE-Worker-Task
+// ============================================================================
+// Der BLE-Task besitzt die BMS-Clients exklusiv. Verbindungsaufbau und
+// Datenabfrage können mehrere Sekunden dauern und blockieren dadurch
+// weder den Webserver noch LED oder Webhook in loop().
+//
+// Mehrere Packs werden reihum bedient: pro Durchlauf höchstens eine
+// BLE-Operation, beginnend hinter dem zuletzt bedienten Pack. Jeder Pack
+// wird so im eingestellten Intervall abgefragt, ohne dass ein nicht
+// erreichbarer Pack die anderen ausbremst. Mit bmsKeepConnected bleiben
+// die Verbindungen offen; sonst wird je Abfrage verbunden, gelesen und
+// getrennt (für Controller mit wenigen gleichzeitigen Verbindungen).
+
+/**
+ * Aktualisiert bmsConnected: alle konfigurierten Packs erreichbar
+ */
+void refreshBmsConnected() {
+  uint8_t count = bmsPackCount();
+  bool all = count > 0;
+  for (uint8_t i = 0; i < count; i++) {
+    all = all && bmsSlots[i].online;
+  }
+  bmsConnected = all;
+}
+
+/**
+ * Trennt die Verbindung eines Packs
+ *
+ * @param pack Pack-Index
+ */
+void disconnectBMS(uint8_t pack) {
+  bmsSlots[pack].client.disconnect();
+  bmsSlots[pack].connected = false;
+}
+
+/**
+ * Wertet das Ergebnis einer Abfrage für die Verbindungsüberwachung aus
+ *
+ * Eine Verbindung kann bestehen bleiben, obwohl das BMS nicht mehr
+ * antwortet. Nach BMS_POLL_FAIL_LIMIT fehlgeschlagenen Abfragen in Folge
+ * (Timeout oder keine plausiblen Daten) wird sie deshalb getrennt und
+ * sofort neu aufgebaut, statt auf den Backoff zu warten.
+ *
+ * @param pack Pack-Index
+ * @param ok Ergebnis von updateBMSData()
+ */
+void recordPollResult(uint8_t pack, bool ok) {
+  BmsSlot& slot = bmsSlots[pack];
+  if (ok) {
+    slot.failedPolls = 0;
+    return;
+  }
+  bmsPollFailures++;
+  if (++slot.failedPolls < BMS_POLL_FAIL_LIMIT) return;
+
+  Serial.printf("[BLE] Pack %u: %u Abfragen ohne Antwort (zuletzt %u ms), verbinde neu\n",
+    pack, slot.failedPolls, (unsigned)slot.pollLatencyMs);
+  slot.failedPolls = 0;
+  slot.online = false;
+  slot.pollInterval = 0;
+  bmsPollReconnects++;
+  if (slot.connected) {
+    disconnectBMS(pack);
+    slot.connectPending = true;
+  }
+}
+
+/**
+ * Versucht eine Verbindung zu einem BMS herzustellen
+ *
+ * Bei Erfolg wird sofort eine erste Datenabfrage durchgeführt, bei
+ * Misserfolg wird die Wartezeit bis zum nächsten Versuch verdoppelt.
+ *
+ * @param pack Pack-Index
+ */
+void connectBMS(uint8_t pack) {
+  BmsSlot& slot = bmsSlots[pack];
+  logCrashLocation("!ble:bms_connect_start");
+  Serial.printf("[BLE] Pack %u: Stelle BMS-Verbindung her: %s\n", pack, slot.mac);
+  slot.client.init(slot.mac);
+  logCrashLocation("!ble:bms_connect_call");
+  int64_t connectStart = esp_timer_get_time();
+  bool connected = slot.client.connect();
+  perfLap(PERF_BLE_CONNECT, connectStart);
+  logCrashLocation("!ble:bms_connect_done");
+  slot.lastConnectAttempt = millis();
+  bmsConnectAttempts++;
+
+  if (connected) {
+    Serial.printf("[BLE] Pack %u: BMS-Verbindung erfolgreich!\n", pack);
+    slot.connected = true;
+    slot.online = true;
+    if (bootTimings.bmsConnect == 0) {
+      bootTimings.bmsConnect = millis();
+    }
+    slot.reconnectDelay = BMS_RECONNECT_MIN_MS;
+    logCrashLocation("!ble:bms_update_start");
+    bool ok = updateBMSData(pack);
+    logCrashLocation("!ble:bms_update_done");
+    slot.lastUpdate = millis();
+    recordPollResult(pack, ok);
+  } else {
+    bmsConnectFailures++;
+    slot.online = false;
+    Serial.printf("[BLE] Pack %u: BMS-Verbindung fehlgeschlagen, nächster Versuch in %lu s\n",
+      pack, slot.reconnectDelay / 1000);
+    // Exponentieller Backoff für den nächsten Versuch
+    slot.reconnectDelay = min(slot.reconnectDelay * 2, (unsigned long)BMS_RECONNECT_MAX_MS);
+  }
+}
+
+/**
+ * Führt die nächste fällige BLE-Operation eines Packs aus
+ *
+ * @param pack Pack-Index
+ * @param now Aktueller millis()-Wert
+ * @return true wenn eine BLE-Operation ausgeführt wurde
+ */
+bool serviceBmsSlot(uint8_t pack, unsigned long now) {
+  BmsSlot& slot = bmsSlots[pack];
+  if (strlen(slot.mac) != 17) {
+    // Keine MAC konfiguriert: Request verwerfen
+    slot.connectPending = false;
+    return false;
+  }
+
+  bool pollDue = (now - slot.lastUpdate >= bmsPollInterval(slot));
+  if (!slot.connected) {
+    // Angeforderte Verbindung sofort, sonst nach Backoff-Zeit (ohne
+    // Dauerverbindung zusätzlich erst wenn die nächste Abfrage fällig ist)
+    bool retryDue = (now - slot.lastConnectAttempt >= slot.reconnectDelay) && (bmsKeepConnected || pollDue);
+    if (!slot.connectPending && !retryDue) return false;
+    slot.connectPending = false;
+    connectBMS(pack);
+  } else if (pollDue) {
+    // BMS-Daten periodisch abfragen (funktioniert auch im AP-Modus)
+    logCrashLocation("ble:bms_periodic_update");
+    bool ok = updateBMSData(pack);
+    slot.lastUpdate = millis();
+    recordPollResult(pack, ok);
+  } else {
+    return false;
+  }
+
+  // Ohne Dauerverbindung nach jeder Abfrage trennen
+  if (!bmsKeepConnected && slot.connected) {
+    disconnectBMS(pack);
+  }
+  return true;
+}
+
+/**
+ * Hauptfunktion des BLE-Worker-Tasks
+ *
+ * Aufgaben:
+ * 1. Verbindungen trennen wenn Bluetooth deaktiviert wurde
+ * 2. Verbindungen herstellen (sofort bei Anforderung, sonst mit Backoff)
+ * 3. BMS-Daten aller Packs reihum im konfigurierten Intervall abfragen
+ *
+ * @param parameter Nicht verwendet
+ */
+void bmsTask(void* parameter) {
+  // Eigener Watchdog-Eintrag: hängt der BLE-Stack, wird ebenfalls resettet
+  esp_task_wdt_add(NULL);
+
+  for (;;) {
+    esp_task_wdt_reset();
+    unsigned long now = millis();
+
+    if (!bluetoothEnabled) {
+      // Bluetooth deaktiviert: bestehende Verbindungen trennen
+      for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+        if (bmsSlots[i].connected) {
+          disconnectBMS(i);
+          Serial.printf("[BLE] Pack %u: BMS-Verbindung getrennt (Bluetooth deaktiviert)\n", i);
+        }
+        bmsSlots[i].online = false;
+      }
+      bmsConnectPending = false;
+    } else {
+      // Angeforderte Verbindung gilt für alle Packs
+      if (bmsConnectPending) {
+        bmsConnectPending = false;
+        for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+          bmsSlots[i].connectPending = true;
+        }
+      }
+      // Round-Robin: der erste fällige Pack hinter dem zuletzt bedienten
+      for (uint8_t n = 0; n < BMS_MAX_PACKS; n++) {
+        uint8_t pack = (bmsNextPack + n) % BMS_MAX_PACKS;
+        if (serviceBmsSlot(pack, now)) {
+          bmsNextPack = (pack + 1) % BMS_MAX_PACKS;
+          break;
+        }
+      }
+    }
+    refreshBmsConnected();
+
+    vTaskDelay(pdMS_TO_TICKS(BMS_TASK_TICK_MS));
+  }
+}
+
+/**
+ * Weckt loop() sobald eine neue Messung vorliegt
+ *
+ * Im Stromsparmodus wartet loop() auf diese Benachrichtigung statt fest zu
+ * schlafen, MQTT und Push-Stream reagieren so ohne Verzögerung.
+ */
+void wakeLoopOnSample(uint8_t pack, const BMSData& data, bool valid) {
+  if (loopTaskHandle) {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+}
+
+/**
+ * Startet den BLE-Worker-Task
+ *
+ * Die erste Verbindung wird sofort angefordert, setup() wartet nicht darauf.
+ * Muss aus setup() aufgerufen werden (merkt sich den loop()-Task).
+ */
+void startBMSTask() {
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  addBmsSampleListener(evaluateAlarmRules);
+  addBmsSampleListener(wakeLoopOnSample);
+  bmsConnectPending = true;
+  xTaskCreate(bmsTask, "bms", BMS_TASK_STACK_SIZE, nullptr, BMS_TASK_PRIORITY, &bmsTaskHandle);
+}
+
+// ============================================================================
+// HTTP-Antworten
+// ============================================================================
+// Die Handler laufen im AsyncTCP-Task und dürfen nicht blockieren. Kleine
+// JSON-Antworten werden komplett erzeugt und in einem Stück gesendet.
+// Große Antworten (Historie) werden per Chunked Transfer-Encoding erst
+// erzeugt, wenn der Server Platz im Sendepuffer hat - der Heap-Bedarf pro
+// Anfrage bleibt damit konstant, egal wie groß die Antwort ist.
+//
+// Einstellungen ändern und alles was blockiert (WLAN verbinden, Neustart,
+// MQTT neu verbinden, NVS schreiben) wird nicht im Handler ausgeführt,
+// sondern als Auftrag an loop() übergeben (siehe "Aufträge vom Webserver").
+
+/**
+ * Sendet ein JSON-Dokument als Antwort
+ *
+ * @param request Anfrage
+ * @param doc Zu serialisierendes Dokument
+ * @param code HTTP-Statuscode (Standard 200)
+ */
+void sendJsonDocument(AsyncWebServerRequest* request, const JsonDocument& doc, int code = 200) {
+  AsyncResponseStream* response = request->beginResponseStream("application/json");
+  response->setCode(code);
+  serializeJson(doc, *response);
+  request->send(response);
+}
+
+/**
+ * Sendet eine feste JSON-Antwort (z.B. {"success":true})
+ *
+ * @param request Anfrage
+ * @param json Nullterminierter JSON-Text
+ * @param code HTTP-Statuscode (Standard 200)
+ */
+void sendJsonText(AsyncWebServerRequest* request, const char* json, int code = 200) {
+  request->send(code, "application/json", json);
+}
+
+/**
+ * Liest einen Query-Parameter als Zahl
+ *
+ * @param request Anfrage
+ * @param name Name des Parameters
+ * @param fallback Wert wenn der Parameter fehlt
+ * @return Wert des Parameters
+ */
+uint32_t getUIntParam(AsyncWebServerRequest* request, const char* name, uint32_t fallback) {
+  if (!request->hasParam(name)) return fallback;
+  return strtoul(request->getParam(name)->value().c_str(), nullptr, 10);
+}
+
+/**
+ * Prüft das ETag des Browsers (If-None-Match)
+ *
+ * @param request Anfrage
+ * @param etag Aktuelles ETag inklusive Anführungszeichen
+ * @return true wenn der Browser die aktuelle Version bereits hat
+ */
+bool etagMatches(AsyncWebServerRequest* request, const char* etag) {
+  const AsyncWebHeader* header = request->getHeader("If-None-Match");
+  return header != nullptr && header->value() == etag;
+}
+
+/**
+ * Sendet 304 Not Modified mit ETag
+ *
+ * @param request Anfrage
+ * @param etag Aktuelles ETag
+ */
+void sendNotModified(AsyncWebServerRequest* request, const char* etag) {
+  AsyncWebServerResponse* response = request->beginResponse(304);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+// ============================================================================
+// Webseiten (vorkomprimiert im Flash)
+// ============================================================================
+// Die Seiten liegen als HTML in web/ und werden beim Build von
+// scripts/build_web.py zusammengesetzt, mit gzip komprimiert und als
+// PROGMEM-Arrays in include/web_assets.h abgelegt. Dynamische Werte lädt
+// das JavaScript der Seiten über /api/settings, /api/status und /api/data.
+
+/**
+ * Liefert eine vorkomprimierte Webseite aus dem Flash aus
+ *
+ * Die gzip-Bytes werden unverändert gesendet, ohne String-Aufbau oder
+ * Kopie in den RAM. Stimmt das ETag des Browsers (If-None-Match), wird
+ * nur 304 Not Modified zurückgegeben.
+ *
+ * @param request Anfrage
+ * @param asset Eintrag aus WEB_ASSETS
+ */
+void sendWebAsset(AsyncWebServerRequest* request, const WebAsset& asset) {
+  if (etagMatches(request, asset.etag)) {
+    sendNotModified(request, asset.etag);
+    return;
+  }
+
+  // Antwort liest direkt aus dem Flash (keine Kopie)
+  AsyncWebServerResponse* response = request->beginResponse(200, "text/html", asset.data, asset.length);
+  response->addHeader("ETag", asset.etag);
+  // Browser muss per ETag nachfragen, darf aber den Cache verwenden
+  response->addHeader("Cache-Control", "no-cache");
+  response->addHeader("Content-Encoding", "gzip");
+  request->send(response);
+}
+
+// ============================================================================
+// Totband
+// ============================================================================
+
+/**
+ * Zuletzt gesendeter Stand je Feld (pro Ausgang: Webhook, MQTT)
+ */
+struct ReportedValues {
+  int32_t keys[FIELD_COUNT] = {};       // Vergleichswert je Feld (siehe bmsFieldKey())
+  unsigned long at[FIELD_COUNT] = {};   // Zeitpunkt der letzten Sendung je Feld (0 = nie)
+  std::array<uint16_t, BMS_MAX_CELLS> cellMv{};  // Gesendete Zellspannungen
+  uint8_t cellCount = 0;
+};
+
+/**
+ * Vergleichswert eines Felds in ganzzahliger Einheit
+ *
+ * Statustexte werden über ihren Code verglichen (jede Änderung zählt).
+ * Für Zellspannungen siehe fieldMoved().
+ */
+int32_t bmsFieldKey(const BMSData& data, BmsField field) {
+  switch (field) {
+    case FIELD_TOTAL_VOLTAGE:     return data.totalMv;
+    case FIELD_CELL_VOLTAGE_SUM:  return data.cellSumMv;
+    case FIELD_CURRENT:           return data.currentMa;
+    case FIELD_MOSFET_TEMP:       return data.mosfetTemp;
+    case FIELD_CELL_TEMP:         return data.cellTemp;
+    case FIELD_SOC:               return data.soc;
+    case FIELD_SOH:               return data.sohCode;
+    case FIELD_REMAINING_AH:      return data.remainingMah;
+    case FIELD_FULL_CAPACITY_AH:  return data.fullCapacityMah;
+    case FIELD_PROTECTION_STATE:  return data.protectionCode;
+    case FIELD_HEAT_STATE:        return data.heatCode;
+    case FIELD_FAILURE_STATE:     return data.failureCode;
+    case FIELD_BALANCING_STATE:   return data.balancingCode;
+    case FIELD_BATTERY_STATE:     return data.batteryStateCode;
+    case FIELD_DISCHARGES_COUNT:  return data.dischargesCount;
+    case FIELD_DISCHARGES_AH:     return data.dischargesMah;
+    default:                      return 0;
+  }
+}
+
+/**
+ * Totband eines Felds in der Einheit von bmsFieldKey()
+ *
+ * @return Mindeständerung (1 = jede Änderung)
+ */
+int32_t bmsFieldDeadband(BmsField field) {
+  switch (field) {
+    case FIELD_TOTAL_VOLTAGE:
+    case FIELD_CELL_VOLTAGE_SUM:
+    case FIELD_CELL_VOLTAGES:     return max((int32_t)deadbandMv, (int32_t)1);
+    case FIELD_CURRENT:           return max((int32_t)deadbandMa, (int32_t)1);
+    case FIELD_MOSFET_TEMP:
+    case FIELD_CELL_TEMP:         return max((int32_t)deadbandTemp, (int32_t)1);
+    case FIELD_SOC:               return max((int32_t)deadbandSoc, (int32_t)1);
+    case FIELD_REMAINING_AH:
+    case FIELD_FULL_CAPACITY_AH:  return DEADBAND_CAPACITY_MAH;
+    default:                      return 1;
+  }
+}
+
+/**
+ * Prüft ob ein Feld gesendet werden muss
+ *
+ * @param r Zuletzt gesendeter Stand
+ * @param data Aktuelle Messung
+ * @param field Feld
+ * @param now Aktueller millis()-Wert
+ * @return true bei Änderung über das Totband, fälligem Lebenszeichen oder noch nie gesendet
+ */
+bool fieldMoved(const ReportedValues& r, const BMSData& data, BmsField field, unsigned long now) {
+  if (r.at[field] == 0 || now - r.at[field] >= reportHeartbeat * 1000) return true;
+  int32_t band = bmsFieldDeadband(field);
+  if (field == FIELD_CELL_VOLTAGES) {
+    if (data.cellCount != r.cellCount) return true;
+    for (uint8_t i = 0; i < data.cellCount; i++) {
+      if (abs((int32_t)data.cellMv[i] - (int32_t)r.cellMv[i]) >= band) return true;
+    }
+    return false;
+  }
+  return abs(bmsFieldKey(data, field) - r.keys[field]) >= band;
+}
+
+/**
+ * Merkt ein Feld als gesendet
+ */
+void markReported(ReportedValues& r, const BMSData& data, BmsField field, unsigned long now) {
+  r.at[field] = now;
+  if (field == FIELD_CELL_VOLTAGES) {
+    r.cellCount = data.cellCount;
+    r.cellMv = data.cellMv;
+  } else {
+    r.keys[field] = bmsFieldKey(data, field);
+  }
+}
+
+/**
+ * Prüft ob mindestens ein Feld gesendet werden muss
+ */
+bool anyFieldMoved(const ReportedValues& r, const BMSData& data, unsigned long now) {
+  for (uint8_t f = 0; f < FIELD_COUNT; f++) {
+    if (fieldMoved(r, data, (BmsField)f, now)) return true;
+  }
+  return false;
+}
+
+// Zuletzt per Webhook gesendeter Stand (nur Cloud-Task)
+ReportedValues haReported;
+
+// Zuletzt per MQTT veröffentlichter Stand (nur loop())
+ReportedValues mqttReported;
+
+// ============================================================================
+// Home Assistant Webhook
+// ============================================================================
+
+/**
+ * Zerlegt die Webhook-URL in Host, Port und Protokoll
+ *
+ * Nur bei geänderter URL: bestehende Verbindungen werden dann getrennt,
+ * damit keine Keep-Alive-Verbindung zum alten Host wiederverwendet wird.
+ *
+ * @param url Aktuelle Webhook-URL
+ */
+void haUpdateConnectionInfo(const String& url) {
+  if (url == haConnUrl) {
+    return;
+  }
+  haConnUrl = url;
+  haPlainClient.stop();
+  haSecureClient.stop();
+  haHostResolvedAt = 0;
+
+  String rest = url;
+  haHttps = rest.startsWith("https://");
+  int schemeEnd = rest.indexOf("://");
+  if (schemeEnd >= 0) rest = rest.substring(schemeEnd + 3);
+  int pathStart = rest.indexOf('/');
+  String hostPort = pathStart >= 0 ? rest.substring(0, pathStart) : rest;
+  int colon = hostPort.indexOf(':');
+  if (colon >= 0) {
+    haHost = hostPort.substring(0, colon);
+    haPort = hostPort.substring(colon + 1).toInt();
+  } else {
+    haHost = hostPort;
+    haPort = haHttps ? 443 : 80;
+  }
+
+  // Zertifikat wird nicht geprüft (wie bisher bei http.begin(url) ohne CA)
+  haSecureClient.setInsecure();
+  haSecureClient.setHandshakeTimeout(HA_TLS_HANDSHAKE_S);
+}
+
+/**
+ * Liefert den Transport-Client passend zum Protokoll der Webhook-URL
+ */
+WiFiClient& haTransport() {
+  return haHttps ? static_cast<WiFiClient&>(haSecureClient) : haPlainClient;
+}
+
+/**
+ * Baut die TCP-Verbindung zum Webhook-Host über die gecachte IP auf
+ *
+ * Nur für http: Die DNS-Auflösung wird HA_DNS_CACHE_MS lang wiederverwendet.
+ * HTTPClient erkennt die bestehende Verbindung und sendet den Host-Header
+ * trotzdem mit dem Hostnamen. Bei https (SNI/Zertifikat) und bei Fehlern
+ * baut HTTPClient die Verbindung selbst über den Hostnamen auf.
+ */
+void haConnect() {
+  if (haHttps || haPlainClient.connected()) {
+    return;
+  }
+
+  unsigned long now = millis();
+  if (haHostResolvedAt == 0 || now - haHostResolvedAt > HA_DNS_CACHE_MS) {
+    if (!WiFi.hostByName(haHost.c_str(), haHostIp)) {
+      haHostResolvedAt = 0;
+      return;
+    }
+    haHostResolvedAt = now;
+  }
+
+  if (!haPlainClient.connect(haHostIp, haPort, 5000)) {
+    // IP evtl. veraltet: beim nächsten Mal neu auflösen
+    haHostResolvedAt = 0;
+  }
+}
+
+/**
+ * Setzt JSON ohne Zwischendokument nach MessagePack um
+ *
+ * Liest die Ausgabe von JsonWriter (Objekte, Arrays, Strings, Zahlen,
+ * true/false/null) in einem Durchgang. Anzahlen von Objekten und Arrays
+ * werden nachgetragen, kleine Container danach auf die kompakte Form
+ * (fixmap/fixarray) verkürzt. Ganzzahlen werden als kleinster passender
+ * Integer kodiert, Dezimalzahlen mit bis zu 7 Stellen als float32.
+ */
+struct MsgPackTranscoder {
+  const char* in;
+  const char* end;
+  uint8_t* out;
+  size_t capacity;
+  size_t pos = 0;
+  bool ok = true;
+
+  void put(uint8_t b) {
+    if (pos < capacity) out[pos++] = b;
+    else ok = false;
+  }
+
+  void putBig(uint64_t value, uint8_t bytes) {
+    for (int i = bytes - 1; i >= 0; i--) put((uint8_t)(value >> (8 * i)));
+  }
+
+  void skipSpace() {
+    while (in < end && (*in == ' ' || *in == '\n' || *in == '\r' || *in == '\t')) in++;
+  }
+
+  /**
+   * Liest eine \uXXXX-Folge (in zeigt auf das erste Hex-Zeichen)
+   */
+  uint16_t hex4() {
+    uint16_t value = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+      char c = (in < end) ? *in++ : '0';
+      value = (value << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10) & 0x0F);
+    }
+    return value;
+  }
+
+  /**
+   * Dekodiert einen String ab dem öffnenden Anführungszeichen
+   *
+   * @param write false = nur die Länge ermitteln
+   * @return Länge in Bytes (UTF-8)
+   */
+  size_t string(bool write) {
+    const char* start = in;
+    size_t length = 0;
+    in++;
+    while (in < end && *in != '"') {
+      uint16_t c = (uint8_t)*in++;
+      if (c == '\\' && in < end) {
+        char e = *in++;
+        switch (e) {
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'u': c = hex4(); break;
+          default:  c = (uint8_t)e; break;
+        }
+        if (e == 'u' && c >= 0x80) {
+          // Als UTF-8 ausgeben (Ersatzpaare werden nicht zusammengesetzt)
+          uint8_t utf8[3];
+          uint8_t n = (c < 0x800) ? 2 : 3;
+          if (n == 2) { utf8[0] = 0xC0 | (c >> 6); utf8[1] = 0x80 | (c & 0x3F); }
+          else { utf8[0] = 0xE0 | (c >> 12); utf8[1] = 0x80 | ((c >> 6) & 0x3F); utf8[2] = 0x80 | (c & 0x3F); }
+          for (uint8_t i = 0; i < n && write; i++) put(utf8[i]);
+          length += n;
+          continue;
+        }
+      }
+      if (write) put((uint8_t)c);
+      length++;
+    }
+    if (in < end) in++;  // Schließendes Anführungszeichen
+    else ok = false;
+    if (!write) in = start;
+    return length;
+  }
+
+  void writeString() {
+    size_t length = string(false);
+    if (length < 32) put(0xA0 | length);
+    else if (length < 0x100) { put(0xD9); putBig(length, 1); }
+    else if (length < 0x10000) { put(0xDA); putBig(length, 2); }
+    else { put(0xDB); putBig(length, 4); }
+    string(true);
+  }
+
+  void writeNumber() {
+    const char* start = in;
+    bool decimal = false;
+    uint8_t digits = 0;
+    while (in < end && (isdigit(*in) || *in == '-' || *in == '+' || *in == '.' || *in == 'e' || *in == 'E')) {
+      if (*in == '.' || *in == 'e' || *in == 'E') decimal = true;
+      if (isdigit(*in)) digits++;
+      in++;
+    }
+    char text[32];
+    size_t n = min((size_t)(in - start), sizeof(text) - 1);
+    memcpy(text, start, n);
+    text[n] = '\0';
+
+    if (decimal) {
+      double value = strtod(text, nullptr);
+      if (digits <= 7) {
+        float f = (float)value;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        put(0xCA);
+        putBig(bits, 4);
+      } else {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put(0xCB);
+        putBig(bits, 8);
+      }
+    } else if (text[0] == '-') {
+      int64_t value = strtoll(text, nullptr, 10);
+      if (value >= -32) put((uint8_t)(int8_t)value);
+      else if (value >= INT8_MIN) { put(0xD0); putBig((uint8_t)value, 1); }
+      else if (value >= INT16_MIN) { put(0xD1); putBig((uint16_t)value, 2); }
+      else if (value >= INT32_MIN) { put(0xD2); putBig((uint32_t)value, 4); }
+      else { put(0xD3); putBig((uint64_t)value, 8); }
+    } else {
+      uint64_t value = strtoull(text, nullptr, 10);
+      if (value < 0x80) put((uint8_t)value);
+      else if (value < 0x100) { put(0xCC); putBig(value, 1); }
+      else if (value < 0x10000) { put(0xCD); putBig(value, 2); }
+      else if (value < 0x100000000ULL) { put(0xCE); putBig(value, 4); }
+      else { put(0xCF); putBig(value, 8); }
+    }
+  }
+
+  /**
+   * Objekt oder Array: Kopf mit 16-Bit-Anzahl, nach dem Inhalt nachgetragen
+   */
+  void writeContainer(bool object, uint8_t depth) {
+    char close = object ? '}' : ']';
+    size_t header = pos;
+    put(object ? 0xDE : 0xDC);
+    putBig(0, 2);
+    in++;
+    uint32_t count = 0;
+    skipSpace();
+    while (ok && in < end && *in != close) {
+      if (object) {
+        skipSpace();
+        if (in >= end || *in != '"') { ok = false; return; }
+        writeString();
+        skipSpace();
+        if (in >= end || *in != ':') { ok = false; return; }
+        in++;
+      }
+      value(depth + 1);
+      count++;
+      skipSpace();
+      if (in < end && *in == ',') in++;
+      skipSpace();
+    }
+    if (in >= end || count > 0xFFFF) { ok = false; return; }
+    in++;
+    if (!ok) return;
+    if (count < 16) {
+      // Kompakte Form: Inhalt um die zwei Anzahl-Bytes nach vorn schieben
+      memmove(out + header + 1, out + header + 3, pos - header - 3);
+      pos -= 2;
+      out[header] = (object ? 0x80 : 0x90) | count;
+    } else {
+      out[header + 1] = count >> 8;
+      out[header + 2] = count & 0xFF;
+    }
+  }
+
+  void value(uint8_t depth) {
+    skipSpace();
+    if (in >= end || depth > 16) { ok = false; return; }
+    char c = *in;
+    if (c == '{' || c == '[') writeContainer(c == '{', depth);
+    else if (c == '"') writeString();
+    else if (c == '-' || isdigit(c)) writeNumber();
+    else if (end - in >= 4 && strncmp(in, "true", 4) == 0) { put(0xC3); in += 4; }
+    else if (end - in >= 5 && strncmp(in, "false", 5) == 0) { put(0xC2); in += 5; }
+    else if (end - in >= 4 && strncmp(in, "null", 4) == 0) { put(0xC0); in += 4; }
+    else ok = false;
+  }
+};
+
+/**
+ * Zu sendender Webhook-Body (JSON oder MessagePack)
+ */
+struct HaBody {
+  const uint8_t* data;
+  size_t length;
+  bool msgpack;
+};
+
+/**
+ * Bereitet einen JSON-Payload für haPost() vor
+ *
+ * Mit haMsgPack wird der Payload einmal nach MessagePack in haPacked
+ * umgesetzt (gleiche Struktur, ohne Heap). Eine Wiederholung nach
+ * geschlossener Keep-Alive-Verbindung sendet dasselbe Ergebnis erneut.
+ * Passt das Ergebnis nicht in haPacked, geht der Payload als JSON raus.
+ *
+ * @param json JSON-Payload (muss bis zum Senden gültig bleiben)
+ * @param length Länge des Payloads
+ * @return Body für haPost()
+ */
+HaBody haEncodeBody(const char* json, size_t length) {
+  lastHaJsonBytes = length;
+  HaBody body = { (const uint8_t*)json, length, false };
+  if (haMsgPack) {
+    MsgPackTranscoder packer{ json, json + length, haPacked, sizeof(haPacked) };
+    packer.value(0);
+    if (packer.ok) {
+      body = { haPacked, packer.pos, true };
+    }
+  }
+  lastHaBytes = body.length;
+  return body;
+}
+
+/**
+ * Sendet einen Payload per POST über die Keep-Alive-Verbindung
+ *
+ * @param url Webhook-URL
+ * @param body Vorbereiteter Body (siehe haEncodeBody())
+ * @return HTTP-Statuscode bzw. negativer HTTPClient-Fehlercode
+ */
+int haPost(const String& url, const HaBody& body) {
+  haHttp.begin(haTransport(), url);
+  haHttp.setReuse(true);           // Keep-Alive: Verbindung nach der Antwort offen halten
+  haHttp.setTimeout(10000);        // Gesamttimeout: 10 Sekunden
+  haHttp.setConnectTimeout(5000);  // Verbindungsaufbau: 5 Sekunden
+  haHttp.addHeader("Content-Type", body.msgpack ? "application/msgpack" : "application/json");
+  return haHttp.POST((uint8_t*)body.data, body.length);
+}
+
+/**
+ * Speichert das Ergebnis eines Webhook-Versuchs für die Anzeige
+ *
+ * @param httpCode HTTP-Statuscode bzw. negativer Fehlercode
+ * @param response Antwort- oder Fehlertext (wird auf 200 Zeichen gekürzt)
+ */
+void setHaResult(int httpCode, const char* response) {
+  String now = getCurrentTimeString();
+  xSemaphoreTake(haMutex, portMAX_DELAY);
+  strlcpy(lastHaTime, now.c_str(), sizeof(lastHaTime));
+  lastHaHttpCode = httpCode;
+  strlcpy(lastHaResponse, response, HA_RESPONSE_LEN + 1);
+  if (strlen(response) > HA_RESPONSE_LEN) {
+    strlcat(lastHaResponse, "...", sizeof(lastHaResponse));
+  }
+  xSemaphoreGive(haMutex);
+}
+
+// Sammel- bzw. Nachholmessungen einer Sendung (nur Cloud-Task, wie haPayload)
+HistorySample haSamples[HA_BATCH_MAX_SAMPLES];
+
+/**
+ * Sammelmodus: legt noch nicht gesendete Messungen im Zwischenspeicher ab
+ *
+ * @param keep Anzahl der neuesten Messungen, die für die nächste Sendung
+ *             im Ringpuffer bleiben (0 = alle ablegen)
+ */
+void spoolBatchSamples(size_t keep) {
+  HistorySample chunk[SPOOL_WRITE_BATCH];
+  // Bereits überschriebene Einträge überspringen (liest 0 Einträge, setzt nur den Cursor)
+  readHistorySince(haBatchCursor, chunk, 0);
+  for (;;) {
+    xSemaphoreTake(historyMutex, portMAX_DELAY);
+    uint32_t unsent = historyTotal - haBatchCursor;
+    xSemaphoreGive(historyMutex);
+    if (unsent <= keep) {
+      break;
+    }
+    size_t count = readHistorySince(haBatchCursor, chunk, min((size_t)SPOOL_WRITE_BATCH, (size_t)(unsent - keep)));
+    for (size_t i = 0; i < count; i++) {
+      webhookSpool.append(toUnixTime(chunk[i]));
+    }
+  }
+}
+
+/**
+ * Sendet alle BMS-Daten als JSON an den Home Assistant Webhook
+ *
+ * Im Sammelmodus werden zusätzlich alle Messungen seit der letzten
+ * erfolgreichen Sendung als "samples" mitgesendet (siehe writeSampleRows()).
+ *
+ * Prüft vor dem Senden:
+ * - Ob Webhook aktiviert ist
+ * - Ob eine URL konfiguriert ist
+ * - Ob WLAN verbunden ist
+ * - Ob BMS-Daten plausibel sind
+ *
+ * Läuft im Cloud-Task, nie in loop() - ein langsamer oder nicht erreichbarer
+ * Server blockiert damit weder Webserver noch LED.
+ *
+ * @param force true = auch senden wenn der Webhook deaktiviert ist (Test)
+ * @param alarm true = ausgelöst durch einen Alarmwechsel ("alarm_event")
+ * @return true wenn erfolgreich gesendet, sonst false
+ */
+bool sendToHomeAssistant(bool force, bool alarm = false) {
+  // URL-Kopie: der Webserver kann die Einstellung währenddessen ändern
+  xSemaphoreTake(haMutex, portMAX_DELAY);
+  String url = haWebhookUrl;
+  xSemaphoreGive(haMutex);
+
+  // Prüfen ob Webhook überhaupt senden soll
+  if ((!haEnabled && !force) || url.length() == 0 || apMode) {
+    return false;
+  }
+
+  // WLAN-Verbindung prüfen
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("[HA] Kein WLAN - überspringe Webhook");
+    setHaResult(-1, "Kein WLAN");
+    return false;
+  }
+
+  // Daten-Plausibilität prüfen
+  if (!bmsDataValid) {
+    Serial.println("[HA] BMS-Daten nicht plausibel - überspringe Webhook");
+    setHaResult(-1, "BMS-Daten nicht plausibel");
+    return false;
+  }
+
+  // Konsistente Kopie der BMS-Daten für den gesamten Payload
+  BMSData data;
+  getBMSSnapshot(data);
+
+  // Sammelmodus: Messungen seit der letzten Sendung mitsenden, was nicht
+  // in eine Sendung passt geht vorher in den Zwischenspeicher
+  uint32_t batchEnd = haBatchCursor;
+  size_t batchCount = 0;
+  if (haBatchMode && !force) {
+    spoolBatchSamples(HA_BATCH_MAX_SAMPLES);
+    batchEnd = haBatchCursor;
+    batchCount = readHistorySince(batchEnd, haSamples, HA_BATCH_MAX_SAMPLES);
+    for (size_t i = 0; i < batchCount; i++) {
+      haSamples[i] = toUnixTime(haSamples[i]);
+    }
+  }
+
+  // JSON direkt in den Puffer schreiben (festes Schema, kein JsonDocument)
+  const char* body = haPayload;
+  JsonWriter json(haPayload, sizeof(haPayload));
+  json.beginObject();
+  json.addString("device", "litime-bms");
+  json.addString("mac", macAddress);
+  json.addString("timestamp", getCurrentTimeString());
+  json.addBool("connected", bmsConnected);
+
+  // Alarmregeln: aktive Alarme (Pack 0) und ob diese Sendung ein Alarmwechsel ist
+  if (alarmEnabled) {
+    writeAlarmNames(json, "alarms", bmsSlots[0].alarmFlags);
+    json.addBool("alarm_event", alarm);
+  }
+
+  // Batterie-Daten als Unterobjekt
+  json.beginObject("battery");
+  json.addFixed("voltage", data.totalMv, 3);
+  json.addFixed("current", data.currentMa, 3);
+  json.addUInt("soc", data.soc);
+  json.addString("soh", data.soh());
+  json.addFixed("remaining_ah", data.remainingMah, 3);
+  json.addFixed("full_capacity_ah", data.fullCapacityMah, 3);
+  json.endObject();
+
+  // Temperaturen als Unterobjekt
+  json.beginObject("temperature");
+  json.addInt("mosfet", data.mosfetTemp);
+  json.addInt("cells", data.cellTemp);
+  json.endObject();
+
+  // Status-Informationen als Unterobjekt
+  json.beginObject("status");
+  json.addString("battery_state", data.batteryState());
+  json.addString("protection_state", data.protectionState());
+  json.addString("failure_state", data.failureState());
+  json.addString("heat_state", data.heatState());
+  json.endObject();
+
+  // Zellspannungen als Array
+  json.beginArray("cell_voltages");
+  for (size_t i = 0; i < data.cellCount; i++) {
+    json.addFixed(nullptr, data.cellMv[i], 3);
+  }
+  json.endArray();
+
+  // Statistiken als Unterobjekt
+  json.beginObject("statistics");
+  json.addUInt("discharge_cycles", data.dischargesCount);
+  json.addFixed("discharged_ah", data.dischargesMah, 3);
+  json.endObject();
+
+  // Abgeleitete Werte (Zellabweichung, Leistung, Energie, Restzeit)
+  BmsAnalytics analytics;
+  getPackAnalytics(0, analytics);
+  writeAnalyticsJson(json, "analytics", analytics, true);
+
+  // Weitere Packs: Kurzfassung je Pack (oberste Ebene bleibt Pack 0)
+  uint8_t packCount = bmsPackCount();
+  if (packCount > 1) {
+    json.beginArray("packs");
+    for (uint8_t i = 0; i < packCount; i++) {
+      BMSData pack;
+      bool valid = false;
+      uint32_t seq = getPackSnapshot(i, pack, &valid);
+      json.beginObject();
+      json.addUInt("pack", i);
+      json.addString("mac", bmsSlots[i].mac);
+      json.addBool("connected", bmsSlots[i].online);
+      json.addBool("valid", valid && seq > 0);
+      if (alarmEnabled) writeAlarmNames(json, "alarms", bmsSlots[i].alarmFlags);
+      if (seq > 0) {
+        json.addFixed("voltage", pack.totalMv, 3);
+        json.addFixed("current", pack.currentMa, 3);
+        json.addUInt("soc", pack.soc);
+        json.addFixed("remaining_ah", pack.remainingMah, 3);
+        json.addInt("cell_temp", pack.cellTemp);
+        json.addString("protection_state", pack.protectionState());
+        json.beginArray("cell_voltages");
+        for (size_t c = 0; c < pack.cellCount; c++) {
+          json.addFixed(nullptr, pack.cellMv[c], 3);
+        }
+        json.endArray();
+        getPackAnalytics(i, analytics);
+        writeAnalyticsJson(json, "analytics", analytics, true);
+      }
+      json.endObject();
+    }
+    json.endArray();
+  }
+
+  if (batchCount > 0) {
+    writeSampleRows(json, haSamples, batchCount);
+  }
+  json.endObject();
+
+  size_t length = json.length();
+  if (length == 0) {
+    Serial.println("[HA] Payload zu groß - überspringe Webhook");
+    setHaResult(-1, "Payload zu groß");
+    return false;
+  }
+
+  // Bestehende Keep-Alive-Verbindung nutzen, sonst über gecachte IP verbinden
+  unsigned long start = millis();
+  haUpdateConnectionInfo(url);
+  bool reused = haTransport().connected();
+  if (!reused) {
+    haConnect();
+  }
+
+  // Watchdog zwischen den Schritten zurücksetzen (Verbindungsaufbau, POST
+  // und Antwort können jeweils in ihren Timeout laufen, siehe cloudTask())
+  esp_task_wdt_reset();
+  HaBody encoded = haEncodeBody(body, length);
+  int httpCode = haPost(url, encoded);
+  esp_task_wdt_reset();
+
+  // Server hat die Keep-Alive-Verbindung inzwischen geschlossen: einmal neu verbinden
+  if (httpCode < 0 && reused) {
+    Serial.println("[HA] Keep-Alive-Verbindung geschlossen, verbinde neu");
+    haHttp.end();
+    haTransport().stop();
+    haConnect();
+    esp_task_wdt_reset();
+    httpCode = haPost(url, encoded);
+    esp_task_wdt_reset();
+  }
+
+  // Antwort bzw. Fehlertext für Anzeige im Webinterface speichern
+  String response;
+  if (httpCode > 0) {
+    // Erfolgreiche Antwort (auch Fehler wie 404 etc.)
+    response = haHttp.getString();
+  } else {
+    // Negative Codes sind Verbindungsfehler
+    switch (httpCode) {
+      case -1: response = "Verbindung fehlgeschlagen"; break;
+      case -2: response = "Senden fehlgeschlagen"; break;
+      case -3: response = "Kein Stream"; break;
+      case -4: response = "Keine HTTP-Verbindung"; break;
+      case -5: response = "Verbindung verloren"; break;
+      case -11: response = "Timeout"; break;
+      default: response = "Fehler " + String(httpCode);
+    }
+  }
+  setHaResult(httpCode, response.c_str());
+  esp_task_wdt_reset();
+
+  // Bei Keep-Alive bleibt die TCP-Verbindung offen, nur der Request-Zustand wird zurückgesetzt
+  haHttp.end();
+  if (httpCode < 0) {
+    haTransport().stop();
+  }
+  lastHaDuration = millis() - start;
+  haLatencyHistogram.observe(lastHaDuration);
+  // Ergebnis nach Statusklasse zählen (2xx-5xx, sonst Verbindungsfehler)
+  haResultCounts[(httpCode >= 200 && httpCode < 600) ? httpCode / 100 - 2 : 4]++;
+
+  // Erfolg loggen, Fehlversuche zählen (Backoff)
+  if (httpCode == 200) {
+    haFailCount = 0;
+    haBatchCursor = batchEnd;  // Mitgesendete Messungen gelten als zugestellt
+    unsigned long now = millis();
+    for (uint8_t f = 0; f < FIELD_COUNT; f++) {
+      markReported(haReported, data, (BmsField)f, now);
+    }
+    Serial.printf("[HA] Daten erfolgreich gesendet (%lu ms%s", (unsigned long)lastHaDuration, reused ? ", Verbindung wiederverwendet" : "");
+    if (batchCount > 0) {
+      Serial.printf(", %u Messungen", (unsigned)batchCount);
+    }
+    Serial.println(")");
+    return true;
+  } else {
+    if (haFailCount < 255) haFailCount++;
+    Serial.printf("[HA] Fehler: HTTP %d - %s\n", httpCode, response.c_str());
+    return false;
+  }
+}
+
+/**
+ * Legt die aktuelle Messung im Webhook-Zwischenspeicher ab
+ *
+ * Jede Messung wird höchstens einmal abgelegt (z.B. wenn das BMS getrennt
+ * ist und sich der Datensatz zwischen zwei Intervallen nicht ändert).
+ * Im Sammelmodus werden alle noch nicht gesendeten Messungen abgelegt.
+ */
+void spoolWebhookSample() {
+  if (!haEnabled) {
+    return;
+  }
+  // Sammelmodus: alle seit der letzten Sendung aufgezeichneten Messungen
+  if (haBatchMode) {
+    spoolBatchSamples(0);
+    return;
+  }
+
+  static uint32_t spooledSeq = 0;
+  BMSData data;
+  uint32_t seq = getBMSSnapshot(data);
+  if (seq == 0 || seq == spooledSeq || !bmsDataValid) {
+    return;
+  }
+  spooledSeq = seq;
+  webhookSpool.append(makeSpoolSample(data));
+}
+
+/**
+ * Sendet zwischengespeicherte Messungen blockweise an den Webhook
+ *
+ * Wird nach einer erfolgreichen Sendung aufgerufen, die Verbindung steht
+ * also bereits. Pro Aufruf höchstens SPOOL_REPLAY_MAX_BATCHES Blöcke, damit
+ * der Cloud-Task nach langen Ausfällen nicht minutenlang belegt ist.
+ * Ein Block wird erst nach HTTP 200 aus dem Zwischenspeicher entfernt.
+ */
+void replayWebhookBacklog() {
+  if (webhookSpool.pending() == 0) {
+    return;
+  }
+
+  xSemaphoreTake(haMutex, portMAX_DELAY);
+  String url = haWebhookUrl;
+  xSemaphoreGive(haMutex);
+
+  // Puffer des Cloud-Tasks wiederverwenden (die reguläre Sendung ist abgeschlossen)
+  static_assert(SPOOL_REPLAY_BATCH <= HA_BATCH_MAX_SAMPLES, "haSamples zu klein für einen Nachholblock");
+  static_assert(SPOOL_PAYLOAD_SIZE <= HA_PAYLOAD_SIZE, "haPayload zu klein für einen Nachholblock");
+  char* payload = haPayload;
+  HistorySample* batch = haSamples;
+
+  size_t sent = 0;
+  for (int b = 0; b < SPOOL_REPLAY_MAX_BATCHES; b++) {
+    esp_task_wdt_reset();
+    size_t count = webhookSpool.peek(batch, SPOOL_REPLAY_BATCH);
+    if (count == 0) {
+      break;
+    }
+    size_t length = buildBacklogPayload(batch, count, payload, SPOOL_PAYLOAD_SIZE);
+    if (length == 0) {
+      // Kann bei festem Format nicht passieren - Block verwerfen statt festhängen
+      webhookSpool.consume(count);
+      continue;
+    }
+
+    int httpCode = haPost(url, haEncodeBody(payload, length));
+    haHttp.end();
+    if (httpCode != 200) {
+      if (httpCode < 0) {
+        haTransport().stop();
+      }
+      Serial.printf("[HA] Nachholen abgebrochen: HTTP %d\n", httpCode);
+      break;
+    }
+    webhookSpool.consume(count);
+    sent += count;
+  }
+
+  if (sent > 0) {
+    Serial.printf("[HA] %u Messungen nachgeholt, %lu ausstehend\n", (unsigned)sent, (unsigned long)webhookSpool.pending());
+  }
+}
+
+// ============================================================================
+// Cloud-Task
+// ============================================================================
+// Der Webhook-Versand läuft in einem eigenen Task. loop() legt im Intervall
+// Aufträge in die Warteschlange; ist noch eine Sendung offen, wird das
+// Intervall übersprungen statt Aufträge anzuhäufen. Kann nicht gesendet
+// werden (kein WLAN, Server-Fehler, Backoff), landet die Messung im
+// Zwischenspeicher und wird nach der nächsten erfolgreichen Sendung nachgeholt.
+
+/**
+ * Wartezeit bis zum nächsten periodischen Webhook
+ *
+ * Nach Fehlversuchen verdoppelt sich das Intervall je Fehler
+ * (exponentieller Backoff), gedeckelt bei HA_BACKOFF_MAX_MS.
+ *
+ * @return Wartezeit in ms
+ */
+unsigned long getHaSendDelay() {
+  unsigned long interval = haInterval * 1000;
+  uint8_t failures = haFailCount;
+  if (failures == 0) {
+    return interval;
+  }
+  unsigned long backoff = interval << min((int)failures, 6);
+  return max(interval, min(backoff, (unsigned long)HA_BACKOFF_MAX_MS));
+}
+
+/**
+ * Prüft mit Totband ob der reguläre Webhook gesendet werden muss
+ *
+ * @return true ohne Totband, ohne plausible Messung (Fehler wird gemeldet)
+ *         oder wenn ein Wert das Totband bzw. das Lebenszeichen überschritten hat
+ */
+bool webhookDue() {
+  if (!reportDeadband || !bmsDataValid) return true;
+  BMSData data;
+  getBMSSnapshot(data);
+  return anyFieldMoved(haReported, data, millis());
+}
+
+/**
+ * Legt einen Webhook-Auftrag in die Warteschlange (blockiert nie)
+ *
+ * @param manual true = Test über das Webinterface
+ * @param alarm true = Alarmwechsel (sofort, ohne Backoff)
+ * @return true wenn der Auftrag angenommen wurde
+ */
+bool queueCloudJob(bool manual, bool alarm = false) {
+  CloudJob job = { manual, alarm, false };
+  return xQueueSend(cloudQueue, &job, 0) == pdTRUE;
+}
+
+/**
+ * Hält den Cloud-Task vor dem Deep Sleep an (aus loop() aufrufen)
+ *
+ * Der Stop-Auftrag wird nach den wartenden Aufträgen ausgeführt: der Task
+ * schreibt den Webhook-Zwischenspeicher (er bleibt alleiniger Nutzer) und
+ * hält dann an. Gewartet wird in Schritten, damit der Watchdog von loop()
+ * nicht auslöst.
+ *
+ * @return true wenn der Task angehalten hat (Zwischenspeicher geschrieben)
+ */
+bool stopCloudTask() {
+  if (!cloudTaskHandle) return true;
+  CloudJob job = { false, false, true };
+  unsigned long start = millis();
+  while (xQueueSend(cloudQueue, &job, pdMS_TO_TICKS(500)) != pdTRUE) {
+    esp_task_wdt_reset();
+    if (millis() - start >= CLOUD_STOP_TIMEOUT_MS) return false;
+  }
+  while (xSemaphoreTake(cloudStopped, pdMS_TO_TICKS(500)) != pdTRUE) {
+    esp_task_wdt_reset();
+    if (millis() - start >= CLOUD_STOP_TIMEOUT_MS) return false;
+  }
+  return true;
+}
+
+/**
+ * Cloud-Task: arbeitet Webhook-Aufträge nacheinander ab
+ *
+ * @param parameter Nicht verwendet
+ */
+void cloudTask(void* parameter) {
+  // Eigener Watchdog-Eintrag. Eine Sendung mit Wiederholung kann über eine
+  // Minute dauern: je Versuch DNS (bis ~4 s) und Verbindungsaufbau (5 s,
+  // https zusätzlich Handshake bis HA_TLS_HANDSHAKE_S) plus 10 s Timeout,
+  // danach das Lesen der Antwort (10 s). sendToHomeAssistant() setzt den
+  // Watchdog zwischen diesen Schritten zurück, einzeln bleibt jeder unter
+  // WDT_TIMEOUT (höchstens ~25 s).
+  esp_task_wdt_add(NULL);
+
+  for (;;) {
+    esp_task_wdt_reset();
+
+    CloudJob job;
+    if (xQueueReceive(cloudQueue, &job, pdMS_TO_TICKS(1000)) != pdTRUE) {
+      continue;
+    }
+
+    if (job.stop) {
+      // Vor dem Deep Sleep: Zwischenspeicher schreiben und nicht mehr senden
+      if (spoolAvailable) webhookSpool.flush();
+      esp_task_wdt_delete(NULL);
+      xSemaphoreGive(cloudStopped);
+      vTaskSuspend(NULL);
+    }
+
+    cloudBusy = true;
+    if (haBatchRestart) {
+      // Sammelmodus neu eingeschaltet: erst ab der nächsten Messung sammeln
+      haBatchRestart = false;
+      xSemaphoreTake(historyMutex, portMAX_DELAY);
+      haBatchCursor = historyTotal;
+      xSemaphoreGive(historyMutex);
+    }
+    int64_t perfStart = esp_timer_get_time();
+    if (job.manual) {
+      logCrashLocation("!cloud:ha_webhook_start");
+      sendToHomeAssistant(true);
+      perfLap(PERF_CLOUD_WEBHOOK, perfStart);
+      logCrashLocation("cloud:ha_webhook_done");
+    } else if (!job.alarm && lastHaAttempt != 0 && millis() - lastHaAttempt < getHaSendDelay()) {
+      // Backoff nach Fehlversuchen: nicht senden, nur zwischenspeichern
+      spoolWebhookSample();
+    } else if (!job.alarm && haFailCount == 0 && !webhookDue()) {
+      // Totband: seit der letzten Sendung hat sich nichts nennenswert bewegt
+      haDeadbandSkips++;
+    } else {
+      lastHaAttempt = millis();
+      logCrashLocation("!cloud:ha_webhook_start");
+      bool sent = sendToHomeAssistant(false, job.alarm);
+      perfStart = perfLap(PERF_CLOUD_WEBHOOK, perfStart);
+      logCrashLocation("cloud:ha_webhook_done");
+      if (sent) {
+        logCrashLocation("!cloud:ha_replay_start");
+        replayWebhookBacklog();
+        perfLap(PERF_CLOUD_REPLAY, perfStart);
+        logCrashLocation("cloud:ha_replay_done");
+      } else {
+        spoolWebhookSample();
+      }
+    }
+    cloudBusy = false;
+  }
+}
+
+/**
+ * Legt Mutex und Warteschlange an und startet den Cloud-Task
+ */
+void startCloudTask() {
+  haMutex = xSemaphoreCreateMutex();
+  cloudQueue = xQueueCreate(CLOUD_QUEUE_LENGTH, sizeof(CloudJob));
+  cloudStopped = xSemaphoreCreateBinary();
+  xTaskCreate(cloudTask, "cloud", CLOUD_TASK_STACK_SIZE, nullptr, CLOUD_TASK_PRIORITY, &cloudTaskHandle);
+}
+
+// ============================================================================
+// MQTT
+// ============================================================================
+// Persistente Broker-Verbindung als Alternative zum HTTP-Webhook. Jeder
+// Messwert hat ein eigenes Topic unter <basis>/..., die Verfügbarkeit wird
+// per Last Will unter <basis>/status gemeldet ("online"/"offline").
+// Pro neuer Messung werden nur die Felder veröffentlicht, die sich seit der
+// letzten veröffentlichten Messung geändert haben (nach dem Verbinden alle).
+
+/**
+ * Metadaten eines MQTT-Messwerts (Topic und Home Assistant Discovery)
+ */
+struct MqttMetric {
+  BmsField field;           // Feld im BMS-Datensatz
+  const char* topic;        // Topic-Suffix unter dem Basis-Topic
+  const char* name;         // Anzeigename in Home Assistant
+  const char* unit;         // Einheit (nullptr = keine)
+  const char* deviceClass;  // HA device_class (nullptr = keine)
+  const char* stateClass;   // HA state_class (nullptr = Text-Sensor)
+};
+
+const MqttMetric MQTT_METRICS[] = {
+  { FIELD_TOTAL_VOLTAGE,    "voltage",          "Spannung",               "V",  "voltage",     "measurement" },
+  { FIELD_CELL_VOLTAGE_SUM, "cell_voltage_sum", "Zellspannungssumme",     "V",  "voltage",     "measurement" },
+  { FIELD_CURRENT,          "current",          "Strom",                  "A",  "current",     "measurement" },
+  { FIELD_MOSFET_TEMP,      "mosfet_temp",      "MOSFET Temperatur",      "°C", "temperature", "measurement" },
+  { FIELD_CELL_TEMP,        "cell_temp",        "Zellen Temperatur",      "°C", "temperature", "measurement" },
+  { FIELD_SOC,              "soc",              "Ladezustand",            "%",  "battery",     "measurement" },
+  { FIELD_SOH,              "soh",              "SOH",                    nullptr, nullptr,    nullptr },
+  { FIELD_REMAINING_AH,     "remaining_ah",     "Verbleibende Kapazität", "Ah", nullptr,       "measurement" },
+  { FIELD_FULL_CAPACITY_AH, "full_capacity_ah", "Volle Kapazität",        "Ah", nullptr,       "measurement" },
+  { FIELD_PROTECTION_STATE, "protection_state", "Schutzstatus",           nullptr, nullptr,    nullptr },
+  { FIELD_HEAT_STATE,       "heat_state",       "Heizung",                nullptr, nullptr,    nullptr },
+  { FIELD_FAILURE_STATE,    "failure_state",    "Fehlerstatus",           nullptr, nullptr,    nullptr },
+  { FIELD_BALANCING_STATE,  "balancing_state",  "Balancing",              nullptr, nullptr,    nullptr },
+  { FIELD_BATTERY_STATE,    "battery_state",    "Batteriestatus",         nullptr, nullptr,    nullptr },
+  { FIELD_DISCHARGES_COUNT, "discharge_cycles", "Entladezyklen",          nullptr, nullptr,    "total_increasing" },
+  { FIELD_DISCHARGES_AH,    "discharged_ah",    "Entladene Ah",           "Ah", nullptr,       "total_increasing" },
+};
+
+const size_t MQTT_METRIC_COUNT = sizeof(MQTT_METRICS) / sizeof(MQTT_METRICS[0]);
+
+// Von der Bibliothek referenzierte Strings (setServer/setCredentials/setWill
+// speichern nur Zeiger) - werden nur bei getrennter Verbindung neu befüllt
+char mqttHostBuf[64];
+char mqttUserBuf[64];
+char mqttPassBuf[64];
+char mqttClientId[32];
+char mqttTopicBase[MQTT_TOPIC_LEN - 32];
+char mqttNodeId[16];
+char mqttStatusTopic[MQTT_TOPIC_LEN];
+
+/**
+ * Formatiert einen Messwert als MQTT-Payload (reiner Wert ohne JSON)
+ *
+ * @param buf Zielpuffer
+ * @param len Größe des Zielpuffers
+ * @param data BMS-Datensatz
+ * @param field Zu formatierendes Feld
+ */
+void formatBmsField(char* buf, size_t len, const BMSData& data, BmsField field) {
+  switch (field) {
+    case FIELD_TOTAL_VOLTAGE:     snprintf(buf, len, "%.3f", data.totalVoltage()); break;
+    case FIELD_CELL_VOLTAGE_SUM:  snprintf(buf, len, "%.3f", data.cellVoltageSum()); break;
+    case FIELD_CURRENT:           snprintf(buf, len, "%.3f", data.current()); break;
+    case FIELD_MOSFET_TEMP:       snprintf(buf, len, "%d", data.mosfetTemp); break;
+    case FIELD_CELL_TEMP:         snprintf(buf, len, "%d", data.cellTemp); break;
+    case FIELD_SOC:               snprintf(buf, len, "%u", data.soc); break;
+    case FIELD_SOH:               strlcpy(buf, data.soh(), len); break;
+    case FIELD_REMAINING_AH:      snprintf(buf, len, "%.2f", data.remainingAh()); break;
+    case FIELD_FULL_CAPACITY_AH:  snprintf(buf, len, "%.2f", data.fullCapacityAh()); break;
+    case FIELD_PROTECTION_STATE:  strlcpy(buf, data.protectionState(), len); break;
+    case FIELD_HEAT_STATE:        strlcpy(buf, data.heatState(), len); break;
+    case FIELD_FAILURE_STATE:     strlcpy(buf, data.failureState(), len); break;
+    case FIELD_BALANCING_STATE:   strlcpy(buf, data.balancingState(), len); break;
+    case FIELD_BATTERY_STATE:     strlcpy(buf, data.batteryState(), len); break;
+    case FIELD_DISCHARGES_COUNT:  snprintf(buf, len, "%lu", (unsigned long)data.dischargesCount); break;
+    case FIELD_DISCHARGES_AH:     snprintf(buf, len, "%.2f", data.dischargesAhCount()); break;
+    default:                      buf[0] = '\0'; break;
+  }
+}
+
+/**
+ * Veröffentlicht eine Nachricht unter <basis>/<suffix>
+ *
+ * @param suffix Topic-Suffix
+ * @param payload Nutzdaten
+ * @param qos QoS-Stufe
+ * @param retain Nachricht auf dem Broker behalten
+ * @return true wenn die Nachricht in die Sendewarteschlange übernommen wurde
+ */
+bool mqttPublish(const char* suffix, const char* payload, uint8_t qos, bool retain) {
+  char topic[MQTT_TOPIC_LEN];
+  snprintf(topic, sizeof(topic), "%s/%s", mqttTopicBase, suffix);
+  if (mqttClient.publish(topic, qos, retain, payload) == 0) {
+    return false;
+  }
+  mqttPublishCount++;
+  return true;
+}
+
+/**
+ * Sendet die Home Assistant Discovery-Konfiguration eines Sensors
+ *
+ * Topic: homeassistant/sensor/<node>/<objekt>/config (retained)
+ *
+ * @param objectId Eindeutiger Name des Sensors innerhalb des Geräts
+ * @param stateSuffix Topic-Suffix des Messwerts
+ * @param name Anzeigename
+ * @param unit Einheit (nullptr = keine)
+ * @param deviceClass HA device_class (nullptr = keine)
+ * @param stateClass HA state_class (nullptr = keine)
+ */
+void mqttPublishDiscovery(const char* objectId, const char* stateSuffix, const char* name,
+                          const char* unit, const char* deviceClass, const char* stateClass) {
+  JsonDocument doc;
+  char buf[MQTT_TOPIC_LEN];
+
+  doc["name"] = name;
+  snprintf(buf, sizeof(buf), "%s_%s", mqttNodeId, objectId);
+  doc["unique_id"] = buf;
+  snprintf(buf, sizeof(buf), "%s/%s", mqttTopicBase, stateSuffix);
+  doc["state_topic"] = buf;
+  doc["availability_topic"] = mqttStatusTopic;
+  if (unit) doc["unit_of_measurement"] = unit;
+  if (deviceClass) doc["device_class"] = deviceClass;
+  if (stateClass) doc["state_class"] = stateClass;
+
+  // Alle Sensoren einem Gerät zuordnen
+  JsonObject device = doc["device"].to<JsonObject>();
+  device["identifiers"].to<JsonArray>().add(mqttNodeId);
+  device["name"] = wifiHostname;
+  device["manufacturer"] = "LiTime";
+  device["model"] = "LiFePO4 BMS";
+
+  char payload[MQTT_PAYLOAD_LEN];
+  serializeJson(doc, payload, sizeof(payload));
+
+  char topic[MQTT_TOPIC_LEN];
+  snprintf(topic, sizeof(topic), "homeassistant/sensor/%s/%s/config", mqttNodeId, objectId);
+  mqttClient.publish(topic, 1, true, payload);
+}
+
+/**
+ * Sendet Discovery-Konfigurationen für Zellen, die noch keine haben
+ *
+ * @param cellCount Aktuelle Zellenzahl des BMS
+ */
+void mqttPublishCellDiscovery(uint8_t cellCount) {
+  char objectId[16];
+  char suffix[16];
+  char name[16];
+  for (uint8_t i = mqttDiscoveredCells; i < cellCount; i++) {
+    snprintf(objectId, sizeof(objectId), "cell_%u", i + 1);
+    snprintf(suffix, sizeof(suffix), "cell/%u", i + 1);
+    snprintf(name, sizeof(name), "Zelle %u", i + 1);
+    mqttPublishDiscovery(objectId, suffix, name, "V", "voltage", "measurement");
+  }
+  mqttDiscoveredCells = cellCount;
+}
+
+/**
+ * Überträgt die MQTT-Einstellungen an den Client
+ *
+ * Darf nur bei getrennter Verbindung aufgerufen werden, da die Bibliothek
+ * die übergebenen Strings nicht kopiert.
+ */
+void mqttApplyConfig() {
+  strlcpy(mqttHostBuf, mqttHost.c_str(), sizeof(mqttHostBuf));
+  strlcpy(mqttUserBuf, mqttUser.c_str(), sizeof(mqttUserBuf));
+  strlcpy(mqttPassBuf, mqttPass.c_str(), sizeof(mqttPassBuf));
+
+  // Knoten-ID und Client-ID aus der MAC-Adresse (ohne Doppelpunkte)
+  size_t n = 0;
+  for (size_t i = 0; i < macAddress.length() && n < sizeof(mqttNodeId) - 1; i++) {
+    char c = macAddress[i];
+    if (c != ':') mqttNodeId[n++] = tolower(c);
+  }
+  mqttNodeId[n] = '\0';
+  snprintf(mqttClientId, sizeof(mqttClientId), "litime-%s", mqttNodeId);
+
+  // Basis-Topic: konfiguriert oder Hostname in Kleinbuchstaben
+  String base = mqttBaseTopic.length() > 0 ? mqttBaseTopic : wifiHostname;
+  if (mqttBaseTopic.length() == 0) base.toLowerCase();
+  while (base.endsWith("/")) base.remove(base.length() - 1);
+  strlcpy(mqttTopicBase, base.c_str(), sizeof(mqttTopicBase));
+  snprintf(mqttStatusTopic, sizeof(mqttStatusTopic), "%s/status", mqttTopicBase);
+
+  mqttClient.setServer(mqttHostBuf, mqttPort);
+  mqttClient.setCredentials(mqttUserBuf[0] ? mqttUserBuf : nullptr, mqttPassBuf[0] ? mqttPassBuf : nullptr);
+  mqttClient.setClientId(mqttClientId);
+  mqttClient.setKeepAlive(MQTT_KEEPALIVE_S);
+  // Bei QoS 1 Sitzung auf dem Broker behalten (unbestätigte Nachrichten überleben Reconnects)
+  mqttClient.setCleanSession(mqttQos == 0);
+  // Last Will: Broker meldet "offline" wenn die Verbindung abreißt
+  mqttClient.setWill(mqttStatusTopic, 1, true, "offline");
+}
+
+/**
+ * Initialisiert den MQTT-Client (Callbacks und Konfiguration)
+ *
+ * Der Verbindungsaufbau erfolgt später non-blocking in serviceMqtt().
+ */
+void setupMqtt() {
+  mqttClient.onConnect([](bool sessionPresent) {
+    // Läuft im MQTT-Task: nur Flags setzen, Veröffentlichung in loop()
+    mqttConnected = true;
+    mqttConnecting = false;
+    mqttSessionStarted = true;
+  });
+  mqttClient.onDisconnect([](espMqttClientTypes::DisconnectReason reason) {
+    if (mqttConnected || mqttConnecting) {
+      Serial.printf("[MQTT] Verbindung getrennt (Grund %u)\n", (unsigned)reason);
+    }
+    mqttConnected = false;
+    mqttConnecting = false;
+  });
+  mqttApplyConfig();
+}
+
+/**
+ * Übernimmt geänderte MQTT-Einstellungen
+ *
+ * Trennt eine bestehende Verbindung; serviceMqtt() verbindet sich danach
+ * sofort mit der neuen Konfiguration.
+ */
+void restartMqtt() {
+  if (!mqttClient.disconnected()) {
+    // Sauber trennen: Broker sendet dann keinen Last Will, daher selbst melden
+    if (mqttConnected) mqttClient.publish(mqttStatusTopic, 1, true, "offline");
+    mqttClient.disconnect(true);
+  }
+  mqttConnected = false;
+  mqttConnecting = false;
+  mqttApplyConfig();
+  mqttReconnectDelay = MQTT_RECONNECT_MIN_MS;
+  lastMqttConnectAttempt = 0;
+  mqttLastSeq = 0;
+  mqttDiscoveredCells = 0;
+}
+
+/**
+ * Abgeleiteter MQTT-Messwert (Topic und Home Assistant Discovery)
+ */
+struct MqttAnalyticsMetric {
+  const char* topic;        // Topic-Suffix unter dem Basis-Topic
+  const char* name;         // Anzeigename in Home Assistant
+  const char* unit;         // Einheit
+  const char* deviceClass;  // HA device_class
+  const char* stateClass;   // HA state_class
+};
+
+const MqttAnalyticsMetric MQTT_ANALYTICS[] = {
+  { "power",         "Leistung",         "W",   "power",    "measurement" },
+  { "cell_delta",    "Zelldifferenz",    "mV",  "voltage",  "measurement" },
+  { "energy_in",     "Geladene Energie", "kWh", "energy",   "total_increasing" },
+  { "energy_out",    "Entladene Energie", "kWh", "energy",  "total_increasing" },
+  { "time_to_full",  "Restzeit bis voll", "min", "duration", "measurement" },
+  { "time_to_empty", "Restzeit bis leer", "min", "duration", "measurement" },
+};
+
+const size_t MQTT_ANALYTICS_COUNT = sizeof(MQTT_ANALYTICS) / sizeof(MQTT_ANALYTICS[0]);
+
+// Zuletzt veröffentlichte Payloads der abgeleiteten Werte (nur loop())
+char mqttAnalyticsLast[MQTT_ANALYTICS_COUNT][16];
+
+/**
+ * Formatiert einen abgeleiteten Wert als MQTT-Payload
+ *
+ * Die Auflösung ist bewusst grob (W, mV, Wh, Minuten), damit nur
+ * tatsächliche Änderungen eine Nachricht auslösen.
+ */
+void formatAnalyticsValue(char* buf, size_t len, const BmsAnalytics& a, size_t index) {
+  switch (index) {
+    case 0: snprintf(buf, len, "%ld", (long)(a.powerMw / 1000)); break;
+    case 1: snprintf(buf, len, "%u", a.cellDeltaMv()); break;
+    case 2: snprintf(buf, len, "%.3f", a.chargedWh() / 1e3); break;
+    case 3: snprintf(buf, len, "%.3f", a.dischargedWh() / 1e3); break;
+    case 4: snprintf(buf, len, "%lu", (unsigned long)(a.timeToFullS / 60)); break;
+    case 5: snprintf(buf, len, "%lu", (unsigned long)(a.timeToEmptyS / 60)); break;
+    default: buf[0] = '\0'; break;
+  }
+}
+
+/**
+ * Veröffentlicht geänderte abgeleitete Werte von Pack 0
+ *
+ * @param full true = alle senden (nach dem Verbinden)
+ */
+void mqttPublishAnalytics(bool full) {
+  BmsAnalytics a;
+  getPackAnalytics(0, a);
+  if (!a.valid) return;
+  char payload[16];
+  for (size_t i = 0; i < MQTT_ANALYTICS_COUNT; i++) {
+    formatAnalyticsValue(payload, sizeof(payload), a, i);
+    if (!full && strcmp(payload, mqttAnalyticsLast[i]) == 0) continue;
+    if (mqttPublish(MQTT_ANALYTICS[i].topic, payload, mqttQos, true)) {
+      strlcpy(mqttAnalyticsLast[i], payload, sizeof(mqttAnalyticsLast[i]));
+    }
+  }
+}
+
+// Binärformat unter <basis>/bin (Little Endian, Version im ersten Byte)
+#define MQTT_BINARY_VERSION 1
+#define MQTT_BINARY_SAMPLE 1    // Typ: aktuelle Messung (MqttBinarySample + Zellspannungen)
+#define MQTT_BINARY_BACKLOG 2   // Typ: Nachholblock (MqttBinaryBacklog + HistorySample-Einträge)
+
+/**
+ * Kopf einer binären Messung (34 Bytes, danach cellCount x uint16_t Zellspannung in mV)
+ *
+ * Neue Felder nur mit neuer Version anhängen, damit Empfänger ältere
+ * Datensätze weiter lesen können.
+ */
+struct __attribute__((packed)) MqttBinarySample {
+  uint8_t version;           // MQTT_BINARY_VERSION
+  uint8_t type;              // MQTT_BINARY_SAMPLE
+  uint8_t pack;              // Pack-Index (0 = erstes BMS)
+  uint8_t cellCount;         // Anzahl folgender Zellspannungen
+  uint32_t timestamp;        // Unix-Zeit der Messung (0 = keine NTP-Zeit)
+  uint16_t totalMv;          // Gesamtspannung in mV
+  uint8_t soc;               // Ladezustand in %
+  uint8_t alarmFlags;        // Aktive Alarme (ALARM_*-Bits)
+  int32_t currentMa;         // Strom in mA (negativ = Entladen)
+  int16_t mosfetTemp;        // MOSFET-Temperatur in °C
+  int16_t cellTemp;          // Zellentemperatur in °C
+  uint32_t remainingMah;     // Verbleibende Kapazität in mAh
+  uint32_t fullCapacityMah;  // Volle Kapazität in mAh
+  int32_t powerMw;           // Leistung in mW
+  uint8_t statusFlags;       // Bit 0: Schutzstatus nicht normal, Bit 1: Fehlerstatus nicht normal
+  uint8_t reserved;          // 0
+};
+
+static_assert(sizeof(MqttBinarySample) == 34, "MqttBinarySample muss 34 Bytes groß sein");
+
+/**
+ * Kopf eines binären Nachholblocks (4 Bytes, danach count x HistorySample)
+ */
+struct __attribute__((packed)) MqttBinaryBacklog {
+  uint8_t version;  // MQTT_BINARY_VERSION
+  uint8_t type;     // MQTT_BINARY_BACKLOG
+  uint16_t count;   // Anzahl folgender Einträge
+};
+
+/**
+ * Veröffentlicht Binärdaten unter <basis>/<suffix>
+ *
+ * @return true wenn die Nachricht in die Sendewarteschlange übernommen wurde
+ */
+bool mqttPublishBinary(const char* suffix, const uint8_t* payload, size_t length, uint8_t qos, bool retain) {
+  char topic[MQTT_TOPIC_LEN];
+  snprintf(topic, sizeof(topic), "%s/%s", mqttTopicBase, suffix);
+  if (mqttClient.publish(topic, qos, retain, payload, length) == 0) {
+    return false;
+  }
+  mqttPublishCount++;
+  return true;
+}
+
+/**
+ * Veröffentlicht eine Messung als Binärdatensatz unter <basis>/bin (retained)
+ *
+ * @param data Plausible Messung von Pack 0
+ */
+void mqttPublishBinarySample(const BMSData& data) {
+  uint8_t buf[sizeof(MqttBinarySample) + BMS_MAX_CELLS * sizeof(uint16_t)];
+  BmsAnalytics analytics;
+  getPackAnalytics(0, analytics);
+
+  MqttBinarySample sample = {};
+  sample.version = MQTT_BINARY_VERSION;
+  sample.type = MQTT_BINARY_SAMPLE;
+  sample.cellCount = data.cellCount;
+  sample.timestamp = lastSyncTime > 0 ? (uint32_t)time(nullptr) : 0;
+  sample.totalMv = data.totalMv;
+  sample.soc = data.soc;
+  sample.alarmFlags = bmsSlots[0].alarmFlags;
+  sample.currentMa = data.currentMa;
+  sample.mosfetTemp = data.mosfetTemp;
+  sample.cellTemp = data.cellTemp;
+  sample.remainingMah = data.remainingMah;
+  sample.fullCapacityMah = data.fullCapacityMah;
+  sample.powerMw = analytics.powerMw;
+  sample.statusFlags = (isBmsStateNormal(data.protectionState()) ? 0 : 1) |
+                       (isBmsStateNormal(data.failureState()) ? 0 : 2);
+  memcpy(buf, &sample, sizeof(sample));
+  memcpy(buf + sizeof(sample), data.cellMv.data(), data.cellCount * sizeof(uint16_t));
+  mqttPublishBinary("bin", buf, sizeof(sample) + data.cellCount * sizeof(uint16_t), mqttQos, true);
+}
+
+/**
+ * Veröffentlicht alle seit der letzten Veröffentlichung geänderten Messwerte
+ *
+ * @param full true = alle Felder senden (nach dem Verbinden)
+ */
+void mqttPublishData(bool full) {
+  BMSData data;
+  uint32_t fieldSeq[FIELD_COUNT];
+  uint32_t seq = getBMSSnapshot(data, fieldSeq);
+  if (seq == 0 || !bmsDataValid) {
+    return;
+  }
+
+  // Binärformat: immer der vollständige Datensatz
+  if (mqttBinary) {
+    mqttPublishBinarySample(data);
+    mqttLastSeq = seq;
+    return;
+  }
+
+  // Beim ersten Wert oder nach Sequenz-Sprung (Neustart) alles senden
+  uint32_t since = (full || mqttLastSeq == 0 || mqttLastSeq > seq) ? 0 : mqttLastSeq;
+  char payload[BMS_STATE_TEXT_LEN];
+
+  // Mit Totband nur Felder, die sich weit genug bewegt haben oder deren
+  // Lebenszeichen fällig ist (dafür auch unveränderte Felder prüfen)
+  unsigned long now = millis();
+  for (size_t i = 0; i < MQTT_METRIC_COUNT; i++) {
+    const MqttMetric& m = MQTT_METRICS[i];
+    if (reportDeadband && since > 0) {
+      if (!fieldMoved(mqttReported, data, m.field, now)) continue;
+    } else if (since > 0 && fieldSeq[m.field] <= since) {
+      continue;
+    }
+    formatBmsField(payload, sizeof(payload), data, m.field);
+    mqttPublish(m.topic, payload, mqttQos, true);
+    markReported(mqttReported, data, m.field, now);
+  }
+
+  // Zellspannungen einzeln unter <basis>/cell/<n> (Totband je Zelle)
+  bool cellsDue = reportDeadband && since > 0
+    ? fieldMoved(mqttReported, data, FIELD_CELL_VOLTAGES, now)
+    : (since == 0 || fieldSeq[FIELD_CELL_VOLTAGES] > since);
+  if (cellsDue) {
+    if (mqttDiscovery && data.cellCount > mqttDiscoveredCells) {
+      mqttPublishCellDiscovery(data.cellCount);
+    }
+    bool heartbeat = since == 0 || !reportDeadband || data.cellCount != mqttReported.cellCount ||
+      now - mqttReported.at[FIELD_CELL_VOLTAGES] >= reportHeartbeat * 1000;
+    int32_t band = bmsFieldDeadband(FIELD_CELL_VOLTAGES);
+    char suffix[16];
+    for (uint8_t c = 0; c < data.cellCount; c++) {
+      if (!heartbeat && abs((int32_t)data.cellMv[c] - (int32_t)mqttReported.cellMv[c]) < band) continue;
+      snprintf(suffix, sizeof(suffix), "cell/%u", c + 1);
+      snprintf(payload, sizeof(payload), "%.3f", data.cellVoltage(c));
+      mqttPublish(suffix, payload, mqttQos, true);
+    }
+    markReported(mqttReported, data, FIELD_CELL_VOLTAGES, now);
+  }
+  mqttPublishAnalytics(since == 0);
+
+  mqttLastSeq = seq;
+}
+
+/**
+ * Veröffentlicht die aktiven Alarme unter <basis>/alarms (retained)
+ *
+ * Nutzdaten: kommagetrennte Namen aller aktiven Alarme (Pack 0 ohne
+ * Präfix, weitere Packs als "2:soc_low"), leer wenn kein Alarm aktiv ist.
+ */
+void mqttPublishAlarms() {
+  char payload[128] = "";
+  size_t length = 0;
+  for (uint8_t p = 0; p < bmsPackCount(); p++) {
+    uint8_t flags = bmsSlots[p].alarmFlags;
+    for (uint8_t i = 0; i < ALARM_COUNT; i++) {
+      if (!(flags & (1 << i))) continue;
+      const char* sep = length > 0 ? "," : "";
+      int n = (p == 0)
+        ? snprintf(payload + length, sizeof(payload) - length, "%s%s", sep, ALARM_NAMES[i])
+        : snprintf(payload + length, sizeof(payload) - length, "%s%u:%s", sep, p + 1, ALARM_NAMES[i]);
+      if (n > 0) length = min(length + n, sizeof(payload) - 1);
+    }
+  }
+  mqttPublish("alarms", payload, 1, true);
+}
+
+/**
+ * Sendet nach dem Verbinden Verfügbarkeit, Discovery und alle Werte
+ *
+ * @param discovery true = Home Assistant Discovery-Konfiguration senden
+ */
+void mqttStartSession(bool discovery) {
+  mqttReconnectDelay = MQTT_RECONNECT_MIN_MS;
+  Serial.println("[MQTT] Verbunden, Basis-Topic: " + String(mqttTopicBase));
+  mqttClient.publish(mqttStatusTopic, 1, true, "online");
+  // Binärformat kann Home Assistant nicht auswerten: keine Discovery
+  if (discovery && !mqttBinary) {
+    for (size_t i = 0; i < MQTT_METRIC_COUNT; i++) {
+      const MqttMetric& m = MQTT_METRICS[i];
+      mqttPublishDiscovery(m.topic, m.topic, m.name, m.unit, m.deviceClass, m.stateClass);
+    }
+    for (size_t i = 0; i < MQTT_ANALYTICS_COUNT; i++) {
+      const MqttAnalyticsMetric& m = MQTT_ANALYTICS[i];
+      mqttPublishDiscovery(m.topic, m.topic, m.name, m.unit, m.deviceClass, m.stateClass);
+    }
+    mqttDiscoveredCells = 0;
+  }
+  mqttPublishData(true);
+  if (alarmEnabled) mqttPublishAlarms();
+}
+
+/**
+ * Legt eine neue Messung im MQTT-Zwischenspeicher ab (während getrennt)
+ */
+void spoolMqttSample() {
+  static uint32_t spooledSeq = 0;
+  BMSData data;
+  uint32_t seq = getBMSSnapshot(data);
+  if (seq == 0 || seq == spooledSeq || !bmsDataValid) {
+    return;
+  }
+  spooledSeq = seq;
+  mqttSpool.append(makeSpoolSample(data));
+}
+
+// Puffer für einen MQTT-Nachholblock (nur loop(), die des Cloud-Tasks sind gleichzeitig in Gebrauch)
+char mqttReplayPayload[SPOOL_PAYLOAD_SIZE];
+HistorySample mqttReplaySamples[SPOOL_REPLAY_BATCH];
+
+/**
+ * Veröffentlicht einen Block zwischengespeicherter Messungen unter <basis>/backlog
+ *
+ * Ein Block pro MQTT_REPLAY_INTERVAL_MS, damit die Sendewarteschlange der
+ * Bibliothek nicht überläuft. Nachrichten gehen immer mit QoS 1 raus, ein
+ * Block wird entfernt sobald die Bibliothek ihn übernommen hat.
+ *
+ * @param currentMillis Aktueller millis()-Wert
+ */
+void mqttReplayBacklog(unsigned long currentMillis) {
+  static unsigned long lastReplay = 0;
+  if (mqttSpool.pending() == 0 || currentMillis - lastReplay < MQTT_REPLAY_INTERVAL_MS) {
+    return;
+  }
+  lastReplay = currentMillis;
+
+  size_t count = mqttSpool.peek(mqttReplaySamples, SPOOL_REPLAY_BATCH);
+  bool published;
+  size_t length;
+  if (mqttBinary) {
+    // Binär: Kopf + Einträge im Historien-Layout (passt sicher in den Puffer)
+    MqttBinaryBacklog header = { MQTT_BINARY_VERSION, MQTT_BINARY_BACKLOG, (uint16_t)count };
+    memcpy(mqttReplayPayload, &header, sizeof(header));
+    memcpy(mqttReplayPayload + sizeof(header), mqttReplaySamples, count * sizeof(HistorySample));
+    length = (count > 0) ? sizeof(header) + count * sizeof(HistorySample) : 0;
+    published = length > 0 && mqttPublishBinary("backlog/bin", (const uint8_t*)mqttReplayPayload, length, 1, false);
+  } else {
+    length = (count > 0) ? buildBacklogPayload(mqttReplaySamples, count, mqttReplayPayload, SPOOL_PAYLOAD_SIZE) : 0;
+    published = length > 0 && mqttPublish("backlog", mqttReplayPayload, 1, false);
+  }
+  if (length == 0 || published) {
+    mqttSpool.consume(count);
+    if (mqttSpool.pending() == 0) {
+      Serial.println("[MQTT] Zwischengespeicherte Messungen nachgeholt");
+    }
+  }
+}
+
+/**
+ * MQTT-Verbindung und Veröffentlichung (aus loop() aufgerufen)
+ *
+ * - Verbindet non-blocking mit exponentiellem Backoff (5s bis 5min)
+ * - Sendet nach dem Verbinden Verfügbarkeit, Discovery und alle Werte
+ * - Sendet danach pro neuer Messung die geänderten Werte
+ *
+ * @param currentMillis Aktueller millis()-Wert
+ */
+void serviceMqtt(unsigned long currentMillis) {
+  if (!mqttEnabled || mqttHost.length() == 0 || apMode) {
+    return;
+  }
+
+  // Ohne Broker-Verbindung: neue Messungen zwischenspeichern
+  bool networkOk = WiFi.status() == WL_CONNECTED;
+  if (!mqttConnected || !networkOk) {
+    spoolMqttSample();
+  }
+  if (!networkOk) {
+    return;
+  }
+
+  // Verbindungsaufbau (TCP/MQTT-Handshake läuft im Task der Bibliothek)
+  if (!mqttConnected && !mqttConnecting) {
+    if (lastMqttConnectAttempt != 0 && currentMillis - lastMqttConnectAttempt < mqttReconnectDelay) {
+      return;
+    }
+    if (lastMqttConnectAttempt != 0) {
+      mqttReconnectDelay = min(mqttReconnectDelay * 2, (unsigned long)MQTT_RECONNECT_MAX_MS);
+    }
+    lastMqttConnectAttempt = currentMillis;
+    Serial.printf("[MQTT] Verbinde mit %s:%u...\n", mqttHostBuf, mqttPort);
+    mqttConnecting = mqttClient.connect();
+    return;
+  }
+
+  if (!mqttConnected) {
+    return;
+  }
+
+  // Neue Sitzung: Verfügbarkeit, Discovery und vollständiger Datensatz
+  if (mqttSessionStarted) {
+    mqttSessionStarted = false;
+    mqttStartSession(mqttDiscovery);
+    return;
+  }
+
+  // Neue Messung vom BLE-Task (jede Sequenznummer nur einmal prüfen)
+  static uint32_t checkedSeq = 0;
+  uint32_t sampleSeq = bmsSampleSeq;
+  if (sampleSeq != checkedSeq) {
+    checkedSeq = sampleSeq;
+    mqttPublishData(false);
+  }
+
+  // Zwischengespeicherte Messungen nachholen
+  mqttReplayBacklog(currentMillis);
+}
+
+/**
+ * Versendet einen Alarmwechsel sofort (aus loop() aufgerufen)
+ *
+ * Höchstens eine Sendung pro alarmMinInterval: weitere Wechsel in dieser
+ * Zeit bleiben vorgemerkt und gehen gesammelt mit der nächsten Sendung
+ * raus. Das reguläre Webhook-Intervall beginnt danach von vorn.
+ *
+ * @param currentMillis Aktueller millis()-Wert
+ */
+void serviceAlarms(unsigned long currentMillis) {
+  if (!alarmPending || apMode) return;
+  if (lastAlarmSend != 0 && currentMillis - lastAlarmSend < alarmMinInterval * 1000) return;
+
+  bool sent = false;
+  if (haEnabled && !cloudBusy && uxQueueMessagesWaiting(cloudQueue) == 0) {
+    sent = queueCloudJob(false, true);
+    if (sent) lastHaSend = currentMillis;
+  }
+  if (mqttEnabled && mqttConnected) {
+    mqttPublishAlarms();
+    sent = true;
+  }
+  // Ohne aktiven Ausgang nichts vormerken, mit belegtem Cloud-Task später erneut
+  if (sent || (!haEnabled && !(mqttEnabled && mqttConnected))) {
+    alarmPending = false;
+    lastAlarmSend = currentMillis;
+  }
+}
+
+// ============================================================================
+// API-Endpunkte
+// ============================================================================
+// RESTful JSON-APIs für AJAX-Anfragen vom Webinterface
+
+/**
+ * Sendet eine fertig geschriebene JSON-Antwort in einem Stück
+ *
+ * Der Inhalt wird kopiert, der Puffer darf danach freigegeben werden.
+ *
+ * @param request Anfrage
+ * @param json Ausgabe von JsonWriter (nullterminiert)
+ * @param length Länge (0 = Puffer war zu klein, dann 500)
+ */
+void sendJsonBuffer(AsyncWebServerRequest* request, const char* json, size_t length) {
+  if (length == 0) {
+    sendJsonText(request, "{\"error\":\"Antwort zu groß\"}", 500);
+    return;
+  }
+  request->send(200, "application/json", json);
+}
+
+/**
+ * Schreibt aktuelle Zeit und letzten NTP-Sync in das offene Objekt
+ *
+ * Wird von /api/time und vom Push-Stream verwendet.
+ *
+ * @param json Ziel (innerhalb eines Objekts)
+ */
+void writeTimeJson(JsonWriter& json) {
+  json.addString("time", getCurrentTimeString());
+  json.addString("lastSync", getLastSyncTimeString());
+}
+
+/**
+ * GET /api/time - Gibt aktuelle Zeit und Sync-Status zurück
+ */
+void handleApiTime(AsyncWebServerRequest* request) {
+  char buf[96];
+  JsonWriter json(buf, sizeof(buf));
+  json.beginObject();
+  writeTimeJson(json);
+  json.endObject();
+  sendJsonBuffer(request, buf, json.length());
+}
+
+/**
+ * Schreibt ein einzelnes BMS-Feld in das offene JSON-Objekt
+ *
+ * Gemeinsame Ausgabe für vollständige Antworten und Delta-Antworten
+ * von /api/data, damit Schlüssel und Einheiten identisch bleiben.
+ *
+ * @param json Ziel (innerhalb eines Objekts)
+ * @param data BMS-Datensatz
+ * @param field Auszugebendes Feld
  */
-void applyWifiTxPower() {
-  switch (wifiTxPower) {
-    case 1:
-      WiFi.setTxPower(WIFI_POWER_11dBm);
-      Serial.println("[WIFI] Sendestärke: Normal (11 dBm)");
-      break;
-    case 2:
-      WiFi.setTxPower(WIFI_POWER_17dBm);
-      Serial.println("[WIFI] Sendestärke: Hoch (17 dBm)");
+void writeBmsField(JsonWriter& json, const BMSData& data, BmsField field) {
+  switch (field) {
+    case FIELD_TOTAL_VOLTAGE:     json.addFixed("totalVoltage", data.totalMv, 3); break;
+    case FIELD_CELL_VOLTAGE_SUM:  json.addFixed("cellVoltageSum", data.cellSumMv, 3); break;
+    case FIELD_CURRENT:           json.addFixed("current", data.currentMa, 3); break;
+    case FIELD_MOSFET_TEMP:       json.addInt("mosfetTemp", data.mosfetTemp); break;
+    case FIELD_CELL_TEMP:         json.addInt("cellTemp", data.cellTemp); break;
+    case FIELD_SOC:               json.addUInt("soc", data.soc); break;
+    case FIELD_SOH:               json.addString("soh", data.soh()); break;
+    case FIELD_REMAINING_AH:      json.addFixed("remainingAh", data.remainingMah, 3); break;
+    case FIELD_FULL_CAPACITY_AH:  json.addFixed("fullCapacityAh", data.fullCapacityMah, 3); break;
+    case FIELD_PROTECTION_STATE:  json.addString("protectionState", data.protectionState()); break;
+    case FIELD_HEAT_STATE:        json.addString("heatState", data.heatState()); break;
+    case FIELD_FAILURE_STATE:     json.addString("failureState", data.failureState()); break;
+    case FIELD_BALANCING_STATE:   json.addString("balancingState", data.balancingState()); break;
+    case FIELD_BATTERY_STATE:     json.addString("batteryState", data.batteryState()); break;
+    case FIELD_DISCHARGES_COUNT:  json.addUInt("dischargesCount", data.dischargesCount); break;
+    case FIELD_DISCHARGES_AH:     json.addFixed("dischargesAhCount", data.dischargesMah, 3); break;
+    case FIELD_CELL_VOLTAGES: {
+      // Zellspannungen als Array
+      json.beginArray("cellVoltages");
+      for (size_t i = 0; i < data.cellCount; i++) {
+        json.addFixed(nullptr, data.cellMv[i], 3);
+      }
+      json.endArray();
       break;
+    }
     default:
-      WiFi.setTxPower(WIFI_POWER_5dBm);
-      Serial.println("[WIFI] Sendestärke: Niedrig (5 dBm)");
       break;
   }
 }
 
-// ============================================================================
-// BMS-Datenvalidierung
-// ============================================================================
+// Felder je Pack in der "packs"-Liste (Teilmenge von writeBmsField())
+const BmsField PACK_FIELDS[] = {
+  FIELD_TOTAL_VOLTAGE, FIELD_CURRENT, FIELD_SOC, FIELD_SOH, FIELD_MOSFET_TEMP, FIELD_CELL_TEMP,
+  FIELD_REMAINING_AH, FIELD_FULL_CAPACITY_AH, FIELD_PROTECTION_STATE, FIELD_FAILURE_STATE,
+  FIELD_BATTERY_STATE, FIELD_CELL_VOLTAGES
+};
 
 /**
- * Prüft ob die aktuellen BMS-Daten plausibel sind
+ * Schreibt die "packs"-Liste (nur bei mehr als einem konfigurierten Pack)
  *
- * Diese Funktion verhindert die Anzeige/Übertragung von ungültigen Daten,
- * die z.B. direkt nach dem Verbindungsaufbau auftreten können (alle Werte 0).
+ * @param json Ziel (innerhalb eines Objekts)
+ */
+void writePacksJson(JsonWriter& json) {
+  uint8_t count = bmsPackCount();
+  if (count < 2) return;
+  json.beginArray("packs");
+  for (uint8_t i = 0; i < count; i++) {
+    BMSData data;
+    bool valid = false;
+    uint32_t seq = getPackSnapshot(i, data, &valid);
+    bool online = bmsSlots[i].online;
+    json.beginObject();
+    json.addUInt("pack", i);
+    json.addString("mac", bmsSlots[i].mac);
+    json.addBool("connected", online);
+    json.addBool("available", bluetoothEnabled && online && valid && seq > 0);
+    json.addUInt("seq", seq);
+    json.addUInt("pollMs", bmsPollInterval(bmsSlots[i]));
+    writeAlarmNames(json, "alarms", bmsSlots[i].alarmFlags);
+    if (seq > 0) {
+      for (BmsField field : PACK_FIELDS) {
+        writeBmsField(json, data, field);
+      }
+      BmsAnalytics analytics;
+      getPackAnalytics(i, analytics);
+      writeAnalyticsJson(json, "analytics", analytics, false);
+    }
+    json.endObject();
+  }
+  json.endArray();
+}
+
+/**
+ * Schreibt den /api/data-Datensatz als JSON-Objekt
  *
- * Prüfkriterien für LiFePO4-Batterien:
- * - Gesamtspannung: 10V - 60V
- * - SOC: 0% - 100%
- * - Zellspannungen: 2.0V - 4.0V (etwas großzügiger für Randfälle)
+ * Die Felder auf oberster Ebene beschreiben Pack 0. Bei mehreren Packs
+ * folgt die "packs"-Liste, aber nur in der vollständigen Antwort.
  *
- * @return true wenn alle Daten plausibel sind, sonst false
+ * @param json Ziel
+ * @param data BMS-Datensatz
+ * @param seq Sequenznummer der Messung
+ * @param fieldSeq Änderungs-Sequenznummern je Feld (nullptr = alle Felder)
+ * @param since Bei > 0 nur Felder die sich nach dieser Messung geändert haben
  */
-bool isBmsDataValid() {
-  // Spannung muss zwischen 10V und 60V liegen (typisch für LiFePO4 4S-16S)
-  if (bmsData.totalVoltage < 10.0 || bmsData.totalVoltage > 60.0) {
-    return false;
-  }
+void writeDataJson(JsonWriter& json, const BMSData& data, uint32_t seq, const uint32_t* fieldSeq, uint32_t since) {
+  json.beginObject();
+  json.addUInt("seq", seq);
+  json.addBool("delta", since > 0);
 
-  // SOC muss zwischen 0 und 100 Prozent sein
-  if (bmsData.soc > 100) {
-    return false;
+  // Verfügbarkeits-Flag für Frontend
+  bool bmsAvailable = bluetoothEnabled && bmsConnected && bmsDataValid;
+  json.addBool("available", bmsAvailable);
+  json.addBool("connected", bmsConnected);
+  writeAlarmNames(json, "alarms", bmsSlots[0].alarmFlags);
+
+  // BMS-Werte (bei Delta nur die geänderten)
+  for (uint8_t f = 0; f < FIELD_COUNT; f++) {
+    if (since == 0 || fieldSeq == nullptr || fieldSeq[f] > since) {
+      writeBmsField(json, data, (BmsField)f);
+    }
   }
 
-  // Mindestens eine Zellspannung muss vorhanden sein
-  if (bmsData.cellVoltages.size() == 0) {
-    return false;
+  // Abgeleitete Werte ändern sich mit jeder Messung (auch in Delta-Antworten)
+  if (seq > 0) {
+    BmsAnalytics analytics;
+    getPackAnalytics(0, analytics);
+    writeAnalyticsJson(json, "analytics", analytics, false);
   }
-
-  // Alle Zellspannungen müssen plausibel sein
-  // LiFePO4: Nominal 3.2V, Bereich ca. 2.5V - 3.65V
-  // Wir verwenden 2.0V - 4.0V für etwas Toleranz
-  for (float v : bmsData.cellVoltages) {
-    if (v < 2.0 || v > 4.0) {
-      return false;
-    }
+  if (since == 0) {
+    writePacksJson(json);
   }
-
-  return true;
+  json.endObject();
 }
 
-// ============================================================================
-// Zeit-Funktionen
-// ============================================================================
-
 /**
- * Synchronisiert die Systemzeit mit einem NTP-Server
+ * Status-Flags, die zusätzlich zur Messung in /api/data eingehen
  *
- * Verwendet die konfigurierte Zeitzone für automatische
- * Sommer-/Winterzeit-Umstellung.
+ * @return Bitmaske aus Bluetooth aktiv, verbunden, plausibel
  */
-void syncNTP() {
-  // Zeitzone und NTP-Server konfigurieren
-  configTzTime(timezone.c_str(), ntpServer);
-
-  // Warten auf Synchronisation (max. 10 Sekunden)
-  struct tm timeinfo;
-  if (getLocalTime(&timeinfo, 10000)) {
-    // Zeitstempel der erfolgreichen Synchronisation speichern
-    lastSyncTime = time(nullptr);
-    Serial.println("NTP synchronisiert");
-  }
+uint8_t bmsDataFlags() {
+  return (bluetoothEnabled ? 1 : 0) | (bmsConnected ? 2 : 0) | (bmsDataValid ? 4 : 0);
 }
 
 /**
- * Gibt die aktuelle Zeit als formatierten String zurück
+ * Erzeugt das ETag für /api/data
  *
- * @return Zeit im Format "DD.MM.YYYY HH:MM:SS" oder Fehlermeldung
+ * Die Antwort hängt von der Messung (Sequenznummer) und den Status-Flags
+ * ab, die nicht Teil der Messung sind (Bluetooth aktiv, verbunden, plausibel).
+ * Bei mehreren Packs kommt der Zähler aller Pack-Messungen hinzu.
+ *
+ * @param seq Sequenznummer der Messung
+ * @return ETag inklusive Anführungszeichen, z.B. "42-7" oder "42-7-130"
  */
-String getCurrentTimeString() {
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
-    return "Zeit nicht verfügbar";
+String bmsDataETag(uint32_t seq) {
+  String etag = "\"" + String(seq) + "-" + String(bmsDataFlags());
+  if (bmsPackCount() > 1) {
+    etag += "-" + String(dataJsonPacksSeq);
   }
-  char buffer[64];
-  strftime(buffer, sizeof(buffer), "%d.%m.%Y %H:%M:%S", &timeinfo);
-  return String(buffer);
+  return etag + "\"";
 }
 
 /**
- * Gibt den Zeitpunkt der letzten NTP-Synchronisation zurück
+ * Liefert den vollständigen /api/data-Datensatz aus dem Cache
  *
- * @return Zeitpunkt als String oder "Noch nicht synchronisiert"
+ * Wird nur neu geschrieben wenn eine neue Messung vorliegt oder sich die
+ * Status-Flags geändert haben, sonst ist jede Abfrage eine reine Kopie.
+ * Der Aufrufer muss dataJsonMutex halten, solange er dataJsonCache liest.
+ *
+ * @param seq Wird auf die Sequenznummer des Datensatzes gesetzt
+ * @return Länge des JSON in dataJsonCache (0 = Puffer zu klein)
  */
-String getLastSyncTimeString() {
-  if (lastSyncTime == 0) {
-    return "Noch nicht synchronisiert";
+size_t getCachedDataJson(uint32_t& seq) {
+  uint32_t currentSeq = bmsSampleSeq;
+  uint32_t packsSeq = bmsPacksSeq;
+  uint8_t flags = bmsDataFlags();
+  if (dataJsonLength == 0 || currentSeq != dataJsonSeq || flags != dataJsonFlags || packsSeq != dataJsonPacksSeq) {
+    BMSData data;
+    seq = getBMSSnapshot(data);
+    JsonWriter json(dataJsonCache, sizeof(dataJsonCache));
+    writeDataJson(json, data, seq, nullptr, 0);
+    dataJsonLength = json.length();
+    dataJsonSeq = seq;
+    dataJsonFlags = flags;
+    dataJsonPacksSeq = packsSeq;
   }
-  struct tm* timeinfo = localtime(&lastSyncTime);
-  char buffer[64];
-  strftime(buffer, sizeof(buffer), "%d.%m.%Y %H:%M:%S", timeinfo);
-  return String(buffer);
+  seq = dataJsonSeq;
+  return dataJsonLength;
 }
 
-// ============================================================================
-// BMS-Datenabfrage
-// ============================================================================
-
 /**
- * Fragt alle Daten vom BMS ab und speichert sie in der globalen Struktur
+ * GET /api/data - Gibt alle BMS-Daten als JSON zurück
  *
- * Diese Funktion:
- * 1. Prüft ob eine BMS-Verbindung besteht
- * 2. Ruft update() am BMS-Client auf um neue Daten zu holen
- * 3. Kopiert alle Werte in die lokale Datenstruktur
- * 4. Validiert die Daten auf Plausibilität
- * 5. Gibt die Daten optional auf Serial aus
+ * Bedingte Abfrage: Jede Antwort trägt ein ETag aus Sequenznummer und
+ * Status-Flags. Schickt der Client dieses per If-None-Match zurück und hat
+ * sich nichts geändert, wird nur 304 Not Modified ohne Body gesendet.
+ *
+ * Delta-Abfrage: /api/data?since=<seq> liefert nur die Felder, die sich
+ * seit der Messung <seq> geändert haben (plus "seq", "delta" und die
+ * Status-Flags). Ist <seq> unbekannt (z.B. nach Neustart), wird die
+ * vollständige Antwort gesendet. Delta-Antworten betreffen nur Pack 0 und
+ * enthalten keine "packs"-Liste.
  */
-void updateBMSData() {
-  // Abbrechen wenn keine Verbindung besteht
-  if (!bmsConnected) return;
+void handleApiData(AsyncWebServerRequest* request) {
+  // Vollständiger Datensatz aus dem Cache (bei Bedarf neu geschrieben)
+  xSemaphoreTake(dataJsonMutex, portMAX_DELAY);
+  uint32_t seq;
+  size_t length = getCachedDataJson(seq);
+
+  // Unverändert seit der letzten Antwort an diesen Client?
+  String etag = bmsDataETag(seq);
+  if (etagMatches(request, etag.c_str())) {
+    xSemaphoreGive(dataJsonMutex);
+    sendNotModified(request, etag.c_str());
+    return;
+  }
 
-  // BMS-Client auffordern neue Daten zu holen
-  bmsClient.update();
+  // Delta nur wenn die angefragte Messung bekannt ist und nicht in der Zukunft liegt
+  uint32_t since = getUIntParam(request, "since", 0);
+  if (since > seq) since = 0;
 
-  // Alle Werte in die lokale Struktur kopieren
-  bmsData.totalVoltage = bmsClient.getTotalVoltage();
-  bmsData.cellVoltageSum = bmsClient.getCellVoltageSum();
-  bmsData.current = bmsClient.getCurrent();
-  bmsData.mosfetTemp = bmsClient.getMosfetTemp();
-  bmsData.cellTemp = bmsClient.getCellTemp();
-  bmsData.soc = bmsClient.getSOC();
-  bmsData.soh = bmsClient.getSOH();
-  bmsData.remainingAh = bmsClient.getRemainingAh();
-  bmsData.fullCapacityAh = bmsClient.getFullCapacityAh();
-  bmsData.protectionState = bmsClient.getProtectionState();
-  bmsData.heatState = bmsClient.getHeatState();
-  bmsData.balanceMemory = bmsClient.getBalanceMemory();
-  bmsData.failureState = bmsClient.getFailureState();
-  bmsData.balancingState = bmsClient.getBalancingState();
-  bmsData.batteryState = bmsClient.getBatteryState();
-  bmsData.dischargesCount = bmsClient.getDischargesCount();
-  bmsData.dischargesAhCount = bmsClient.getDischargesAhCount();
-  bmsData.cellVoltages = bmsClient.getCellVoltages();
-
-  // Plausibilitätsprüfung durchführen
-  bool wasValid = bmsDataValid;
-  bmsDataValid = isBmsDataValid();
+  AsyncWebServerResponse* response;
+  if (since == 0) {
+    // Antwort kopiert den Cache, danach kann er wieder freigegeben werden
+    response = (length > 0) ? request->beginResponse(200, "application/json", dataJsonCache) : nullptr;
+    xSemaphoreGive(dataJsonMutex);
+  } else {
+    xSemaphoreGive(dataJsonMutex);
+
+    // Delta: nur geänderte Felder, in einen eigenen Puffer
+    BMSData data;
+    uint32_t fieldSeq[FIELD_COUNT];
+    seq = getBMSSnapshot(data, fieldSeq);
+    char buf[DATA_JSON_SIZE];
+    JsonWriter json(buf, sizeof(buf));
+    writeDataJson(json, data, seq, fieldSeq, since);
+    response = (json.length() > 0) ? request->beginResponse(200, "application/json", buf) : nullptr;
+  }
 
-  // Bei ungültigen Daten: Meldung ausgeben und abbrechen
-  if (!bmsDataValid) {
-    if (wasValid) {
-      Serial.println("[BMS] Daten nicht plausibel - überspringe Ausgabe/Webhook");
-    }
-    return;  // Keine weitere Verarbeitung bei ungültigen Daten
+  if (response == nullptr) {
+    sendJsonBuffer(request, nullptr, 0);
+    return;
   }
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
 
-  // Wenn Daten wieder plausibel werden: Meldung ausgeben
-  if (!wasValid && bmsDataValid) {
-    Serial.println("[BMS] Daten jetzt plausibel - Ausgabe aktiviert");
+/**
+ * Summen eines Zeitintervalls beim Zusammenfassen der Historie (?step=)
+ */
+struct HistoryBucket {
+  uint32_t start = 0;       // Beginn des Intervalls
+  uint32_t count = 0;       // Anzahl Einträge im Intervall
+  uint32_t sumMv = 0;
+  int32_t sumCa = 0;
+  int32_t sumMosfet = 0;
+  int32_t sumCell = 0;
+  uint32_t sumSoc = 0;
+  uint16_t cellMinMv = 0xFFFF;
+  uint16_t cellMaxMv = 0;
+  uint8_t pack = 0;         // Pack der Einträge (Intervalle gelten je Pack)
+
+  void add(const HistorySample& s) {
+    count++;
+    pack = s.pack;
+    sumMv += s.totalMv;
+    sumCa += s.currentCa;
+    sumMosfet += s.mosfetTemp;
+    sumCell += s.cellTemp;
+    sumSoc += s.soc;
+    cellMinMv = min(cellMinMv, s.cellMinMv);
+    cellMaxMv = max(cellMaxMv, s.cellMaxMv);
   }
 
-  // Optional: Daten auf Serial ausgeben
-  if (serialOutputEnabled) {
-    printBMSDataSerial();
+  HistorySample average() const {
+    HistorySample s = {};
+    s.time = start;
+    s.totalMv = sumMv / count;
+    s.currentCa = sumCa / (int32_t)count;
+    s.mosfetTemp = sumMosfet / (int32_t)count;
+    s.cellTemp = sumCell / (int32_t)count;
+    s.soc = sumSoc / count;
+    s.cellMinMv = cellMinMv;
+    s.cellMaxMv = cellMaxMv;
+    s.pack = pack;
+    return s;
   }
-}
+};
 
 /**
- * Gibt eine kompakte Übersicht der BMS-Daten auf Serial aus
+ * Schreibt einen Historien-Eintrag als CSV-Zeile oder Binär-Datensatz
  *
- * Wird nur aufgerufen wenn serialOutputEnabled true ist.
+ * @param out Ziel (mindestens HISTORY_LINE_SIZE Bytes)
+ * @param s Eintrag (Zeit bereits umgerechnet)
+ * @param csv true = CSV, false = Binär
+ * @return Anzahl geschriebener Bytes
  */
-void printBMSDataSerial() {
-  Serial.println("══════════════════════════════════════════════════════");
-  Serial.println("                   LiTime BMS Status                   ");
-  Serial.println("══════════════════════════════════════════════════════");
-  Serial.printf("Gesamtspannung: %.2f V | SOC: %d%% | Strom: %.2f A\n",
-    bmsData.totalVoltage, bmsData.soc, bmsData.current);
-  Serial.printf("Temperatur: MOSFET %d°C | Zellen %d°C\n",
-    bmsData.mosfetTemp, bmsData.cellTemp);
-  Serial.println();
+size_t formatHistorySample(uint8_t* out, const HistorySample& s, bool csv) {
+  if (!csv) {
+    memcpy(out, &s, sizeof(s));
+    return sizeof(s);
+  }
+  int n = snprintf((char*)out, HISTORY_LINE_SIZE, "%lu,%.3f,%.2f,%u,%d,%d,%.3f,%.3f,%u\n",
+                   (unsigned long)s.time, s.totalMv / 1000.0f, s.currentCa / 100.0f, s.soc,
+                   s.mosfetTemp, s.cellTemp, s.cellMinMv / 1000.0f, s.cellMaxMv / 1000.0f, s.pack);
+  return min((size_t)n, (size_t)HISTORY_LINE_SIZE - 1);
 }
 
-// ============================================================================
-// HTML-Templates für das Webinterface
-// ============================================================================
-// Die Templates verwenden Raw String Literals (R"rawliteral(...)rawliteral")
-// um HTML/CSS/JavaScript direkt einzubetten ohne Escape-Zeichen
-
-/**
- * HTML-Header mit CSS-Styles und Navigation
- *
- * Das Design verwendet ein dunkles Farbschema mit Akzentfarbe #4ecca3 (Türkis)
- * und ist vollständig responsiv für mobile Geräte.
- */
-const char* HTML_HEADER = R"rawliteral(
-<!DOCTYPE html>
-<html lang="de">
-<head>
-  <meta charset="UTF-8">
-  <meta name="viewport" content="width=device-width, initial-scale=1.0">
-  <title>LiTime BMS Monitor</title>
-  <style>
-    /* Reset und Basis-Styles */
-    * { box-sizing: border-box; margin: 0; padding: 0; }
-    body { font-family: -apple-system, BlinkMacSystemFont, 'Segoe UI', Roboto, sans-serif; background: #1a1a2e; color: #eee; min-height: 100vh; }
-
-    /* Navigation */
-    .nav { background: #16213e; padding: 1rem; display: flex; gap: 1rem; flex-wrap: wrap; }
-    .nav a { color: #4ecca3; text-decoration: none; padding: 0.5rem 1rem; border-radius: 5px; transition: background 0.3s; }
-    .nav a:hover, .nav a.active { background: #4ecca3; color: #1a1a2e; }
-
-    /* Container und Karten */
-    .container { max-width: 900px; margin: 0 auto; padding: 1rem; }
-    .card { background: #16213e; border-radius: 10px; padding: 1.5rem; margin-bottom: 1rem; }
-    .card h2 { color: #4ecca3; margin-bottom: 1rem; border-bottom: 1px solid #4ecca3; padding-bottom: 0.5rem; }
-
-    /* Grid-Layout für Statistiken */
-    .grid { display: grid; grid-template-columns: repeat(auto-fit, minmax(200px, 1fr)); gap: 1rem; }
-    .stat { background: #1a1a2e; padding: 1rem; border-radius: 8px; text-align: center; }
-    .stat-value { font-size: 1.8rem; font-weight: bold; color: #4ecca3; }
-    .stat-label { font-size: 0.9rem; color: #888; margin-top: 0.3rem; }
-
-    /* Formular-Elemente */
-    input, select { width: 100%; padding: 0.8rem; margin: 0.5rem 0; border: 1px solid #4ecca3; border-radius: 5px; background: #1a1a2e; color: #eee; }
-    button { background: #4ecca3; color: #1a1a2e; padding: 0.8rem 1.5rem; border: none; border-radius: 5px; cursor: pointer; font-weight: bold; margin-top: 0.5rem; }
-    button:hover { background: #3db892; }
-
-    /* Toggle-Switch (iOS-Style) */
-    .toggle { display: flex; align-items: center; gap: 1rem; }
-    .toggle-switch { position: relative; width: 60px; height: 30px; }
-    .toggle-switch input { opacity: 0; width: 0; height: 0; }
-    .slider { position: absolute; cursor: pointer; top: 0; left: 0; right: 0; bottom: 0; background: #ccc; border-radius: 30px; transition: 0.4s; }
-    .slider:before { position: absolute; content: ""; height: 22px; width: 22px; left: 4px; bottom: 4px; background: white; border-radius: 50%; transition: 0.4s; }
-    input:checked + .slider { background: #4ecca3; }
-    input:checked + .slider:before { transform: translateX(30px); }
-
-    /* Status-Badges */
-    .status { padding: 0.3rem 0.8rem; border-radius: 15px; font-size: 0.85rem; }
-    .status.connected { background: #4ecca3; color: #1a1a2e; }
-    .status.disconnected { background: #e74c3c; color: white; }
-
-    /* Zeitanzeige */
-    .time-display { font-size: 2rem; font-weight: bold; color: #4ecca3; text-align: center; padding: 1rem; }
-
-    /* Tabellen */
-    table { width: 100%; border-collapse: collapse; }
-    td { padding: 0.5rem; border-bottom: 1px solid #333; }
-    td:first-child { color: #888; }
-    td:last-child { text-align: right; color: #4ecca3; }
-
-    /* Zellspannungs-Grid */
-    .cell-grid { display: grid; grid-template-columns: repeat(auto-fit, minmax(80px, 1fr)); gap: 0.5rem; }
-    .cell { background: #1a1a2e; padding: 0.5rem; border-radius: 5px; text-align: center; font-size: 0.85rem; }
-    .cell-num { color: #888; font-size: 0.75rem; }
-
-    /* Statusleiste oben */
-    .status-bar { background: #0d1117; padding: 0.5rem 1rem; display: flex; gap: 0.8rem; flex-wrap: wrap; font-size: 0.75rem; border-bottom: 1px solid #333; }
-    .status-item { display: flex; align-items: center; gap: 0.3rem; }
-    .status-dot { width: 8px; height: 8px; border-radius: 50%; }
-    .status-dot.green { background: #4ecca3; }
-    .status-dot.red { background: #e74c3c; }
-    .status-dot.yellow { background: #f39c12; }
-    .status-dot.gray { background: #666; }
-
-    /* Nicht verfügbare Bereiche */
-    .unavailable { opacity: 0.5; }
-    .unavailable-msg { text-align: center; padding: 2rem; color: #888; }
-  </style>
-</head>
-<body>
-  <!-- Hauptnavigation -->
-  <nav class="nav">
-    <a href="/" id="nav-values">Werte</a>
-    <a href="/bluetooth" id="nav-bluetooth">Bluetooth</a>
-    <a href="/cloud" id="nav-cloud">Cloud</a>
-    <a href="/wlan" id="nav-wlan">WLAN</a>
-  </nav>
-  <!-- Statusleiste wird per JavaScript befüllt -->
-  <div class="status-bar" id="statusBar"></div>
-  <div class="container">
-)rawliteral";
-
-/**
- * HTML-Footer mit JavaScript für aktive Navigation
- */
-const char* HTML_FOOTER = R"rawliteral(
-  </div>
-  <script>
-    // Aktiven Navigationspunkt hervorheben
-    const path = window.location.pathname;
-    document.querySelectorAll('.nav a').forEach(a => {
-      if (a.getAttribute('href') === path || (path === '/' && a.id === 'nav-values')) {
-        a.classList.add('active');
-      }
-    });
-  </script>
-</body>
-</html>
-)rawliteral";
-
-// ============================================================================
-// Webseiten-Handler
-// ============================================================================
-
 /**
- * Handler für die Hauptseite (Werte-Übersicht)
- *
- * Zeigt:
- * - Aktuelle Uhrzeit mit NTP-Sync-Status
- * - BMS-Übersicht (SOC, Spannung, Strom, Temperatur)
- * - Detaillierte Werte (alle BMS-Parameter)
- * - Zellspannungen als Grid
+ * Zustand eines laufenden /api/history-Exports
  *
- * Bei fehlender BMS-Verbindung werden die Bereiche ausgegraut
- * und eine entsprechende Meldung angezeigt.
+ * Der Webserver fragt per fill() Stück für Stück nach, sobald Platz im
+ * Sendepuffer ist. Aus dem Ringpuffer wird blockweise kopiert, der
+ * BLE-Task wird dabei nur kurz gesperrt.
  */
-void handleRoot() {
-  String html = HTML_HEADER;
-
-  // Prüfen ob BMS-Daten verfügbar sind (Bluetooth aktiv UND verbunden UND Daten plausibel)
-  bool bmsAvailable = bluetoothEnabled && bmsConnected && bmsDataValid;
-
-  // Zeit-Karte (immer sichtbar)
-  html += R"rawliteral(
-    <div class="card">
-      <h2>Zeit</h2>
-      <div class="time-display" id="currentTime">--:--:--</div>
-      <table>
-        <tr><td>Letzte NTP Synchronisierung</td><td id="lastSync">)rawliteral";
-  html += getLastSyncTimeString();
-  html += R"rawliteral(</td></tr>
-      </table>
-    </div>
-
-    <div class="card)rawliteral";
-  // CSS-Klasse "unavailable" hinzufügen wenn BMS nicht verfügbar
-  if (!bmsAvailable) html += " unavailable";
-  html += R"rawliteral(" id="bmsOverview">
-      <h2>BMS Übersicht</h2>)rawliteral";
-
-  // Bei nicht verfügbarem BMS: Fehlermeldung anzeigen
-  if (!bmsAvailable) {
-    html += R"rawliteral(
-      <div class="unavailable-msg">)rawliteral";
-    // Spezifische Fehlermeldung je nach Ursache
-    if (!bluetoothEnabled) {
-      html += "Bluetooth ist deaktiviert";
-    } else if (!bmsConnected) {
-      html += "Keine Verbindung zum BMS";
-    } else {
-      html += "BMS-Daten nicht verfügbar";
-    }
-    html += R"rawliteral(</div>)rawliteral";
-  } else {
-    // BMS-Übersicht mit den vier wichtigsten Werten
-    html += R"rawliteral(
-      <div class="grid">
-        <div class="stat">
-          <div class="stat-value" id="soc">)rawliteral";
-    html += String(bmsData.soc);
-    html += R"rawliteral(%</div>
-          <div class="stat-label">Ladezustand</div>
-        </div>
-        <div class="stat">
-          <div class="stat-value" id="voltage">)rawliteral";
-    html += String(bmsData.totalVoltage, 2);
-    html += R"rawliteral( V</div>
-          <div class="stat-label">Spannung</div>
-        </div>
-        <div class="stat">
-          <div class="stat-value" id="current">)rawliteral";
-    html += String(bmsData.current, 2);
-    html += R"rawliteral( A</div>
-          <div class="stat-label">Strom</div>
-        </div>
-        <div class="stat">
-          <div class="stat-value" id="temp">)rawliteral";
-    html += String(bmsData.cellTemp);
-    html += R"rawliteral( °C</div>
-          <div class="stat-label">Temperatur</div>
-        </div>
-      </div>)rawliteral";
-  }
-  html += R"rawliteral(
-    </div>
-
-    <div class="card)rawliteral";
-  if (!bmsAvailable) html += " unavailable";
-  html += R"rawliteral(" id="bmsDetails">
-      <h2>Detaillierte Werte</h2>)rawliteral";
-
-  if (!bmsAvailable) {
-    html += R"rawliteral(
-      <div class="unavailable-msg">)rawliteral";
-    if (!bluetoothEnabled) {
-      html += "Bluetooth ist deaktiviert";
-    } else if (!bmsConnected) {
-      html += "Keine Verbindung zum BMS";
-    } else {
-      html += "BMS-Daten nicht verfügbar";
-    }
-    html += R"rawliteral(</div>)rawliteral";
-  } else {
-    // Detaillierte Wertetabelle
-    html += R"rawliteral(
-      <table>
-        <tr><td>Gesamtspannung</td><td id="totalVoltage">)rawliteral";
-    html += String(bmsData.totalVoltage, 2) + " V</td></tr>";
-    html += "<tr><td>Zellspannungssumme</td><td id=\"cellVoltageSum\">" + String(bmsData.cellVoltageSum, 2) + " V</td></tr>";
-    html += "<tr><td>Strom</td><td id=\"currentDetail\">" + String(bmsData.current, 2) + " A</td></tr>";
-    html += "<tr><td>SOC</td><td id=\"socDetail\">" + String(bmsData.soc) + " %</td></tr>";
-    html += "<tr><td>SOH</td><td id=\"soh\">" + bmsData.soh + "</td></tr>";
-    html += "<tr><td>Verbleibende Kapazität</td><td id=\"remainingAh\">" + String(bmsData.remainingAh, 2) + " Ah</td></tr>";
-    html += "<tr><td>Volle Kapazität</td><td id=\"fullCapacity\">" + String(bmsData.fullCapacityAh, 2) + " Ah</td></tr>";
-    html += "<tr><td>MOSFET Temperatur</td><td id=\"mosfetTemp\">" + String(bmsData.mosfetTemp) + " °C</td></tr>";
-    html += "<tr><td>Zellen Temperatur</td><td id=\"cellTempDetail\">" + String(bmsData.cellTemp) + " °C</td></tr>";
-    html += "<tr><td>Batteriestatus</td><td id=\"batteryState\">" + bmsData.batteryState + "</td></tr>";
-    html += "<tr><td>Schutzstatus</td><td id=\"protectionState\">" + bmsData.protectionState + "</td></tr>";
-    html += "<tr><td>Fehlerstatus</td><td id=\"failureState\">" + bmsData.failureState + "</td></tr>";
-    html += "<tr><td>Heizung</td><td id=\"heatState\">" + bmsData.heatState + "</td></tr>";
-    html += "<tr><td>Entladezyklen</td><td id=\"discharges\">" + String(bmsData.dischargesCount) + "</td></tr>";
-    html += "<tr><td>Entladene Ah</td><td id=\"dischargesAh\">" + String(bmsData.dischargesAhCount, 2) + " Ah</td></tr>";
-    html += R"rawliteral(
-      </table>)rawliteral";
-  }
-  html += R"rawliteral(
-    </div>
-
-    <div class="card)rawliteral";
-  if (!bmsAvailable) html += " unavailable";
-  html += R"rawliteral(" id="bmsCells">
-      <h2>Zellspannungen</h2>)rawliteral";
-
-  if (!bmsAvailable) {
-    html += R"rawliteral(
-      <div class="unavailable-msg">)rawliteral";
-    if (!bluetoothEnabled) {
-      html += "Bluetooth ist deaktiviert";
-    } else if (!bmsConnected) {
-      html += "Keine Verbindung zum BMS";
-    } else {
-      html += "BMS-Daten nicht verfügbar";
-    }
-    html += R"rawliteral(</div>)rawliteral";
-  } else {
-    // Zellspannungen als Grid
-    html += R"rawliteral(
-      <div class="cell-grid" id="cellGrid">)rawliteral";
-    for (size_t i = 0; i < bmsData.cellVoltages.size(); i++) {
-      html += "<div class=\"cell\"><div class=\"cell-num\">Zelle " + String(i + 1) + "</div>";
-      html += String(bmsData.cellVoltages[i], 3) + " V</div>";
-    }
-    html += R"rawliteral(
-      </div>)rawliteral";
-  }
-  html += R"rawliteral(
-    </div>
-
-    <script>
-      /**
-       * Aktualisiert die Statusleiste mit aktuellen Verbindungsstatus
-       * Wird alle 2 Sekunden aufgerufen
-       */
-      function updateStatusBar() {
-        fetch('/api/status').then(r => r.json()).then(s => {
-          let html = '';
-          // WLAN-Status: grün=verbunden, gelb=AP-Modus, rot=getrennt
-          html += '<div class="status-item"><div class="status-dot ' + (s.wlanConnected ? 'green' : (s.apMode ? 'yellow' : 'red')) + '"></div>WLAN: ' + (s.apMode ? 'AP' : (s.wlanConnected ? 'OK' : 'Aus')) + '</div>';
-          // Internet: grün wenn NTP erfolgreich war
-          html += '<div class="status-item"><div class="status-dot ' + (s.internetOk ? 'green' : 'red') + '"></div>Internet</div>';
-          // NTP: grün wenn synchronisiert
-          html += '<div class="status-item"><div class="status-dot ' + (s.ntpSynced ? 'green' : 'red') + '"></div>NTP</div>';
-          // Terminal: grün=aktiviert, grau=deaktiviert
-          html += '<div class="status-item"><div class="status-dot ' + (s.serialEnabled ? 'green' : 'gray') + '"></div>Terminal</div>';
-          // Bluetooth: grün=aktiviert, grau=deaktiviert
-          html += '<div class="status-item"><div class="status-dot ' + (s.btEnabled ? 'green' : 'gray') + '"></div>Bluetooth</div>';
-          // BMS: grün=verbunden, rot=getrennt
-          html += '<div class="status-item"><div class="status-dot ' + (s.bmsConnected ? 'green' : 'red') + '"></div>BMS</div>';
-          // Cloud: grün=OK, rot=Fehler, grau=deaktiviert
-          html += '<div class="status-item"><div class="status-dot ' + (s.cloudEnabled ? (s.cloudOk ? 'green' : 'red') : 'gray') + '"></div>Cloud</div>';
-          document.getElementById('statusBar').innerHTML = html;
-        });
+struct HistoryExport {
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  uint32_t step = 0;
+  int16_t pack = -1;        // Nur Einträge dieses Packs (-1 = alle)
+  bool csv = true;
+  uint32_t offset = 0;      // Laufzeit -> Unix-Zeit
+  uint32_t next = 0;        // Nächster zu lesender Eintrag (fortlaufend gezählt)
+  uint32_t end = 0;         // Ende des beim Start gültigen Bereichs
+  bool finished = false;
+  HistoryBucket bucket;
+
+  HistorySample chunk[HISTORY_EXPORT_CHUNK];  // Kopie aus dem Ringpuffer
+  size_t chunkLength = 0;
+  size_t chunkPos = 0;
+
+  uint8_t pending[HISTORY_LINE_SIZE];  // Noch nicht gesendete Zeile/Datensatz
+  size_t pendingLength = 0;
+  size_t pendingPos = 0;
+
+  /**
+   * Füllt den Sendepuffer des Webservers
+   *
+   * @return Anzahl Bytes (0 = Export beendet)
+   */
+  size_t fill(uint8_t* buffer, size_t maxLen) {
+    size_t written = 0;
+    while (written < maxLen) {
+      if (pendingPos < pendingLength) {
+        size_t n = min(maxLen - written, pendingLength - pendingPos);
+        memcpy(buffer + written, pending + pendingPos, n);
+        written += n;
+        pendingPos += n;
+        continue;
       }
+      if (!produce()) break;
+    }
+    return written;
+  }
 
-      /**
-       * Aktualisiert die Zeitanzeige
-       * Wird jede Sekunde aufgerufen
-       */
-      function updateTime() {
-        fetch('/api/time').then(r => r.json()).then(data => {
-          document.getElementById('currentTime').textContent = data.time;
-        });
+private:
+  /**
+   * Holt den nächsten Eintrag aus dem Ringpuffer
+   *
+   * Inzwischen überschriebene Einträge werden übersprungen.
+   */
+  bool readSample(HistorySample& out) {
+    if (chunkPos == chunkLength) {
+      if (next >= end) return false;
+      xSemaphoreTake(historyMutex, portMAX_DELAY);
+      uint32_t oldest = historyTotal - historyCount;
+      if (next < oldest) next = oldest;
+      if (next >= end) {
+        // Bereich komplett überschrieben
+        xSemaphoreGive(historyMutex);
+        return false;
       }
-
-      /**
-       * Aktualisiert alle BMS-Daten auf der Seite
-       * Wird jede Sekunde aufgerufen
-       */
-      function updateData() {
-        fetch('/api/data').then(r => r.json()).then(data => {
-          // Prüfen ob BMS-Daten verfügbar sind
-          if (!data.available) {
-            // Bereiche ausgrauen wenn nicht verfügbar
-            ['bmsOverview', 'bmsDetails', 'bmsCells'].forEach(id => {
-              document.getElementById(id).classList.add('unavailable');
-            });
-            return;
-          }
-          // Bereiche wieder aktivieren
-          ['bmsOverview', 'bmsDetails', 'bmsCells'].forEach(id => {
-            document.getElementById(id).classList.remove('unavailable');
-          });
-          // Alle Werte aktualisieren (nur wenn Elemente existieren)
-          if (document.getElementById('soc')) {
-            document.getElementById('soc').textContent = data.soc + '%';
-            document.getElementById('voltage').textContent = data.totalVoltage.toFixed(2) + ' V';
-            document.getElementById('current').textContent = data.current.toFixed(2) + ' A';
-            document.getElementById('temp').textContent = data.cellTemp + ' °C';
-            document.getElementById('totalVoltage').textContent = data.totalVoltage.toFixed(2) + ' V';
-            document.getElementById('cellVoltageSum').textContent = data.cellVoltageSum.toFixed(2) + ' V';
-            document.getElementById('currentDetail').textContent = data.current.toFixed(2) + ' A';
-            document.getElementById('socDetail').textContent = data.soc + ' %';
-            document.getElementById('soh').textContent = data.soh;
-            document.getElementById('remainingAh').textContent = data.remainingAh.toFixed(2) + ' Ah';
-            document.getElementById('fullCapacity').textContent = data.fullCapacityAh.toFixed(2) + ' Ah';
-            document.getElementById('mosfetTemp').textContent = data.mosfetTemp + ' °C';
-            document.getElementById('cellTempDetail').textContent = data.cellTemp + ' °C';
-            document.getElementById('batteryState').textContent = data.batteryState;
-            document.getElementById('protectionState').textContent = data.protectionState;
-            document.getElementById('failureState').textContent = data.failureState;
-            document.getElementById('heatState').textContent = data.heatState;
-            document.getElementById('discharges').textContent = data.dischargesCount;
-            document.getElementById('dischargesAh').textContent = data.dischargesAhCount.toFixed(2) + ' Ah';
-
-            // Zellspannungen dynamisch neu rendern
-            let cellHtml = '';
-            data.cellVoltages.forEach((v, i) => {
-              cellHtml += '<div class="cell"><div class="cell-num">Zelle ' + (i+1) + '</div>' + v.toFixed(3) + ' V</div>';
-            });
-            document.getElementById('cellGrid').innerHTML = cellHtml;
-          }
-        });
+      chunkLength = min((uint32_t)HISTORY_EXPORT_CHUNK, end - next);
+      for (size_t i = 0; i < chunkLength; i++) {
+        chunk[i] = historyBuffer[(next + i) % HISTORY_CAPACITY];
       }
+      xSemaphoreGive(historyMutex);
+      next += chunkLength;
+      chunkPos = 0;
+      if (chunkLength == 0) return false;
+    }
+    out = chunk[chunkPos++];
+    return true;
+  }
 
-      // Update-Intervalle starten
-      setInterval(updateStatusBar, 2000);  // Statusleiste alle 2 Sekunden
-      setInterval(updateTime, 1000);        // Zeit jede Sekunde
-      setInterval(updateData, 1000);        // BMS-Daten jede Sekunde
-
-      // Sofort beim Laden aktualisieren
-      updateStatusBar();
-      updateTime();
-      updateData();
-    </script>
-  )rawliteral";
-
-  html += HTML_FOOTER;
-  server.send(200, "text/html", html);
-}
-
-/**
- * Handler für die Bluetooth-Einstellungsseite
- *
- * Ermöglicht:
- * - Bluetooth ein-/ausschalten
- * - Terminal-Ausgabe ein-/ausschalten
- * - BMS MAC-Adresse konfigurieren
- * - Abfrageintervall einstellen
- */
-void handleBluetooth() {
-  String html = HTML_HEADER;
-
-  html += R"rawliteral(
-    <div class="card">
-      <h2>Bluetooth Verbindung</h2>
-      <div style="display: flex; align-items: center; gap: 1rem; margin-bottom: 1rem;">
-        <span>Status:</span>
-        <span class="status )rawliteral";
-  // Verbindungsstatus als Badge
-  html += bmsConnected ? "connected\">Verbunden" : "disconnected\">Getrennt";
-  html += R"rawliteral(</span>
-      </div>
-      <!-- Toggle für Bluetooth -->
-      <div class="toggle">
-        <span>Bluetooth aktivieren</span>
-        <label class="toggle-switch">
-          <input type="checkbox" id="btToggle" )rawliteral";
-  html += bluetoothEnabled ? "checked" : "";
-  html += R"rawliteral( onchange="toggleBluetooth(this.checked)">
-          <span class="slider"></span>
-        </label>
-      </div>
-      <!-- Toggle für Terminal-Ausgabe -->
-      <div class="toggle" style="margin-top:1rem;">
-        <span>Terminal-Ausgabe</span>
-        <label class="toggle-switch">
-          <input type="checkbox" id="serialToggle" )rawliteral";
-  html += serialOutputEnabled ? "checked" : "";
-  html += R"rawliteral( onchange="toggleSerial(this.checked)">
-          <span class="slider"></span>
-        </label>
-      </div>
-    </div>
-
-    <div class="card">
-      <h2>Einstellungen</h2>
-      <label>BMS MAC-Adresse</label>
-      <input type="text" id="bmsMac" value=")rawliteral";
-  html += bmsMac;
-  html += R"rawliteral(" placeholder="XX:XX:XX:XX:XX:XX" style="font-family: monospace;">
-      <label>Abfrageintervall (Sekunden)</label>
-      <input type="number" id="interval" value=")rawliteral";
-  html += String(bmsInterval);
-  html += R"rawliteral(" min="5" max="300">
-      <button onclick="saveSettings()">Speichern</button>
-    </div>
-
-    <script>
-      // Terminal-Ausgabe umschalten
-      function toggleSerial(enabled) {
-        fetch('/api/serial', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({enabled: enabled})
-        });
+  /**
+   * Schreibt die nächste Ausgabezeile nach pending
+   *
+   * @return false wenn keine Einträge mehr folgen
+   */
+  bool produce() {
+    pendingPos = 0;
+    pendingLength = 0;
+    HistorySample s;
+    while (!finished) {
+      if (!readSample(s)) {
+        // Letztes Intervall ausgeben
+        finished = true;
+        if (bucket.count > 0) {
+          pendingLength = formatHistorySample(pending, bucket.average(), csv);
+          return true;
+        }
+        return false;
       }
 
-      // Bluetooth umschalten
-      function toggleBluetooth(enabled) {
-        fetch('/api/bluetooth', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({enabled: enabled})
-        }).then(() => location.reload());
-      }
+      s.time += offset;
+      if (s.time < from || s.time > to) continue;
+      if (pack >= 0 && s.pack != pack) continue;
 
-      // Einstellungen speichern (MAC und Intervall)
-      function saveSettings() {
-        const mac = document.getElementById('bmsMac').value;
-        const interval = document.getElementById('interval').value;
-        fetch('/api/bms-settings', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({mac: mac, interval: parseInt(interval)})
-        }).then(() => {
-          alert('Gespeichert! Gerät startet neu...');
-          setTimeout(() => location.reload(), 3000);
-        });
+      if (step == 0) {
+        pendingLength = formatHistorySample(pending, s, csv);
+        return true;
       }
-    </script>
-  )rawliteral";
-
-  html += HTML_FOOTER;
-  server.send(200, "text/html", html);
-}
 
-// ============================================================================
-// Home Assistant Webhook
-// ============================================================================
+      // Neues Intervall: vorheriges als Mittelwert ausgeben
+      uint32_t start = s.time - (s.time % step);
+      if (bucket.count > 0 && start != bucket.start) {
+        pendingLength = formatHistorySample(pending, bucket.average(), csv);
+        bucket = HistoryBucket();
+        bucket.start = start;
+        bucket.add(s);
+        return true;
+      }
+      bucket.start = start;
+      bucket.add(s);
+    }
+    return false;
+  }
+};
 
 /**
- * Sendet alle BMS-Daten als JSON an den Home Assistant Webhook
+ * GET /api/history - Exportiert die Messwert-Historie aus dem Ringpuffer
  *
- * Prüft vor dem Senden:
- * - Ob Webhook aktiviert ist
- * - Ob eine URL konfiguriert ist
- * - Ob WLAN verbunden ist
- * - Ob BMS-Daten plausibel sind
+ * Parameter (alle optional):
+ * - from, to: Zeitraum in Sekunden (Unix-Zeit, ohne NTP: Laufzeit)
+ * - step: Zusammenfassen auf ein Raster von step Sekunden (Mittelwerte,
+ *         Zellspannung min/max über das Intervall); 0 = Einzelwerte
+ * - format: "csv" (Standard) oder "bin"
+ * - pack: nur Einträge dieses Packs (Standard: alle; mit step nur Pack 0,
+ *         damit Mittelwerte nicht über mehrere Batterien gebildet werden)
  *
- * @return true wenn erfolgreich gesendet, sonst false
+ * CSV: time,voltage,current,soc,mosfet_temp,cell_temp,cell_min,cell_max,pack
+ * Binär: 8 Byte Kopf ("BMSH", Version 1, Datensatzgröße 16, Zeitbasis
+ * 1 = Unix / 0 = Laufzeit, 0) gefolgt von HistorySample-Datensätzen.
+ * Die Zeitbasis steht zusätzlich im Header X-History-Time-Base.
+ *
+ * Die Antwort wird als Chunked-Antwort erst beim Senden aus dem
+ * Ringpuffer erzeugt (siehe HistoryExport).
  */
-bool sendToHomeAssistant() {
-  // Prüfen ob Webhook überhaupt senden soll
-  if (!haEnabled || haWebhookUrl.length() == 0 || apMode) {
-    return false;
-  }
-
-  // WLAN-Verbindung prüfen
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("[HA] Kein WLAN - überspringe Webhook");
-    lastHaTime = getCurrentTimeString();
-    lastHaHttpCode = -1;
-    lastHaResponse = "Kein WLAN";
-    return false;
+void handleApiHistory(AsyncWebServerRequest* request) {
+  std::shared_ptr<HistoryExport> state = std::make_shared<HistoryExport>();
+
+  // Umrechnung Laufzeit -> Unix-Zeit (nur wenn NTP synchronisiert ist)
+  bool unixTime = (lastSyncTime > 0);
+  state->offset = unixTime ? (uint32_t)(time(nullptr) - uptimeSeconds()) : 0;
+
+  state->from = getUIntParam(request, "from", 0);
+  state->to = getUIntParam(request, "to", UINT32_MAX);
+  state->step = getUIntParam(request, "step", 0);
+  if (request->hasParam("pack")) {
+    state->pack = min(getUIntParam(request, "pack", 0), (uint32_t)BMS_MAX_PACKS - 1);
+  } else if (state->step > 0) {
+    state->pack = 0;
   }
+  state->csv = !(request->hasParam("format") && request->getParam("format")->value() == "bin");
 
-  // Daten-Plausibilität prüfen
-  if (!bmsDataValid) {
-    Serial.println("[HA] BMS-Daten nicht plausibel - überspringe Webhook");
-    lastHaTime = getCurrentTimeString();
-    lastHaHttpCode = -1;
-    lastHaResponse = "BMS-Daten nicht plausibel";
-    return false;
+  // Kopfzeile bzw. Binär-Kopf als erste Ausgabe
+  if (state->csv) {
+    const char* header = "time,voltage,current,soc,mosfet_temp,cell_temp,cell_min,cell_max,pack\n";
+    state->pendingLength = strlen(header);
+    memcpy(state->pending, header, state->pendingLength);
+  } else {
+    const uint8_t header[8] = { 'B', 'M', 'S', 'H', 1, sizeof(HistorySample), (uint8_t)(unixTime ? 1 : 0), 0 };
+    state->pendingLength = sizeof(header);
+    memcpy(state->pending, header, sizeof(header));
   }
 
-  // HTTP-Client konfigurieren mit Timeouts
-  HTTPClient http;
-  http.setTimeout(10000);       // Gesamttimeout: 10 Sekunden
-  http.setConnectTimeout(5000); // Verbindungsaufbau: 5 Sekunden
-  http.begin(haWebhookUrl);
-  http.addHeader("Content-Type", "application/json");
-
-  // JSON-Dokument erstellen
-  JsonDocument doc;
-  doc["device"] = "litime-bms";
-  doc["mac"] = macAddress;
-  doc["timestamp"] = getCurrentTimeString();
-  doc["connected"] = bmsConnected;
-
-  // Batterie-Daten als Unterobjekt
-  JsonObject battery = doc["battery"].to<JsonObject>();
-  battery["voltage"] = bmsData.totalVoltage;
-  battery["current"] = bmsData.current;
-  battery["soc"] = bmsData.soc;
-  battery["soh"] = bmsData.soh;
-  battery["remaining_ah"] = bmsData.remainingAh;
-  battery["full_capacity_ah"] = bmsData.fullCapacityAh;
+  // Bereich der beim Start gültigen Einträge
+  xSemaphoreTake(historyMutex, portMAX_DELAY);
+  state->next = historyTotal - historyCount;
+  state->end = historyTotal;
+  xSemaphoreGive(historyMutex);
 
-  // Temperaturen als Unterobjekt
-  JsonObject temps = doc["temperature"].to<JsonObject>();
-  temps["mosfet"] = bmsData.mosfetTemp;
-  temps["cells"] = bmsData.cellTemp;
+  AsyncWebServerResponse* response = request->beginChunkedResponse(
+    state->csv ? "text/csv" : "application/octet-stream",
+    [state](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      return state->fill(buffer, maxLen);
+    });
+  response->addHeader("X-History-Time-Base", unixTime ? "unix" : "uptime");
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
 
-  // Status-Informationen als Unterobjekt
-  JsonObject status = doc["status"].to<JsonObject>();
-  status["battery_state"] = bmsData.batteryState;
-  status["protection_state"] = bmsData.protectionState;
-  status["failure_state"] = bmsData.failureState;
-  status["heat_state"] = bmsData.heatState;
+/**
+ * GET /api/status - Gibt Systemstatus für Statusleiste zurück
+ */
+void handleApiStatus(AsyncWebServerRequest* request) {
+  char buf[STATUS_JSON_SIZE];
+  JsonWriter json(buf, sizeof(buf));
+  writeStatusJson(json, nullptr, true);
+  sendJsonBuffer(request, buf, json.length());
+}
 
-  // Zellspannungen als Array
-  JsonArray cells = doc["cell_voltages"].to<JsonArray>();
-  for (float v : bmsData.cellVoltages) {
-    cells.add(v);
+/**
+ * Schreibt die Messwerte eines Zeitabschnitts als JSON-Objekt
+ *
+ * Das Histogramm endet mit der letzten belegten Klasse.
+ *
+ * @param json Ziel (innerhalb eines Arrays)
+ * @param name Name des Abschnitts bzw. Pfad der Route
+ * @param stats Messwerte (ältere Generation = noch keine Messung seit dem Zurücksetzen)
+ */
+void writePerfStats(JsonWriter& json, const char* name, const PerfStats& stats) {
+  bool current = stats.generation == perfGeneration;
+  uint32_t count = current ? stats.count : 0;
+  uint64_t totalUs = current ? stats.total() : 0;
+  json.beginObject();
+  json.addString("name", name);
+  json.addUInt("count", count);
+  json.addFixed("totalMs", (long)(totalUs / 1000), 0);
+  json.addUInt("avgUs", count > 0 ? (unsigned long)(totalUs / count) : 0);
+  json.addUInt("maxUs", current ? stats.maxUs : 0);
+  json.beginArray("hist");
+  uint8_t used = 0;
+  for (uint8_t i = 0; current && i < PERF_BUCKET_COUNT; i++) {
+    if (stats.buckets[i] > 0) used = i + 1;
   }
+  for (uint8_t i = 0; i < used; i++) {
+    json.addUInt(nullptr, stats.buckets[i]);
+  }
+  json.endArray();
+  json.endObject();
+}
 
-  // Statistiken als Unterobjekt
-  JsonObject stats = doc["statistics"].to<JsonObject>();
-  stats["discharge_cycles"] = bmsData.dischargesCount;
-  stats["discharged_ah"] = bmsData.dischargesAhCount;
-
-  // JSON serialisieren und senden
-  String payload;
-  serializeJson(doc, payload);
-
-  int httpCode = http.POST(payload);
-
-  // Status für Anzeige im Webinterface speichern
-  lastHaTime = getCurrentTimeString();
-  lastHaHttpCode = httpCode;
-
-  if (httpCode > 0) {
-    // Erfolgreiche Antwort (auch Fehler wie 404 etc.)
-    lastHaResponse = http.getString();
-    // Response auf 200 Zeichen kürzen für Anzeige
-    if (lastHaResponse.length() > 200) {
-      lastHaResponse = lastHaResponse.substring(0, 200) + "...";
-    }
-  } else {
-    // Negative Codes sind Verbindungsfehler
-    switch (httpCode) {
-      case -1: lastHaResponse = "Verbindung fehlgeschlagen"; break;
-      case -2: lastHaResponse = "Senden fehlgeschlagen"; break;
-      case -3: lastHaResponse = "Kein Stream"; break;
-      case -4: lastHaResponse = "Keine HTTP-Verbindung"; break;
-      case -5: lastHaResponse = "Verbindung verloren"; break;
-      case -11: lastHaResponse = "Timeout"; break;
-      default: lastHaResponse = "Fehler " + String(httpCode);
+/**
+ * Zustand einer laufenden /api/perf-Antwort
+ *
+ * Schreibt Kopf, je einen Eintrag pro Zeitabschnitt bzw. Route und den
+ * Abschluss nacheinander in einen kleinen Puffer, während der Server sendet.
+ */
+struct PerfExport {
+  uint32_t sinceS = 0;   // Sekunden seit dem Zurücksetzen (beim Start der Anfrage)
+  uint8_t step = 0;      // 0 = Kopf, dann Zeitabschnitte, Routen, "other", Abschluss
+
+  char pending[PERF_ENTRY_SIZE];  // Noch nicht gesendeter Text
+  size_t pendingLength = 0;
+  size_t pendingPos = 0;
+
+  /**
+   * Füllt den Sendepuffer des Webservers
+   *
+   * @return Anzahl Bytes (0 = Antwort vollständig)
+   */
+  size_t fill(uint8_t* buffer, size_t maxLen) {
+    size_t written = 0;
+    while (written < maxLen) {
+      if (pendingPos < pendingLength) {
+        size_t n = min(maxLen - written, pendingLength - pendingPos);
+        memcpy(buffer + written, pending + pendingPos, n);
+        written += n;
+        pendingPos += n;
+        continue;
+      }
+      if (!produce()) break;
     }
+    return written;
   }
 
-  http.end();
+private:
+  /**
+   * Übernimmt festen Text nach pending
+   */
+  void text(const char* value) {
+    pendingLength = strlen(value);
+    memcpy(pending, value, pendingLength);
+  }
 
-  // Erfolg loggen
-  if (httpCode == 200) {
-    Serial.println("[HA] Daten erfolgreich gesendet");
+  /**
+   * Schreibt einen Eintrag nach pending (ab dem zweiten mit Komma davor)
+   */
+  void entry(const char* name, const PerfStats& stats, bool first) {
+    size_t offset = first ? 0 : 1;
+    pending[0] = ',';
+    JsonWriter json(pending + offset, sizeof(pending) - offset);
+    writePerfStats(json, name, stats);
+    pendingLength = json.length() > 0 ? offset + json.length() : 0;
+  }
+
+  /**
+   * Schreibt den nächsten Abschnitt der Antwort nach pending
+   *
+   * @return false wenn die Antwort vollständig ist
+   */
+  bool produce() {
+    pendingPos = 0;
+    pendingLength = 0;
+    uint8_t routeStart = 1 + PERF_PROBE_COUNT;
+    if (step == 0) {
+      pendingLength = snprintf(pending, sizeof(pending),
+                               "{\"sinceS\":%lu,\"bucketsUs\":\"2^i\",\"probes\":[", (unsigned long)sinceS);
+    } else if (step < routeStart) {
+      uint8_t i = step - 1;
+      entry(PERF_PROBE_NAMES[i], perfProbes[i], i == 0);
+    } else if (step == routeStart) {
+      text("],\"routes\":[");
+    } else if (step <= routeStart + perfRouteCount) {
+      uint8_t i = step - routeStart - 1;
+      entry(perfRouteNames[i], perfRoutes[i], i == 0);
+    } else if (step == routeStart + perfRouteCount + 1) {
+      entry("other", perfRoutes[PERF_MAX_ROUTES], perfRouteCount == 0);
+    } else if (step == routeStart + perfRouteCount + 2) {
+      text("]}");
+    } else {
+      return false;
+    }
+    step++;
     return true;
-  } else {
-    Serial.printf("[HA] Fehler: HTTP %d - %s\n", httpCode, lastHaResponse.c_str());
-    return false;
   }
+};
+
+/**
+ * GET /api/perf - Laufzeitprofil von loop(), Tasks und HTTP-Routen
+ *
+ * Antwort: {"sinceS": 120, "bucketsUs": "2^i", "probes": [...], "routes": [...]}
+ * Je Eintrag: count, totalMs, avgUs, maxUs und hist (Anzahl je Klasse
+ * [2^i, 2^(i+1)) µs, i ab 0; ohne leere Klassen am Ende).
+ *
+ * Die Antwort wird als Chunked-Antwort Eintrag für Eintrag erzeugt (siehe
+ * PerfExport), pro Anfrage wird nur dieser Zustand angelegt.
+ */
+void handleApiPerf(AsyncWebServerRequest* request) {
+  std::shared_ptr<PerfExport> state = std::make_shared<PerfExport>();
+  state->sinceS = (uint32_t)((esp_timer_get_time() - perfResetAt) / 1000000);
+
+  AsyncWebServerResponse* response = request->beginChunkedResponse(
+    "application/json",
+    [state](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      return state->fill(buffer, maxLen);
+    });
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
 }
 
 /**
- * Handler für die Cloud-Einstellungsseite (Home Assistant)
- *
- * Ermöglicht:
- * - Webhook aktivieren/deaktivieren
- * - Webhook-URL konfigurieren
- * - Sendeintervall einstellen
- * - Test-Webhook senden
- * - Letzten Webhook-Status anzeigen
- * - JSON-Vorschau anzeigen
- */
-void handleCloud() {
-  String html = HTML_HEADER;
-
-  html += R"rawliteral(
-    <div class="card">
-      <h2>Home Assistant</h2>
-      <p style="color:#888;margin-bottom:1rem;">Sendet BMS-Daten per Webhook an Home Assistant.</p>
-
-      <div class="toggle" style="margin-bottom:1rem;">
-        <span>Webhook aktivieren</span>
-        <label class="toggle-switch">
-          <input type="checkbox" id="haEnabled" )rawliteral";
-  html += haEnabled ? "checked" : "";
-  html += R"rawliteral( onchange="toggleHA(this.checked)">
-          <span class="slider"></span>
-        </label>
-      </div>
-
-      <label>Webhook URL</label>
-      <input type="text" id="haWebhook" value=")rawliteral";
-  html += haWebhookUrl;
-  html += R"rawliteral(" placeholder="http://homeassistant.local:8123/api/webhook/WEBHOOK_ID">
-
-      <label>Sendeintervall (Sekunden)</label>
-      <input type="number" id="haInterval" value=")rawliteral";
-  html += String(haInterval);
-  html += R"rawliteral(" min="10" max="3600">
-
-      <button onclick="saveHA()">Speichern</button>
-      <button onclick="testHA()" style="background:#666;margin-left:0.5rem;">Jetzt senden</button>
-    </div>
-
-    <div class="card">
-      <h2>Letzter Webhook</h2>
-      <table>
-        <tr><td>Zeitpunkt</td><td id="lastTime">)rawliteral";
-  html += lastHaTime.length() > 0 ? lastHaTime : "Noch nicht gesendet";
-  html += R"rawliteral(</td></tr>
-        <tr><td>HTTP Status</td><td id="lastCode">)rawliteral";
-  // HTTP-Statuscode als farbiges Badge
-  if (lastHaHttpCode > 0) {
-    html += "<span class=\"status " + String(lastHaHttpCode == 200 ? "connected" : "disconnected") + "\">" + String(lastHaHttpCode) + "</span>";
-  } else {
-    html += "-";
-  }
-  html += R"rawliteral(</td></tr>
-        <tr><td>Response</td><td id="lastResponse" style="word-break:break-all;">)rawliteral";
-  html += lastHaResponse.length() > 0 ? lastHaResponse : "-";
-  html += R"rawliteral(</td></tr>
-      </table>
-    </div>
-
-    <div class="card">
-      <h2>JSON Vorschau</h2>
-      <p style="color:#888;margin-bottom:0.5rem;">Diese Daten werden an Home Assistant gesendet:</p>
-      <pre id="jsonPreview" style="background:#1a1a2e;padding:1rem;border-radius:8px;overflow-x:auto;font-size:0.8rem;color:#4ecca3;"></pre>
-      <button onclick="refreshPreview()">Aktualisieren</button>
-    </div>
-
-    <script>
-      // Webhook aktivieren/deaktivieren
-      function toggleHA(enabled) {
-        fetch('/api/ha-settings', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({enabled: enabled, url: document.getElementById('haWebhook').value, interval: parseInt(document.getElementById('haInterval').value)})
-        }).then(() => location.reload());
-      }
+ * POST /api/perf-reset - Laufzeitprofil zurücksetzen
+ *
+ * Die Zähler werden vom jeweils schreibenden Task beim nächsten Messwert
+ * geleert (siehe PerfStats::record()).
+ */
+void handleApiPerfReset(AsyncWebServerRequest* request) {
+  perfResetAt = esp_timer_get_time();
+  perfGeneration = perfGeneration + 1;
+  sendJsonText(request, "{\"success\":true}");
+}
 
-      // Webhook-Einstellungen speichern
-      function saveHA() {
-        const url = document.getElementById('haWebhook').value;
-        const interval = document.getElementById('haInterval').value;
-        const enabled = document.getElementById('haEnabled').checked;
-        fetch('/api/ha-settings', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({enabled: enabled, url: url, interval: parseInt(interval)})
-        }).then(() => {
-          alert('Gespeichert!');
-        });
-      }
+// Puffer für eine Metrik-Familie (HELP, TYPE und alle Werte, z.B. alle Zellen eines Packs)
+#define METRICS_FAMILY_SIZE 1024
 
-      // Test-Webhook senden
-      function testHA() {
-        fetch('/api/ha-test', {method: 'POST'})
-          .then(r => r.json())
-          .then(d => {
-            location.reload();
-          });
-      }
+/**
+ * Beschreibung einer Batterie-Metrik (ein Wert je Pack)
+ */
+struct BatteryMetric {
+  const char* name;
+  const char* type;
+  const char* help;
+};
+
+// Batterie-Familien 0-8, Wert siehe batteryMetricValue(); Familie 9 sind die Zellen
+const BatteryMetric BATTERY_METRICS[] = {
+  { "litime_battery_voltage_volts", "gauge", "Gesamtspannung" },
+  { "litime_battery_current_amperes", "gauge", "Strom (negativ = Entladen)" },
+  { "litime_battery_soc_percent", "gauge", "Ladezustand" },
+  { "litime_battery_remaining_ampere_hours", "gauge", "Verbleibende Kapazität" },
+  { "litime_battery_capacity_ampere_hours", "gauge", "Volle Kapazität" },
+  { "litime_battery_mosfet_temperature_celsius", "gauge", "MOSFET-Temperatur" },
+  { "litime_battery_cell_temperature_celsius", "gauge", "Zellentemperatur" },
+  { "litime_battery_discharge_cycles_total", "counter", "Entladezyklen" },
+  { "litime_battery_discharged_ampere_hours_total", "counter", "Entladene Ah über die Lebensdauer" },
+};
+#define BATTERY_METRIC_COUNT (sizeof(BATTERY_METRICS) / sizeof(BATTERY_METRICS[0]))
 
-      // JSON-Vorschau aktualisieren
-      function refreshPreview() {
-        fetch('/api/data').then(r => r.json()).then(data => {
-          const preview = {
-            device: "litime-bms",
-            mac: ")rawliteral";
-  html += macAddress;
-  html += R"rawliteral(",
-            timestamp: new Date().toLocaleString('de-DE'),
-            connected: data.connected,
-            battery: {
-              voltage: data.totalVoltage,
-              current: data.current,
-              soc: data.soc,
-              soh: data.soh,
-              remaining_ah: data.remainingAh,
-              full_capacity_ah: data.fullCapacityAh
-            },
-            temperature: {
-              mosfet: data.mosfetTemp,
-              cells: data.cellTemp
-            },
-            status: {
-              battery_state: data.batteryState,
-              protection_state: data.protectionState,
-              failure_state: data.failureState,
-              heat_state: data.heatState
-            },
-            cell_voltages: data.cellVoltages,
-            statistics: {
-              discharge_cycles: data.dischargesCount,
-              discharged_ah: data.dischargesAhCount
-            }
-          };
-          document.getElementById('jsonPreview').textContent = JSON.stringify(preview, null, 2);
-        });
-      }
+/**
+ * Wert einer Batterie-Metrik aus einer Messung
+ *
+ * @param index Index in BATTERY_METRICS
+ * @param data Messung
+ * @return Wert in der Einheit der Metrik
+ */
+double batteryMetricValue(uint8_t index, const BMSData& data) {
+  switch (index) {
+    case 0: return data.totalMv / 1000.0;
+    case 1: return data.currentMa / 1000.0;
+    case 2: return data.soc;
+    case 3: return data.remainingMah / 1000.0;
+    case 4: return data.fullCapacityMah / 1000.0;
+    case 5: return data.mosfetTemp;
+    case 6: return data.cellTemp;
+    case 7: return data.dischargesCount;
+    case 8: return data.dischargesMah / 1000.0;
+    default: return 0;
+  }
+}
 
-      // Vorschau beim Laden aktualisieren
-      refreshPreview();
-    </script>
-  )rawliteral";
-
-  html += HTML_FOOTER;
-  server.send(200, "text/html", html);
-}
-
-/**
- * Handler für die WLAN-Einstellungsseite
- *
- * Ermöglicht:
- * - WLAN-Status anzeigen (AP-Modus oder verbunden)
- * - Verfügbare Netzwerke scannen
- * - Mit neuem Netzwerk verbinden
- * - WLAN zurücksetzen (AP-Modus starten)
- * - Zeitzone konfigurieren
- */
-void handleWlan() {
-  String html = HTML_HEADER;
-
-  html += R"rawliteral(
-    <div class="card">
-      <h2>WLAN Status</h2>
-      <div id="status"></div>
-    </div>
-
-    <div class="card" id="networkCard">
-      <h2>Netzwerk wechseln</h2>
-      <button onclick="scanNetworks()">Netzwerke suchen</button>
-      <div id="networks" style="margin-top: 1rem;"></div>
-    </div>
-
-    <div class="card" id="resetCard" style="display:none;">
-      <h2>WLAN zurücksetzen</h2>
-      <p style="color:#888;margin-bottom:1rem;">Löscht die gespeicherten WLAN-Daten und startet den Access Point Modus.</p>
-      <button style="background:#e74c3c;" onclick="resetWiFi()">WLAN zurücksetzen</button>
-    </div>
-
-    <div class="card">
-      <h2>WLAN Sendestärke</h2>
-      <label>Sendeleistung</label>
-      <select id="txPower" onchange="showTxPowerWarning(this.value)">
-        <option value="0" )rawliteral";
-  html += wifiTxPower == 0 ? "selected" : "";
-  html += R"rawliteral(>Niedrig (5 dBm) - Empfohlen</option>
-        <option value="1" )rawliteral";
-  html += wifiTxPower == 1 ? "selected" : "";
-  html += R"rawliteral(>Normal (11 dBm)</option>
-        <option value="2" )rawliteral";
-  html += wifiTxPower == 2 ? "selected" : "";
-  html += R"rawliteral(>Hoch (17 dBm)</option>
-      </select>
-      <div id="txPowerWarning" style="display:none;background:#f39c1233;border:1px solid #f39c12;border-radius:8px;padding:0.8rem;margin-top:0.8rem;">
-        <span style="color:#f39c12;">⚠️ Achtung:</span> Höhere Sendeleistung führt zu erhöhter Wärmeentwicklung. Dies kann bei dauerhaftem Betrieb zu Überhitzung führen.
-      </div>
-      <button onclick="saveTxPower()" style="margin-top:0.8rem;">Speichern</button>
-    </div>
-
-    <div class="card">
-      <h2>Zeitzone</h2>
-      <label>Zeitzone (POSIX Format)</label>
-      <select id="timezone" onchange="document.getElementById('tzCustom').style.display = this.value === 'custom' ? 'block' : 'none'">
-        <option value="CET-1CEST,M3.5.0,M10.5.0/3" )rawliteral";
-  html += timezone == "CET-1CEST,M3.5.0,M10.5.0/3" ? "selected" : "";
-  html += R"rawliteral(>Berlin (CET/CEST)</option>
-        <option value="GMT0BST,M3.5.0/1,M10.5.0" )rawliteral";
-  html += timezone == "GMT0BST,M3.5.0/1,M10.5.0" ? "selected" : "";
-  html += R"rawliteral(>London (GMT/BST)</option>
-        <option value="EST5EDT,M3.2.0,M11.1.0" )rawliteral";
-  html += timezone == "EST5EDT,M3.2.0,M11.1.0" ? "selected" : "";
-  html += R"rawliteral(>New York (EST/EDT)</option>
-        <option value="PST8PDT,M3.2.0,M11.1.0" )rawliteral";
-  html += timezone == "PST8PDT,M3.2.0,M11.1.0" ? "selected" : "";
-  html += R"rawliteral(>Los Angeles (PST/PDT)</option>
-        <option value="custom">Benutzerdefiniert...</option>
-      </select>
-      <input type="text" id="tzCustom" placeholder="z.B. CET-1CEST,M3.5.0,M10.5.0/3" style="display:none;" value=")rawliteral";
-  html += timezone;
-  html += R"rawliteral(">
-      <button onclick="saveTimezone()">Speichern</button>
-    </div>
-
-    <!-- Modal für WLAN-Passwort-Eingabe -->
-    <div id="modal" style="display:none;position:fixed;top:0;left:0;width:100%;height:100%;background:rgba(0,0,0,0.8);z-index:100;">
-      <div style="background:#16213e;margin:15% auto;padding:20px;border-radius:15px;max-width:320px;text-align:center;">
-        <h3 id="selectedSSID" style="color:#4ecca3;margin-bottom:1rem;"></h3>
-        <input type="password" id="password" placeholder="Passwort" style="margin-bottom:1rem;">
-        <div>
-          <button onclick="connect()">Verbinden</button>
-          <button onclick="closeModal()" style="background:#666;">Abbrechen</button>
-        </div>
-      </div>
-    </div>
-
-    <script>
-      var selectedSSID = '';
-      var isApMode = false;
-
-      // WLAN-Status aktualisieren
-      function updateStatus() {
-        fetch('/status')
-          .then(r => r.json())
-          .then(d => {
-            var s = document.getElementById('status');
-            isApMode = d.apMode;
-            if (d.apMode) {
-              // Access Point Modus
-              s.innerHTML = '<table>' +
-                '<tr><td>Modus</td><td><span class="status disconnected">Access Point</span></td></tr>' +
-                '<tr><td>SSID</td><td>' + d.apSSID + '</td></tr>' +
-                '<tr><td>Passwort</td><td>' + d.apPassword + '</td></tr>' +
-                '<tr><td>IP</td><td>192.168.4.1</td></tr>' +
-                '</table>';
-              document.getElementById('resetCard').style.display = 'none';
-            } else {
-              // Station Modus (mit Router verbunden)
-              // Farbe für Signalqualität bestimmen
-              var qualityColor = '#4ecca3';  // Standard: grün
-              if (d.rssi < -80) qualityColor = '#e74c3c';  // Schwach: rot
-              else if (d.rssi < -70) qualityColor = '#f39c12';  // Ausreichend: orange
-              else if (d.rssi < -60) qualityColor = '#f1c40f';  // Gut: gelb
-
-              s.innerHTML = '<table>' +
-                '<tr><td>Modus</td><td><span class="status connected">Verbunden</span></td></tr>' +
-                '<tr><td>SSID</td><td>' + d.ssid + '</td></tr>' +
-                '<tr><td>IP Adresse</td><td>' + d.ip + '</td></tr>' +
-                '<tr><td>MAC Adresse</td><td>)rawliteral";
-  html += macAddress;
-  html += R"rawliteral(</td></tr>' +
-                '<tr><td>Signalstärke</td><td><span style="color:' + qualityColor + ';">' + d.quality + '</span> (' + d.rssi + ' dBm)</td></tr>' +
-                '</table>';
-              document.getElementById('resetCard').style.display = 'block';
-            }
-          });
+/**
+ * Zustand einer laufenden /metrics-Antwort
+ *
+ * Erzeugt das Prometheus-Textformat Familie für Familie, während der Server
+ * sendet. Pro Anfrage wird nur dieser Zustand angelegt, unabhängig davon wie
+ * viele Metriken es gibt - kein String, keine Gesamtkopie.
+ */
+struct MetricsExport {
+  BMSData data[BMS_MAX_PACKS];            // Snapshot je Pack beim Start der Anfrage
+  bool dataValid[BMS_MAX_PACKS] = {};     // Batteriewerte des Packs ausgeben
+  bool online[BMS_MAX_PACKS] = {};        // Pack beim Start der Anfrage erreichbar
+  double pollInterval[BMS_MAX_PACKS] = {};  // Aktuelles Abfrageintervall in s
+  double pollLatency[BMS_MAX_PACKS] = {};   // Dauer der letzten Abfrage in s
+  BmsAnalytics analytics[BMS_MAX_PACKS];  // Abgeleitete Werte je Pack
+  uint8_t packCount = 0;                  // Konfigurierte Packs
+  uint8_t family = 0;        // Nächste auszugebende Familie
+  uint8_t cellPack = 0;      // Nächster Pack der Zell-Familie (je Pack ein Block)
+
+  char pending[METRICS_FAMILY_SIZE];  // Noch nicht gesendeter Text
+  size_t pendingLength = 0;
+  size_t pendingPos = 0;
+
+  /**
+   * Füllt den Sendepuffer des Webservers
+   *
+   * @return Anzahl Bytes (0 = Antwort vollständig)
+   */
+  size_t fill(uint8_t* buffer, size_t maxLen) {
+    size_t written = 0;
+    while (written < maxLen) {
+      if (pendingPos < pendingLength) {
+        size_t n = min(maxLen - written, pendingLength - pendingPos);
+        memcpy(buffer + written, pending + pendingPos, n);
+        written += n;
+        pendingPos += n;
+        continue;
       }
+      if (!produce()) break;
+    }
+    return written;
+  }
 
-      // Verfügbare Netzwerke scannen
-      function scanNetworks() {
-        document.getElementById('networks').innerHTML = '<p style="color:#888;">Suche...</p>';
-        fetch('/scan')
-          .then(r => r.json())
-          .then(d => {
-            var html = '';
-            d.forEach(n => {
-              html += '<div style="background:#1a1a2e;padding:1rem;border-radius:8px;margin:0.5rem 0;cursor:pointer;" onclick="selectNetwork(\'' + n.ssid.replace(/'/g, "\\'") + '\')">' +
-                '<div style="font-weight:bold;">' + n.ssid + '</div>' +
-                '<div style="color:#888;font-size:0.85rem;">Signal: ' + n.rssi + ' dBm</div>' +
-                '</div>';
-            });
-            document.getElementById('networks').innerHTML = html || '<p style="color:#888;">Keine Netzwerke gefunden</p>';
-          });
-      }
+private:
+  /**
+   * Hängt formatierten Text an pending an (kürzt bei vollem Puffer)
+   */
+  void append(const char* format, ...) {
+    if (pendingLength >= sizeof(pending) - 1) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(pending + pendingLength, sizeof(pending) - pendingLength, format, args);
+    va_end(args);
+    if (n > 0) pendingLength = min(pendingLength + n, sizeof(pending) - 1);
+  }
 
-      // Netzwerk auswählen (öffnet Modal)
-      function selectNetwork(ssid) {
-        selectedSSID = ssid;
-        document.getElementById('selectedSSID').textContent = ssid;
-        document.getElementById('password').value = '';
-        document.getElementById('modal').style.display = 'block';
-      }
+  /**
+   * Schreibt HELP und TYPE einer Familie
+   */
+  void header(const char* name, const char* type, const char* help) {
+    append("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  }
 
-      // Modal schließen
-      function closeModal() {
-        document.getElementById('modal').style.display = 'none';
-      }
+  /**
+   * Familie mit einem einzelnen Wert
+   */
+  void single(const char* name, const char* type, const char* help, double value) {
+    header(name, type, help);
+    append("%s %.10g\n", name, value);
+  }
+
+  /**
+   * Familie mit einem Wert je Pack (Label pack)
+   *
+   * @param values Wert je Pack
+   * @param onlyValid Nur Packs mit gültiger Messung ausgeben
+   */
+  void perPack(const char* name, const char* type, const char* help, const double* values, bool onlyValid) {
+    header(name, type, help);
+    for (uint8_t i = 0; i < packCount; i++) {
+      if (onlyValid && !dataValid[i]) continue;
+      append("%s{pack=\"%u\"} %.10g\n", name, i, values[i]);
+    }
+  }
 
-      // Mit ausgewähltem Netzwerk verbinden
-      function connect() {
-        var pw = document.getElementById('password').value;
-        document.getElementById('modal').innerHTML = '<div style="background:#16213e;margin:15% auto;padding:20px;border-radius:15px;max-width:320px;text-align:center;"><p>Verbinde...</p></div>';
-        fetch('/connect', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/x-www-form-urlencoded'},
-          body: 'ssid=' + encodeURIComponent(selectedSSID) + '&password=' + encodeURIComponent(pw)
-        })
-        .then(r => r.json())
-        .then(d => {
-          closeModal();
-          if (d.success) {
-            document.getElementById('networks').innerHTML = '<div style="background:#4ecca333;padding:1rem;border-radius:8px;">' +
-              '<h3 style="color:#4ecca3;">Verbindung erfolgreich!</h3>' +
-              '<p>Neue IP: <strong>' + d.ip + '</strong></p>' +
-              '<p>Erreichbar unter: <a href="http://)rawliteral" + wifiHostname + R"rawliteral(.local" style="color:#4ecca3;">http://)rawliteral" + wifiHostname + R"rawliteral(.local</a></p>' +
-              '</div>';
-            setTimeout(() => location.reload(), 3000);
-          } else {
-            alert('Verbindung fehlgeschlagen: ' + d.message);
-            location.reload();
-          }
-        });
-      }
+  /**
+   * Histogramm in Sekunden aus einem LatencyHistogram
+   */
+  void histogram(const char* name, const char* help, const LatencyHistogram& h) {
+    header(name, "histogram", help);
+    uint32_t cumulative = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+      cumulative += h.buckets[i];
+      append("%s_bucket{le=\"%g\"} %u\n", name, LATENCY_BUCKETS_MS[i] / 1000.0, (unsigned)cumulative);
+    }
+    cumulative += h.buckets[LATENCY_BUCKET_COUNT];
+    append("%s_bucket{le=\"+Inf\"} %u\n", name, (unsigned)cumulative);
+    append("%s_sum %.3f\n%s_count %u\n", name, h.sumMs / 1000.0, name, (unsigned)cumulative);
+  }
 
-      // WLAN zurücksetzen
-      function resetWiFi() {
-        if (confirm('WLAN-Zugangsdaten wirklich löschen?')) {
-          fetch('/reset', { method: 'POST' })
-            .then(r => r.json())
-            .then(d => {
-              alert('WLAN-Daten gelöscht. Das Gerät startet im Access Point Modus neu.');
-            });
+  /**
+   * Schreibt die nächste Familie nach pending
+   *
+   * @return false wenn alle Familien ausgegeben sind
+   */
+  bool produce() {
+    pendingPos = 0;
+    pendingLength = 0;
+    // Batteriewerte (Familien 0-9) nur mit mindestens einer gültigen Messung
+    bool anyValid = false;
+    for (uint8_t i = 0; i < packCount; i++) anyValid = anyValid || dataValid[i];
+    if (family < 10 && !anyValid) family = 10;
+
+    double values[BMS_MAX_PACKS];
+    if (family < BATTERY_METRIC_COUNT) {
+      const BatteryMetric& metric = BATTERY_METRICS[family];
+      for (uint8_t i = 0; i < packCount; i++) values[i] = batteryMetricValue(family, data[i]);
+      perPack(metric.name, metric.type, metric.help, values, true);
+      family++;
+      return true;
+    }
+    if (family == 9) {
+      // Zellspannungen: ein Block je Pack, damit jeder in pending passt
+      while (cellPack < packCount && !dataValid[cellPack]) cellPack++;
+      if (cellPack < packCount) {
+        if (cellPack == firstValidPack()) {
+          header("litime_battery_cell_voltage_volts", "gauge", "Zellspannung");
         }
-      }
-
-      // Zeitzone speichern
-      function saveTimezone() {
-        let tz = document.getElementById('timezone').value;
-        if (tz === 'custom') {
-          tz = document.getElementById('tzCustom').value;
+        const BMSData& d = data[cellPack];
+        for (uint8_t i = 0; i < d.cellCount; i++) {
+          append("litime_battery_cell_voltage_volts{pack=\"%u\",cell=\"%u\"} %.3f\n", cellPack, i + 1, d.cellMv[i] / 1000.0);
         }
-        fetch('/api/timezone', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({timezone: tz})
-        }).then(() => alert('Zeitzone gespeichert!'));
-      }
-
-      // Warnung bei höherer Sendeleistung anzeigen
-      function showTxPowerWarning(value) {
-        document.getElementById('txPowerWarning').style.display = (value > 0) ? 'block' : 'none';
+        cellPack++;
+        return true;
       }
+      family = 10;
+    }
 
-      // Sendestärke speichern
-      function saveTxPower() {
-        let power = parseInt(document.getElementById('txPower').value);
-        fetch('/api/wifi-power', {
-          method: 'POST',
-          headers: {'Content-Type': 'application/json'},
-          body: JSON.stringify({power: power})
-        }).then(() => alert('Sendestärke gespeichert! Die Änderung wird sofort wirksam.'));
+    switch (family++) {
+      case 10:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = online[i] ? 1 : 0;
+        perPack("litime_bms_connected", "gauge", "BMS per BLE erreichbar", values, false);
+        break;
+      case 11:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = dataValid[i] ? 1 : 0;
+        perPack("litime_bms_data_valid", "gauge", "Letzte Messung plausibel", values, false);
+        break;
+      case 12: histogram("litime_ble_poll_duration_seconds", "Dauer einer BMS-Abfrage", blePollHistogram); break;
+      case 13: single("litime_ble_connect_attempts_total", "counter", "Verbindungsversuche zum BMS", bmsConnectAttempts); break;
+      case 14: single("litime_ble_connect_failures_total", "counter", "Fehlgeschlagene Verbindungsversuche zum BMS", bmsConnectFailures); break;
+      case 15: histogram("litime_webhook_duration_seconds", "Dauer eines Webhook-Versands", haLatencyHistogram); break;
+      case 16: {
+        static const char* const classes[] = { "2xx", "3xx", "4xx", "5xx", "error" };
+        header("litime_webhook_responses_total", "counter", "Webhook-Ergebnisse nach HTTP-Statusklasse");
+        for (uint8_t i = 0; i < 5; i++) {
+          append("litime_webhook_responses_total{class=\"%s\"} %u\n", classes[i], (unsigned)haResultCounts[i]);
+        }
+        break;
       }
+      case 17: single("litime_mqtt_connected", "gauge", "Verbindung zum MQTT-Broker", mqttConnected ? 1 : 0); break;
+      case 18: single("litime_mqtt_messages_total", "counter", "Veröffentlichte MQTT-Nachrichten", mqttPublishCount); break;
+      case 19: single("litime_heap_free_bytes", "gauge", "Freier Heap", ESP.getFreeHeap()); break;
+      case 20: single("litime_heap_min_free_bytes", "gauge", "Minimaler freier Heap seit Start", minFreeHeap); break;
+      case 21: single("litime_heap_largest_free_block_bytes", "gauge", "Größter zusammenhängender freier Block", ESP.getMaxAllocHeap()); break;
+      case 22: single("litime_loop_iterations_total", "counter", "Durchläufe der Hauptschleife", loopIterations); break;
+      case 23: single("litime_loop_duration_max_seconds", "gauge", "Längster Durchlauf der Hauptschleife im letzten Messfenster", loopMaxUs / 1e6); break;
+      case 24: single("litime_http_requests_total", "counter", "Beantwortete HTTP-Anfragen", httpRequestCount); break;
+      case 25: single("litime_wifi_rssi_dbm", "gauge", "WLAN-Empfangsstärke", WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : 0); break;
+      case 26: single("litime_uptime_seconds", "counter", "Laufzeit seit dem Start", uptimeSeconds()); break;
+      case 27: perPack("litime_ble_poll_interval_seconds", "gauge", "Aktuelles (adaptives) Abfrageintervall", pollInterval, false); break;
+      case 28: perPack("litime_ble_poll_last_duration_seconds", "gauge", "Dauer der letzten BMS-Abfrage", pollLatency, false); break;
+      case 29: single("litime_ble_poll_failures_total", "counter", "Abfragen ohne rechtzeitige plausible Antwort", bmsPollFailures); break;
+      case 30: single("litime_ble_poll_reconnects_total", "counter", "Neuverbindungen nach wiederholt fehlgeschlagenen Abfragen", bmsPollReconnects); break;
+      case 31: single("litime_alarm_events_total", "counter", "Erkannte Alarmwechsel (Alarmregeln)", alarmEventCount); break;
+      case 32: single("litime_webhook_deadband_skips_total", "counter", "Webhook-Intervalle ohne Sendung (Totband)", haDeadbandSkips); break;
+      case 33:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = analytics[i].powerMw / 1000.0;
+        perPack("litime_battery_power_watts", "gauge", "Leistung (negativ = Entladen)", values, true);
+        break;
+      case 34:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = analytics[i].cellDeltaMv() / 1000.0;
+        perPack("litime_battery_cell_delta_volts", "gauge", "Differenz höchste - niedrigste Zelle", values, true);
+        break;
+      case 35:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = analytics[i].chargedWh();
+        perPack("litime_battery_charged_watt_hours_total", "counter", "Geladene Energie", values, true);
+        break;
+      case 36:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = analytics[i].dischargedWh();
+        perPack("litime_battery_discharged_watt_hours_total", "counter", "Entladene Energie", values, true);
+        break;
+      case 37:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = analytics[i].timeToFullS;
+        perPack("litime_battery_time_to_full_seconds", "gauge", "Restzeit bis voll (0 = lädt nicht)", values, true);
+        break;
+      case 38:
+        for (uint8_t i = 0; i < packCount; i++) values[i] = analytics[i].timeToEmptyS;
+        perPack("litime_battery_time_to_empty_seconds", "gauge", "Restzeit bis leer (0 = entlädt nicht)", values, true);
+        break;
+      case 39: single("litime_heap_min_largest_free_block_bytes", "gauge", "Kleinster größter freier Block seit Start", minLargestFreeBlock); break;
+      case 40: single("litime_heap_alloc_failures_total", "counter", "Fehlgeschlagene Heap-Allokationen", heapAllocFailures); break;
+      case 41: single("litime_heap_relief_total", "counter", "Entlastungen wegen knappem Speicher", heapReliefCount); break;
+      case 42:
+        header("litime_task_stack_free_min_bytes", "gauge", "Kleinster je freier Stack je Task");
+        for (uint8_t i = 0; i < STACK_WATCH_COUNT; i++) {
+          if (stackFreeBytes[i] > 0) {
+            append("litime_task_stack_free_min_bytes{task=\"%s\"} %u\n", STACK_WATCH_NAMES[i], (unsigned)stackFreeBytes[i]);
+          }
+        }
+        break;
+      default: return false;
+    }
+    return true;
+  }
 
-      // Status beim Laden aktualisieren
-      updateStatus();
-      // Warnung initial anzeigen falls nötig
-      showTxPowerWarning(document.getElementById('txPower').value);
-    </script>
-  )rawliteral";
-
-  html += HTML_FOOTER;
-  server.send(200, "text/html", html);
-}
-
-// ============================================================================
-// API-Endpunkte
-// ============================================================================
-// RESTful JSON-APIs für AJAX-Anfragen vom Webinterface
-
-/**
- * GET /api/time - Gibt aktuelle Zeit und Sync-Status zurück
- */
-void handleApiTime() {
-  JsonDocument doc;
-  doc["time"] = getCurrentTimeString();
-  doc["lastSync"] = getLastSyncTimeString();
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
-}
+  /**
+   * Erster Pack mit gültiger Messung (vor ihm steht der Kopf der Zell-Familie)
+   */
+  uint8_t firstValidPack() const {
+    uint8_t i = 0;
+    while (i < packCount && !dataValid[i]) i++;
+    return i;
+  }
+};
 
 /**
- * GET /api/data - Gibt alle BMS-Daten als JSON zurück
+ * GET /metrics - Messwerte und interne Zähler im Prometheus-Textformat
+ *
+ * Die Antwort wird als Chunked-Antwort erst beim Senden erzeugt (siehe
+ * MetricsExport), eine Abfrage alle paar Sekunden belastet den Heap nicht.
+ * Batterie- und Verbindungswerte tragen das Label pack (0 = erstes BMS).
  */
-void handleApiData() {
-  JsonDocument doc;
-
-  // Verfügbarkeits-Flag für Frontend
-  bool bmsAvailable = bluetoothEnabled && bmsConnected && bmsDataValid;
-  doc["available"] = bmsAvailable;
-
-  // Alle BMS-Werte
-  doc["totalVoltage"] = bmsData.totalVoltage;
-  doc["cellVoltageSum"] = bmsData.cellVoltageSum;
-  doc["current"] = bmsData.current;
-  doc["mosfetTemp"] = bmsData.mosfetTemp;
-  doc["cellTemp"] = bmsData.cellTemp;
-  doc["soc"] = bmsData.soc;
-  doc["soh"] = bmsData.soh;
-  doc["remainingAh"] = bmsData.remainingAh;
-  doc["fullCapacityAh"] = bmsData.fullCapacityAh;
-  doc["protectionState"] = bmsData.protectionState;
-  doc["heatState"] = bmsData.heatState;
-  doc["failureState"] = bmsData.failureState;
-  doc["balancingState"] = bmsData.balancingState;
-  doc["batteryState"] = bmsData.batteryState;
-  doc["dischargesCount"] = bmsData.dischargesCount;
-  doc["dischargesAhCount"] = bmsData.dischargesAhCount;
-  doc["connected"] = bmsConnected;
-
-  // Zellspannungen als Array
-  JsonArray cells = doc["cellVoltages"].to<JsonArray>();
-  for (float v : bmsData.cellVoltages) {
-    cells.add(v);
+void handleMetrics(AsyncWebServerRequest* request) {
+  std::shared_ptr<MetricsExport> state = std::make_shared<MetricsExport>();
+  state->packCount = bmsPackCount();
+  for (uint8_t i = 0; i < state->packCount; i++) {
+    bool valid = false;
+    uint32_t seq = getPackSnapshot(i, state->data[i], &valid);
+    state->dataValid[i] = (seq > 0 && valid);
+    state->online[i] = bmsSlots[i].online;
+    state->pollInterval[i] = bmsPollInterval(bmsSlots[i]) / 1000.0;
+    state->pollLatency[i] = bmsSlots[i].pollLatencyMs / 1000.0;
+    getPackAnalytics(i, state->analytics[i]);
   }
 
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
+  AsyncWebServerResponse* response = request->beginChunkedResponse(
+    "text/plain; version=0.0.4; charset=utf-8",
+    [state](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      return state->fill(buffer, maxLen);
+    });
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
 }
 
 /**
- * GET /api/status - Gibt Systemstatus für Statusleiste zurück
+ * Schreibt den Systemstatus (Statusleiste) als JSON-Objekt
+ *
+ * Wird von /api/status und vom Push-Stream (/api/stream) verwendet.
+ *
+ * @param json Ziel
+ * @param key Schlüssel im umgebenden Objekt (nullptr = eigenständiges Objekt)
+ * @param boot true = Zeitpunkte der Startphasen anhängen (nur /api/status)
  */
-void handleApiStatus() {
-  JsonDocument doc;
+void writeStatusJson(JsonWriter& json, const char* key, bool boot) {
+  json.beginObject(key);
 
   // WLAN Status
-  doc["apMode"] = apMode;
-  doc["wlanConnected"] = (WiFi.status() == WL_CONNECTED);
+  json.addBool("apMode", apMode);
+  json.addBool("wlanConnected", WiFi.status() == WL_CONNECTED);
 
   // Internet-Verbindung (NTP als Indikator)
-  doc["internetOk"] = (lastSyncTime > 0);
+  json.addBool("internetOk", lastSyncTime > 0);
 
   // NTP Status
-  doc["ntpSynced"] = (lastSyncTime > 0);
+  json.addBool("ntpSynced", lastSyncTime > 0);
 
   // Terminal/Serial
-  doc["serialEnabled"] = serialOutputEnabled;
+  json.addBool("serialEnabled", serialOutputEnabled);
 
   // Bluetooth
-  doc["btEnabled"] = bluetoothEnabled;
+  json.addBool("btEnabled", bluetoothEnabled);
 
   // BMS Verbindung
-  doc["bmsConnected"] = bmsConnected;
-  doc["bmsDataValid"] = bmsDataValid;
+  json.addBool("bmsConnected", bmsConnected);
+  json.addBool("bmsDataValid", bmsDataValid);
+  uint8_t packs = bmsPackCount();
+  uint8_t online = 0;
+  for (uint8_t i = 0; i < packs; i++) {
+    if (bmsSlots[i].online) online++;
+  }
+  json.addUInt("bmsPacks", packs);
+  json.addUInt("bmsPacksOnline", online);
+  json.addUInt("bmsPollMs", bmsPollInterval(bmsSlots[0]));
+  json.addUInt("bmsLatencyMs", bmsSlots[0].pollLatencyMs);
+
+  // Cloud (Home Assistant Webhook und/oder MQTT)
+  json.addBool("cloudEnabled", haEnabled || mqttEnabled);
+  json.addBool("cloudOk", isCloudOk());
+  json.addBool("mqttEnabled", mqttEnabled);
+  json.addBool("mqttConnected", mqttConnected);
+
+  // Energiesparmodus (gemessene Auslastung von loop(), keine Strommessung)
+  json.addUInt("powerMode", powerMode);
+  json.addBool("lightSleep", lightSleepActive);
+  json.addFixed("loopBusyPct", loopBusyPermille, 1);
+
+  // Startzeiten in ms seit Reset (0 = Phase noch nicht erreicht)
+  if (boot) {
+    json.beginObject("boot");
+    json.addUInt("wifiStartMs", bootTimings.wifiStart);
+    json.addUInt("webServerMs", bootTimings.webServer);
+    json.addUInt("setupMs", bootTimings.setup);
+    json.addUInt("wifiMs", bootTimings.wifi);
+    json.addUInt("ntpMs", bootTimings.ntp);
+    json.addUInt("bmsConnectMs", bootTimings.bmsConnect);
+    json.addUInt("bmsDataMs", bootTimings.bmsData);
+    json.endObject();
+  }
+
+  // Speicher und Task-Stacks (Stand des letzten Heap-Checks, Stack = kleinster je freier Wert)
+  if (boot) {
+    json.beginObject("memory");
+    json.addUInt("freeHeap", ESP.getFreeHeap());
+    json.addUInt("minFreeHeap", minFreeHeap);
+    json.addUInt("largestBlock", largestFreeBlock);
+    json.addUInt("minLargestBlock", minLargestFreeBlock);
+    json.addUInt("allocFailures", heapAllocFailures);
+    json.addUInt("lastAllocFailSize", heapLastFailSize);
+    json.addBool("low", heapLow);
+    json.addUInt("action", heapAction);
+    json.beginObject("stackFree");
+    for (uint8_t i = 0; i < STACK_WATCH_COUNT; i++) {
+      json.addUInt(STACK_WATCH_NAMES[i], stackFreeBytes[i]);
+    }
+    json.endObject();
+    json.endObject();
+  }
 
-  // Cloud/Home Assistant
-  doc["cloudEnabled"] = haEnabled;
-  doc["cloudOk"] = (haEnabled && lastHaHttpCode == 200);
+  json.endObject();
+}
 
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
+/**
+ * Prüft ob alle aktivierten Cloud-Ausgänge funktionieren
+ *
+ * @return true wenn mindestens ein Ausgang aktiv ist und keiner einen Fehler meldet
+ */
+bool isCloudOk() {
+  if (!haEnabled && !mqttEnabled) return false;
+  bool haOk = !haEnabled || lastHaHttpCode == 200;
+  bool mqttOk = !mqttEnabled || mqttConnected;
+  return haOk && mqttOk;
+}
+
+/**
+ * Verdichtet den Systemstatus zu einer Bitmaske
+ *
+ * Der Push-Stream sendet ein neues Ereignis sobald sich die Maske ändert.
+ *
+ * @return Bitmaske aller Status-Flags aus writeStatusJson()
+ */
+uint16_t getStatusSignature() {
+  return (apMode ? 1 : 0)
+       | ((WiFi.status() == WL_CONNECTED) ? 2 : 0)
+       | ((lastSyncTime > 0) ? 4 : 0)
+       | (serialOutputEnabled ? 8 : 0)
+       | (bluetoothEnabled ? 16 : 0)
+       | (bmsConnected ? 32 : 0)
+       | (bmsDataValid ? 64 : 0)
+       | ((haEnabled || mqttEnabled) ? 128 : 0)
+       | (isCloudOk() ? 256 : 0)
+       | (mqttEnabled ? 512 : 0)
+       | (mqttConnected ? 1024 : 0);
+}
+
+/**
+ * GET /api/settings - Gibt alle Benutzer-Einstellungen zurück
+ *
+ * Die Webseiten sind statisch im Flash abgelegt und füllen ihre
+ * Formularfelder beim Laden über diesen Endpunkt.
+ *
+ * settingsMutex verhindert, dass loop() gleichzeitig Einstellungen ändert.
+ */
+void handleApiSettings(AsyncWebServerRequest* request) {
+  JsonDocument doc;
+  xSemaphoreTake(settingsMutex, portMAX_DELAY);
+  // Bluetooth / BMS
+  doc["btEnabled"] = bluetoothEnabled;
+  doc["serialEnabled"] = serialOutputEnabled;
+  doc["bmsMac"] = bmsSlots[0].mac;
+  JsonArray macs = doc["bmsMacs"].to<JsonArray>();
+  for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+    macs.add(bmsSlots[i].mac);
+  }
+  doc["bmsInterval"] = bmsInterval;
+  doc["bmsKeepConnected"] = bmsKeepConnected;
+  doc["bmsAdaptive"] = bmsAdaptivePolling;
+
+  // Home Assistant Webhook inkl. letztem Versand
+  doc["haEnabled"] = haEnabled;
+  doc["haInterval"] = haInterval;
+  doc["haBatch"] = haBatchMode;
+  doc["haMsgPack"] = haMsgPack;
+  doc["lastHaBytes"] = (uint32_t)lastHaBytes;
+  doc["lastHaJsonBytes"] = (uint32_t)lastHaJsonBytes;
+  doc["lastHaHttpCode"] = (int)lastHaHttpCode;
+  doc["lastHaDurationMs"] = (unsigned long)lastHaDuration;
+  doc["haFailCount"] = (uint8_t)haFailCount;
+  doc["haBusy"] = (bool)cloudBusy;
+  xSemaphoreTake(haMutex, portMAX_DELAY);
+  doc["haWebhook"] = haWebhookUrl;
+  doc["lastHaTime"] = lastHaTime;
+  doc["lastHaResponse"] = lastHaResponse;
+  xSemaphoreGive(haMutex);
+
+  // MQTT (Passwort wird nicht ausgegeben)
+  doc["mqttEnabled"] = mqttEnabled;
+  doc["mqttHost"] = mqttHost;
+  doc["mqttPort"] = mqttPort;
+  doc["mqttUser"] = mqttUser;
+  doc["mqttPassSet"] = (mqttPass.length() > 0);
+  doc["mqttTopic"] = mqttBaseTopic;
+  doc["mqttTopicEffective"] = (const char*)mqttTopicBase;
+  doc["mqttQos"] = mqttQos;
+  doc["mqttDiscovery"] = mqttDiscovery;
+  doc["mqttBinary"] = mqttBinary;
+  doc["mqttConnected"] = (bool)mqttConnected;
+  doc["mqttPublishCount"] = mqttPublishCount;
+
+  // Alarmregeln
+  doc["alarmEnabled"] = alarmEnabled;
+  doc["alarmSocMin"] = alarmSocMin;
+  doc["alarmCellDeltaMv"] = alarmCellDeltaMv;
+  doc["alarmTempMax"] = alarmTempMax;
+  doc["alarmCurrentMax"] = alarmCurrentMax;
+  doc["alarmMinInterval"] = alarmMinInterval;
+  doc["alarmEventCount"] = (uint32_t)alarmEventCount;
+
+  // Totband
+  doc["deadbandEnabled"] = reportDeadband;
+  doc["deadbandMv"] = deadbandMv;
+  doc["deadbandMa"] = deadbandMa;
+  doc["deadbandSoc"] = deadbandSoc;
+  doc["deadbandTemp"] = deadbandTemp;
+  doc["reportHeartbeat"] = reportHeartbeat;
+  doc["haDeadbandSkips"] = (uint32_t)haDeadbandSkips;
+
+  // Zwischenspeicher (noch nicht gesendete Messungen)
+  doc["spoolAvailable"] = spoolAvailable;
+  doc["spoolWebhook"] = webhookSpool.pending();
+  doc["spoolMqtt"] = mqttSpool.pending();
+
+  // WLAN / Zeit
+  doc["wifiTxPower"] = wifiTxPower;
+  doc["powerMode"] = powerMode;
+  doc["heapAction"] = heapAction;
+  doc["heapMinBlock"] = heapMinBlock;
+  doc["headless"] = headlessMode;
+  doc["sleepInterval"] = sleepInterval;
+  doc["headlessWindowS"] = headlessMode ? (HEADLESS_CONFIG_WINDOW_MS - min(millis() - headlessWindowStart, (unsigned long)HEADLESS_CONFIG_WINDOW_MS)) / 1000 : 0;
+  doc["headlessLastAwakeMs"] = headlessLastAwakeMs;
+  // Eigene Instanz statt des globalen preferences-Objekts (läuft neben loop())
+  Preferences wifiPrefs;
+  wifiPrefs.begin("wifi", true);
+  doc["staticIp"] = wifiPrefs.getBool("staticIp", false);
+  doc["staticIpAddr"] = IPAddress(wifiPrefs.getULong("ip", 0)).toString();
+  doc["staticGateway"] = IPAddress(wifiPrefs.getULong("gateway", 0)).toString();
+  doc["staticSubnet"] = IPAddress(wifiPrefs.getULong("subnet", 0)).toString();
+  doc["staticDns"] = IPAddress(wifiPrefs.getULong("dns", 0)).toString();
+  doc["wifiCachedChannel"] = wifiPrefs.getUChar("channel", 0);
+  wifiPrefs.end();
+  doc["timezone"] = timezone;
+  doc["macAddress"] = macAddress;
+  doc["hostname"] = wifiHostname;
+  xSemaphoreGive(settingsMutex);
+
+  sendJsonDocument(request, doc);
 }
 
 /**
@@ -1827,25 +6407,16 @@ void handleApiStatus() {
  *
  * Body: {"enabled": true/false}
  */
-void handleApiBluetooth() {
-  if (server.hasArg("plain")) {
-    JsonDocument doc;
-    deserializeJson(doc, server.arg("plain"));
-    bluetoothEnabled = doc["enabled"].as<bool>();
-    saveSettings();
-
-    if (bluetoothEnabled && !bmsConnected && !bmsConnectPending) {
-      // BMS-Verbindung wird im loop() non-blocking hergestellt
-      bmsConnectPending = true;
-      Serial.println("[BLE] BMS-Verbindung angefordert, wird im Hintergrund hergestellt...");
-    } else if (!bluetoothEnabled && bmsConnected) {
-      // Bluetooth deaktiviert: Verbindung trennen
-      bmsClient.disconnect();
-      bmsConnected = false;
-      bmsConnectPending = false;
-    }
+void handleApiBluetooth(JsonDocument& doc) {
+  bluetoothEnabled = doc["enabled"].as<bool>();
+  saveSettings();
+
+  if (bluetoothEnabled && !bmsConnected && !bmsConnectPending) {
+    // BMS-Verbindung wird im BLE-Task non-blocking hergestellt
+    bmsConnectPending = true;
+    Serial.println("[BLE] BMS-Verbindung angefordert, wird im Hintergrund hergestellt...");
   }
-  server.send(200, "application/json", "{\"success\":true}");
+  // Bei deaktiviertem Bluetooth trennt der BLE-Task die Verbindung selbst
 }
 
 /**
@@ -1853,52 +6424,74 @@ void handleApiBluetooth() {
  *
  * Body: {"enabled": true/false}
  */
-void handleApiSerial() {
-  if (server.hasArg("plain")) {
-    JsonDocument doc;
-    deserializeJson(doc, server.arg("plain"));
-    serialOutputEnabled = doc["enabled"].as<bool>();
-    saveSettings();
-    Serial.println(serialOutputEnabled ? "[SERIAL] Terminal-Ausgabe aktiviert" : "[SERIAL] Terminal-Ausgabe deaktiviert");
-  }
-  server.send(200, "application/json", "{\"success\":true}");
+void handleApiSerial(JsonDocument& doc) {
+  serialOutputEnabled = doc["enabled"].as<bool>();
+  saveSettings();
+  Serial.println(serialOutputEnabled ? "[SERIAL] Terminal-Ausgabe aktiviert" : "[SERIAL] Terminal-Ausgabe deaktiviert");
 }
 
 /**
  * POST /api/bms-settings - BMS-Einstellungen speichern
  *
- * Body: {"mac": "XX:XX:XX:XX:XX:XX", "interval": 20}
- * Bei MAC-Änderung wird das Gerät neu gestartet
+ * Body: {"macs": ["XX:XX:XX:XX:XX:XX", ...], "interval": 20, "keepConnected": true, "adaptive": true}
+ * Statt "macs" wird weiterhin {"mac": "..."} für einen einzelnen Pack akzeptiert.
+ * Leere Einträge entfernen einen Pack, die übrigen rücken auf.
+ * Bei MAC-Änderung wird die neue Liste nur in den NVS geschrieben und das
+ * Gerät neu gestartet - bmsSlots bleibt bis dahin unverändert, weil die
+ * anderen Tasks die MACs ohne Sperre lesen.
  */
-void handleApiBmsSettings() {
-  if (server.hasArg("plain")) {
-    JsonDocument doc;
-    deserializeJson(doc, server.arg("plain"));
+void handleApiBmsSettings(JsonDocument& doc) {
+  unsigned long newInterval = doc["interval"].as<unsigned long>();
 
-    String newMac = doc["mac"].as<String>();
-    unsigned long newInterval = doc["interval"].as<unsigned long>();
+  // Intervall validieren (5-300 Sekunden)
+  if (newInterval < 5) newInterval = 5;
+  if (newInterval > 300) newInterval = 300;
+  bmsInterval = newInterval;
 
-    // Intervall validieren (5-300 Sekunden)
-    if (newInterval < 5) newInterval = 5;
-    if (newInterval > 300) newInterval = 300;
-    bmsInterval = newInterval;
+  if (!doc["keepConnected"].isNull()) {
+    bmsKeepConnected = doc["keepConnected"].as<bool>();
+  }
+  if (!doc["adaptive"].isNull()) {
+    bmsAdaptivePolling = doc["adaptive"].as<bool>();
+  }
 
-    // Prüfen ob MAC geändert wurde (muss 17 Zeichen haben: XX:XX:XX:XX:XX:XX)
-    bool macChanged = (newMac != bmsMac && newMac.length() == 17);
-    if (macChanged) {
-      bmsMac = newMac;
+  // Neue MAC-Liste zusammenstellen (nur gültige Einträge, lückenlos)
+  String newMacs[BMS_MAX_PACKS];
+  uint8_t count = 0;
+  JsonArray macs = doc["macs"].as<JsonArray>();
+  if (!macs.isNull()) {
+    for (JsonVariant mac : macs) {
+      String value = mac.as<String>();
+      if (value.length() == 17 && count < BMS_MAX_PACKS) newMacs[count++] = value;
     }
+  } else {
+    // Einzelne MAC: nur Pack 0 ersetzen, weitere Packs bleiben erhalten
+    String value = doc["mac"].as<String>();
+    newMacs[count++] = (value.length() == 17) ? value : bmsSlots[0].mac;
+    for (uint8_t i = 1; i < BMS_MAX_PACKS; i++) newMacs[i] = bmsSlots[i].mac;
+  }
+
+  // Prüfen ob sich eine MAC geändert hat (muss 17 Zeichen haben: XX:XX:XX:XX:XX:XX)
+  bool macChanged = false;
+  for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+    if (newMacs[i] != bmsSlots[i].mac) macChanged = true;
+  }
+  // Ohne eine einzige gültige MAC die bestehende Konfiguration behalten
+  if (newMacs[0].length() != 17) macChanged = false;
 
-    saveSettings();
-    server.send(200, "application/json", "{\"success\":true}");
+  saveSettings();
 
-    // Bei MAC-Änderung Neustart erforderlich
-    if (macChanged) {
-      delay(1000);
-      ESP.restart();
+  // Bei MAC-Änderung neue Liste speichern und neu starten (Antwort ist bereits gesendet)
+  if (macChanged) {
+    preferences.begin("settings", false);
+    SettingsWriter nvs{preferences};
+    for (uint8_t i = 0; i < BMS_MAX_PACKS; i++) {
+      putBmsMac(nvs, i, newMacs[i].c_str());
     }
-  } else {
-    server.send(200, "application/json", "{\"success\":true}");
+    preferences.end();
+    saveEnergyCounters();
+    delay(1000);
+    ESP.restart();
   }
 }
 
@@ -1907,15 +6500,106 @@ void handleApiBmsSettings() {
  *
  * Body: {"timezone": "CET-1CEST,M3.5.0,M10.5.0/3"}
  */
-void handleApiTimezone() {
-  if (server.hasArg("plain")) {
-    JsonDocument doc;
-    deserializeJson(doc, server.arg("plain"));
-    timezone = doc["timezone"].as<String>();
-    saveSettings();
-    syncNTP();  // Sofort neu synchronisieren mit neuer Zeitzone
+void handleApiTimezone(JsonDocument& doc) {
+  timezone = doc["timezone"].as<String>();
+  saveSettings();
+  syncNTP();  // Sofort neu synchronisieren mit neuer Zeitzone
+}
+
+/**
+ * POST /api/power-mode - Energiesparmodus speichern und anwenden
+ *
+ * Body: {"mode": 1}  // 0=Normal, 1=Stromsparen
+ */
+void handleApiPowerMode(JsonDocument& doc) {
+  uint8_t mode = doc["mode"].as<uint8_t>();
+
+  // Wert validieren (0-1)
+  if (mode > 1) mode = 1;
+
+  powerMode = mode;
+  saveSettings();
+  applyPowerMode();  // Sofort anwenden
+}
+
+/**
+ * POST /api/memory-settings - Maßnahme bei knappem Speicher speichern
+ *
+ * Body: {"action": 1, "minBlock": 10240}  // 0=warnen, 1=entlasten, 2=entlasten + Neustart
+ */
+void handleApiMemorySettings(JsonDocument& doc) {
+  heapAction = min(doc["action"] | 1u, 2u);
+  uint32_t block = doc["minBlock"] | 10240u;
+
+  // Schwelle validieren (4096-65535 Bytes)
+  if (block < 4096) block = 4096;
+  if (block > 65535) block = 65535;
+  heapMinBlock = block;
+
+  saveSettings();
+}
+
+/**
+ * POST /api/headless - Headless-Betrieb (Deep Sleep) einstellen
+ *
+ * Body: {"enabled": true, "interval": 300}
+ *
+ * Beim Einschalten beginnt das Konfigurationsfenster neu.
+ */
+void handleApiHeadless(JsonDocument& doc) {
+  headlessMode = doc["enabled"].as<bool>();
+  sleepInterval = doc["interval"].as<unsigned long>();
+
+  // Intervall validieren (60-86400 Sekunden)
+  if (sleepInterval < 60) sleepInterval = 60;
+  if (sleepInterval > 86400) sleepInterval = 86400;
+
+  headlessWindowStart = millis();
+  saveSettings();
+}
+
+/**
+ * POST /api/wifi-ip - Feste IP-Adresse oder DHCP einstellen
+ *
+ * Body: {"static": true, "ip": "192.168.1.50", "gateway": "192.168.1.1",
+ *        "subnet": "255.255.255.0", "dns": "192.168.1.1"}
+ *
+ * Wird beim nächsten Verbindungsaufbau wirksam (Neustart oder Reconnect).
+ * Die Adressen werden vorab im Webserver geprüft (validateWifiIp()).
+ */
+void handleApiWifiIp(JsonDocument& doc) {
+  bool staticIp = doc["static"].as<bool>();
+  IPAddress ip, gateway, subnet, dns;
+  ip.fromString((const char*)(doc["ip"] | ""));
+  gateway.fromString((const char*)(doc["gateway"] | ""));
+  subnet.fromString((const char*)(doc["subnet"] | ""));
+  dns.fromString((const char*)(doc["dns"] | ""));  // Optional
+
+  preferences.begin("wifi", false);
+  preferences.putBool("staticIp", staticIp);
+  if (staticIp) {
+    preferences.putULong("ip", (uint32_t)ip);
+    preferences.putULong("gateway", (uint32_t)gateway);
+    preferences.putULong("subnet", (uint32_t)subnet);
+    preferences.putULong("dns", (uint32_t)dns);
+  }
+  preferences.end();
+}
+
+/**
+ * Prüft die Adressen für /api/wifi-ip (läuft im Webserver)
+ *
+ * @param doc Body der Anfrage
+ * @return Fehlermeldung oder nullptr wenn gültig
+ */
+const char* validateWifiIp(JsonDocument& doc) {
+  IPAddress ip, gateway, subnet;
+  if (doc["static"].as<bool>() && (!ip.fromString((const char*)(doc["ip"] | "")) ||
+                                  !gateway.fromString((const char*)(doc["gateway"] | "")) ||
+                                  !subnet.fromString((const char*)(doc["subnet"] | "")))) {
+    return "Ungültige IP-Adresse";
   }
-  server.send(200, "application/json", "{\"success\":true}");
+  return nullptr;
 }
 
 /**
@@ -1923,108 +6607,386 @@ void handleApiTimezone() {
  *
  * Body: {"power": 0}  // 0=Niedrig, 1=Normal, 2=Hoch
  */
-void handleApiWifiPower() {
-  if (server.hasArg("plain")) {
-    JsonDocument doc;
-    deserializeJson(doc, server.arg("plain"));
-    uint8_t power = doc["power"].as<uint8_t>();
+void handleApiWifiPower(JsonDocument& doc) {
+  uint8_t power = doc["power"].as<uint8_t>();
 
-    // Wert validieren (0-2)
-    if (power > 2) power = 2;
+  // Wert validieren (0-2)
+  if (power > 2) power = 2;
 
-    wifiTxPower = power;
-    saveSettings();
-    applyWifiTxPower();  // Sofort anwenden
-  }
-  server.send(200, "application/json", "{\"success\":true}");
+  wifiTxPower = power;
+  saveSettings();
+  applyWifiTxPower();  // Sofort anwenden
 }
 
 /**
  * POST /api/ha-settings - Home Assistant Webhook-Einstellungen speichern
  *
- * Body: {"enabled": true, "url": "http://...", "interval": 60}
+ * Body: {"enabled": true, "url": "http://...", "interval": 60, "batch": false, "msgpack": false}
+ *
+ * "batch" und "msgpack" sind optional - fehlt ein Feld, bleibt die Einstellung unverändert.
+ */
+void handleApiHaSettings(JsonDocument& doc) {
+  bool wasBatching = haEnabled && haBatchMode;
+  haEnabled = doc["enabled"].as<bool>();
+  haBatchMode = doc["batch"] | haBatchMode;
+  haMsgPack = doc["msgpack"] | haMsgPack;
+  if (!wasBatching && haEnabled && haBatchMode) {
+    haBatchRestart = true;
+  }
+  xSemaphoreTake(haMutex, portMAX_DELAY);
+  haWebhookUrl = doc["url"].as<String>();
+  xSemaphoreGive(haMutex);
+  haInterval = doc["interval"].as<unsigned long>();
+  haFailCount = 0;  // Neue Einstellungen: Backoff zurücksetzen
+
+  // Intervall validieren (10-3600 Sekunden)
+  if (haInterval < 10) haInterval = 10;
+  if (haInterval > 3600) haInterval = 3600;
+
+  saveSettings();
+}
+
+/**
+ * POST /api/alarm-settings - Alarmregeln speichern
+ *
+ * Body: {"enabled": true, "socMin": 20, "cellDeltaMv": 100, "tempMax": 50,
+ *        "currentMax": 80, "minInterval": 30}
+ * Schwelle 0 = Regel deaktiviert. Gilt ab der nächsten Messung.
  */
-void handleApiHaSettings() {
-  if (server.hasArg("plain")) {
-    JsonDocument doc;
-    deserializeJson(doc, server.arg("plain"));
-    haEnabled = doc["enabled"].as<bool>();
-    haWebhookUrl = doc["url"].as<String>();
-    haInterval = doc["interval"].as<unsigned long>();
+void handleApiAlarmSettings(JsonDocument& doc) {
+  alarmEnabled = doc["enabled"].as<bool>();
+  alarmSocMin = min(doc["socMin"].as<unsigned int>(), 100u);
+  alarmCellDeltaMv = min(doc["cellDeltaMv"].as<unsigned int>(), 2000u);
+  alarmTempMax = min(doc["tempMax"].as<unsigned int>(), 120u);
+  alarmCurrentMax = min(doc["currentMax"].as<unsigned int>(), 1000u);
+  alarmMinInterval = doc["minInterval"] | 30;
+
+  // Mindestabstand validieren (5-3600 Sekunden)
+  if (alarmMinInterval < 5) alarmMinInterval = 5;
+  if (alarmMinInterval > 3600) alarmMinInterval = 3600;
+
+  saveSettings();
+}
 
-    // Intervall validieren (10-3600 Sekunden)
-    if (haInterval < 10) haInterval = 10;
-    if (haInterval > 3600) haInterval = 3600;
+/**
+ * POST /api/report-settings - Totband für Webhook und MQTT speichern
+ *
+ * Body: {"enabled": true, "mv": 10, "ma": 200, "soc": 1, "temp": 1, "heartbeat": 900}
+ */
+void handleApiReportSettings(JsonDocument& doc) {
+  reportDeadband = doc["enabled"].as<bool>();
+  deadbandMv = min(doc["mv"] | 10u, 1000u);
+  deadbandMa = min(doc["ma"] | 200u, 50000u);
+  deadbandSoc = min(doc["soc"] | 1u, 50u);
+  deadbandTemp = min(doc["temp"] | 1u, 20u);
+  reportHeartbeat = doc["heartbeat"] | 900;
+
+  // Lebenszeichen validieren (60-86400 Sekunden)
+  if (reportHeartbeat < 60) reportHeartbeat = 60;
+  if (reportHeartbeat > 86400) reportHeartbeat = 86400;
+
+  saveSettings();
+}
 
-    saveSettings();
+/**
+ * POST /api/mqtt-settings - MQTT-Einstellungen speichern
+ *
+ * Body: {"enabled": true, "host": "192.168.1.10", "port": 1883, "user": "",
+ *        "pass": "", "topic": "", "qos": 0, "discovery": true, "binary": false}
+ *
+ * "pass" ist optional - fehlt das Feld, bleibt das gespeicherte Passwort erhalten.
+ * Eine bestehende Verbindung wird getrennt und mit den neuen Daten neu aufgebaut.
+ */
+void handleApiMqttSettings(JsonDocument& doc) {
+  mqttEnabled = doc["enabled"].as<bool>();
+  mqttHost = doc["host"].as<String>();
+  mqttHost.trim();
+  mqttPort = doc["port"] | 1883;
+  mqttUser = doc["user"].as<String>();
+  if (doc["pass"].is<const char*>()) {
+    mqttPass = doc["pass"].as<String>();
   }
-  server.send(200, "application/json", "{\"success\":true}");
+  mqttBaseTopic = doc["topic"].as<String>();
+  mqttBaseTopic.trim();
+  mqttQos = doc["qos"].as<uint8_t>() > 0 ? 1 : 0;
+  mqttDiscovery = doc["discovery"] | true;
+  mqttBinary = doc["binary"] | false;
+
+  if (mqttPort == 0) mqttPort = 1883;
+
+  saveSettings();
+  restartMqtt();
+  Serial.println("[MQTT] Einstellungen geändert: " + String(mqttEnabled ? "aktiviert" : "deaktiviert"));
 }
 
 /**
  * POST /api/ha-test - Test-Webhook an Home Assistant senden
  *
- * Sendet sofort einen Webhook unabhängig vom Intervall
+ * Stellt sofort einen Webhook in die Warteschlange, unabhängig vom Intervall.
+ * Die Antwort wartet nicht auf das Ergebnis.
  */
-void handleApiHaTest() {
+void handleApiHaTest(AsyncWebServerRequest* request) {
   // Im AP-Modus nicht möglich
   if (apMode) {
-    server.send(200, "application/json", "{\"success\":false,\"message\":\"Nicht im AP-Modus möglich\"}");
+    sendJsonText(request, "{\"success\":false,\"message\":\"Nicht im AP-Modus möglich\"}");
     return;
   }
   // Keine URL konfiguriert
-  if (haWebhookUrl.length() == 0) {
-    server.send(200, "application/json", "{\"success\":false,\"message\":\"Keine Webhook URL konfiguriert\"}");
+  xSemaphoreTake(haMutex, portMAX_DELAY);
+  bool hasUrl = haWebhookUrl.length() > 0;
+  xSemaphoreGive(haMutex);
+  if (!hasUrl) {
+    sendJsonText(request, "{\"success\":false,\"message\":\"Keine Webhook URL konfiguriert\"}");
     return;
   }
 
-  // Temporär aktivieren für Test (falls deaktiviert)
-  bool wasEnabled = haEnabled;
-  haEnabled = true;
-  bool success = sendToHomeAssistant();
-  haEnabled = wasEnabled;
-
-  if (success) {
-    server.send(200, "application/json", "{\"success\":true}");
+  // Asynchron über den Cloud-Task senden (auch wenn der Webhook deaktiviert ist)
+  // Das Ergebnis erscheint in /api/settings (lastHaTime, lastHaHttpCode)
+  if (queueCloudJob(true)) {
+    sendJsonText(request, "{\"success\":true,\"queued\":true}");
   } else {
-    server.send(200, "application/json", "{\"success\":false,\"message\":\"HTTP Fehler\"}");
+    sendJsonText(request, "{\"success\":false,\"message\":\"Webhook-Warteschlange voll\"}");
   }
 }
 
 /**
- * POST /api/reset-wifi - WLAN-Daten löschen und Gerät neu starten
+ * POST /api/reset-wifi und /reset - WLAN-Daten löschen und Gerät neu starten
+ *
+ * Läuft als Auftrag in loop(), die Antwort ist bereits gesendet.
  */
-void handleApiResetWifi() {
+void handleApiResetWifi(JsonDocument& doc) {
   // WLAN-Daten aus NVS löschen
   preferences.begin("wifi", false);
   preferences.clear();
   preferences.end();
 
-  server.send(200, "application/json", "{\"success\":true}");
-  delay(1000);
+  delay(1000);    // AsyncTCP-Task stellt die Antwort noch zu
   ESP.restart();  // Neustart im AP-Modus
 }
 
+// ============================================================================
+// Push-Stream (Server-Sent Events)
+// ============================================================================
+// Statt drei Polling-Timern pro Browser hält jede Seite eine einzige
+// Verbindung zu /api/stream offen. Der Server sendet:
+// - "update": Status + BMS-Daten + Zeit, sobald eine neue Messung vorliegt
+//   oder sich der Status ändert
+// - "time":   Aktuelle Uhrzeit jede Sekunde (gleichzeitig Keep-Alive,
+//   tote Verbindungen werden beim Schreiben erkannt)
+//
+// Die Verbindungen verwaltet AsyncEventSource im AsyncTCP-Task. loop()
+// erzeugt die Ereignisse und übergibt sie einmal für alle Clients.
+
+/**
+ * Schreibt das kombinierte "update"-Ereignis (Status + Daten + Zeit) nach streamJson
+ *
+ * Der Datensatz kommt aus dem /api/data-Cache und wird nur kopiert.
+ *
+ * @return Länge der Ereignisdaten (0 = Puffer zu klein)
+ */
+size_t buildStreamUpdate() {
+  uint32_t seq;
+  JsonWriter json(streamJson, sizeof(streamJson));
+  json.beginObject();
+  writeTimeJson(json);
+  writeStatusJson(json, "status");
+  xSemaphoreTake(dataJsonMutex, portMAX_DELAY);
+  size_t dataLength = getCachedDataJson(seq);
+  json.addRaw("data", dataJsonCache, dataLength);
+  xSemaphoreGive(dataJsonMutex);
+  json.endObject();
+  return json.length();
+}
+
+/**
+ * Schreibt das "time"-Ereignis nach streamJson
+ *
+ * @return Länge der Ereignisdaten
+ */
+size_t buildStreamTime() {
+  JsonWriter json(streamJson, sizeof(streamJson));
+  json.beginObject();
+  writeTimeJson(json);
+  json.endObject();
+  return json.length();
+}
+
+/**
+ * Neuer Client an /api/stream (läuft im AsyncTCP-Task)
+ *
+ * Überzählige Clients und Clients bei knappem Speicher (heapLow) werden
+ * sofort getrennt. Sonst sendet loop() beim
+ * nächsten Durchlauf ein vollständiges "update"-Ereignis an alle.
+ *
+ * @param client Neu verbundener Client
+ */
+void onStreamConnect(AsyncEventSourceClient* client) {
+  if (events.count() > STREAM_MAX_CLIENTS) {
+    Serial.println("[STREAM] Zu viele Stream-Verbindungen, Client abgewiesen");
+    client->close();
+    return;
+  }
+  if (heapLow) {
+    Serial.println("[STREAM] Speicher knapp, Client abgewiesen");
+    client->close();
+    return;
+  }
+  streamForceUpdate = true;
+  Serial.printf("[STREAM] Client verbunden (%u offen)\n", (unsigned)events.count());
+}
+
+/**
+ * Versorgt alle offenen Stream-Verbindungen mit Ereignissen
+ *
+ * Wird in jedem Loop-Durchlauf aufgerufen. Das "update"-Ereignis wird nur
+ * einmal serialisiert und an alle Clients verteilt. Tote Verbindungen
+ * erkennt und entfernt AsyncEventSource selbst.
+ *
+ * @param currentMillis Aktueller Zeitstempel aus millis()
+ */
+void serviceEventStream(unsigned long currentMillis) {
+  if (events.count() == 0) return;
+
+  // Neue Messung (eines beliebigen Packs), Statuswechsel oder neuer Client → kombiniertes Update senden
+  uint32_t seq = bmsPacksSeq;
+  uint16_t status = getStatusSignature();
+  bool sendUpdate = (streamForceUpdate || seq != streamLastSeq || status != streamLastStatus);
+  bool sendTime = (currentMillis - streamLastTime >= STREAM_TIME_INTERVAL);
+  if (!sendUpdate && !sendTime) return;
+
+  streamForceUpdate = false;
+  size_t length = sendUpdate ? buildStreamUpdate() : buildStreamTime();
+  streamLastSeq = seq;
+  streamLastStatus = status;
+  streamLastTime = currentMillis;
+  if (length == 0) return;
+
+  events.send(streamJson, sendUpdate ? "update" : "time");
+}
+
 // ============================================================================
 // WLAN-Handler
 // ============================================================================
 
 /**
- * GET /scan - Verfügbare WLAN-Netzwerke scannen
+ * Startet einen asynchronen WLAN-Scan (kehrt sofort zurück)
+ */
+void startWifiScan() {
+  scanRequested = false;
+  if (scanRunning) return;
+  // async=true: Ergebnis wird in serviceWifiScan() abgeholt
+  if (WiFi.scanNetworks(true) == WIFI_SCAN_FAILED) {
+    Serial.println("[WIFI] Scan konnte nicht gestartet werden");
+    return;
+  }
+  scanRunning = true;
+  scanStartTime = millis();
+}
+
+/**
+ * Holt das Ergebnis eines laufenden Scans ab (aus loop())
+ *
+ * Übernimmt je SSID das stärkste Signal, sortiert nach Empfangsstärke und
+ * gibt die Scan-Liste des WLAN-Treibers sofort wieder frei. Startet außerdem
+ * vom Webserver angeforderte Scans.
  *
- * @return JSON-Array mit {ssid, rssi} für jedes gefundene Netzwerk
+ * @param now Aktueller millis()-Wert
  */
-void handleScan() {
-  int n = WiFi.scanNetworks();
-  String json = "[";
+void serviceWifiScan(unsigned long now) {
+  if (scanRequested) startWifiScan();
+  if (!scanRunning) return;
+
+  int n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING && now - scanStartTime < SCAN_TIMEOUT_MS) return;
+  scanRunning = false;
+  if (n < 0) {
+    // Fehlgeschlagen (z.B. während eines Verbindungsaufbaus) oder hängend
+    Serial.println("[WIFI] Scan fehlgeschlagen");
+    WiFi.scanDelete();
+    return;
+  }
+
+  // Erst lokal aufbauen, dann unter scanMutex übernehmen
+  ScanResult results[SCAN_MAX_RESULTS];
+  uint8_t count = 0;
   for (int i = 0; i < n; i++) {
-    if (i > 0) json += ",";
     String ssid = WiFi.SSID(i);
-    ssid.replace("\"", "\\\"");  // Anführungszeichen escapen
-    json += "{\"ssid\":\"" + ssid + "\",\"rssi\":" + String(WiFi.RSSI(i)) + "}";
+    if (ssid.length() == 0) continue;  // Versteckte Netzwerke
+    int8_t rssi = WiFi.RSSI(i);
+
+    // Doppelte SSID (mehrere APs): stärkstes Signal behalten
+    int existing = -1;
+    for (uint8_t j = 0; j < count; j++) {
+      if (strcmp(results[j].ssid, ssid.c_str()) == 0) {
+        existing = j;
+        break;
+      }
+    }
+    if (existing >= 0) {
+      if (rssi <= results[existing].rssi) continue;
+    } else if (count < SCAN_MAX_RESULTS) {
+      existing = count++;
+    } else if (rssi > results[count - 1].rssi) {
+      existing = count - 1;  // Schwächsten Eintrag ersetzen
+    } else {
+      continue;
+    }
+
+    ScanResult& r = results[existing];
+    strlcpy(r.ssid, ssid.c_str(), sizeof(r.ssid));
+    r.rssi = rssi;
+    r.channel = WiFi.channel(i);
+
+    // Nach vorne einsortieren (Liste bleibt absteigend nach RSSI)
+    while (existing > 0 && results[existing - 1].rssi < results[existing].rssi) {
+      ScanResult tmp = results[existing - 1];
+      results[existing - 1] = results[existing];
+      results[existing] = tmp;
+      existing--;
+    }
+  }
+  WiFi.scanDelete();
+
+  xSemaphoreTake(scanMutex, portMAX_DELAY);
+  memcpy(scanResults, results, sizeof(ScanResult) * count);
+  scanResultCount = count;
+  scanResultTime = now;
+  xSemaphoreGive(scanMutex);
+  Serial.printf("[WIFI] Scan abgeschlossen: %u Netzwerke in %lu ms\n", count, now - scanStartTime);
+}
+
+/**
+ * GET /scan - Verfügbare WLAN-Netzwerke (blockiert nicht)
+ *
+ * Liefert sofort das zuletzt gespeicherte Ergebnis und startet bei Bedarf
+ * einen neuen Scan im Hintergrund. Die Seite fragt erneut ab, solange
+ * "scanning" true ist.
+ *
+ * Parameter: refresh=1 erzwingt einen neuen Scan
+ *
+ * @return JSON {scanning, age, networks: [{ssid, rssi, channel}]}
+ */
+void handleScan(AsyncWebServerRequest* request) {
+  unsigned long now = millis();
+  JsonDocument doc;
+
+  xSemaphoreTake(scanMutex, portMAX_DELAY);
+  bool stale = (scanResultTime == 0 || now - scanResultTime >= SCAN_CACHE_MS);
+  if (stale || getUIntParam(request, "refresh", 0) == 1) {
+    scanRequested = true;  // Scan startet loop() (WLAN-Treiber nicht aus diesem Task bedienen)
   }
-  json += "]";
-  server.send(200, "application/json", json);
+  doc["scanning"] = scanRunning || scanRequested;
+  doc["age"] = scanResultTime == 0 ? -1 : (long)((now - scanResultTime) / 1000);
+  JsonArray networks = doc["networks"].to<JsonArray>();
+  for (uint8_t i = 0; i < scanResultCount; i++) {
+    JsonObject entry = networks.add<JsonObject>();
+    entry["ssid"] = scanResults[i].ssid;
+    entry["rssi"] = scanResults[i].rssi;
+    entry["channel"] = scanResults[i].channel;
+  }
+  xSemaphoreGive(scanMutex);
+
+  sendJsonDocument(request, doc);
 }
 
 /**
@@ -2032,7 +6994,7 @@ void handleScan() {
  *
  * @return JSON mit apMode, ssid, ip, rssi, quality oder apSSID, apPassword
  */
-void handleStatus() {
+void handleStatus(AsyncWebServerRequest* request) {
   JsonDocument doc;
   doc["apMode"] = apMode;
 
@@ -2064,19 +7026,20 @@ void handleStatus() {
     doc["quality"] = quality;
   }
 
-  String json;
-  serializeJson(doc, json);
-  server.send(200, "application/json", json);
+  sendJsonDocument(request, doc);
 }
 
 /**
  * POST /connect - Mit neuem WLAN-Netzwerk verbinden
  *
- * Parameter: ssid, password (application/x-www-form-urlencoded)
+ * Läuft als Auftrag in loop(). Die Antwort wurde bereits gesendet, da der
+ * Access Point beim Wechsel in den Station-Modus ohnehin wegfällt.
+ *
+ * @param doc Auftrag mit ssid, password
  */
-void handleConnect() {
-  String ssid = server.arg("ssid");
-  String password = server.arg("password");
+void handleConnect(JsonDocument& doc) {
+  String ssid = doc["ssid"].as<String>();
+  String password = doc["password"].as<String>();
 
   Serial.println("Verbinde mit: " + ssid);
 
@@ -2084,6 +7047,7 @@ void handleConnect() {
   WiFi.mode(WIFI_STA);
   WiFi.setHostname(wifiHostname.c_str());  // Hostname für Router setzen
   applyWifiTxPower();  // Konfigurierte Sendeleistung anwenden
+  applyPowerMode();    // Modem-Sleep und Power Management
   WiFi.begin(ssid.c_str(), password.c_str());
 
   // Auf Verbindung warten (max. 15 Sekunden)
@@ -2099,36 +7063,21 @@ void handleConnect() {
     preferences.putString("ssid", ssid);
     preferences.putString("password", password);
     preferences.end();
+    saveWifiCache();  // AP für schnelle Verbindung beim nächsten Start merken
 
     apMode = false;
 
     // mDNS starten für Hostname.local
     MDNS.begin(wifiHostname.c_str());
 
-    String json = "{\"success\":true,\"ip\":\"" + WiFi.localIP().toString() + "\",\"ssid\":\"" + ssid + "\"}";
-    server.send(200, "application/json", json);
     Serial.println("\nVerbunden! IP: " + WiFi.localIP().toString());
   } else {
     // Verbindung fehlgeschlagen: zurück in AP-Modus
+    Serial.println("\nVerbindung fehlgeschlagen");
     startAP();
-    server.send(200, "application/json", "{\"success\":false,\"message\":\"Verbindung fehlgeschlagen\"}");
   }
 }
 
-/**
- * POST /reset - WLAN-Daten löschen und Gerät neu starten
- */
-void handleReset() {
-  preferences.begin("wifi", false);
-  preferences.clear();
-  preferences.end();
-
-  server.send(200, "application/json", "{\"success\":true}");
-
-  delay(1000);
-  ESP.restart();
-}
-
 // ============================================================================
 // WLAN-Funktionen
 // ============================================================================
@@ -2167,36 +7116,136 @@ void startAP() {
   bool configOk = WiFi.softAPConfig(apIP, gateway, subnet);
   Serial.println("[AP] WiFi.softAPConfig() = " + String(configOk ? "OK" : "FEHLER"));
 
-  // Access Point starten
-  // Kanal 6 ist oft weniger überlastet
-  // Nicht versteckt, maximal 4 gleichzeitige Clients
-  Serial.println("[AP] Starte softAP auf Kanal 6...");
-  bool apOk = WiFi.softAP(apSSID.c_str(), AP_PASSWORD, 6, false, 4);
-  Serial.println("[AP] WiFi.softAP() = " + String(apOk ? "OK" : "FEHLER"));
+  // Access Point starten
+  // Kanal 6 ist oft weniger überlastet
+  // Nicht versteckt, maximal 4 gleichzeitige Clients
+  Serial.println("[AP] Starte softAP auf Kanal 6...");
+  bool apOk = WiFi.softAP(apSSID.c_str(), AP_PASSWORD, 6, false, 4);
+  Serial.println("[AP] WiFi.softAP() = " + String(apOk ? "OK" : "FEHLER"));
+
+  delay(1000);  // Warten bis AP stabil ist
+
+  apMode = true;
+
+  // Detaillierten Status ausgeben
+  Serial.println("[AP] ══════════════════════════════════════");
+  Serial.println("[AP] Access Point Status:");
+  Serial.println("[AP]   SSID: " + apSSID);
+  Serial.println("[AP]   Passwort: " + String(AP_PASSWORD));
+  Serial.println("[AP]   IP: " + WiFi.softAPIP().toString());
+  Serial.println("[AP]   Kanal: 6");
+  Serial.println("[AP]   MAC: " + WiFi.softAPmacAddress());
+  Serial.println("[AP]   TX Power: " + String(WiFi.getTxPower()) + " (0.25 dBm units)");
+  Serial.println("[AP]   Clients: " + String(WiFi.softAPgetStationNum()));
+  Serial.println("[AP] ══════════════════════════════════════");
+}
+
+/**
+ * Lädt den gemerkten Access Point (BSSID und Kanal) aus dem NVS
+ *
+ * @param bssid Ziel für die 6 Bytes der BSSID
+ * @param channel Ziel für den Kanal
+ * @return true wenn ein gültiger Eintrag vorhanden ist
+ */
+bool loadWifiCache(uint8_t* bssid, uint8_t& channel) {
+  preferences.begin("wifi", true);
+  size_t len = preferences.getBytes("bssid", bssid, 6);
+  channel = preferences.getUChar("channel", 0);
+  preferences.end();
+  return len == 6 && channel > 0;
+}
+
+/**
+ * Merkt sich BSSID und Kanal der aktuellen Verbindung im NVS
+ *
+ * Schreibt nur bei Änderung (Flash-Verschleiß).
+ */
+void saveWifiCache() {
+  const uint8_t* bssid = WiFi.BSSID();
+  uint8_t channel = WiFi.channel();
+  if (bssid == nullptr || channel == 0) return;
+
+  uint8_t oldBssid[6];
+  uint8_t oldChannel;
+  if (loadWifiCache(oldBssid, oldChannel) && oldChannel == channel && memcmp(oldBssid, bssid, 6) == 0) {
+    return;
+  }
+
+  preferences.begin("wifi", false);
+  preferences.putBytes("bssid", bssid, 6);
+  preferences.putUChar("channel", channel);
+  preferences.end();
+  Serial.printf("[WIFI] AP gemerkt: %s, Kanal %u\n", WiFi.BSSIDstr().c_str(), channel);
+}
+
+/**
+ * Setzt die IP-Konfiguration vor WiFi.begin(): feste IP oder DHCP
+ */
+void applyWifiIpConfig() {
+  preferences.begin("wifi", true);
+  bool staticIp = preferences.getBool("staticIp", false);
+  IPAddress ip(preferences.getULong("ip", 0));
+  IPAddress gateway(preferences.getULong("gateway", 0));
+  IPAddress subnet(preferences.getULong("subnet", 0));
+  IPAddress dns(preferences.getULong("dns", 0));
+  preferences.end();
 
-  delay(1000);  // Warten bis AP stabil ist
+  if (staticIp && (uint32_t)ip != 0) {
+    // Ohne eigenen DNS-Server das Gateway verwenden
+    WiFi.config(ip, gateway, subnet, (uint32_t)dns != 0 ? dns : gateway);
+  } else {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());  // DHCP
+  }
+}
 
-  apMode = true;
+/**
+ * Startet die Verbindung mit dem gespeicherten WLAN (non-blocking)
+ *
+ * Gezielt: direkt auf den gemerkten AP (BSSID und Kanal), ohne Scan.
+ * Ohne gemerkten AP wird automatisch normal mit Scan verbunden.
+ *
+ * @param targeted true = gemerkten AP verwenden
+ * @return false wenn keine WLAN-Daten gespeichert sind
+ */
+bool beginSavedWiFi(bool targeted) {
+  preferences.begin("wifi", true);
+  String ssid = preferences.getString("ssid", "");
+  String password = preferences.getString("password", "");
+  preferences.end();
+  if (ssid.length() == 0) {
+    return false;
+  }
 
-  // Detaillierten Status ausgeben
-  Serial.println("[AP] ══════════════════════════════════════");
-  Serial.println("[AP] Access Point Status:");
-  Serial.println("[AP]   SSID: " + apSSID);
-  Serial.println("[AP]   Passwort: " + String(AP_PASSWORD));
-  Serial.println("[AP]   IP: " + WiFi.softAPIP().toString());
-  Serial.println("[AP]   Kanal: 6");
-  Serial.println("[AP]   MAC: " + WiFi.softAPmacAddress());
-  Serial.println("[AP]   TX Power: " + String(WiFi.getTxPower()) + " (0.25 dBm units)");
-  Serial.println("[AP]   Clients: " + String(WiFi.softAPgetStationNum()));
-  Serial.println("[AP] ══════════════════════════════════════");
+  uint8_t bssid[6];
+  uint8_t channel = 0;
+  if (targeted && !loadWifiCache(bssid, channel)) {
+    targeted = false;
+  }
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname(wifiHostname.c_str());  // Hostname für Router setzen
+  applyWifiTxPower();  // Konfigurierte Sendeleistung anwenden
+  applyPowerMode();    // Modem-Sleep und Power Management
+  applyWifiIpConfig(); // Feste IP oder DHCP
+  if (targeted) {
+    Serial.printf("[WIFI] Gezielte Verbindung: Kanal %u\n", channel);
+    WiFi.begin(ssid.c_str(), password.c_str(), channel, bssid);
+  } else {
+    WiFi.begin(ssid.c_str(), password.c_str());
+  }
+  return true;
 }
 
 /**
- * Versucht eine Verbindung mit dem gespeicherten WLAN-Netzwerk herzustellen
+ * Startet die Verbindung mit dem gespeicherten WLAN-Netzwerk (non-blocking)
+ *
+ * Erst gezielt auf den gemerkten AP (typisch unter einer Sekunde), bei
+ * Misserfolg führt serviceBoot() mit vollem Scan und zuletzt mit dem
+ * Access Point fort.
  *
- * @return true wenn Verbindung erfolgreich, false wenn fehlgeschlagen oder keine Daten gespeichert
+ * @return false wenn keine WLAN-Daten gespeichert sind
  */
-bool connectToSavedWiFi() {
+bool startSavedWiFi() {
   Serial.println("[WIFI] Prüfe gespeicherte WLAN-Daten...");
 
   // Gespeicherte Credentials aus NVS laden
@@ -2216,50 +7265,164 @@ bool connectToSavedWiFi() {
 
   Serial.println("[WIFI] Verbinde mit gespeichertem WLAN: " + ssid);
 
-  // In Station-Modus wechseln
-  WiFi.mode(WIFI_STA);
-  WiFi.setHostname(wifiHostname.c_str());  // Hostname für Router setzen
-  applyWifiTxPower();  // Konfigurierte Sendeleistung anwenden
-  WiFi.begin(ssid.c_str(), password.c_str());
+  uint8_t bssid[6];
+  uint8_t channel;
+  bootPhase = loadWifiCache(bssid, channel) ? BOOT_WIFI_TARGETED : BOOT_WIFI_SCAN;
+  bootPhaseStart = millis();
+  return beginSavedWiFi(bootPhase == BOOT_WIFI_TARGETED);
+}
 
-  // Auf Verbindung warten mit Fortschrittsanzeige
-  unsigned long start = millis();
-  int dots = 0;
-  while (WiFi.status() != WL_CONNECTED && millis() - start < WIFI_TIMEOUT_MS) {
-    delay(500);
-    Serial.print(".");
-    dots++;
-    // Alle 20 Punkte Status ausgeben
-    if (dots % 20 == 0) {
-      Serial.println();
-      Serial.print("[WIFI] Status: ");
-      Serial.println(WiFi.status());
-    }
+/**
+ * Wird einmal aufgerufen, sobald die WLAN-Verbindung beim Start steht
+ *
+ * Startet mDNS und die NTP-Synchronisation (läuft im Hintergrund).
+ */
+void onBootWifiConnected() {
+  bootTimings.wifi = millis();
+  saveWifiCache();
+  Serial.println("[WIFI] ══════════════════════════════════════");
+  Serial.println("[WIFI] Verbunden nach " + String(bootTimings.wifi - bootTimings.wifiStart) + " ms!");
+  Serial.println("[WIFI]   SSID: " + WiFi.SSID());
+  Serial.println("[WIFI]   IP: " + WiFi.localIP().toString());
+  Serial.println("[WIFI]   Gateway: " + WiFi.gatewayIP().toString());
+  Serial.println("[WIFI]   RSSI: " + String(WiFi.RSSI()) + " dBm");
+  Serial.println("[WIFI] ══════════════════════════════════════");
+
+  // mDNS starten für Hostname.local
+  if (MDNS.begin(wifiHostname.c_str())) {
+    Serial.println("[WIFI] mDNS gestartet: http://" + wifiHostname + ".local");
   }
 
+  // NTP-Zeitsynchronisation, Ergebnis meldet onNtpSync()
+  Serial.println("[WIFI] Starte NTP-Synchronisation...");
+  syncNTP();
+  lastNtpSync = millis();
+}
+
+/**
+ * Führt den Startablauf nach setup() in loop() fort (non-blocking)
+ *
+ * Gezielte Verbindung -> Verbindung mit Scan -> Access Point. Der
+ * Webserver läuft währenddessen bereits.
+ *
+ * @param now Aktueller millis()-Wert
+ */
+void serviceBoot(unsigned long now) {
+  if (bootPhase == BOOT_DONE) return;
+
   if (WiFi.status() == WL_CONNECTED) {
-    // Verbindung erfolgreich
-    Serial.println();
-    Serial.println("[WIFI] ══════════════════════════════════════");
-    Serial.println("[WIFI] Verbunden!");
-    Serial.println("[WIFI]   SSID: " + WiFi.SSID());
-    Serial.println("[WIFI]   IP: " + WiFi.localIP().toString());
-    Serial.println("[WIFI]   Gateway: " + WiFi.gatewayIP().toString());
-    Serial.println("[WIFI]   RSSI: " + String(WiFi.RSSI()) + " dBm");
-    Serial.println("[WIFI] ══════════════════════════════════════");
+    bootPhase = BOOT_DONE;
+    onBootWifiConnected();
+    return;
+  }
 
-    // mDNS starten für Hostname.local
-    if (MDNS.begin(wifiHostname.c_str())) {
-      Serial.println("[WIFI] mDNS gestartet: http://" + wifiHostname + ".local");
-    }
+  if (bootPhase == BOOT_WIFI_TARGETED && now - bootPhaseStart >= WIFI_FAST_TIMEOUT_MS) {
+    // AP gewechselt oder Kanal geändert: normal mit Scan verbinden
+    Serial.println("[WIFI] Gemerkter AP nicht erreichbar, verbinde mit Scan...");
+    WiFi.disconnect();
+    beginSavedWiFi(false);
+    bootPhase = BOOT_WIFI_SCAN;
+    bootPhaseStart = now;
+  } else if (bootPhase == BOOT_WIFI_SCAN && now - bootPhaseStart >= WIFI_TIMEOUT_MS) {
+    // Verbindung fehlgeschlagen: Access Point für die Konfiguration
+    Serial.println("[WIFI] Verbindung fehlgeschlagen! Status: " + String(WiFi.status()));
+    Serial.println("[WIFI] Kein WLAN -> starte AP");
+    bootPhase = BOOT_DONE;
+    startAP();
+  }
+}
 
-    return true;
+// ============================================================================
+// Aufträge vom Webserver
+// ============================================================================
+// Die Handler laufen im AsyncTCP-Task. Alles was Einstellungen ändert oder
+// blockiert, wird mit einer Kopie des Request-Bodys an loop() übergeben
+// (gleiches Muster wie die Cloud-Warteschlange). Der Browser erhält sofort
+// {"success":true}, die Änderung ist wenige Millisekunden später aktiv.
+
+/**
+ * Auftrag für loop()
+ */
+struct WebCommand {
+  void (*run)(JsonDocument& doc);  // Ausführender Handler
+  JsonDocument* doc;               // Kopie des Request-Bodys (gibt loop() frei)
+  bool lockSettings;               // settingsMutex während der Ausführung halten
+};
+
+/**
+ * Übergibt einen Auftrag an loop()
+ *
+ * @param run Ausführender Handler
+ * @param doc Auftragsdaten (wird übernommen und nach der Ausführung gelöscht)
+ * @param lockSettings settingsMutex halten (false bei lang blockierenden Aufträgen)
+ * @return true wenn eingereiht, false wenn die Warteschlange voll ist
+ */
+bool queueWebCommand(void (*run)(JsonDocument&), JsonDocument* doc, bool lockSettings = true) {
+  WebCommand cmd = { run, doc, lockSettings };
+  if (xQueueSend(webCommandQueue, &cmd, 0) != pdTRUE) {
+    delete doc;
+    Serial.println("[WEB] Auftrags-Warteschlange voll");
+    return false;
   }
+  return true;
+}
 
-  // Verbindung fehlgeschlagen
-  Serial.println();
-  Serial.println("[WIFI] Verbindung fehlgeschlagen! Status: " + String(WiFi.status()));
-  return false;
+/**
+ * Bestätigt einen Auftrag gegenüber dem Browser
+ *
+ * @param request Anfrage
+ * @param queued Ergebnis von queueWebCommand()
+ * @param reply Antwort bei Erfolg
+ */
+void replyWebCommand(AsyncWebServerRequest* request, bool queued, const char* reply = "{\"success\":true}") {
+  if (queued) {
+    sendJsonText(request, reply);
+  } else {
+    sendJsonText(request, "{\"success\":false,\"message\":\"Gerät beschäftigt\"}", 503);
+  }
+}
+
+/**
+ * Registriert einen POST-Endpunkt mit JSON-Body, der in loop() ausgeführt wird
+ *
+ * Der Pfad wird zugleich für das Laufzeitprofil angemeldet (perfAddRoute()).
+ *
+ * @param uri Pfad des Endpunkts
+ * @param run Ausführender Handler
+ * @param validate Optionale Prüfung im Webserver (Fehlermeldung → 400)
+ */
+void onJsonCommand(const char* uri, void (*run)(JsonDocument&), const char* (*validate)(JsonDocument&) = nullptr) {
+  perfAddRoute(uri);
+  AsyncCallbackJsonWebHandler* handler = new AsyncCallbackJsonWebHandler(uri,
+    [run, validate](AsyncWebServerRequest* request, JsonVariant& json) {
+      JsonDocument* doc = new JsonDocument();
+      doc->set(json);
+      const char* error = validate ? validate(*doc) : nullptr;
+      if (error) {
+        delete doc;
+        JsonDocument reply;
+        reply["success"] = false;
+        reply["message"] = error;
+        sendJsonDocument(request, reply, 400);
+        return;
+      }
+      replyWebCommand(request, queueWebCommand(run, doc));
+    });
+  handler->setMethod(HTTP_POST);
+  server.addHandler(handler);
+}
+
+/**
+ * Führt wartende Aufträge des Webservers aus (aus loop())
+ */
+void serviceWebCommands() {
+  WebCommand cmd;
+  while (xQueueReceive(webCommandQueue, &cmd, 0) == pdTRUE) {
+    if (cmd.lockSettings) xSemaphoreTake(settingsMutex, portMAX_DELAY);
+    cmd.run(*cmd.doc);
+    if (cmd.lockSettings) xSemaphoreGive(settingsMutex);
+    delete cmd.doc;
+  }
 }
 
 // ============================================================================
@@ -2269,44 +7432,333 @@ bool connectToSavedWiFi() {
 /**
  * Konfiguriert alle Routen des Webservers
  *
+ * Lesende GET-Handler antworten direkt aus dem AsyncTCP-Task, POST-Handler
+ * werden als Auftrag in loop() ausgeführt (siehe serviceWebCommands()).
+ * Mehrere Browser werden damit gleichzeitig bedient, ein langsamer Client
+ * hält weder andere Anfragen noch loop() auf.
+ *
  * Routen:
  * - /              - Hauptseite (Werte)
  * - /bluetooth     - Bluetooth-Einstellungen
  * - /cloud         - Home Assistant Einstellungen
  * - /wlan          - WLAN-Einstellungen
+ * - /api/settings - Einstellungen für die Formulare der Webseiten
+ * - /api/history  - Messwert-Historie als CSV oder binär
  * - /api/*         - JSON-APIs
+ * - /api/stream    - Push-Stream (Server-Sent Events)
+ * - /metrics       - Prometheus-Metriken
+ * - /api/perf      - Laufzeitprofil (POST /api/perf-reset setzt zurück)
  * - /scan, /status, /connect, /reset - WLAN-Konfiguration
  */
 void setupWebServer() {
-  // Hauptseiten
-  server.on("/", handleRoot);
-  server.on("/bluetooth", handleBluetooth);
-  server.on("/cloud", handleCloud);
-  server.on("/wlan", handleWlan);
+  webCommandQueue = xQueueCreate(WEB_COMMAND_QUEUE_LENGTH, sizeof(WebCommand));
+
+  // Alle Anfragen zählen (für /metrics) und Dauer je Route messen (/api/perf)
+  server.addMiddleware([](AsyncWebServerRequest* request, ArMiddlewareNext next) {
+    httpRequestCount++;
+    int64_t start = esp_timer_get_time();
+    next();
+    perfRoute(request->url().c_str()).record((uint32_t)(esp_timer_get_time() - start));
+  });
+
+  // Hauptseiten (vorkomprimiert aus web_assets.h)
+  for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+    const WebAsset& asset = WEB_ASSETS[i];
+    server.on(asset.path, HTTP_GET, [&asset](AsyncWebServerRequest* request) { sendWebAsset(request, asset); });
+    perfAddRoute(asset.path);
+  }
+
+  // Übrige Routen für das Laufzeitprofil (JSON-Aufträge melden sich in onJsonCommand() selbst an)
+  static const char* const PERF_ROUTE_PATHS[] = {
+    "/api/time", "/api/data", "/api/history", "/api/status", "/api/settings", "/metrics",
+    "/api/perf", "/api/perf-reset", "/api/ha-test", "/api/stream",
+    "/scan", "/status", "/connect", "/api/reset-wifi", "/reset"
+  };
+  for (const char* path : PERF_ROUTE_PATHS) perfAddRoute(path);
 
   // API Endpunkte für AJAX
   server.on("/api/time", HTTP_GET, handleApiTime);
   server.on("/api/data", HTTP_GET, handleApiData);
+  server.on("/api/history", HTTP_GET, handleApiHistory);
   server.on("/api/status", HTTP_GET, handleApiStatus);
-  server.on("/api/bluetooth", HTTP_POST, handleApiBluetooth);
-  server.on("/api/serial", HTTP_POST, handleApiSerial);
-  server.on("/api/bms-settings", HTTP_POST, handleApiBmsSettings);
-  server.on("/api/timezone", HTTP_POST, handleApiTimezone);
-  server.on("/api/wifi-power", HTTP_POST, handleApiWifiPower);
-  server.on("/api/reset-wifi", HTTP_POST, handleApiResetWifi);
-  server.on("/api/ha-settings", HTTP_POST, handleApiHaSettings);
+  server.on("/api/settings", HTTP_GET, handleApiSettings);
+  server.on("/metrics", HTTP_GET, handleMetrics);
+  server.on("/api/perf", HTTP_GET, handleApiPerf);
+  server.on("/api/perf-reset", HTTP_POST, handleApiPerfReset);
   server.on("/api/ha-test", HTTP_POST, handleApiHaTest);
+  onJsonCommand("/api/bluetooth", handleApiBluetooth);
+  onJsonCommand("/api/serial", handleApiSerial);
+  onJsonCommand("/api/bms-settings", handleApiBmsSettings);
+  onJsonCommand("/api/timezone", handleApiTimezone);
+  onJsonCommand("/api/wifi-power", handleApiWifiPower);
+  onJsonCommand("/api/wifi-ip", handleApiWifiIp, validateWifiIp);
+  onJsonCommand("/api/power-mode", handleApiPowerMode);
+  onJsonCommand("/api/memory-settings", handleApiMemorySettings);
+  onJsonCommand("/api/headless", handleApiHeadless);
+  onJsonCommand("/api/ha-settings", handleApiHaSettings);
+  onJsonCommand("/api/mqtt-settings", handleApiMqttSettings);
+  onJsonCommand("/api/alarm-settings", handleApiAlarmSettings);
+  onJsonCommand("/api/report-settings", handleApiReportSettings);
+
+  // Push-Stream
+  events.onConnect(onStreamConnect);
+  server.addHandler(&events);
 
   // WLAN-Konfiguration
-  server.on("/scan", handleScan);
-  server.on("/status", handleStatus);
-  server.on("/connect", HTTP_POST, handleConnect);
-  server.on("/reset", HTTP_POST, handleReset);
+  server.on("/scan", HTTP_GET, handleScan);
+  server.on("/status", HTTP_GET, handleStatus);
+  server.on("/connect", HTTP_POST, [](AsyncWebServerRequest* request) {
+    // Formularfelder kopieren, verbunden wird in loop()
+    JsonDocument* doc = new JsonDocument();
+    (*doc)["ssid"] = request->arg("ssid");
+    (*doc)["password"] = request->arg("password");
+    replyWebCommand(request, queueWebCommand(handleConnect, doc, false), "{\"success\":true,\"pending\":true}");
+  });
+  // /reset und /api/reset-wifi: WLAN-Daten löschen und neu starten
+  auto resetWifi = [](AsyncWebServerRequest* request) {
+    replyWebCommand(request, queueWebCommand(handleApiResetWifi, new JsonDocument()));
+  };
+  server.on("/api/reset-wifi", HTTP_POST, resetWifi);
+  server.on("/reset", HTTP_POST, resetWifi);
 
   server.begin();
   Serial.println("Webserver gestartet");
 }
 
+// ============================================================================
+// Headless-Betrieb (Deep Sleep)
+// ============================================================================
+// Für Installationen ohne Bedarf an Webinterface: Nach dem Wecken durch den
+// Timer wird weder Webserver noch AP gestartet. Der Wachzyklus verbindet
+// das WLAN mit den im RTC-Speicher gemerkten Daten (BSSID, Kanal, IP -
+// kein Scan, kein DHCP), liest parallel dazu einmal das BMS, sendet per
+// Webhook und/oder MQTT und geht sofort wieder in den Deep Sleep.
+//
+// Nach Einschalten oder Reset läuft das Gerät normal mit Webinterface
+// (Konfigurationsfenster) und geht erst nach HEADLESS_CONFIG_WINDOW_MS in
+// den Schlafzyklus. Zum Umkonfigurieren also einfach kurz stromlos machen.
+
+/**
+ * Merkt sich die aktuelle WLAN-Verbindung im RTC-Speicher (Schnellverbindung)
+ */
+void saveWifiFastConnect() {
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid == nullptr) return;
+  memcpy(rtcWifi.bssid, bssid, sizeof(rtcWifi.bssid));
+  rtcWifi.channel = WiFi.channel();
+  rtcWifi.ip = (uint32_t)WiFi.localIP();
+  rtcWifi.gateway = (uint32_t)WiFi.gatewayIP();
+  rtcWifi.subnet = (uint32_t)WiFi.subnetMask();
+  rtcWifi.dns = (uint32_t)WiFi.dnsIP();
+  rtcWifi.magic = WIFI_FAST_MAGIC;
+}
+
+/**
+ * Startet den WLAN-Verbindungsaufbau (non-blocking)
+ *
+ * Mit gültigen RTC-Daten direkt auf BSSID und Kanal mit der zuletzt
+ * erhaltenen IP (kein DHCP), sonst wie beim normalen Start über den im
+ * NVS gemerkten AP.
+ *
+ * @param fast true = gemerkte Verbindungsdaten aus dem RTC-Speicher verwenden
+ * @return false wenn keine WLAN-Daten gespeichert sind
+ */
+bool headlessBeginWiFi(bool fast) {
+  if (!fast) {
+    return beginSavedWiFi(true);
+  }
+
+  preferences.begin("wifi", true);
+  String ssid = preferences.getString("ssid", "");
+  String password = preferences.getString("password", "");
+  preferences.end();
+  if (ssid.length() == 0) {
+    return false;
+  }
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname(wifiHostname.c_str());
+  applyWifiTxPower();
+  WiFi.config(IPAddress(rtcWifi.ip), IPAddress(rtcWifi.gateway), IPAddress(rtcWifi.subnet), IPAddress(rtcWifi.dns));
+  WiFi.begin(ssid.c_str(), password.c_str(), rtcWifi.channel, rtcWifi.bssid);
+  return true;
+}
+
+/**
+ * Wartet auf die WLAN-Verbindung des Wachzyklus
+ *
+ * Scheitert die Schnellverbindung (anderer AP, IP vergeben), werden die
+ * RTC-Daten verworfen und einmal normal verbunden.
+ *
+ * @param fast true = Verbindung wurde mit RTC-Daten gestartet
+ * @return true wenn verbunden
+ */
+bool headlessWaitWiFi(bool fast) {
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < HEADLESS_WIFI_TIMEOUT_MS) {
+    delay(10);
+  }
+  if (WiFi.status() == WL_CONNECTED) {
+    Serial.printf("[SLEEP] WLAN verbunden nach %lu ms%s\n", millis() - start, fast ? " (Schnellverbindung)" : "");
+    saveWifiFastConnect();
+    saveWifiCache();
+    return true;
+  }
+
+  if (!fast) {
+    Serial.println("[SLEEP] WLAN-Verbindung fehlgeschlagen");
+    return false;
+  }
+  Serial.println("[SLEEP] Schnellverbindung fehlgeschlagen, verbinde mit Scan");
+  rtcWifi.magic = 0;
+  WiFi.disconnect();
+  return beginSavedWiFi(false) && headlessWaitWiFi(false);
+}
+
+/**
+ * Veröffentlicht die Messung per MQTT und trennt sauber
+ *
+ * Wartet bis die Sendewarteschlange der Bibliothek leer ist, damit
+ * nichts verloren geht. Ohne Verbindung landet die Messung im
+ * Zwischenspeicher.
+ *
+ * @param online WLAN verbunden
+ */
+void headlessPublishMqtt(bool online) {
+  if (!online) {
+    spoolMqttSample();
+    return;
+  }
+
+  setupMqtt();
+  mqttConnecting = mqttClient.connect();
+  unsigned long start = millis();
+  while (mqttConnecting && !mqttConnected && millis() - start < HEADLESS_MQTT_TIMEOUT_MS) {
+    delay(10);
+  }
+  if (!mqttConnected) {
+    Serial.println("[SLEEP] MQTT nicht erreichbar");
+    spoolMqttSample();
+    return;
+  }
+
+  // Discovery ist retained, nur gelegentlich erneut senden
+  mqttSessionStarted = false;
+  mqttStartSession(mqttDiscovery && headlessCycles % HEADLESS_DISCOVERY_EVERY == 1);
+  mqttReplayBacklog(millis() + MQTT_REPLAY_INTERVAL_MS);
+
+  while (mqttClient.queueSize() > 0 && mqttConnected && millis() - start < HEADLESS_MQTT_TIMEOUT_MS * 2) {
+    delay(10);
+  }
+  mqttClient.disconnect();
+  while (mqttConnected && millis() - start < HEADLESS_MQTT_TIMEOUT_MS * 2) {
+    delay(10);
+  }
+}
+
+/**
+ * Geht in den Deep Sleep bis zum nächsten Wachzyklus
+ *
+ * @param awakeMs Dauer des Wachzyklus (0 = Ende des Konfigurationsfensters)
+ */
+void enterDeepSleep(unsigned long awakeMs) {
+  // Gesammelte Einträge des Zwischenspeichers und Energiezähler schreiben (RAM geht verloren).
+  // Den Webhook-Zwischenspeicher schreibt der Cloud-Task selbst (einziger Nutzer), ohne
+  // Cloud-Task (Wachzyklus) gehört er loop()
+  if (!stopCloudTask()) {
+    Serial.println("[SLEEP] Cloud-Task antwortet nicht - Webhook-Zwischenspeicher nicht geschrieben");
+  } else if (spoolAvailable && !cloudTaskHandle) {
+    webhookSpool.flush();
+  }
+  if (spoolAvailable) {
+    mqttSpool.flush();
+  }
+  saveEnergyCounters();
+  if (!apMode && WiFi.status() == WL_CONNECTED) {
+    saveWifiFastConnect();
+  }
+  rtcLastSyncTime = lastSyncTime;
+  if (awakeMs > 0) {
+    headlessLastAwakeMs = awakeMs;
+  }
+
+  uint64_t intervalMs = (uint64_t)sleepInterval * 1000;
+  uint64_t sleepMs = (intervalMs > awakeMs) ? intervalMs - awakeMs : 0;
+  sleepMs = max(sleepMs, (uint64_t)HEADLESS_MIN_SLEEP_S * 1000);
+
+  Serial.printf("[SLEEP] Wach %lu ms, schlafe %lu s\n", awakeMs, (unsigned long)(sleepMs / 1000));
+  Serial.flush();
+  ledOff();
+  esp_sleep_enable_timer_wakeup(sleepMs * 1000ULL);
+  esp_deep_sleep_start();
+}
+
+/**
+ * Wachzyklus nach Timer-Wecken: messen, senden, schlafen (kehrt nicht zurück)
+ */
+void runHeadlessCycle() {
+  unsigned long cycleStart = millis();
+  headlessCycles++;
+  Serial.printf("[SLEEP] Wachzyklus %lu (letzter: %lu ms)\n", (unsigned long)headlessCycles, (unsigned long)headlessLastAwakeMs);
+
+  // Systemzeit läuft im Deep Sleep weiter, nur Zeitzone und Sync-Zeitpunkt fehlen
+  lastSyncTime = rtcLastSyncTime;
+  setenv("TZ", timezone.c_str(), 1);
+  tzset();
+
+  bmsDataMutex = xSemaphoreCreateMutex();
+  historyMutex = xSemaphoreCreateMutex();
+  haMutex = xSemaphoreCreateMutex();
+
+  // WLAN verbindet im Hintergrund, während das BMS gelesen wird
+  bool fast = (rtcWifi.magic == WIFI_FAST_MAGIC);
+  bool wifiStarted = headlessBeginWiFi(fast);
+
+  for (uint8_t i = 0; bluetoothEnabled && i < bmsPackCount(); i++) {
+    logCrashLocation("!sleep:bms_connect");
+    BmsSlot& slot = bmsSlots[i];
+    slot.client.init(slot.mac);
+    if (slot.client.connect()) {
+      slot.connected = true;
+      updateBMSData(i);
+      disconnectBMS(i);
+    } else {
+      Serial.printf("[SLEEP] Pack %u: BMS nicht erreichbar\n", i);
+    }
+    esp_task_wdt_reset();
+  }
+
+  bool online = wifiStarted && headlessWaitWiFi(fast);
+  setupSpool();
+
+  // NTP nur wenn nötig (Zeitstempel), sonst reicht die RTC
+  if (online && (lastSyncTime == 0 || time(nullptr) - lastSyncTime > (time_t)(ntpSyncInterval / 1000))) {
+    time_t previousSync = lastSyncTime;
+    unsigned long ntpStart = millis();
+    syncNTP();
+    while (lastSyncTime == previousSync && millis() - ntpStart < HEADLESS_NTP_TIMEOUT_MS) {
+      delay(10);
+    }
+  }
+
+  if (bmsDataValid) {
+    if (haEnabled) {
+      logCrashLocation("!sleep:ha_webhook");
+      if (online && sendToHomeAssistant(false)) {
+        replayWebhookBacklog();
+      } else {
+        spoolWebhookSample();
+      }
+    }
+    if (mqttEnabled && mqttHost.length() > 0) {
+      logCrashLocation("!sleep:mqtt");
+      headlessPublishMqtt(online);
+    }
+  }
+
+  enterDeepSleep(millis() - cycleStart);
+}
+
 // ============================================================================
 // Setup - Wird einmal beim Start ausgeführt
 // ============================================================================
@@ -2322,12 +7774,21 @@ void setupWebServer() {
  * 5. WLAN-Verbindung herstellen oder AP starten
  * 6. Webserver starten
  * 7. NTP synchronisieren (wenn WLAN verbunden)
- * 8. BMS-Verbindung herstellen (wenn konfiguriert)
+ * 8. BLE-Task starten (stellt die BMS-Verbindung im Hintergrund her)
  */
 void setup() {
   // Serial-Kommunikation mit 115200 Baud starten
   Serial.begin(115200);
-  delay(2000);  // Warten bis Serial bereit ist (USB CDC braucht etwas Zeit)
+  // Nach Timer-Wecken (Headless-Betrieb) zählt jede Millisekunde
+  bool timerWakeup = (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER);
+  if (!timerWakeup) {
+    // Warten bis Serial bereit ist (USB CDC braucht etwas Zeit), höchstens 2 Sekunden
+    // und nur solange kein Terminal verbunden ist
+    unsigned long serialStart = millis();
+    while (!Serial && millis() - serialStart < 2000) {
+      delay(10);
+    }
+  }
 
   // LED-Pin als Ausgang konfigurieren und LED ausschalten
   pinMode(LED_PIN, OUTPUT);
@@ -2374,6 +7835,7 @@ void setup() {
   // Benutzereinstellungen aus NVS laden
   Serial.println("[INIT] Lade Einstellungen...");
   loadSettings();
+  loadEnergyCounters();
   Serial.println("[INIT] Einstellungen geladen");
 
   // MAC-Adresse auslesen für eindeutige AP-SSID und Hostname
@@ -2390,59 +7852,74 @@ void setup() {
   Serial.println("[INIT] Hostname: " + wifiHostname);
   Serial.println();
 
-  // WLAN-Verbindung herstellen oder Access Point starten
+  // NTP-Ergebnis kommt per Callback (syncNTP() blockiert nicht)
+  sntp_set_time_sync_notification_cb(onNtpSync);
+
+  // Headless-Betrieb: nach Timer-Wecken ohne Webserver/AP messen, senden, schlafen
+  if (headlessMode && timerWakeup) {
+    runHeadlessCycle();  // Kehrt nicht zurück
+  }
+
+  // WLAN-Verbindung starten (non-blocking, serviceBoot() führt fort) oder Access Point starten
   Serial.println("[INIT] Starte WLAN...");
-  if (!connectToSavedWiFi()) {
-    // Keine gespeicherten Daten oder Verbindung fehlgeschlagen
+  bootTimings.wifiStart = millis();
+  if (!startSavedWiFi()) {
+    // Keine gespeicherten Daten
     Serial.println("[INIT] Kein WLAN -> starte AP");
     startAP();
   } else {
-    Serial.println("[INIT] WLAN verbunden");
+    Serial.println("[INIT] WLAN verbindet im Hintergrund");
   }
 
   Serial.println();
   Serial.println("[INIT] Aktueller Modus: " + String(apMode ? "ACCESS POINT" : "STATION"));
   Serial.println();
 
+  // Mutexe vor dem Webserver anlegen (Handler laufen parallel zu loop())
+  bmsDataMutex = xSemaphoreCreateMutex();
+  historyMutex = xSemaphoreCreateMutex();
+  dataJsonMutex = xSemaphoreCreateMutex();
+  settingsMutex = xSemaphoreCreateMutex();
+  scanMutex = xSemaphoreCreateMutex();
+
+  // Zwischenspeicher für Cloud-Ausfälle mounten (vor dem Cloud-Task)
+  setupSpool();
+
+  // Cloud-Task starten (Webhook-Versand außerhalb von loop())
+  startCloudTask();
+
   // Webserver mit allen Routen starten
   Serial.println("[INIT] Starte Webserver...");
   setupWebServer();
+  bootTimings.webServer = millis();
 
-  // NTP-Zeitsynchronisation (nur wenn mit Router verbunden)
-  if (!apMode) {
-    Serial.println("[INIT] Synchronisiere NTP...");
-    syncNTP();
-  } else {
+  // MQTT-Client vorbereiten (verbindet sich non-blocking aus loop())
+  setupMqtt();
+  if (mqttEnabled) {
+    Serial.println("[INIT] MQTT aktiviert: " + mqttHost + ":" + String(mqttPort));
+  }
+
+  // NTP-Zeitsynchronisation startet sobald das WLAN verbunden ist (onBootWifiConnected())
+  if (apMode) {
     Serial.println("[INIT] AP-Modus - überspringe NTP");
   }
 
-  // BMS-Verbindung wenn Bluetooth aktiviert und MAC konfiguriert
-  if (bluetoothEnabled && bmsMac.length() == 17) {
-    Serial.println("[INIT] Verbinde mit BMS: " + bmsMac);
-    bmsClient.init(bmsMac.c_str());
-    bmsConnected = bmsClient.connect();
-    if (bmsConnected) {
-      Serial.println("[INIT] BMS verbunden!");
-      updateBMSData();  // Erste Datenabfrage
-    } else {
-      Serial.println("[INIT] BMS Verbindung fehlgeschlagen!");
-    }
-  } else if (bluetoothEnabled && bmsMac.length() != 17) {
+  // BLE-Task starten - verbindet sich im Hintergrund mit dem BMS
+  if (bluetoothEnabled && bmsPackCount() > 0) {
+    Serial.printf("[INIT] BMS-Verbindung wird im Hintergrund hergestellt (%u Packs)\n", bmsPackCount());
+  } else if (bluetoothEnabled) {
     Serial.println("[INIT] BMS MAC nicht konfiguriert - bitte im Webinterface einstellen");
   }
+  startBMSTask();
 
   // Timing-Variablen initialisieren
-  lastBmsUpdate = millis();
   lastNtpSync = millis();
   lastHeapCheck = millis();
 
   // Heap-Monitoring initialisieren
   minFreeHeap = ESP.getFreeHeap();
   Serial.println("[INIT] Aktueller freier Heap: " + String(minFreeHeap) + " bytes");
-
-  // Crash-Log löschen (Setup erfolgreich abgeschlossen)
-  // Wird nach 60 Sekunden gelöscht, falls keine Probleme auftreten
-  Serial.println("[INIT] Crash-Log wird nach 60s Laufzeit gelöscht");
+  heap_caps_register_failed_alloc_callback(onHeapAllocFailed);
 
   // Watchdog einmal zurücksetzen nach Setup
   esp_task_wdt_reset();
@@ -2457,11 +7934,12 @@ void setup() {
     Serial.println("[INIT] Passwort: " + String(AP_PASSWORD));
     Serial.println("[INIT] Dann öffne: http://192.168.4.1");
   } else {
-    // Webinterface-URL anzeigen
-    Serial.println("[INIT] Webinterface: http://" + WiFi.localIP().toString());
+    // Webinterface-URL anzeigen (IP erst nach der Verbindung bekannt)
+    Serial.println("[INIT] Webinterface: http://" + wifiHostname + ".local");
   }
   Serial.println("══════════════════════════════════════════════════════");
   Serial.println();
+  bootTimings.setup = millis();
 }
 
 // ============================================================================
@@ -2476,14 +7954,16 @@ void setup() {
  *
  * Aufgaben:
  * 1. Webserver-Anfragen verarbeiten
- * 2. WLAN-Verbindung überwachen und bei Bedarf reconnecten
- * 3. BMS-Daten periodisch abfragen
- * 4. BMS-Reconnect bei Verbindungsverlust
- * 5. NTP periodisch synchronisieren
- * 6. Home Assistant Webhook periodisch senden
+ * 2. Startablauf fortführen, danach WLAN-Verbindung überwachen und bei Bedarf reconnecten
+ * 3. NTP periodisch synchronisieren
+ * 4. Home Assistant Webhook periodisch senden
+ * 5. MQTT-Verbindung halten und neue Messungen veröffentlichen
+ *
+ * BMS-Abfrage und -Reconnect laufen im eigenen BLE-Task (bmsTask).
  */
 void loop() {
   unsigned long currentMillis = millis();
+  uint64_t loopStart = esp_timer_get_time();
 
   // ========================================
   // Watchdog zurücksetzen (Lebenszeichen)
@@ -2492,15 +7972,6 @@ void loop() {
   // Dies zeigt dem Watchdog, dass die loop() noch läuft
   esp_task_wdt_reset();
 
-  // ========================================
-  // Crash-Log löschen nach 60 Sekunden Laufzeit
-  // ========================================
-  static bool crashLogCleared = false;
-  if (!crashLogCleared && currentMillis > 60000) {
-    clearCrashLog();
-    crashLogCleared = true;
-    Serial.println("[WATCHDOG] Crash-Log gelöscht (erfolgreicher Betrieb)");
-  }
 
   // ========================================
   // Heap-Speicher überwachen
@@ -2514,110 +7985,144 @@ void loop() {
   // LED-Status aktualisieren
   // ========================================
   // Zeigt Verbindungsstatus durch Blinkmuster an
+  // (perfLap() misst jede Phase für /api/perf, Start = Ende der vorherigen)
+  int64_t phaseStart = esp_timer_get_time();
   updateLED(currentMillis);
+  phaseStart = perfLap(PERF_LOOP_LED, phaseStart);
+
+  // ========================================
+  // Aufträge vom Webserver ausführen
+  // ========================================
+  // Anfragen beantwortet der AsyncTCP-Task, Änderungen laufen hier
+  serviceWebCommands();
+  phaseStart = perfLap(PERF_LOOP_WEB_COMMANDS, phaseStart);
 
   // ========================================
-  // Webserver-Anfragen verarbeiten
+  // Push-Stream-Clients versorgen
   // ========================================
-  // Muss in jeder Loop-Iteration aufgerufen werden
-  server.handleClient();
+  // Sendet nur bei neuer Messung, Statuswechsel oder Zeit-Tick
+  serviceEventStream(currentMillis);
+  phaseStart = perfLap(PERF_LOOP_STREAM, phaseStart);
 
   // ========================================
   // WLAN-Verbindung überwachen (non-blocking)
   // ========================================
-  // Nur im Station-Modus (nicht im AP-Modus)
-  if (!apMode) {
+  // Beim Start: gezielte Verbindung -> Scan -> AP (siehe serviceBoot())
+  serviceBoot(currentMillis);
+
+  // Ergebnis eines laufenden WLAN-Scans abholen (/scan)
+  serviceWifiScan(currentMillis);
+
+  // Nur im Station-Modus (nicht im AP-Modus) und nach dem Startablauf
+  if (!apMode && bootPhase == BOOT_DONE) {
     // Wenn Reconnect läuft: Status prüfen
+    // Abwechselnd gezielt auf den gemerkten AP (kurzer Timeout) und mit
+    // vollem Scan, nach jeder erfolglosen Runde wifiRetryInterval Pause
     if (wifiReconnecting) {
       if (WiFi.status() == WL_CONNECTED) {
         // Reconnect erfolgreich
-        Serial.println("[WIFI] Reconnect erfolgreich! IP: " + WiFi.localIP().toString());
+        Serial.println("[WIFI] Reconnect erfolgreich nach " + String(currentMillis - wifiReconnectStart) + " ms! IP: " + WiFi.localIP().toString());
         MDNS.begin(wifiHostname.c_str());  // mDNS neu starten
+        saveWifiCache();
         wifiReconnecting = false;
-      } else if (currentMillis - wifiReconnectStart > 15000) {
-        // Timeout nach 15 Sekunden
-        Serial.println("[WIFI] Reconnect Timeout, versuche erneut beim nächsten Check");
+        wifiReconnectAttempts = 0;
+      } else if (currentMillis - wifiReconnectStart > (wifiReconnectTargeted ? WIFI_FAST_TIMEOUT_MS : WIFI_RECONNECT_TIMEOUT_MS)) {
         wifiReconnecting = false;
+        wifiReconnectAttempts++;
+        if (wifiReconnectTargeted) {
+          // Gemerkter AP nicht erreichbar: sofort mit Scan weiter
+          Serial.println("[WIFI] Gezielter Reconnect fehlgeschlagen, versuche mit Scan...");
+          lastWifiCheck = currentMillis - wifiRetryInterval;
+        } else {
+          Serial.println("[WIFI] Reconnect Timeout, versuche erneut in " + String(wifiRetryInterval / 1000) + " s");
+          lastWifiCheck = currentMillis;
+        }
       }
     }
-    // Periodisch Verbindung prüfen (alle 30 Sekunden)
-    else if (currentMillis - lastWifiCheck >= wifiCheckInterval) {
+    // Verbindung prüfen (jede Sekunde), nach Fehlversuchen erst nach der Pause
+    else if (currentMillis - lastWifiCheck >= (wifiReconnectAttempts == 0 ? wifiCheckInterval : wifiRetryInterval)) {
       lastWifiCheck = currentMillis;
       if (WiFi.status() != WL_CONNECTED) {
         // Verbindung verloren: Reconnect starten
-        Serial.println("[WIFI] Verbindung verloren, starte Reconnect...");
-        WiFi.reconnect();
+        wifiReconnectTargeted = (wifiReconnectAttempts % 2 == 0);
+        Serial.println("[WIFI] Verbindung verloren, starte Reconnect" + String(wifiReconnectTargeted ? " (gemerkter AP)..." : " (Scan)..."));
+        WiFi.disconnect();
+        beginSavedWiFi(wifiReconnectTargeted);
         wifiReconnecting = true;
         wifiReconnectStart = currentMillis;
+      } else {
+        wifiReconnectAttempts = 0;
       }
     }
   }
+  phaseStart = perfLap(PERF_LOOP_WIFI, phaseStart);
 
   // ========================================
-  // BMS-Verbindung herstellen (non-blocking)
+  // NTP periodisch synchronisieren
   // ========================================
-  // Wird vom API-Handler oder Reconnect-Timer angefordert
-  if (bluetoothEnabled && bmsConnectPending && !bmsConnected && bmsMac.length() == 17) {
-    logCrashLocation("!loop:bms_connect_start");
-    Serial.println("[BLE] Stelle BMS-Verbindung her...");
-    bmsClient.init(bmsMac.c_str());
-    logCrashLocation("!loop:bms_connect_call");
-    bmsConnected = bmsClient.connect();
-    logCrashLocation("!loop:bms_connect_done");
-    bmsConnectPending = false;
-    if (bmsConnected) {
-      Serial.println("[BLE] BMS-Verbindung erfolgreich!");
-      logCrashLocation("!loop:bms_update_start");
-      updateBMSData();
-      logCrashLocation("!loop:bms_update_done");
-    } else {
-      Serial.println("[BLE] BMS-Verbindung fehlgeschlagen");
-    }
-    lastBmsUpdate = currentMillis;
-  } else if (bmsConnectPending && bmsMac.length() != 17) {
-    // Keine MAC konfiguriert: Request verwerfen
-    bmsConnectPending = false;
+  // Nur wenn WLAN verbunden, alle 1 Stunde
+  if (!apMode && WiFi.status() == WL_CONNECTED && (currentMillis - lastNtpSync >= ntpSyncInterval)) {
+    syncNTP();
+    lastNtpSync = currentMillis;
   }
+  phaseStart = perfLap(PERF_LOOP_NTP, phaseStart);
 
   // ========================================
-  // BMS-Daten periodisch abfragen
+  // Home Assistant Webhook periodisch senden
   // ========================================
-  // Funktioniert auch im AP-Modus
-  if (bluetoothEnabled && bmsConnected && (currentMillis - lastBmsUpdate >= bmsInterval * 1000)) {
-    logCrashLocation("loop:bms_periodic_update");
-    updateBMSData();
-    lastBmsUpdate = currentMillis;
+  // Auftrag im Intervall, auch ohne WLAN: der Cloud-Task sendet oder legt die
+  // Messung im Zwischenspeicher ab (Backoff entscheidet ebenfalls der Task).
+  // Ist die vorherige Sendung noch offen, wird dieses Intervall übersprungen.
+  if (haEnabled && !apMode && (currentMillis - lastHaSend >= haInterval * 1000)) {
+    if (!cloudBusy && uxQueueMessagesWaiting(cloudQueue) == 0) {
+      queueCloudJob(false);
+    }
+    lastHaSend = currentMillis;
   }
+  phaseStart = perfLap(PERF_LOOP_WEBHOOK, phaseStart);
 
   // ========================================
-  // BMS-Reconnect bei Verbindungsverlust
+  // MQTT-Verbindung und Veröffentlichung
   // ========================================
-  // Alle 30 Sekunden erneut versuchen
-  if (bluetoothEnabled && !bmsConnected && !bmsConnectPending && (currentMillis - lastBmsUpdate >= 30000)) {
-    Serial.println("[BLE] Plane BMS Reconnect...");
-    bmsConnectPending = true;  // Wird im nächsten Loop-Durchlauf ausgeführt
-  }
+  // Reconnect mit Backoff, Messwerte bei jeder neuen BMS-Messung
+  serviceMqtt(currentMillis);
+  phaseStart = perfLap(PERF_LOOP_MQTT, phaseStart);
 
   // ========================================
-  // NTP periodisch synchronisieren
+  // Alarmwechsel sofort senden
   // ========================================
-  // Nur wenn WLAN verbunden, alle 1 Stunde
-  if (!apMode && WiFi.status() == WL_CONNECTED && (currentMillis - lastNtpSync >= ntpSyncInterval)) {
-    syncNTP();
-    lastNtpSync = currentMillis;
-  }
+  // Vom BLE-Task erkannt (evaluateAlarmRules()), mit Mindestabstand
+  serviceAlarms(currentMillis);
+  phaseStart = perfLap(PERF_LOOP_ALARMS, phaseStart);
 
   // ========================================
-  // Home Assistant Webhook periodisch senden
+  // Energiezähler sichern
   // ========================================
-  // Nur wenn aktiviert und WLAN verbunden
-  if (haEnabled && !apMode && WiFi.status() == WL_CONNECTED && (currentMillis - lastHaSend >= haInterval * 1000)) {
-    logCrashLocation("!loop:ha_webhook_start");
-    sendToHomeAssistant();
-    logCrashLocation("loop:ha_webhook_done");
-    lastHaSend = currentMillis;
+  serviceEnergyCounters(currentMillis);
+  perfLap(PERF_LOOP_ENERGY, phaseStart);
+
+  // ========================================
+  // Headless-Betrieb: Ende des Konfigurationsfensters
+  // ========================================
+  // Nicht im AP-Modus (WLAN noch nicht eingerichtet) und nicht solange
+  // eine Seite mit Push-Stream geöffnet ist
+  if (headlessMode && !apMode && events.count() == 0 &&
+      currentMillis - headlessWindowStart >= HEADLESS_CONFIG_WINDOW_MS) {
+    Serial.println("[SLEEP] Konfigurationsfenster abgelaufen");
+    enterDeepSleep(0);
   }
 
   // Allgemeine Loop-Position loggen (nicht zu oft)
   logCrashLocation("loop:end");
+
+  // ========================================
+  // Auslastung messen, im Stromsparmodus CPU abgeben
+  // ========================================
+  // Warten lässt den Leerlauf-Task laufen: Taktabsenkung und Light Sleep.
+  // Eine neue Messung (wakeLoopOnSample()) beendet die Pause sofort.
+  trackLoopLoad(loopStart);
+  perfLap(PERF_LOOP, loopStart);
+  if (powerMode == 1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(POWER_LOOP_SLEEP_MS));
+  }
 }